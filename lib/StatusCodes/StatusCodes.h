@@ -69,6 +69,20 @@ enum ErrorCode {
 
     // BLE Error (700-799)
     INVALID_JSON_BLE_REQUEST_FORMAT = -700,                 /* Invalid Request JSON Format                                                          */ 
+    BLE_COMMAND_QUEUE_FULL = -701,                          /* The device is busy, the command queue is full and the command was not accepted       */
+    BLE_COMMAND_FIELD_TOO_LONG = -702,                      /* A field of the command is longer than the device can hold                            */
+    BLE_COMMAND_UNKNOWN = -703,                             /* The command is not one the device knows                                              */
+
+    // Access Log Error (800-899)
+    FAILED_TO_QUERY_ACCESS_LOG_NO_TIME_RANGE = -801,        /* Failed to query the access log because no valid `from` and `to` was provided         */
+
+    // Firmware Update Error (1000-1099)
+    FAILED_TO_UPDATE_FIRMWARE = -1000,                      /* Failed to download, apply or verify the firmware update                              */
+    INVALID_FIRMWARE_UPDATE_REQUEST = -1001,                /* The BLE firmware update request is malformed or its signature is not valid           */
+    FIRMWARE_UPDATE_IN_PROGRESS = -1002,                    /* A BLE firmware update is already running                                             */
+    FIRMWARE_UPDATE_TIMEOUT = -1003,                        /* The BLE firmware update received no data for too long and was aborted                */
+    FIRMWARE_UPDATE_ABORTED = -1004,                        /* The BLE firmware update was aborted by the client                                    */
+    FIRMWARE_UPDATE_NOT_AUTHORIZED = -1005,                 /* The BLE firmware update was requested over a connection that is not bonded           */
 
     // Etc (900-999)
     FAILED_DELETE_USERS_KEY_ACCESS = -900                   /* Failed to delete the all key access user have                                        */
@@ -106,6 +120,20 @@ enum SuccessCode {
     SUCCESS_DELETING_NFCS_USER = 206,                       /* Successfully deleted all the fingerprints on under user                              */
     SUCCESS_DELETING_NFC_ACCESS_FILE = 207,                 /* Success deleted the NFC key access .json file                                        */
 
+    /// BLE Success Code (700-799)
+    STATUS_BLE_COMMAND_ACCEPTED = 700,                      /* The command is queued, with its `id` and the commands `queued` ahead of it           */
+
+    /// Access Log Success Code (800-899)
+    STATUS_ACCESS_LOG_EVENTS = 800,                         /* A page of access log events of the requested time range                              */
+    SUCCESS_QUERY_ACCESS_LOG = 801,                         /* Success sending all the access log events of the requested time range                */
+
+    /// Firmware Update Success Code (1000-1099)
+    STATUS_FIRMWARE_UP_TO_DATE = 1000,                      /* The server has no firmware update for the running firmware                           */
+    SUCCESS_UPDATING_FIRMWARE = 1001,                       /* The firmware update is written, the device restarts to run it                        */
+    STATUS_FIRMWARE_UPDATE_READY = 1002,                    /* The BLE firmware update is accepted, the client can start sending the image          */
+    STATUS_FIRMWARE_UPDATE_ACK = 1003,                      /* The image is written up to `offset`, with the transfer rate in bytes per second      */
+    STATUS_FIRMWARE_UPDATE_RESEND = 1004,                   /* A packet was lost, the client resends the image from `offset`                        */
+
     // Etc (900-999)
     SUCCESS_DELETE_USERS_KEY_ACCESS = 900,                  /* Success deleting the key access of a user (well at least one of them)                */
 };
@@ -0,0 +1,167 @@
+"""
+Local stand-in for the key access backup endpoint of the backend, to test the backups without it.
+
+Serves the same endpoint as `BACKEND_URL` on the device:
+  POST /user-vehicle/vehicle/<VIN>/key-access/backup   Stores a backup (`?mode=full|incremental&sequence=N&base=M`)
+  GET  /user-vehicle/vehicle/<VIN>/key-access/backup   The last full backup and the incremental ones after it
+
+Build the device with `-DKEY_ACCESS_BACKUP_ENABLED=1 -DBACKEND_URL='"http://<host>:3000/api/v1"'` and
+`KEY_ACCESS_BACKUP_KEY` in the environment to use it.
+
+  python3 backup_server.py [--dir backups] [--port 3000] [--conflict-rate 0.2] [--key <KEY_ACCESS_BACKUP_KEY>]
+
+Every backup is inflated and its CRC checked before it is stored, and its HMAC too when `--key` is given.
+The real server never has the key, only the devices check the HMAC when they restore. `--conflict-rate` answers 409 to
+that fraction of the incremental backups, to check that the device sends a full one next. A GET
+answers every stored backup with its length as 4 bytes big endian, as the device expects.
+"""
+
+import argparse
+import binascii
+import hashlib
+import hmac
+import json
+import os
+import random
+import struct
+import zlib
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+
+def check_backup(data, key=None):
+    """Inflate a backup and check its lines, returns the header or raises ValueError"""
+    lines = zlib.decompress(data).split(b"\n")
+    if len(lines) < 3 or lines[-1] != b"":
+        raise ValueError("backup does not end with a line")
+
+    header = json.loads(lines[0])
+    footer = json.loads(lines[-2])
+    if header.get("backup") != 2 or not footer.get("end") or "hmac" not in footer:
+        raise ValueError("backup has no header or footer")
+
+    body = b"".join(line + b"\n" for line in lines[:-2])
+    if footer.get("crc32") != "%08x" % binascii.crc32(body):
+        raise ValueError("backup CRC does not match")
+    if key is not None and not hmac.compare_digest(footer["hmac"], hmac.new(key.encode(), body, hashlib.sha256).hexdigest()):
+        raise ValueError("backup HMAC does not match")
+    return header
+
+
+class BackupRequestHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_POST(self):
+        url = urlparse(self.path)
+        query = parse_qs(url.query)
+        vin = self.backup_vin(url.path)
+        if vin is None:
+            self.send_body(404, b"Not found", "text/plain")
+            return
+
+        data = self.read_body()
+        try:
+            header = check_backup(data, self.server.key)
+        except (ValueError, zlib.error) as error:
+            self.send_body(400, str(error).encode(), "text/plain")
+            return
+
+        mode = query.get("mode", [""])[0]
+        members = self.server.backups.setdefault(vin, [])
+        if mode == "incremental":
+            last = members[-1][0] if members else None
+            if last is None or header["base"] != last or random.random() < self.server.conflict_rate:
+                self.send_body(409, json.dumps({"sequence": last}).encode(), "application/json")
+                return
+        elif mode == "full":
+            members.clear()
+        else:
+            self.send_body(400, b"Unknown mode", "text/plain")
+            return
+
+        members.append((header["sequence"], data))
+        self.save(vin)
+        self.log_message("Stored %s backup %d of %s, %d bytes", mode, header["sequence"], vin, len(data))
+        self.send_body(201, json.dumps({"sequence": header["sequence"]}).encode(), "application/json")
+
+    def do_GET(self):
+        vin = self.backup_vin(urlparse(self.path).path)
+        members = self.server.backups.get(vin) if vin else None
+        if not members:
+            self.send_body(404, b"No backup", "text/plain")
+            return
+
+        body = b"".join(struct.pack(">I", len(data)) + data for _, data in members)
+        self.send_body(200, body, "application/octet-stream")
+
+    def read_body(self):
+        if self.headers.get("Transfer-Encoding", "").lower() == "chunked":
+            body = b""
+            while True:
+                size = int(self.rfile.readline().split(b";")[0], 16)
+                chunk = self.rfile.read(size)
+                self.rfile.readline()
+                if size == 0:
+                    break
+                body += chunk
+        else:
+            body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        return body
+
+    def backup_vin(self, path):
+        parts = path.rstrip("/").split("/")
+        if len(parts) >= 5 and parts[-4:-3] == ["vehicle"] and parts[-2:] == ["key-access", "backup"]:
+            return parts[-3]
+        return None
+
+    def save(self, vin):
+        if not self.server.directory:
+            return
+        os.makedirs(self.server.directory, exist_ok=True)
+        with open(os.path.join(self.server.directory, "%s.bin" % vin), "wb") as file:
+            for _, data in self.server.backups[vin]:
+                file.write(struct.pack(">I", len(data)) + data)
+
+    def send_body(self, status, body, content_type):
+        self.send_response(status)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Local stand-in for the key access backup endpoint")
+    parser.add_argument("--dir", help="Directory the backups are kept in between runs, one file per VIN")
+    parser.add_argument("--conflict-rate", type=float, default=0.0, help="Fraction of incremental backups answered 409")
+    parser.add_argument("--key", help="KEY_ACCESS_BACKUP_KEY of the device, to check the HMAC of the backups")
+    parser.add_argument("--port", type=int, default=3000)
+    args = parser.parse_args()
+
+    server = ThreadingHTTPServer(("", args.port), BackupRequestHandler)
+    server.directory = args.dir
+    server.conflict_rate = args.conflict_rate
+    server.key = args.key
+    server.backups = {}
+
+    # Reload the backups a previous run stored
+    if args.dir and os.path.isdir(args.dir):
+        for name in os.listdir(args.dir):
+            if not name.endswith(".bin"):
+                continue
+            with open(os.path.join(args.dir, name), "rb") as file:
+                data = file.read()
+            members, offset = [], 0
+            while offset + 4 <= len(data):
+                (length,) = struct.unpack(">I", data[offset:offset + 4])
+                member = data[offset + 4:offset + 4 + length]
+                members.append((check_backup(member, args.key)["sequence"], member))
+                offset += 4 + length
+            server.backups[name[:-4]] = members
+
+    print("Serving key access backups on port %d" % args.port)
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,73 @@
+"""
+Send a command to the Door characteristic of the device (`src/communication/ble/service/DoorInfoService.h`)
+and print its notifications, in JSON like the legacy head units or in MessagePack.
+
+  python3 ble_command.py door_unlock [--data '{"key_access_id": "..."}'] [--id 7] [--encoding msgpack] [--address <mac>]
+
+The device answers a connection in the encoding of the last command it wrote. Needs `pip install bleak`,
+and `pip install msgpack` for `--encoding msgpack`.
+"""
+
+import argparse
+import asyncio
+import json
+import sys
+
+from bleak import BleakClient, BleakScanner
+
+DEVICE_NAME = "Yaris Door Auth"
+DOOR_UUID = "ce51316c-d0e1-4ddf-b453-bda6477ee9b9"
+NOTIFICATION_UUID = "01952383-cf1a-705c-8744-2eee6f3f80c8"
+
+NOTIFICATION_TIMEOUT_S = 10     # Wait for the next notification before giving up
+
+
+async def find_device(address):
+    if address:
+        return address
+    device = await BleakScanner.find_device_by_name(DEVICE_NAME)
+    if device is None:
+        sys.exit("No device named %r found" % DEVICE_NAME)
+    return device.address
+
+
+def encoder(encoding):
+    if encoding == "json":
+        return (lambda document: json.dumps(document).encode()), (lambda data: json.loads(data))
+    import msgpack
+    return (lambda document: msgpack.packb(document)), (lambda data: msgpack.unpackb(data))
+
+
+async def send(args):
+    encode, decode = encoder(args.encoding)
+    request = {"command": args.command, "data": json.loads(args.data)}
+    if args.id:
+        request["id"] = args.id
+    payload = encode(request)
+
+    async with BleakClient(await find_device(args.address)) as client:
+        notifications = asyncio.Queue()
+        await client.start_notify(NOTIFICATION_UUID, lambda _, data: notifications.put_nowait(bytes(data)))
+        await client.write_gatt_char(DOOR_UUID, payload, response=True)
+        print("Sent %d bytes of %s" % (len(payload), args.encoding))
+
+        while True:
+            try:
+                data = await asyncio.wait_for(notifications.get(), NOTIFICATION_TIMEOUT_S)
+            except asyncio.TimeoutError:
+                return
+            print("%3d bytes  %s" % (len(data), decode(data)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Send a command to the Door characteristic over BLE")
+    parser.add_argument("command", help="Command name, e.g. door_unlock")
+    parser.add_argument("--data", default="{}", help="JSON object of the `data` field")
+    parser.add_argument("--id", type=int, help="Id echoed in the acknowledgement")
+    parser.add_argument("--encoding", choices=["json", "msgpack"], default="json", help="Encoding of the command and the replies")
+    parser.add_argument("--address", help="BLE address of the device, found by its name if not given")
+    asyncio.run(send(parser.parse_args()))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,63 @@
+import base64
+import hashlib
+import os
+import sys
+
+# The keys and credentials are never committed, every build takes them from the environment
+# An unset one is left undefined, `src/config/Config.h` then stops the build or disables the feature
+
+# SHA-256 of the DER of the firmware update public keys that must not be trusted anymore, their private key is known
+REVOKED_MANIFEST_KEYS = {
+    "b654e6735f46c4af50fee99ae2854f23116cf95d2b07e2df4e1c4d0c1f4cd6e0",
+}
+
+
+def public_key_fingerprint(path):
+    with open(path) as file:
+        body = "".join(line.strip() for line in file if line.strip() and not line.startswith("-----"))
+    return hashlib.sha256(base64.b64decode(body)).hexdigest()
+
+
+def pem_flag(name, path):
+    with open(path) as file:
+        pem = file.read().strip() + "\n"
+    return string_flag(name, pem.replace("\n", "\\n"))
+
+
+def string_flag(name, value):
+    return "'-D%s=\\\"%s\\\"'" % (name, value)
+
+
+flags = []
+
+# PEM file of the public key that verifies the firmware updates
+key_file = os.environ.get("OTA_MANIFEST_PUBLIC_KEY_FILE")
+if key_file:
+    if public_key_fingerprint(key_file) in REVOKED_MANIFEST_KEYS:
+        sys.exit("%s is a revoked firmware update key, generate a new key pair" % key_file)
+    flags.append(pem_flag("OTA_MANIFEST_PUBLIC_KEY", key_file))
+
+# Bearer token of the admin api, it can also be stored in NVS instead
+admin_token = os.environ.get("ADMIN_API_TOKEN")
+if admin_token:
+    flags.append(string_flag("ADMIN_API_TOKEN", admin_token))
+
+# Key of the HMAC of the key access backups, needed with `-DKEY_ACCESS_BACKUP_ENABLED=1`
+backup_key = os.environ.get("KEY_ACCESS_BACKUP_KEY")
+if backup_key:
+    flags.append(string_flag("KEY_ACCESS_BACKUP_KEY", backup_key))
+
+# Key of the replication datagrams, the same on every controller of the group, needed with `-DREPLICATION_ENABLED=1`
+replication_key = os.environ.get("REPLICATION_KEY")
+if replication_key:
+    flags.append(string_flag("REPLICATION_KEY", replication_key))
+
+# Broker of the key access changes, over TLS with a login, and the PEM file of its CA if it is private
+for name in ["MQTT_BROKER_URL", "MQTT_USERNAME", "MQTT_PASSWORD"]:
+    if os.environ.get(name):
+        flags.append(string_flag(name, os.environ[name]))
+mqtt_ca_file = os.environ.get("MQTT_CA_CERT_FILE")
+if mqtt_ca_file:
+    flags.append(pem_flag("MQTT_CA_CERT", mqtt_ca_file))
+
+print(" ".join(flags))
@@ -0,0 +1,90 @@
+"""
+Push key access changes to a device over MQTT and print the access events it publishes back,
+to test the credential update channel (`WifiService::handleKeyAccessMessage`) against a local broker.
+
+Run a broker with a TLS listener and a password file, e.g. `mosquitto -v`, and build the device with its
+`MQTT_BROKER_URL`, `MQTT_USERNAME` and `MQTT_PASSWORD` (see the README).
+
+  python3 mqtt_key_access.py --ca <ca.pem> --username <user> --password <password> revoke --type RFID --key-access-id <id>
+  python3 mqtt_key_access.py ... add --key-access-id <id> --nfc-uid <uid> --visitor-id <id> --visitor-name <name>
+  python3 mqtt_key_access.py ... events
+
+The messages are published with QoS 1, so a device that is offline gets them once it reconnects.
+Needs `pip install paho-mqtt`.
+"""
+
+import argparse
+import json
+import time
+
+import paho.mqtt.client as mqtt
+
+VIN = "1HGCM82633A123456"   # See `src/config/Config.h`
+
+
+def connect(args):
+    client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2)
+    client.tls_set(ca_certs=args.ca)
+    client.username_pw_set(args.username, args.password)
+    client.connect(args.host, args.port)
+    return client
+
+
+def publish(args, message):
+    client = connect(args)
+    client.loop_start()
+
+    start = time.monotonic()
+    client.publish("vehicle/%s/key-access" % args.vin, json.dumps(message), qos=1).wait_for_publish()
+    print("Published %s in %.0f ms" % (message, (time.monotonic() - start) * 1000))
+
+    client.loop_stop()
+    client.disconnect()
+
+
+def print_events(args):
+    def on_message(client, userdata, message):
+        for event in json.loads(message.payload).get("events", []):
+            print("%(sequence)6d  %(action)-6s  %(type)-11s  %(key_access_id)s" % event)
+
+    client = connect(args)
+    client.on_message = on_message
+    client.subscribe("vehicle/%s/events" % args.vin, qos=1)
+    print("Waiting for access events of %s" % args.vin)
+    client.loop_forever()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Push key access changes to a device over MQTT")
+    parser.add_argument("--host", default="localhost", help="Host of the broker")
+    parser.add_argument("--port", type=int, default=8883)
+    parser.add_argument("--ca", help="PEM file of the CA of the broker, the system CAs if not given")
+    parser.add_argument("--username", required=True, help="Login on the broker")
+    parser.add_argument("--password", required=True)
+    parser.add_argument("--vin", default=VIN, help="VIN of the device")
+    commands = parser.add_subparsers(dest="command", required=True)
+
+    revoke = commands.add_parser("revoke", help="Revoke a key access")
+    revoke.add_argument("--type", choices=["RFID", "Fingerprint"], required=True)
+    revoke.add_argument("--key-access-id", required=True)
+
+    add = commands.add_parser("add", help="Add an NFC Card")
+    add.add_argument("--key-access-id", required=True)
+    add.add_argument("--nfc-uid", required=True)
+    add.add_argument("--visitor-id", required=True)
+    add.add_argument("--visitor-name", required=True)
+
+    commands.add_parser("events", help="Print the access events published by the device")
+
+    args = parser.parse_args()
+    if args.command == "revoke":
+        publish(args, {"action": "revoke", "type": args.type, "key_access_id": args.key_access_id})
+    elif args.command == "add":
+        publish(args, {"action": "add", "type": "RFID", "key_access_id": args.key_access_id, "nfc_uid": args.nfc_uid,
+                       "visitor_id": args.visitor_id, "visitor_name": args.visitor_name})
+    else:
+        print_events(args)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,114 @@
+"""
+Firmware update over BLE, the same protocol a phone uses with the OTA service of the device
+(`src/communication/ble/service/OTAService.h`), to test it without the app.
+
+  python3 ota_ble.py --firmware .pio/build/esp32dev/firmware.bin --key <private key PEM> [--address <mac>]
+
+The image is signed with `openssl`, the device only accepts images signed by the key of
+`OTA_MANIFEST_PUBLIC_KEY`. Needs `pip install bleak`.
+"""
+
+import argparse
+import asyncio
+import hashlib
+import json
+import os
+import struct
+import subprocess
+import sys
+import time
+
+from bleak import BleakClient, BleakScanner
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+
+DEVICE_NAME = "Yaris Door Auth"
+CONTROL_UUID = "6e1f0a5c-3b1d-4c8e-9a57-2d1c0f4b7e11"
+DATA_UUID = "6e1f0a5c-3b1d-4c8e-9a57-2d1c0f4b7e12"
+
+# See `lib/StatusCodes/StatusCodes.h`
+SUCCESS_UPDATING_FIRMWARE = 1001
+STATUS_FIRMWARE_UPDATE_READY = 1002
+STATUS_FIRMWARE_UPDATE_ACK = 1003
+STATUS_FIRMWARE_UPDATE_RESEND = 1004
+
+HEADER_SIZE = 4             # Little endian offset of the packet in the image
+STATUS_TIMEOUT_S = 20       # Longest wait for a notification of the device
+
+
+async def find_device(address):
+    if address:
+        return address
+    device = await BleakScanner.find_device_by_name(DEVICE_NAME)
+    if device is None:
+        sys.exit("No device named %r found" % DEVICE_NAME)
+    return device.address
+
+
+async def update(args):
+    with open(args.firmware, "rb") as file:
+        image = file.read()
+    signature = subprocess.run(["openssl", "dgst", "-sha256", "-sign", args.key], input=image,
+                               stdout=subprocess.PIPE, check=True).stdout
+
+    async with BleakClient(await find_device(args.address)) as client:
+        # The device only accepts an update from a bonded connection
+        await client.pair()
+        statuses = asyncio.Queue()
+        await client.start_notify(CONTROL_UUID, lambda _, data: statuses.put_nowait(json.loads(data)))
+
+        request = {"command": "begin", "data": {
+            "size": len(image),
+            "sha256": hashlib.sha256(image).hexdigest(),
+            "signature": signature.hex(),
+        }}
+        await client.write_gatt_char(CONTROL_UUID, json.dumps(request).encode(), response=True)
+
+        status = await asyncio.wait_for(statuses.get(), STATUS_TIMEOUT_S)
+        if status["status"] != STATUS_FIRMWARE_UPDATE_READY:
+            sys.exit("Update refused: %s" % status)
+
+        window = status["data"]["window"]
+        packet_size = min(status["data"]["packet_size"], client.mtu_size - 3 - HEADER_SIZE)
+        print("Sending %d bytes, %d bytes per packet, %d byte window" % (len(image), packet_size, window))
+
+        acknowledged = sent = resends = 0
+        start = time.monotonic()
+        while True:
+            # Keep the window full, then wait for the device to acknowledge or ask for a resend
+            while sent < len(image) and statuses.empty():
+                payload = image[sent:sent + packet_size]
+                if sent + len(payload) - acknowledged > window:
+                    break
+                await client.write_gatt_char(DATA_UUID, struct.pack("<I", sent) + payload, response=False)
+                sent += len(payload)
+
+            status = await asyncio.wait_for(statuses.get(), STATUS_TIMEOUT_S)
+            code, data = status["status"], status.get("data", {})
+
+            if code == STATUS_FIRMWARE_UPDATE_ACK:
+                acknowledged = data["offset"]
+                print("\r%5.1f%%  %6.1f KB/s (device %6.1f KB/s)  %d resends" % (
+                    100.0 * acknowledged / len(image), acknowledged / (time.monotonic() - start) / 1024,
+                    data["rate"] / 1024, resends), end="", flush=True)
+            elif code == STATUS_FIRMWARE_UPDATE_RESEND:
+                resends += 1
+                sent = max(data["offset"], acknowledged)
+            elif code == SUCCESS_UPDATING_FIRMWARE:
+                print("\nUpdated %d bytes in %.1f s (%.1f KB/s, %d resends), the device restarts into the new firmware" % (
+                    data["size"], data["elapsed_ms"] / 1000, data["rate"] / 1024, data["resends"]))
+                return
+            else:
+                sys.exit("\nUpdate failed: %s" % status)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Firmware update over BLE")
+    parser.add_argument("--firmware", required=True, help="Firmware image to send")
+    parser.add_argument("--address", help="BLE address of the device, found by its name if not given")
+    parser.add_argument("--key", required=True, help="EC private key that signs the image, the device is built with its public key")
+    asyncio.run(update(parser.parse_args()))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,309 @@
+// Host tool for the compressed delta OTA updates, see `src/ota/DeltaPatch.h` for the patch format.
+//
+//   ota_delta diff  <old.bin> <new.bin> <patch.bin>    Create the patch from the running firmware to the new one
+//   ota_delta apply <old.bin> <patch.bin> <new.bin>    Apply a patch the same way the device does
+//
+// Build with `make` in this directory, needs zlib and OpenSSL (libcrypto).
+
+#include "DeltaPatch.h"
+
+#include <openssl/sha.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+typedef std::vector<uint8_t> Bytes;
+
+static bool readFile(const char *path, Bytes &data) {
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+
+    uint8_t buffer[65536];
+    size_t read;
+    data.clear();
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) data.insert(data.end(), buffer, buffer + read);
+
+    bool ok = !ferror(file);
+    fclose(file);
+    return ok;
+}
+
+static bool writeFile(const char *path, const Bytes &data) {
+    FILE *file = fopen(path, "wb");
+    if (file == nullptr) {
+        fprintf(stderr, "Cannot create %s\n", path);
+        return false;
+    }
+
+    bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+    ok = fclose(file) == 0 && ok;
+    return ok;
+}
+
+static void appendUint32(Bytes &data, uint32_t value) {
+    for (int i = 0; i < 4; i++) data.push_back(value >> (8 * i));
+}
+
+/**
+ * Suffix array of the old image by prefix doubling, fast enough for a few MB of firmware.
+ */
+static std::vector<int32_t> buildSuffixArray(const Bytes &data) {
+    const int32_t size = data.size();
+    std::vector<int32_t> suffixes(size), rank(size), next(size);
+
+    for (int32_t i = 0; i < size; i++) {
+        suffixes[i] = i;
+        rank[i] = data[i];
+    }
+
+    for (int32_t step = 1; size > 0; step *= 2) {
+        auto key = [&](int32_t i) { return std::make_pair(rank[i], i + step < size ? rank[i + step] : -1); };
+        std::sort(suffixes.begin(), suffixes.end(), [&](int32_t a, int32_t b) { return key(a) < key(b); });
+
+        next[suffixes[0]] = 0;
+        for (int32_t i = 1; i < size; i++) {
+            next[suffixes[i]] = next[suffixes[i - 1]] + (key(suffixes[i - 1]) < key(suffixes[i]) ? 1 : 0);
+        }
+        rank.swap(next);
+        if (rank[suffixes[size - 1]] == size - 1) break;
+    }
+    return suffixes;
+}
+
+static int32_t matchLength(const uint8_t *a, int32_t aSize, const uint8_t *b, int32_t bSize) {
+    int32_t length = 0;
+    while (length < aSize && length < bSize && a[length] == b[length]) length++;
+    return length;
+}
+
+/**
+ * Longest match of `target` in the old image, found by a binary search over the suffix array.
+ */
+static int32_t findMatch(const Bytes &old, const std::vector<int32_t> &suffixes, const uint8_t *target, int32_t targetSize, int32_t &position) {
+    const int32_t oldSize = old.size();
+    int32_t low = 0, high = oldSize - 1;
+
+    while (high - low > 1) {
+        int32_t middle = low + (high - low) / 2;
+        int32_t suffix = suffixes[middle];
+        int32_t length = std::min(oldSize - suffix, targetSize);
+        if (memcmp(old.data() + suffix, target, length) < 0) low = middle;
+        else high = middle;
+    }
+
+    int32_t lowLength = matchLength(old.data() + suffixes[low], oldSize - suffixes[low], target, targetSize);
+    int32_t highLength = matchLength(old.data() + suffixes[high], oldSize - suffixes[high], target, targetSize);
+    if (lowLength >= highLength) {
+        position = suffixes[low];
+        return lowLength;
+    }
+    position = suffixes[high];
+    return highLength;
+}
+
+static void appendRecord(Bytes &records, const Bytes &old, const Bytes &current, int32_t oldStart, int32_t newStart,
+                         int32_t diffLength, int32_t extraLength, int32_t seek) {
+    appendUint32(records, diffLength);
+    appendUint32(records, extraLength);
+    appendUint32(records, (uint32_t)seek);
+    for (int32_t i = 0; i < diffLength; i++) records.push_back(current[newStart + i] - old[oldStart + i]);
+    records.insert(records.end(), current.begin() + newStart + diffLength, current.begin() + newStart + diffLength + extraLength);
+}
+
+/**
+ * Build the records with the bsdiff approach: find long exact matches, extend them with approximate
+ * matches whose difference bytes are mostly zero, and store the bytes between matches as extra bytes.
+ * Moved code only differs in its addresses, so the difference bytes compress very well.
+ */
+static Bytes buildRecords(const Bytes &old, const Bytes &current) {
+    const int32_t oldSize = old.size();
+    const int32_t newSize = current.size();
+    Bytes records;
+
+    if (oldSize == 0) {
+        appendRecord(records, old, current, 0, 0, 0, newSize, 0);
+        return records;
+    }
+
+    std::vector<int32_t> suffixes = buildSuffixArray(old);
+
+    int32_t scan = 0, length = 0, position = 0;
+    int32_t lastScan = 0, lastPosition = 0, lastOffset = 0;
+
+    while (scan < newSize) {
+        int32_t oldScore = 0;
+        int32_t scoreScan = scan += length;
+
+        for (; scan < newSize; scan++) {
+            length = findMatch(old, suffixes, current.data() + scan, newSize - scan, position);
+
+            for (; scoreScan < scan + length; scoreScan++) {
+                if (scoreScan + lastOffset < oldSize && old[scoreScan + lastOffset] == current[scoreScan]) oldScore++;
+            }
+
+            // A new match that is clearly better than just continuing the previous one
+            if ((length == oldScore && length != 0) || length > oldScore + 8) break;
+
+            if (scan + lastOffset < oldSize && old[scan + lastOffset] == current[scan]) oldScore--;
+        }
+
+        if (length == oldScore && scan != newSize) continue;
+
+        // Extend the previous match forward while more than half of the bytes still match
+        int32_t score = 0, bestScore = 0, forward = 0;
+        for (int32_t i = 0; lastScan + i < scan && lastPosition + i < oldSize;) {
+            if (old[lastPosition + i] == current[lastScan + i]) score++;
+            i++;
+            if (score * 2 - i > bestScore * 2 - forward) {
+                bestScore = score;
+                forward = i;
+            }
+        }
+
+        // Extend the new match backward the same way
+        int32_t backward = 0;
+        if (scan < newSize) {
+            score = 0;
+            bestScore = 0;
+            for (int32_t i = 1; scan >= lastScan + i && position >= i; i++) {
+                if (old[position - i] == current[scan - i]) score++;
+                if (score * 2 - i > bestScore * 2 - backward) {
+                    bestScore = score;
+                    backward = i;
+                }
+            }
+        }
+
+        // Split the overlap of both extensions where it matches best
+        if (lastScan + forward > scan - backward) {
+            int32_t overlap = (lastScan + forward) - (scan - backward);
+            int32_t split = 0;
+            score = 0;
+            bestScore = 0;
+            for (int32_t i = 0; i < overlap; i++) {
+                if (current[lastScan + forward - overlap + i] == old[lastPosition + forward - overlap + i]) score++;
+                if (current[scan - backward + i] == old[position - backward + i]) score--;
+                if (score > bestScore) {
+                    bestScore = score;
+                    split = i + 1;
+                }
+            }
+            forward += split - overlap;
+            backward -= split;
+        }
+
+        int32_t extraLength = (scan - backward) - (lastScan + forward);
+        int32_t seek = (position - backward) - (lastPosition + forward);
+        appendRecord(records, old, current, lastPosition, lastScan, forward, extraLength, seek);
+
+        lastScan = scan - backward;
+        lastPosition = position - backward;
+        lastOffset = position - scan;
+    }
+    return records;
+}
+
+static int diff(const char *oldPath, const char *newPath, const char *patchPath) {
+    Bytes old, current;
+    if (!readFile(oldPath, old) || !readFile(newPath, current)) return 1;
+
+    DeltaHeader header = {};
+    header.version = DELTA_VERSION;
+    header.oldSize = old.size();
+    header.newSize = current.size();
+    SHA256(old.data(), old.size(), header.oldSha256);
+    SHA256(current.data(), current.size(), header.newSha256);
+
+    Bytes records = buildRecords(old, current);
+
+    uLongf compressedSize = compressBound(records.size());
+    Bytes patch(DELTA_HEADER_SIZE + compressedSize);
+    DeltaPatch::serializeHeader(header, patch.data());
+    if (compress2(patch.data() + DELTA_HEADER_SIZE, &compressedSize, records.data(), records.size(), Z_BEST_COMPRESSION) != Z_OK) {
+        fprintf(stderr, "Failed to compress the patch\n");
+        return 1;
+    }
+    patch.resize(DELTA_HEADER_SIZE + compressedSize);
+
+    if (!writeFile(patchPath, patch)) return 1;
+    printf("Patch %s: %zu bytes for a %zu byte image (%.1f%%)\n", patchPath, patch.size(), current.size(),
+           current.empty() ? 0.0 : 100.0 * patch.size() / current.size());
+    return 0;
+}
+
+static int apply(const char *oldPath, const char *patchPath, const char *newPath) {
+    Bytes old, patchData;
+    if (!readFile(oldPath, old) || !readFile(patchPath, patchData)) return 1;
+
+    DeltaHeader header;
+    if (!DeltaPatch::parseHeader(patchData.data(), patchData.size(), header)) {
+        fprintf(stderr, "Invalid patch header\n");
+        return 1;
+    }
+
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(old.data(), old.size(), digest);
+    if (old.size() != header.oldSize || memcmp(digest, header.oldSha256, sizeof(digest)) != 0) {
+        fprintf(stderr, "The patch does not apply to %s\n", oldPath);
+        return 1;
+    }
+
+    Bytes current;
+    DeltaPatch patch(
+        [&](uint32_t offset, uint8_t *buffer, size_t length) {
+            if ((uint64_t)offset + length > old.size()) return false;
+            memcpy(buffer, old.data() + offset, length);
+            return true;
+        },
+        [&](const uint8_t *buffer, size_t length) {
+            current.insert(current.end(), buffer, buffer + length);
+            return true;
+        });
+    patch.begin(header);
+
+    // Inflate in small pieces, the same way the device streams the patch
+    z_stream stream = {};
+    inflateInit(&stream);
+    stream.next_in = patchData.data() + DELTA_HEADER_SIZE;
+    stream.avail_in = patchData.size() - DELTA_HEADER_SIZE;
+
+    int status = Z_OK;
+    while (status == Z_OK) {
+        uint8_t buffer[1024];
+        stream.next_out = buffer;
+        stream.avail_out = sizeof(buffer);
+        status = inflate(&stream, Z_NO_FLUSH);
+        if ((status == Z_OK || status == Z_STREAM_END) && !patch.write(buffer, sizeof(buffer) - stream.avail_out)) break;
+    }
+    inflateEnd(&stream);
+
+    if (status != Z_STREAM_END || !patch.isComplete()) {
+        fprintf(stderr, "Failed to apply the patch after %u bytes\n", patch.written());
+        return 1;
+    }
+
+    SHA256(current.data(), current.size(), digest);
+    if (memcmp(digest, header.newSha256, sizeof(digest)) != 0) {
+        fprintf(stderr, "SHA-256 of the new image does not match the patch\n");
+        return 1;
+    }
+
+    if (!writeFile(newPath, current)) return 1;
+    printf("Applied %s: %zu byte image verified\n", patchPath, current.size());
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc == 5 && strcmp(argv[1], "diff") == 0) return diff(argv[2], argv[3], argv[4]);
+    if (argc == 5 && strcmp(argv[1], "apply") == 0) return apply(argv[2], argv[3], argv[4]);
+
+    fprintf(stderr, "Usage:\n  %s diff <old.bin> <new.bin> <patch.bin>\n  %s apply <old.bin> <patch.bin> <new.bin>\n", argv[0], argv[0]);
+    return 2;
+}
@@ -0,0 +1,155 @@
+"""
+Local stand-in for the firmware update server, to test the OTA updates without the backend.
+
+Serves the same endpoints as `OTA_SERVER_URL` on the device:
+  GET /manifest   Signed manifest of the firmware with the SHA-256 of every chunk
+  GET /image      The firmware image, supports `Range` requests for the chunked download
+  GET /delta      Delta patch from the running firmware (`?from=<version>`), made with `scripts/ota_delta`
+
+Build the device with `-DOTA_SERVER_URL='"http://<host>:8080"'` to use it.
+
+  python3 ota_server.py --firmware .pio/build/esp32dev/firmware.bin --version 0.4.0 \
+      --key <private key PEM> [--chunk-size 16384] [--delta-dir patches] [--drop-rate 0.2]
+
+`--drop-rate` closes the connection halfway through that fraction of the image responses, to
+check that the device resumes instead of starting over. Signing needs the `openssl` command.
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import random
+import re
+import struct
+import subprocess
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+
+
+def build_manifest(image, version, chunk_size, key):
+    chunks = [hashlib.sha256(image[i:i + chunk_size]).digest() for i in range(0, len(image), chunk_size)]
+    image_hash = hashlib.sha256(image).digest()
+
+    # Same message as `ChunkedOTA::verifySignature`, openssl hashes it with SHA-256 before signing
+    message = version.encode() + b"\n" + struct.pack("<II", len(image), chunk_size) + image_hash + b"".join(chunks)
+    signature = subprocess.run(["openssl", "dgst", "-sha256", "-sign", key], input=message,
+                               stdout=subprocess.PIPE, check=True).stdout
+
+    return {
+        "version": version,
+        "size": len(image),
+        "chunk_size": chunk_size,
+        "sha256": image_hash.hex(),
+        "chunks": [chunk.hex() for chunk in chunks],
+        "signature": signature.hex(),
+    }
+
+
+class OTARequestHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"   # Keep-alive, the chunks are requested over one connection
+
+    def do_GET(self):
+        url = urlparse(self.path)
+        query = parse_qs(url.query)
+        path = url.path.rstrip("/").rsplit("/", 1)[-1]
+
+        if path == "manifest":
+            self.send_body(200, json.dumps(self.server.manifest).encode(), "application/json")
+        elif path == "image":
+            self.send_image()
+        elif path == "delta":
+            self.send_delta(query.get("from", [""])[0])
+        else:
+            self.send_body(404, b"Not found", "text/plain")
+
+    def send_image(self):
+        image = self.server.image
+        start, end = 0, len(image) - 1
+        status = 200
+
+        match = re.fullmatch(r"bytes=(\d+)-(\d*)", self.headers.get("Range", ""))
+        if match:
+            start = int(match.group(1))
+            end = min(int(match.group(2)) if match.group(2) else len(image) - 1, len(image) - 1)
+            if start > end:
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % len(image))
+                self.send_header("Content-Length", "0")
+                self.end_headers()
+                return
+            status = 206
+
+        body = image[start:end + 1]
+        self.server.bytes_sent += len(body)
+
+        self.send_response(status)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(len(body)))
+        self.send_header("Accept-Ranges", "bytes")
+        if status == 206:
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, len(image)))
+        self.end_headers()
+
+        if random.random() < self.server.drop_rate:
+            self.wfile.write(body[:len(body) // 2])
+            self.log_message("Dropped the connection after %d of %d bytes", len(body) // 2, len(body))
+            self.close_connection = True
+            return
+        self.wfile.write(body)
+
+    def send_delta(self, version):
+        patch = os.path.join(self.server.delta_dir, "%s.bin" % version) if self.server.delta_dir and version else None
+        if version == self.server.manifest["version"]:
+            self.send_body(204, b"", "application/octet-stream")
+        elif patch and os.path.isfile(patch):
+            with open(patch, "rb") as file:
+                self.send_body(200, file.read(), "application/octet-stream")
+        else:
+            self.send_body(404, b"No patch for this version", "text/plain")
+
+    def send_body(self, status, body, content_type):
+        self.send_response(status)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_request(self, code="-", size="-"):
+        super().log_request(code, size)
+        if urlparse(self.path).path.endswith("image"):
+            self.log_message("Image bytes sent so far: %d of a %d byte image", self.server.bytes_sent, len(self.server.image))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Local stand-in for the firmware update server")
+    parser.add_argument("--firmware", required=True, help="Firmware image to serve")
+    parser.add_argument("--version", required=True, help="Version of the firmware image")
+    parser.add_argument("--key", required=True, help="EC private key that signs the manifest, the device is built with its public key")
+    parser.add_argument("--chunk-size", type=int, default=16384, help="Bytes per chunk, a multiple of 4096")
+    parser.add_argument("--delta-dir", help="Directory of delta patches named <from version>.bin")
+    parser.add_argument("--drop-rate", type=float, default=0.0, help="Fraction of image responses cut halfway")
+    parser.add_argument("--port", type=int, default=8080)
+    args = parser.parse_args()
+
+    if args.chunk_size <= 0 or args.chunk_size % 4096 != 0:
+        parser.error("--chunk-size must be a multiple of 4096")
+
+    with open(args.firmware, "rb") as file:
+        image = file.read()
+
+    server = ThreadingHTTPServer(("", args.port), OTARequestHandler)
+    server.image = image
+    server.manifest = build_manifest(image, args.version, args.chunk_size, args.key)
+    server.delta_dir = args.delta_dir
+    server.drop_rate = args.drop_rate
+    server.bytes_sent = 0
+
+    print("Serving firmware %s (%d bytes, %d chunks) on port %d" % (args.version, len(image), len(server.manifest["chunks"]), args.port))
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
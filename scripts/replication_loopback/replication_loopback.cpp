@@ -0,0 +1,230 @@
+// Host tool for the key access replication, see `src/communication/replication/ReplicationNode.h`.
+// Runs several nodes in one process, each on its own UDP port of the loopback, and checks that they converge.
+//
+//   replication_loopback [nodes] [loss percent]
+//
+// Node 0 is provisioned with NFC Cards while the last node is still down, then several nodes change
+// the key access at once, and then node 1 is restarted from its stored snapshot and journal. Every datagram
+// is dropped with the given probability, so the anti-entropy digests have to repair the losses.
+// Build with `make` in this directory, needs OpenSSL (libcrypto).
+
+#include "ReplicationNode.h"
+#include "ReplicationSocket.h"
+
+#include <netinet/in.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BASE_PORT       47800
+#define GROUP           0x5EED0001
+#define TIMEOUT_MS      30000
+#define JOURNAL_MAX     2048        // Journal bytes before a node stores a new snapshot, small so a run takes a few
+
+static const char NETWORK_KEY[] = "loopback-replication-key";
+
+static std::atomic<unsigned> sentDatagrams(0);
+static std::atomic<unsigned> droppedDatagrams(0);
+
+static uint32_t nowMs() {
+    using namespace std::chrono;
+    return (uint32_t)duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static void mac(const uint8_t *data, size_t length, uint8_t *out) {
+    unsigned int outLength = 32;
+    HMAC(EVP_sha256(), NETWORK_KEY, sizeof(NETWORK_KEY) - 1, data, length, out, &outLength);
+}
+
+/// @brief A door controller, its key access store is a map of Key Access ID to NFC Card UID
+struct Node {
+    uint32_t id;
+    int lossPercent;
+    std::mt19937 random;
+    std::mutex mutex;
+    ReplicationSocket socket;
+    std::unique_ptr<ReplicationNode> replication;
+    std::map<std::string, std::string> store;
+    std::vector<uint8_t> saved;
+    std::vector<uint8_t> journal;
+    std::atomic<bool> running;
+    std::thread thread;
+
+    Node(uint32_t id, int lossPercent) : id(id), lossPercent(lossPercent), random(id), running(false) {}
+
+    void create() {
+        replication.reset(new ReplicationNode(id, GROUP,
+            [this](const ReplicationPeer *peer, const uint8_t *data, size_t length) {
+                sentDatagrams++;
+                if ((int)(random() % 100) < lossPercent) {
+                    droppedDatagrams++;
+                    return;
+                }
+                socket.send(peer, data, length);
+            },
+            [this](const ReplicationEntry &entry) {
+                if (entry.action == REPLICATION_ADD) store[entry.keyAccessId] = entry.uidCard;
+                else store.erase(entry.keyAccessId);
+                return true;
+            },
+            mac));
+    }
+
+    bool start(int nodes) {
+        if (!socket.open(INADDR_LOOPBACK, BASE_PORT + id, false)) return false;
+        for (int peer = 0; peer < nodes; peer++) {
+            if ((uint32_t)peer != id) socket.addTarget(INADDR_LOOPBACK, BASE_PORT + peer);
+        }
+
+        running = true;
+        thread = std::thread([this]() {
+            uint8_t buffer[REPLICATION_MAX_DATAGRAM];
+            uint32_t waitMs = 0;
+            while (running) {
+                ReplicationPeer from;
+                int length = socket.receive(buffer, sizeof(buffer), from, waitMs < 50 ? waitMs : 50);
+
+                std::lock_guard<std::mutex> lock(mutex);
+                if (length > 0 && replication->receive(buffer, length, from)) persist();
+                waitMs = replication->poll(nowMs());
+            }
+        });
+        return true;
+    }
+
+    void stop() {
+        running = false;
+        if (thread.joinable()) thread.join();
+        socket.close();
+    }
+
+    void add(const std::string &keyAccessId, const std::string &uidCard) {
+        std::lock_guard<std::mutex> lock(mutex);
+        store[keyAccessId] = uidCard;
+        replication->record(REPLICATION_ADD, 0, keyAccessId.c_str(), uidCard.c_str(), "visitor", "Visitor");
+        persist();
+    }
+
+    void revoke(const std::string &keyAccessId) {
+        std::lock_guard<std::mutex> lock(mutex);
+        store.erase(keyAccessId);
+        replication->record(REPLICATION_REVOKE, 0, keyAccessId.c_str(), nullptr, nullptr, nullptr);
+        persist();
+    }
+
+    // Like the firmware, the changes are appended to the journal and a snapshot is only taken now and then
+    void persist() {
+        std::vector<uint8_t> changes;
+        replication->takeJournal(changes);
+        journal.insert(journal.end(), changes.begin(), changes.end());
+        if (journal.size() >= JOURNAL_MAX && replication->save(saved)) journal.clear();
+    }
+};
+
+static bool converged(std::vector<std::unique_ptr<Node>> &nodes) {
+    std::lock_guard<std::mutex> first(nodes[0]->mutex);
+    for (size_t i = 1; i < nodes.size(); i++) {
+        std::lock_guard<std::mutex> lock(nodes[i]->mutex);
+        if (nodes[i]->store != nodes[0]->store) return false;
+        if (nodes[i]->replication->getContentHash() != nodes[0]->replication->getContentHash()) return false;
+        for (size_t origin = 0; origin < nodes.size(); origin++) {
+            if (nodes[i]->replication->getSequence(origin) != nodes[0]->replication->getSequence(origin)) return false;
+        }
+    }
+    return true;
+}
+
+static bool waitConverged(std::vector<std::unique_ptr<Node>> &nodes, const char *step, size_t expected) {
+    uint32_t start = nowMs();
+    while (!converged(nodes)) {
+        if (nowMs() - start > TIMEOUT_MS) {
+            printf("%s: not converged after %d ms\n", step, TIMEOUT_MS);
+            for (auto &node : nodes) {
+                std::lock_guard<std::mutex> lock(node->mutex);
+                printf("  node %u: %zu key access, hash %08x\n", node->id, node->store.size(), node->replication->getContentHash());
+            }
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    std::lock_guard<std::mutex> lock(nodes[0]->mutex);
+    if (nodes[0]->store.size() != expected) {
+        printf("%s: converged to %zu key access instead of %zu\n", step, nodes[0]->store.size(), expected);
+        return false;
+    }
+    printf("%s: converged in %u ms, %zu key access, %u datagrams sent, %u dropped\n",
+        step, nowMs() - start, nodes[0]->store.size(), sentDatagrams.load(), droppedDatagrams.load());
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 4;
+    int lossPercent = argc > 2 ? atoi(argv[2]) : 20;
+    if (count < 3 || count > REPLICATION_MAX_NODES || lossPercent < 0 || lossPercent >= 100) {
+        fprintf(stderr, "Usage: %s [nodes, 3 to %d] [loss percent, 0 to 99]\n", argv[0], REPLICATION_MAX_NODES);
+        return 2;
+    }
+
+    std::vector<std::unique_ptr<Node>> nodes;
+    for (int i = 0; i < count; i++) {
+        nodes.emplace_back(new Node(i, lossPercent));
+        nodes.back()->create();
+    }
+
+    // Every node but the last one is up while the changes are made
+    for (int i = 0; i < count - 1; i++) {
+        if (!nodes[i]->start(count)) {
+            fprintf(stderr, "Cannot bind port %d\n", BASE_PORT + i);
+            return 1;
+        }
+    }
+
+    // One write on node 0 per NFC Card
+    for (int i = 0; i < 40; i++) {
+        char keyAccessId[16], uidCard[16];
+        snprintf(keyAccessId, sizeof(keyAccessId), "key-%03d", i);
+        snprintf(uidCard, sizeof(uidCard), "04%08X", i * 2654435761u);
+        nodes[0]->add(keyAccessId, uidCard);
+    }
+    if (!nodes[count - 1]->start(count)) return 1;
+    if (!waitConverged(nodes, "provisioning", 40)) return 1;
+
+    // Changes on several nodes at once
+    for (int i = 4; i < 40; i += 5) {
+        char keyAccessId[16];
+        snprintf(keyAccessId, sizeof(keyAccessId), "key-%03d", i);
+        nodes[1]->revoke(keyAccessId);
+    }
+    nodes[2]->add("key-100", "04A1B2C3D4");
+    nodes[count - 1]->revoke("key-000");
+    if (!waitConverged(nodes, "concurrent changes", 32)) return 1;
+
+    // Restart node 1 from its stored state, it has to resume its own sequence
+    nodes[1]->stop();
+    std::vector<uint8_t> saved = nodes[1]->saved;
+    std::vector<uint8_t> journal = nodes[1]->journal;
+    nodes[1]->create();
+    bool loaded = saved.empty() || nodes[1]->replication->load(saved.data(), saved.size());
+    if (!loaded || !nodes[1]->replication->replay(journal.data(), journal.size()) || !nodes[1]->start(count)) {
+        fprintf(stderr, "Cannot restart node 1\n");
+        return 1;
+    }
+    nodes[1]->revoke("key-100");
+    nodes[2]->add("key-200", "04FFEEDDCC");
+    if (!waitConverged(nodes, "restart", 32)) return 1;
+
+    for (auto &node : nodes) node->stop();
+    return 0;
+}
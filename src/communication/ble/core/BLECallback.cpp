@@ -1,5 +1,6 @@
 #include "BLECallback.h"
 #include <esp_log.h>
+#include "communication/ble/helpers/BLEEncoding.h"
 #define BLE_CALLBACK_LOG_TAG "BLE_CALLBACK"
 
 
@@ -29,6 +30,9 @@ void BLECallback::onDisconnect(NimBLEServer *pServer, NimBLEConnInfo &connInfo,
     std::string clientAddress = connInfo.getAddress().toString();
     ESP_LOGW(BLE_CALLBACK_LOG_TAG, "A device just disconnected! Address: %s, Reason: 0x%X", clientAddress.c_str(), reason);
 
+    // A client that reuses the handle starts as JSON again
+    BLEEncodingTable::forget(connInfo.getConnHandle());
+
     // Restart advertising so the device can reconnect
     pServer->startAdvertising();
     ESP_LOGI(BLE_CALLBACK_LOG_TAG, "BLE advertising restarted");
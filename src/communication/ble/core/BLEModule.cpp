@@ -1,6 +1,7 @@
 #define BLE_MODULE_LOG_TAG "BLE"
 #include <esp_log.h>
 #include "BLEModule.h"
+#include "config/Config.h"
 
 BLEModule::BLEModule() {}
 
@@ -16,6 +17,8 @@ void BLEModule::initBLE(){
     ESP_LOGI(BLE_MODULE_LOG_TAG, "Initializing BLE Server and Service...");
     
     NimBLEDevice::init(std::string(BLESERVERNAME));
+    NimBLEDevice::setMTU(OTA_BLE_MTU);     // Largest MTU the client accepts, for the firmware update packets
+    NimBLEDevice::setSecurityAuth(true, false, true);   // Bond with secure connections, the firmware update needs a bonded client
     _bleServer = NimBLEDevice::createServer();
     _bleServer -> setCallbacks(new BLECallback());
 }
@@ -26,7 +29,7 @@ void BLEModule::initBLE(){
  * This method registers any kind of custom services for the BLE Service Channel.
  * enabling BLE clients to interact with the services
  *
- * @see DeviceInfoService::startService(), DoorInfoService::startService()
+ * @see DeviceInfoService::startService(), DoorInfoService::startService(), OTAService::startService()
  */
 void BLEModule::setupCharacteristic(){
     // Register BLE Service
@@ -36,6 +39,14 @@ void BLEModule::setupCharacteristic(){
     _doorInfoService = new DoorInfoService(_bleServer);
     _doorInfoService->startService();
 
+#if OTA_SIGNED_UPDATES_ENABLED
+    _otaService = new OTAService(_bleServer);
+    _otaService->startService();
+#else
+    _otaService = nullptr;
+    ESP_LOGW(BLE_MODULE_LOG_TAG, "Built without OTA_MANIFEST_PUBLIC_KEY, the BLE firmware update service is not started");
+#endif
+
     ESP_LOGI(BLE_MODULE_LOG_TAG, "BLE services set up.");
 }
 
@@ -119,4 +130,40 @@ void BLEModule::sendReport(int statusCode){
     JsonDocument document;
     document["status"]  = statusCode;
     _doorInfoService -> sendNotification(document);
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Sends a notification with the given status code and data payload
+ * 
+ * This method constructs a JSON document containing the status code and the payload on `data` field
+ * and sends it as a notification to the door information service.
+ *
+ * @param statusCode the Status Code int
+ * @param payload The JSON data to be sent in the notification.
+ *
+ */
+void BLEModule::sendReport(int statusCode, JsonVariantConst payload){
+    ESP_LOGI(BLE_MODULE_LOG_TAG, "Sending notification with data to door notification characteristic, status Code: %d", statusCode);
+
+    JsonDocument document;
+    document["status"]  = statusCode;
+    document["data"]    = payload;
+    _doorInfoService -> sendNotification(document);
+}
+
+/**
+ * @brief The largest notification value every connected client can receive
+ *
+ * A notification goes to all the connections, so the smallest negotiated ATT MTU is used.
+ *
+ * @return The size in bytes, from `BLE_DEFAULT_ATT_MTU` when no client is connected
+ */
+size_t BLEModule::getNotificationSize(){
+    uint16_t mtu = 0;
+    for (uint16_t peer : _bleServer->getPeerDevices()) {
+        uint16_t peerMtu = _bleServer->getPeerMTU(peer);
+        if (peerMtu != 0 && (mtu == 0 || peerMtu < mtu)) mtu = peerMtu;
+    }
+    if (mtu < BLE_DEFAULT_ATT_MTU) mtu = BLE_DEFAULT_ATT_MTU;
+    return mtu - BLE_ATT_NOTIFY_HEADER_SIZE;
+}
@@ -7,9 +7,12 @@
 
 #include "communication/ble/service/DeviceInfoService.h"
 #include "communication/ble/service/DoorInfoService.h"
+#include "communication/ble/service/OTAService.h"
 
 // Define BLE service and characteristic UUIDs
 #define BLESERVERNAME               "Yaris Door Auth"
+#define BLE_DEFAULT_ATT_MTU         23              // ATT MTU of a client that has not negotiated a larger one
+#define BLE_ATT_NOTIFY_HEADER_SIZE  3               // Opcode and handle of a notification, taken from the MTU
 
 class BLEModule {
 public:
@@ -19,6 +22,8 @@ public:
     void setupAdvertising();
     void sendReport(const char* status, const JsonObject& payload, const char* message);
     void sendReport(int statusCode);
+    void sendReport(int statusCode, JsonVariantConst payload);
+    size_t getNotificationSize();
 
 private:
     NimBLEServer* _bleServer;
@@ -26,6 +31,7 @@ private:
 
     DeviceInfoService* _deviceInfoService;
     DoorInfoService* _doorInfoService;
+    OTAService* _otaService;
 };
 
 
@@ -0,0 +1,111 @@
+#include "BLEEncoding.h"
+
+BLEEncodingTable::Entry BLEEncodingTable::_entries[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+portMUX_TYPE BLEEncodingTable::_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Tell the encoding of a written value from its first byte
+ *
+ * A MessagePack document is a map, so it starts with a fixmap (0x80 - 0x8f), map16 (0xde) or
+ * map32 (0xdf) byte, none of which can start a JSON text.
+ */
+BLEEncoding BLEEncodingTable::detect(const std::string &value) {
+    if (value.empty()) return BLE_ENCODING_JSON;
+
+    uint8_t first = (uint8_t)value[0];
+    if ((first & 0xF0) == 0x80 || first == 0xDE || first == 0xDF) return BLE_ENCODING_MSGPACK;
+    return BLE_ENCODING_JSON;
+}
+
+DeserializationError BLEEncodingTable::deserialize(JsonDocument &document, const std::string &value, BLEEncoding encoding) {
+    if (encoding == BLE_ENCODING_MSGPACK) return deserializeMsgPack(document, value.data(), value.size());
+    return deserializeJson(document, value.data(), value.size());
+}
+
+void BLEEncodingTable::serialize(JsonVariantConst document, BLEEncoding encoding, std::string &output) {
+    output.clear();
+    if (encoding == BLE_ENCODING_MSGPACK) serializeMsgPack(document, output);
+    else serializeJson(document, output);
+}
+
+/**
+ * @brief Remember the encoding of a connection, called on every command it writes
+ *
+ */
+void BLEEncodingTable::set(uint16_t connHandle, BLEEncoding encoding) {
+    if (encoding == BLE_ENCODING_JSON) {
+        forget(connHandle);
+        return;
+    }
+
+    portENTER_CRITICAL(&_lock);
+    Entry *free = nullptr;
+    Entry *found = nullptr;
+    for (Entry &entry : _entries) {
+        if (entry.used && entry.connHandle == connHandle) found = &entry;
+        else if (!entry.used && free == nullptr) free = &entry;
+    }
+    Entry *target = found != nullptr ? found : free;
+    if (target != nullptr) {
+        target->used = true;
+        target->connHandle = connHandle;
+        target->encoding = encoding;
+    }
+    portEXIT_CRITICAL(&_lock);
+
+    if (target == nullptr) ESP_LOGW(BLE_ENCODING_LOG_TAG, "No room for the encoding of connection %u, it stays JSON", connHandle);
+}
+
+BLEEncoding BLEEncodingTable::get(uint16_t connHandle) {
+    BLEEncoding encoding = BLE_ENCODING_JSON;
+    portENTER_CRITICAL(&_lock);
+    for (const Entry &entry : _entries) {
+        if (entry.used && entry.connHandle == connHandle) encoding = entry.encoding;
+    }
+    portEXIT_CRITICAL(&_lock);
+    return encoding;
+}
+
+/**
+ * @brief Drop the encoding of a connection, called when it disconnects so a new one on the same handle starts as JSON
+ *
+ */
+void BLEEncodingTable::forget(uint16_t connHandle) {
+    portENTER_CRITICAL(&_lock);
+    for (Entry &entry : _entries) {
+        if (entry.used && entry.connHandle == connHandle) entry.used = false;
+    }
+    portEXIT_CRITICAL(&_lock);
+}
+
+/**
+ * @brief Notify a document on a characteristic, each connection in its own encoding
+ *
+ * The document is serialized at most once per encoding. The value of the characteristic is kept
+ * as JSON for the clients that read it instead of subscribing.
+ *
+ * @param characteristic The characteristic to notify on
+ * @param document The document to send
+ * @param connHandle The only connection to notify, `BLE_HS_CONN_HANDLE_NONE` for all of them
+ */
+void BLEEncodingTable::notify(NimBLECharacteristic *characteristic, JsonVariantConst document, uint16_t connHandle) {
+    if (characteristic == nullptr) return;
+
+    std::string json;
+    std::string msgpack;
+    serialize(document, BLE_ENCODING_JSON, json);
+    characteristic->setValue((const uint8_t *)json.data(), json.size());
+
+    std::vector<uint16_t> peers;
+    if (connHandle != BLE_HS_CONN_HANDLE_NONE) peers.push_back(connHandle);
+    else peers = NimBLEDevice::getServer()->getPeerDevices();
+
+    for (uint16_t peer : peers) {
+        if (get(peer) == BLE_ENCODING_MSGPACK) {
+            if (msgpack.empty()) serialize(document, BLE_ENCODING_MSGPACK, msgpack);
+            characteristic->notify((const uint8_t *)msgpack.data(), msgpack.size(), peer);
+        } else {
+            characteristic->notify((const uint8_t *)json.data(), json.size(), peer);
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef BLE_ENCODING_H
+#define BLE_ENCODING_H
+
+#define BLE_ENCODING_LOG_TAG "BLE_ENCODING"
+
+#include "NimBLEDevice.h"
+#include <esp_log.h>
+#include <ArduinoJson.h>
+#include <freertos/FreeRTOS.h>
+#include <string>
+
+#ifndef CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+#define CONFIG_BT_NIMBLE_MAX_CONNECTIONS 3
+#endif
+
+/// @brief How the messages of a BLE connection are encoded
+enum BLEEncoding : uint8_t {
+    BLE_ENCODING_JSON,          /* JSON text, the default and the only one the legacy clients know             */
+    BLE_ENCODING_MSGPACK,       /* MessagePack, the same documents in binary, smaller and cheaper to parse      */
+};
+
+/**
+ * @brief Encoding of the BLE messages, chosen per connection.
+ *
+ * A client picks the encoding by the one it writes its commands in, a MessagePack map is recognized
+ * by its first byte, anything else is read as JSON. From then on every notification to that
+ * connection is sent in the same encoding, until it disconnects. The documents are the same in
+ * both encodings, so the command semantics and the status codes do not change.
+ */
+class BLEEncodingTable {
+public:
+    static BLEEncoding detect(const std::string &value);
+    static DeserializationError deserialize(JsonDocument &document, const std::string &value, BLEEncoding encoding);
+    static void serialize(JsonVariantConst document, BLEEncoding encoding, std::string &output);
+
+    static void set(uint16_t connHandle, BLEEncoding encoding);
+    static BLEEncoding get(uint16_t connHandle);
+    static void forget(uint16_t connHandle);
+
+    static void notify(NimBLECharacteristic *characteristic, JsonVariantConst document, uint16_t connHandle = BLE_HS_CONN_HANDLE_NONE);
+
+private:
+    /// @brief A connection that does not use JSON, the connections without one are JSON
+    struct Entry {
+        bool used;
+        uint16_t connHandle;
+        BLEEncoding encoding;
+    };
+
+    static Entry _entries[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+    static portMUX_TYPE _lock;
+};
+
+#endif
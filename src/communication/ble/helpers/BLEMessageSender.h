@@ -7,26 +7,47 @@
 #include <esp_log.h>
 #include <ArduinoJson.h>
 
+#include "BLEEncoding.h"
+
 class BLEMessageSender {
 public:
     /**
      * @brief a JSON notification helper class to send status code the connected client based on respected characteristic want's to be used 
      * 
-     * This function serializes the JSON document and sends it to the notification characteristic that was being passed.
+     * This function serializes the JSON document and sends it to the notification characteristic that was being passed,
+     * in the encoding of each connection. See `BLEEncodingTable`.
      * 
      * @param charac The JSON document containing the notification data.
      * @param StatusCode status code of the operation results. See `lib/StatusCode.h`
+     * @param connHandle The only connection to notify, the one that wrote the request. All of them by default.
+     */
+    static void sendNotification(NimBLECharacteristic* charac, int StatusCode, uint16_t connHandle = BLE_HS_CONN_HANDLE_NONE) {
+        if (charac) {
+            ESP_LOGI(BLE_MESSAGE_SENDER_LOG_TAG, "Sending notification with status code: %d", StatusCode);
+
+            JsonDocument document;
+            document["status"] = StatusCode;
+            BLEEncodingTable::notify(charac, document, connHandle);
+            return;
+        }
+    }
+
+    /**
+     * @brief Same as `sendNotification` with the status code only, with a payload in the `data` field
+     * 
+     * @param charac The characteristic to send the notification on.
+     * @param StatusCode status code of the operation results. See `lib/StatusCode.h`
+     * @param data The JSON data to be sent in the notification.
+     * @param connHandle The only connection to notify, the one that wrote the request. All of them by default.
      */
-    static void sendNotification(NimBLECharacteristic* charac, int StatusCode) {
+    static void sendNotification(NimBLECharacteristic* charac, int StatusCode, JsonVariantConst data, uint16_t connHandle = BLE_HS_CONN_HANDLE_NONE) {
         if (charac) {
             ESP_LOGI(BLE_MESSAGE_SENDER_LOG_TAG, "Sending notification with status code: %d", StatusCode);
 
             JsonDocument document;
             document["status"] = StatusCode;
-            String buffer;
-            serializeJson(document, buffer);
-            charac -> setValue(buffer.c_str());
-            charac -> notify();
+            document["data"] = data;
+            BLEEncodingTable::notify(charac, document, connHandle);
             return;
         }
     }
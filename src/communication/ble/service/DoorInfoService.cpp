@@ -1,6 +1,7 @@
 #include "DoorInfoService.h"
 #include <stdio.h>
 #include "entity/CommandBleData.h"
+#include "entity/CommandBleTable.h"
 #include "StatusCodes.h"
 
 
@@ -15,16 +16,24 @@ DoorCharacteristicCallbacks::DoorCharacteristicCallbacks(NimBLECharacteristic *p
  */
 void DoorCharacteristicCallbacks::onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo){
     const std::string& value = pCharacteristic -> getValue();
-    ESP_LOGI(DOOR_INFO_SERVICE_LOG_TAG, "Incoming Door Characteristic UUID value of %s", value.c_str());
+    uint16_t connHandle = connInfo.getConnHandle();
+
+    // The client picks its encoding with the command it writes, the replies to it follow the same one
+    BLEEncoding encoding = BLEEncodingTable::detect(value);
+    BLEEncodingTable::set(connHandle, encoding);
+    if (encoding == BLE_ENCODING_JSON)
+        ESP_LOGI(DOOR_INFO_SERVICE_LOG_TAG, "Incoming Door Characteristic UUID value of %s", value.c_str());
+    else
+        ESP_LOGI(DOOR_INFO_SERVICE_LOG_TAG, "Incoming Door Characteristic UUID value of %u MessagePack bytes", (unsigned)value.size());
 
     JsonDocument incomingData;
-    DeserializationError error = deserializeJson(incomingData, value);
+    DeserializationError error = BLEEncodingTable::deserialize(incomingData, value, encoding);
 
     if (error){
-        ESP_LOGE(DOOR_INFO_SERVICE_LOG_TAG, "Failed to deserialize JSON. Error: %s", error.c_str());
+        ESP_LOGE(DOOR_INFO_SERVICE_LOG_TAG, "Failed to deserialize %s. Error: %s", encoding == BLE_ENCODING_JSON ? "JSON" : "MessagePack", error.c_str());
         incomingData.clear();
 
-        BLEMessageSender::sendNotification(_pNotificationChar, INVALID_JSON_BLE_REQUEST_FORMAT);
+        BLEMessageSender::sendNotification(_pNotificationChar, INVALID_JSON_BLE_REQUEST_FORMAT, connHandle);
         return;
     }
 
@@ -33,9 +42,21 @@ void DoorCharacteristicCallbacks::onWrite(NimBLECharacteristic* pCharacteristic,
     const char *name = data["name"];
     const char *key_access = nullptr;
     const char *visitor_id = nullptr;
-
-    if (command != nullptr)
-        ESP_LOGI(DOOR_INFO_SERVICE_LOG_TAG, "Received Name: Command = %s", command);
+    bool has_time_range = false;
+    uint32_t from = 0;
+    uint32_t to = 0;
+    uint32_t id = incomingData["id"] | (uint32_t)0;
+
+    // The numeric ids are written here, they have to outlive the checks below
+    char key_access_buffer[12];
+    char visitor_id_buffer[12];
+
+    if (command == nullptr){
+        ESP_LOGE(DOOR_INFO_SERVICE_LOG_TAG, "Received Door Characteristic without `command`. Cannot proceed.");
+        BLEMessageSender::sendNotification(_pNotificationChar, INVALID_JSON_BLE_REQUEST_FORMAT, connHandle);
+        return;
+    }
+    ESP_LOGI(DOOR_INFO_SERVICE_LOG_TAG, "Received Name: Command = %s", command);
 
     if (!data.isNull()){
         if (name != nullptr)
@@ -48,9 +69,8 @@ void DoorCharacteristicCallbacks::onWrite(NimBLECharacteristic* pCharacteristic,
         else if (data["key_access_id"].is<int>())
         {
             int key_access_int = data["key_access_id"].as<int>();
-            char buffer[8];
-            itoa(key_access_int, buffer, 10);
-            key_access = buffer;
+            itoa(key_access_int, key_access_buffer, 10);
+            key_access = key_access_buffer;
             ESP_LOGI(DOOR_INFO_SERVICE_LOG_TAG, "Received Data: Key Access = %s", key_access);
         }
 
@@ -63,101 +83,82 @@ void DoorCharacteristicCallbacks::onWrite(NimBLECharacteristic* pCharacteristic,
         else if (data["visitor_id"].is<int>())
         {
             int visitor_id_int = data["visitor_id"].as<int>();
-            char buffer[8];
-            itoa(visitor_id_int, buffer, 10);
-            visitor_id = buffer;
+            itoa(visitor_id_int, visitor_id_buffer, 10);
+            visitor_id = visitor_id_buffer;
             ESP_LOGI(DOOR_INFO_SERVICE_LOG_TAG, "Received Data: Visitor ID = %s", visitor_id);
         }
-    }
-
-    // Error handling when BLE Door Characteristic Callback kicks in
-    if (strcmp(command, "register_fp") == 0){
-        if (name == nullptr && visitor_id != nullptr && key_access != nullptr){
-            ESP_LOGE(DOOR_INFO_SERVICE_LOG_TAG, "Received 'register_fp' command, but 'name' is empty. Cannot proceed.");
-            BLEMessageSender::sendNotification(_pNotificationChar, FAILED_TO_REGISTER_FINGERPRINT_NO_NAME);
-            return;
-        }
-        
-        if (visitor_id == nullptr || key_access == nullptr){
-            ESP_LOGE(DOOR_INFO_SERVICE_LOG_TAG, "Received 'register_fp' command, but `visitor_id` or `key_access` is empty. Cannot proceed.");
-            BLEMessageSender::sendNotification(_pNotificationChar, FAILED_TO_DELETE_FINGERPRINT_NO_ID);
-            return;
-        }
 
-        if (name == nullptr && visitor_id == nullptr && key_access == nullptr){
-            ESP_LOGE(DOOR_INFO_SERVICE_LOG_TAG, "Received 'register_fp' command, but 'name', `visitor_id`, `key_access` is empty. Cannot proceed.");
-            BLEMessageSender::sendNotification(_pNotificationChar, FAILED_TO_DELETE_FINGERPRINT_NO_NAME_AND_ID);
-            return;
-        }
-    }
-
-    if (strcmp(command, "delete_fp") == 0){
-        if (key_access == nullptr){
-            ESP_LOGW(DOOR_INFO_SERVICE_LOG_TAG, "Received 'delete_fp' command but `visitor_id` is empty. Cannot proceed.");
-            BLEMessageSender::sendNotification(_pNotificationChar, FAILED_TO_DELETE_FINGERPRINT_NO_ID);
-            return;
+        if (data["from"].is<uint32_t>() && data["to"].is<uint32_t>())
+        {
+            has_time_range = true;
+            from = data["from"].as<uint32_t>();
+            to = data["to"].as<uint32_t>();
+            ESP_LOGI(DOOR_INFO_SERVICE_LOG_TAG, "Received Data: Time Range = %lu - %lu", (unsigned long)from, (unsigned long)to);
         }
     }
 
-    if (strcmp(command, "delete_fp_user") == 0){
-        if (visitor_id == nullptr){
-            ESP_LOGW(DOOR_INFO_SERVICE_LOG_TAG, "Received 'delete_fp_user' command but `visitor_id` is empty. Cannot proceed.");
-            BLEMessageSender::sendNotification(_pNotificationChar, FAILED_TO_DELETE_FINGERPRINT_NO_ID);
-            return;
-        }
+    // Error handling when BLE Door Characteristic Callback kicks in, the table knows the fields of every command
+    const CommandBleSpec *spec = findBleCommand(command);
+    if (spec == nullptr){
+        ESP_LOGW(DOOR_INFO_SERVICE_LOG_TAG, "Received unknown '%s' command. Cannot proceed.", command);
+        BLEMessageSender::sendNotification(_pNotificationChar, BLE_COMMAND_UNKNOWN, connHandle);
+        return;
     }
 
-    if (strcmp(command, "register_rfid") == 0){
-        if (name == nullptr && visitor_id != nullptr && key_access != nullptr){
-            ESP_LOGE(DOOR_INFO_SERVICE_LOG_TAG, "Received 'register_rfid' command, but 'name' is empty. Cannot proceed.");
-            BLEMessageSender::sendNotification(_pNotificationChar, FAILED_TO_REGISTER_NFC_NO_NAME);
-            return;
-        }
-        
-        if (visitor_id == nullptr || key_access == nullptr){
-            ESP_LOGE(DOOR_INFO_SERVICE_LOG_TAG, "Received 'register_rfid' command, but `visitor_id` or `key_access` is empty. Cannot proceed.");
-            BLEMessageSender::sendNotification(_pNotificationChar, FAILED_TO_REGISTER_NFC_NO_VISITOR_ID_OR_KEY_ACCESS_ID);
-            return;
-        }
-
-        if (name == nullptr && visitor_id == nullptr && key_access == nullptr){
-            ESP_LOGE(DOOR_INFO_SERVICE_LOG_TAG, "Received 'register_rfid' command, but 'name', `visitor_id`, `key_access` is empty. Cannot proceed.");
-            BLEMessageSender::sendNotification(_pNotificationChar, FAILED_TO_REGISTER_NFC_NO_NAME_AND_ID);
-            return;
-        }
+    uint8_t present = (name != nullptr ? FIELD_NAME : FIELD_NONE)
+        | (key_access != nullptr ? FIELD_KEY_ACCESS : FIELD_NONE)
+        | (visitor_id != nullptr ? FIELD_VISITOR_ID : FIELD_NONE)
+        | (has_time_range && from <= to ? FIELD_TIME_RANGE : FIELD_NONE);
+    int fieldError = checkBleCommandFields(*spec, present);
+    if (fieldError != 0){
+        ESP_LOGW(DOOR_INFO_SERVICE_LOG_TAG, "Received '%s' command without its required fields (0x%02x of 0x%02x). Cannot proceed.", command, present & spec->required, spec->required);
+        BLEMessageSender::sendNotification(_pNotificationChar, fieldError, connHandle);
+        return;
     }
     
-    if (strcmp(command, "delete_rfid") == 0){
-        if (key_access == nullptr){
-            ESP_LOGW(DOOR_INFO_SERVICE_LOG_TAG, "Received 'delete_rfid' command but `key access id` is empty. Cannot proceed.");
-            BLEMessageSender::sendNotification(_pNotificationChar, FAILED_TO_DELETE_NFC_NO_ID);
-            return;
-        }
+    // The command is copied whole into the queue, a field that does not fit is refused rather than cut
+    CommandBleData commandData = {};
+    commandData.id = id;
+    commandData.state = spec->state;
+    commandData.from = from;
+    commandData.to = to;
+    if (!copyField(commandData.command, sizeof(commandData.command), command)
+        || !copyField(commandData.name, sizeof(commandData.name), name)
+        || !copyField(commandData.keyAccess, sizeof(commandData.keyAccess), key_access)
+        || !copyField(commandData.visitorId, sizeof(commandData.visitorId), visitor_id)){
+        ESP_LOGW(DOOR_INFO_SERVICE_LOG_TAG, "Received '%s' command with a field too long. Cannot proceed.", command);
+        BLEMessageSender::sendNotification(_pNotificationChar, BLE_COMMAND_FIELD_TOO_LONG, connHandle);
+        return;
     }
 
-    if (strcmp(command, "delete_rfid_user") == 0){
-        if (visitor_id == nullptr){
-            ESP_LOGW(DOOR_INFO_SERVICE_LOG_TAG, "Received 'delete_rfid_user' command but `visitor_id` is empty. Cannot proceed.");
-            BLEMessageSender::sendNotification(_pNotificationChar, FAILED_TO_DELETE_NFC_NO_ID);
-            return;
-        }
-    }
+    // Acknowledge every command, the head unit can send the next one without waiting for the result
+    JsonDocument ack;
+    ack["command"] = command;
+    if (id != 0) ack["id"] = id;
 
-    if (strcmp(command, "delete_access_user") == 0){
-        if (visitor_id == nullptr){
-            ESP_LOGW(DOOR_INFO_SERVICE_LOG_TAG, "Received 'delete_access_user' command but `visitor_id` is empty. Cannot proceed.");
-            BLEMessageSender::sendNotification(_pNotificationChar, FAILED_TO_DELETE_NFC_NO_ID);
-            return;
-        }
+    size_t ahead = commandBleQueue.pending();
+    if (!commandBleQueue.push(commandData)){
+        ESP_LOGW(DOOR_INFO_SERVICE_LOG_TAG, "Command queue is full, refusing '%s' command.", command);
+        BLEMessageSender::sendNotification(_pNotificationChar, BLE_COMMAND_QUEUE_FULL, ack, connHandle);
+        return;
     }
-    
-    commandBleData.setCommand(command);
-    commandBleData.setName(name);
-    commandBleData.setKeyAccess(key_access);
-    commandBleData.setVisitorId(visitor_id);
 
-    ESP_LOGI(DOOR_INFO_SERVICE_LOG_TAG, "Received Valid Data Door Characteristic: Payload = %s", value.c_str());
-    vTaskDelay( 50 / portTICK_PERIOD_MS);
+    ESP_LOGI(DOOR_INFO_SERVICE_LOG_TAG, "Received Valid Data Door Characteristic: Command = %s, %u queued ahead", command, (unsigned)ahead);
+    ack["queued"] = ahead;
+    BLEMessageSender::sendNotification(_pNotificationChar, STATUS_BLE_COMMAND_ACCEPTED, ack, connHandle);
+}
+
+/**
+ * @brief Copy a field of a command into its fixed buffer, a missing field leaves it empty
+ *
+ * @return `false` if the field does not fit in the buffer
+ */
+bool DoorCharacteristicCallbacks::copyField(char *buffer, size_t size, const char *value){
+    if (value == nullptr){
+        buffer[0] = '\0';
+        return true;
+    }
+    return (size_t)snprintf(buffer, size, "%s", value) < size;
 }
 
 /**
@@ -283,17 +284,15 @@ void DoorInfoService::startService() {
  * @param json The JSON document containing the notification data.
  */
 void DoorInfoService::sendNotification(JsonDocument& json){
-    String buffer;
-    serializeJson(json, buffer);
-    _pNotificationChar -> setValue(buffer.c_str());
-    _pNotificationChar -> notify();
+    BLEEncodingTable::notify(_pNotificationChar, json);
     ESP_LOGI(DOOR_INFO_SERVICE_LOG_TAG, "Notification sent to Notification Characteristic!");
 }
 
 /**
  * @brief Sends a status as a notification to the client.
  * 
- * This function creates a simple JSON document with the status sends it to the notification characteristic.
+ * This function creates a simple JSON document with the status sends it to the notification characteristic,
+ * in the encoding of each connection.
  * 
  * @param status The status of the notification.
  */
@@ -301,17 +300,15 @@ void DoorInfoService::sendNotification(char* status){
     JsonDocument document;
     document["status"] = status;
 
-    String buffer;
-    serializeJson(document, buffer);
-    _pNotificationChar -> setValue(buffer.c_str());
-    _pNotificationChar -> notify();
+    BLEEncodingTable::notify(_pNotificationChar, document);
     ESP_LOGI(DOOR_INFO_SERVICE_LOG_TAG, "Notification sent to Notification Characteristic!");
 }
 
 /**
  * @brief Sends a status and message as a notification to the client.
  * 
- * This function creates a simple JSON document with the status and message and sends it to the notification characteristic.
+ * This function creates a simple JSON document with the status and message and sends it to the notification characteristic,
+ * in the encoding of each connection.
  * 
  * @param status The status of the notification.
  * @param message The message to send as a notification.
@@ -321,9 +318,6 @@ void DoorInfoService::sendNotification(char* status, char* message){
     document["status"] = status;
     document["message"] = message;
 
-    String buffer;
-    serializeJson(document, buffer);
-    _pNotificationChar -> setValue(buffer.c_str());
-    _pNotificationChar -> notify();
+    BLEEncodingTable::notify(_pNotificationChar, document);
     ESP_LOGI(DOOR_INFO_SERVICE_LOG_TAG, "Notification sent to Notification Characteristic!");
 }
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include <ArduinoJson.h>
 
 #include "StatusCodes.h"
+#include "communication/ble/helpers/BLEEncoding.h"
 #include "communication/ble/helpers/BLEMessageSender.h"
 
 #define SERVICE_UUID                         "4fafc201-1fb5-459e-8fcc-c5c9c331914b"
@@ -19,6 +20,7 @@
 class DoorCharacteristicCallbacks : public NimBLECharacteristicCallbacks {
     private:
         NimBLECharacteristic* _pNotificationChar;
+        static bool copyField(char *buffer, size_t size, const char *value);
     public:
         DoorCharacteristicCallbacks(NimBLECharacteristic* pNotificationChar);
         void onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) override;
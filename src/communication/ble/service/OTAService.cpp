@@ -0,0 +1,528 @@
+#include "OTAService.h"
+#include <esp_timer.h>
+#include <mbedtls/pk.h>
+
+#include "config/Config.h"
+#include "ota/ota.h"
+#include "tasks/BaseTask.h"
+#include "communication/ble/helpers/BLEMessageSender.h"
+
+static bool decodeHex(const char *hex, uint8_t *data, size_t size) {
+    if (hex == nullptr || strlen(hex) != size * 2) return false;
+
+    for (size_t i = 0; i < size; i++) {
+        char byte[3] = { hex[i * 2], hex[i * 2 + 1], '\0' };
+        char *end;
+        data[i] = strtoul(byte, &end, 16);
+        if (*end != '\0') return false;
+    }
+    return true;
+}
+
+OTAControlCharacteristicCallback::OTAControlCharacteristicCallback(OTAService* pOTAService)
+    : _pOTAService(pOTAService){}
+
+/**
+ * @brief Handles the `begin` and `abort` commands written to the OTA Control characteristic.
+ *
+ * @param pCharacteristic Pointer to the characteristic that was written to.
+ * @param connInfo        Connection information of the client that wrote the data.
+ */
+void OTAControlCharacteristicCallback::onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo){
+    const std::string& value = pCharacteristic -> getValue();
+    ESP_LOGI(OTA_SERVICE_LOG_TAG, "Incoming OTA Control Characteristic UUID value of %s", value.c_str());
+
+    JsonDocument request;
+    DeserializationError error = deserializeJson(request, value);
+    if (error){
+        ESP_LOGE(OTA_SERVICE_LOG_TAG, "Failed to deserialize JSON. Error: %s", error.c_str());
+        BLEMessageSender::sendNotification(pCharacteristic, INVALID_JSON_BLE_REQUEST_FORMAT);
+        return;
+    }
+
+    _pOTAService -> handleControl(request, connInfo);
+}
+
+OTADataCharacteristicCallback::OTADataCharacteristicCallback(OTAService* pOTAService)
+    : _pOTAService(pOTAService){}
+
+/**
+ * @brief Handles a packet of the image written without response to the OTA Data characteristic.
+ *
+ * @param pCharacteristic Pointer to the characteristic that was written to.
+ * @param connInfo        Connection information of the client that wrote the data.
+ */
+void OTADataCharacteristicCallback::onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo){
+    NimBLEAttValue value = pCharacteristic -> getValue();
+    _pOTAService -> handleData(value.data(), value.size());
+}
+
+/**
+ * @class OTAService
+ * @brief BLE service for updating the firmware without WiFi.
+ */
+OTAService::OTAService(NimBLEServer* pServer) {
+    this -> _pServer = pServer;
+    this -> _pService = nullptr;
+    this -> _pControlChar = nullptr;
+    this -> _pDataChar = nullptr;
+
+    this -> _state = OTA_SESSION_IDLE;
+    this -> _abortRequested = false;
+    this -> _windowMutex = xSemaphoreCreateMutex();
+    this -> _window = NULL;
+    this -> _handle = 0;
+    this -> _partition = nullptr;
+    mbedtls_sha256_init(&this -> _sha);
+    this -> _signatureLength = 0;
+    this -> _imageSize = 0;
+    this -> _packetSize = 0;
+    this -> _received = 0;
+    this -> _written = 0;
+    this -> _resendOffset = OTA_BLE_NO_RESEND;
+    this -> _resends = 0;
+    this -> _startTime = 0;
+}
+
+OTAService::~OTAService() {}
+
+/**
+ * @brief Starts the OTAService by creating the control and data characteristics.
+ *
+ * The data characteristic only accepts write without response, so the client can queue several
+ * packets in one connection event instead of waiting a round trip for every packet. Both
+ * characteristics need an encrypted connection, so the client is asked to pair before its first write.
+ */
+void OTAService::startService() {
+    ESP_LOGI(OTA_SERVICE_LOG_TAG, "Initializing BLE OTA Service");
+    _pService = _pServer->createService(OTA_SERVICE_UUID);
+
+    // Initialize BLE OTA Control Characteristic, the acknowledgements are notified on it as well
+    ESP_LOGI(OTA_SERVICE_LOG_TAG, "Initializing BLE OTA Control Characteristic");
+    _pControlChar = _pService->createCharacteristic(
+        OTA_CONTROL_CHARACTERISTIC_UUID,
+        NIMBLE_PROPERTY::WRITE | NIMBLE_PROPERTY::WRITE_ENC | NIMBLE_PROPERTY::NOTIFY
+    );
+    _pControlChar->setCallbacks(new OTAControlCharacteristicCallback(this));
+    NimBLEDescriptor* controlDesc = new NimBLEDescriptor(
+        NimBLEUUID((uint16_t)0x2901), NIMBLE_PROPERTY::READ, 64, _pControlChar);
+    controlDesc->setValue("OTA Control Characteristic");
+    _pControlChar->addDescriptor(controlDesc);
+
+    // Initialize BLE OTA Data Characteristic
+    ESP_LOGI(OTA_SERVICE_LOG_TAG, "Initializing BLE OTA Data Characteristic");
+    _pDataChar = _pService->createCharacteristic(
+        OTA_DATA_CHARACTERISTIC_UUID,
+        NIMBLE_PROPERTY::WRITE_NR | NIMBLE_PROPERTY::WRITE_ENC,
+        OTA_BLE_MTU - 3
+    );
+    _pDataChar->setCallbacks(new OTADataCharacteristicCallback(this));
+    NimBLEDescriptor* dataDesc = new NimBLEDescriptor(
+        NimBLEUUID((uint16_t)0x2901), NIMBLE_PROPERTY::READ, 64, _pDataChar);
+    dataDesc->setValue("OTA Data Characteristic");
+    _pDataChar->addDescriptor(dataDesc);
+
+    // Start the service
+    ESP_LOGI(OTA_SERVICE_LOG_TAG, "Starting OTA Service");
+    _pService->start();
+}
+
+/**
+ * @brief Handles a command of the OTA Control characteristic.
+ *
+ * - `{"command": "begin", "data": {"size": ..., "sha256": "...", "signature": "..."}}` starts an update
+ * - `{"command": "abort"}` stops the running update, the running firmware stays the boot partition
+ *
+ * @param request  The parsed command
+ * @param connInfo Connection information of the client that wrote the command.
+ */
+void OTAService::handleControl(JsonDocument& request, NimBLEConnInfo& connInfo) {
+    const char *command = request["command"];
+    if (command == nullptr) {
+        sendStatus(INVALID_FIRMWARE_UPDATE_REQUEST);
+        return;
+    }
+
+    if (strcmp(command, "begin") == 0) {
+        begin(request["data"], connInfo);
+    } else if (strcmp(command, "abort") == 0) {
+        if (_state == OTA_SESSION_IDLE) sendStatus(FIRMWARE_UPDATE_ABORTED);
+        else _abortRequested = true;
+    } else {
+        ESP_LOGW(OTA_SERVICE_LOG_TAG, "Unknown OTA command: %s", command);
+        sendStatus(INVALID_FIRMWARE_UPDATE_REQUEST);
+    }
+}
+
+/**
+ * @brief Check the begin request and start the writer task of the update.
+ *
+ * The signature check and the preparation of the partition take a while, so they are done by the
+ * writer task instead of the BLE host task. The connection is asked for the shortest interval and the
+ * longest link layer packets, so a connection event carries as many packets as possible.
+ *
+ * @param data     The `data` field of the begin command
+ * @param connInfo Connection information of the client that starts the update.
+ */
+void OTAService::begin(JsonObjectConst data, NimBLEConnInfo& connInfo) {
+    if (!isAuthorized(connInfo)) {
+        ESP_LOGW(OTA_SERVICE_LOG_TAG, "Firmware update refused, the connection is not bonded.");
+        sendStatus(FIRMWARE_UPDATE_NOT_AUTHORIZED);
+        return;
+    }
+
+    if (_state != OTA_SESSION_IDLE) {
+        ESP_LOGW(OTA_SERVICE_LOG_TAG, "A firmware update is already running.");
+        sendStatus(FIRMWARE_UPDATE_IN_PROGRESS);
+        return;
+    }
+
+    const char *signatureHex = data["signature"];
+    _imageSize = data["size"] | 0;
+    _signatureLength = signatureHex != nullptr ? strlen(signatureHex) / 2 : 0;
+    _partition = esp_ota_get_next_update_partition(NULL);
+
+    if (_partition == nullptr || _imageSize == 0 || _imageSize > _partition->size
+        || !decodeHex(data["sha256"], _imageSha256, sizeof(_imageSha256))
+        || _signatureLength == 0 || _signatureLength > sizeof(_signature)
+        || !decodeHex(signatureHex, _signature, _signatureLength)) {
+        ESP_LOGE(OTA_SERVICE_LOG_TAG, "Invalid firmware update request.");
+        sendStatus(INVALID_FIRMWARE_UPDATE_REQUEST);
+        return;
+    }
+
+    _packetSize = connInfo.getMTU() - 3 - OTA_BLE_PACKET_HEADER_SIZE;
+    _pServer->updateConnParams(connInfo.getConnHandle(), 6, 12, 0, 400);   // 7.5 - 15 ms interval, 4 s supervision timeout
+    _pServer->setDataLen(connInfo.getConnHandle(), 251);
+
+    _state = OTA_SESSION_STARTING;
+    _abortRequested = false;
+    BaseType_t created = xTaskCreate(
+        writeImage,                     // Function to run in the task
+        "BLE OTA",                      // Name of the task
+        OTA_BLE_TASK_STACK_SIZE,        // Stack size (adjustable)
+        this,                           // Pass the `this` pointer to the task
+        5,                              // Task priority
+        NULL                            // The task deletes itself when the update ends
+    );
+    if (created != pdPASS) {
+        ESP_LOGE(OTA_SERVICE_LOG_TAG, "Failed to create the BLE OTA task.");
+        _state = OTA_SESSION_IDLE;
+        sendStatus(FAILED_TO_UPDATE_FIRMWARE);
+    }
+}
+
+/**
+ * @brief Check the client can update the firmware, only an encrypted connection that is bonded or
+ * paired with authentication can
+ *
+ * @param connInfo Connection information of the client that starts the update.
+ * @return `true` if the client can update the firmware, `false` otherwise.
+ */
+bool OTAService::isAuthorized(NimBLEConnInfo& connInfo) {
+    return connInfo.isEncrypted() && (connInfo.isBonded() || connInfo.isAuthenticated());
+}
+
+/**
+ * @brief Handles a packet of the image, the first 4 bytes are its little endian offset in the image.
+ *
+ * Runs on the BLE host task, so the packet is only copied into the window and written to flash by
+ * the writer task. A packet after a gap asks the client once to resend from the first missing offset,
+ * the packets already in flight after the lost one are dropped until the resend arrives.
+ *
+ * @param data   The packet
+ * @param length The length of the packet
+ */
+void OTAService::handleData(const uint8_t* data, size_t length) {
+    if (_state != OTA_SESSION_RECEIVING || length <= OTA_BLE_PACKET_HEADER_SIZE) return;
+
+    uint32_t offset = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+    const uint8_t *payload = data + OTA_BLE_PACKET_HEADER_SIZE;
+    size_t payloadLength = length - OTA_BLE_PACKET_HEADER_SIZE;
+    uint32_t expected = _received;
+
+    // A resent packet that already arrived
+    if (offset < expected) return;
+
+    if (offset + payloadLength > _imageSize) {
+        ESP_LOGW(OTA_SERVICE_LOG_TAG, "Dropped a packet past the end of the image at offset %lu.", (unsigned long)offset);
+        return;
+    }
+
+    bool stored = false;
+    if (offset == expected) {
+        xSemaphoreTake(_windowMutex, portMAX_DELAY);
+        stored = _window != NULL && xStreamBufferSpacesAvailable(_window) >= payloadLength
+                 && xStreamBufferSend(_window, payload, payloadLength, 0) == payloadLength;
+        xSemaphoreGive(_windowMutex);
+    }
+
+    if (!stored) {
+        // A lost packet, or the client sent more than the window
+        if (_resendOffset != expected) {
+            _resendOffset = expected;
+            requestResend(expected);
+        }
+        return;
+    }
+    _received = expected + payloadLength;
+}
+
+/**
+ * @brief The writer task of an update, deletes itself when the update ends.
+ *
+ * @param parameter The `OTAService` of the update
+ */
+void OTAService::writeImage(void* parameter) {
+    OTAService* service = static_cast<OTAService*>(parameter);
+
+    // Held for the whole transfer, an update over WiFi writes the same partition
+    if (xSemaphoreTake(firmwareUpdateMutex(), 0) != pdTRUE) {
+        ESP_LOGW(OTA_SERVICE_LOG_TAG, "A firmware update over WiFi is already running.");
+        service->sendStatus(FIRMWARE_UPDATE_IN_PROGRESS);
+        service->cleanup();
+        vTaskDelete(NULL);
+        return;
+    }
+
+    if (service->prepare() && service->finish()) {
+        ESP_LOGI(OTA_SERVICE_LOG_TAG, "Restarting into the new firmware...");
+        vTaskDelay(pdMS_TO_TICKS(OTA_BLE_RESTART_DELAY_MS));
+        esp_restart();
+    }
+
+    service->cleanup();
+    xSemaphoreGive(firmwareUpdateMutex());
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Check the signature of the image and open the inactive partition for writing.
+ *
+ * The partition is erased sector by sector while it is written, so the client can start sending
+ * right away instead of waiting seconds for the whole partition to be erased.
+ *
+ * @return `true` if the client was told to start sending the image, `false` otherwise.
+ */
+bool OTAService::prepare() {
+    mbedtls_sha256_init(&_sha);
+    mbedtls_sha256_starts(&_sha, 0);
+
+    if (!verifySignature()) {
+        sendStatus(INVALID_FIRMWARE_UPDATE_REQUEST);
+        return false;
+    }
+
+    if (esp_ota_begin(_partition, OTA_WITH_SEQUENTIAL_WRITES, &_handle) != ESP_OK) {
+        ESP_LOGE(OTA_SERVICE_LOG_TAG, "Failed to start writing partition %s.", _partition->label);
+        _handle = 0;
+        sendStatus(FAILED_TO_UPDATE_FIRMWARE);
+        return false;
+    }
+
+    xSemaphoreTake(_windowMutex, portMAX_DELAY);
+    _window = xStreamBufferCreate(OTA_BLE_WINDOW_SIZE, 1);
+    xSemaphoreGive(_windowMutex);
+    if (_window == NULL) {
+        ESP_LOGE(OTA_SERVICE_LOG_TAG, "Not enough memory for the receive window.");
+        sendStatus(FAILED_TO_UPDATE_FIRMWARE);
+        return false;
+    }
+
+    _received = 0;
+    _written = 0;
+    _resendOffset = OTA_BLE_NO_RESEND;
+    _resends = 0;
+    _startTime = esp_timer_get_time();
+    _state = OTA_SESSION_RECEIVING;
+
+    ESP_LOGI(OTA_SERVICE_LOG_TAG, "Receiving a %lu byte image into partition %s, %u bytes per packet.",
+             (unsigned long)_imageSize, _partition->label, _packetSize);
+
+    JsonDocument data;
+    data["window"] = OTA_BLE_WINDOW_SIZE;
+    data["ack_interval"] = OTA_BLE_ACK_INTERVAL;
+    data["packet_size"] = _packetSize;
+    sendStatus(STATUS_FIRMWARE_UPDATE_READY, data);
+    return true;
+}
+
+/**
+ * @brief Check the ECDSA P-256 signature of the SHA-256 of the image with `OTA_MANIFEST_PUBLIC_KEY`.
+ *
+ * The same key signs the manifests of the chunked updates, the signature is made with
+ * `openssl dgst -sha256 -sign <key> firmware.bin`.
+ *
+ * @return `true` if the signature is valid, `false` otherwise.
+ */
+bool OTAService::verifySignature() {
+#if !OTA_SIGNED_UPDATES_ENABLED
+    ESP_LOGE(OTA_SERVICE_LOG_TAG, "Built without OTA_MANIFEST_PUBLIC_KEY, no image can be trusted");
+    return false;
+#else
+    mbedtls_pk_context key;
+    mbedtls_pk_init(&key);
+    const char *publicKey = OTA_MANIFEST_PUBLIC_KEY;
+    int result = mbedtls_pk_parse_public_key(&key, (const uint8_t*)publicKey, strlen(publicKey) + 1);
+    if (result == 0) result = mbedtls_pk_verify(&key, MBEDTLS_MD_SHA256, _imageSha256, sizeof(_imageSha256), _signature, _signatureLength);
+    mbedtls_pk_free(&key);
+
+    if (result != 0) ESP_LOGE(OTA_SERVICE_LOG_TAG, "Image signature is not valid: -0x%04x", -result);
+    return result == 0;
+#endif
+}
+
+/**
+ * @brief Write the received image into the partition and acknowledge it, then verify and activate it.
+ *
+ * The acknowledged offset is the written offset, so the bytes in the window never exceed
+ * `OTA_BLE_WINDOW_SIZE` while the client respects it. When no data arrives for `OTA_BLE_RESEND_MS`
+ * the client is asked to resend from the last received offset, because a lost tail of the window
+ * is never followed by a packet that shows the gap.
+ *
+ * @return `true` if the new image is the boot partition, `false` otherwise.
+ */
+bool OTAService::finish() {
+    uint8_t buffer[OTA_BLE_WRITE_SIZE];
+    uint32_t acknowledged = 0;
+    uint32_t lastProgress = 0;
+    int64_t lastData = esp_timer_get_time();
+
+    while (_written < _imageSize) {
+        if (_abortRequested) {
+            ESP_LOGW(OTA_SERVICE_LOG_TAG, "Firmware update aborted by the client after %lu bytes.", (unsigned long)_written);
+            sendStatus(FIRMWARE_UPDATE_ABORTED);
+            return false;
+        }
+
+        size_t length = xStreamBufferReceive(_window, buffer, sizeof(buffer), pdMS_TO_TICKS(OTA_BLE_RESEND_MS));
+        int64_t now = esp_timer_get_time();
+        if (length == 0) {
+            if (now - lastData >= (int64_t)OTA_BLE_TIMEOUT_MS * 1000) {
+                ESP_LOGE(OTA_SERVICE_LOG_TAG, "Firmware update timed out after %lu bytes.", (unsigned long)_written);
+                sendStatus(FIRMWARE_UPDATE_TIMEOUT);
+                return false;
+            }
+            requestResend(_received);
+            continue;
+        }
+        lastData = now;
+
+        mbedtls_sha256_update(&_sha, buffer, length);
+        if (esp_ota_write(_handle, buffer, length) != ESP_OK) {
+            ESP_LOGE(OTA_SERVICE_LOG_TAG, "Failed to write the image at offset %lu.", (unsigned long)_written);
+            sendStatus(FAILED_TO_UPDATE_FIRMWARE);
+            return false;
+        }
+        _written += length;
+
+        uint32_t rate = (uint64_t)_written * 1000000 / (now - _startTime + 1);
+        if (_written - acknowledged >= OTA_BLE_ACK_INTERVAL || _written == _imageSize) {
+            acknowledged = _written;
+            JsonDocument data;
+            data["offset"] = _written;
+            data["rate"] = rate;
+            sendStatus(STATUS_FIRMWARE_UPDATE_ACK, data);
+        }
+
+        uint32_t progress = (uint64_t)_written * 10 / _imageSize;
+        if (progress != lastProgress) {
+            lastProgress = progress;
+            ESP_LOGI(OTA_SERVICE_LOG_TAG, "OTA Progress: %lu%%, %lu B/s, %lu resends", (unsigned long)progress * 10,
+                     (unsigned long)rate, (unsigned long)_resends.load());
+        }
+    }
+
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&_sha, digest);
+    if (memcmp(digest, _imageSha256, sizeof(digest)) != 0) {
+        ESP_LOGE(OTA_SERVICE_LOG_TAG, "SHA-256 of the received image does not match.");
+        sendStatus(FAILED_TO_UPDATE_FIRMWARE);
+        return false;
+    }
+
+    esp_err_t result = esp_ota_end(_handle);
+    _handle = 0;
+    if (result == ESP_OK) result = esp_ota_set_boot_partition(_partition);
+    if (result != ESP_OK) {
+        ESP_LOGE(OTA_SERVICE_LOG_TAG, "Failed to activate the new image: %s", esp_err_to_name(result));
+        sendStatus(FAILED_TO_UPDATE_FIRMWARE);
+        return false;
+    }
+
+    uint32_t elapsed = (esp_timer_get_time() - _startTime) / 1000;
+    uint32_t rate = (uint64_t)_imageSize * 1000 / (elapsed + 1);
+    ESP_LOGI(OTA_SERVICE_LOG_TAG, "Firmware update of %lu bytes received in %lu ms (%lu B/s, %lu resends).",
+             (unsigned long)_imageSize, (unsigned long)elapsed, (unsigned long)rate, (unsigned long)_resends.load());
+
+    JsonDocument data;
+    data["size"] = _imageSize;
+    data["elapsed_ms"] = elapsed;
+    data["rate"] = rate;
+    data["resends"] = _resends.load();
+    sendStatus(SUCCESS_UPDATING_FIRMWARE, data);
+    return true;
+}
+
+/**
+ * @brief Release the update so a new one can begin, the running firmware stays the boot partition.
+ */
+void OTAService::cleanup() {
+    _state = OTA_SESSION_FINISHING;
+
+    xSemaphoreTake(_windowMutex, portMAX_DELAY);
+    if (_window != NULL) {
+        vStreamBufferDelete(_window);
+        _window = NULL;
+    }
+    xSemaphoreGive(_windowMutex);
+
+    if (_handle != 0) {
+        esp_ota_abort(_handle);
+        _handle = 0;
+    }
+    mbedtls_sha256_free(&_sha);
+
+    _abortRequested = false;
+    _state = OTA_SESSION_IDLE;
+}
+
+/**
+ * @brief Ask the client to resend the image from an offset.
+ *
+ * @param offset The first offset that was not received
+ */
+void OTAService::requestResend(uint32_t offset) {
+    _resends++;
+    ESP_LOGD(OTA_SERVICE_LOG_TAG, "Requesting a resend from offset %lu.", (unsigned long)offset);
+
+    JsonDocument data;
+    data["offset"] = offset;
+    sendStatus(STATUS_FIRMWARE_UPDATE_RESEND, data);
+}
+
+/**
+ * @brief Sends a status code as a notification of the OTA Control characteristic.
+ *
+ * @param statusCode the Status Code int
+ */
+void OTAService::sendStatus(int statusCode) {
+    BLEMessageSender::sendNotification(_pControlChar, statusCode);
+}
+
+/**
+ * @brief Sends a status code and data as a notification of the OTA Control characteristic.
+ *
+ * @param statusCode the Status Code int
+ * @param data The JSON data to be sent in the `data` field.
+ */
+void OTAService::sendStatus(int statusCode, JsonDocument& data) {
+    JsonDocument document;
+    document["status"] = statusCode;
+    document["data"] = data;
+
+    char buffer[128];
+    size_t length = serializeJson(document, buffer, sizeof(buffer));
+    _pControlChar -> setValue((const uint8_t*)buffer, length);
+    _pControlChar -> notify();
+}
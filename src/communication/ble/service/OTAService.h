@@ -0,0 +1,118 @@
+#ifndef OTA_SERVICE_H
+#define OTA_SERVICE_H
+
+#define OTA_SERVICE_LOG_TAG "OTA_SERVICE"
+
+#include "NimBLEDevice.h"
+#include <esp_log.h>
+#include <esp_ota_ops.h>
+#include <ArduinoJson.h>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/stream_buffer.h>
+#include <mbedtls/sha256.h>
+
+#include "StatusCodes.h"
+
+#define OTA_SERVICE_UUID                     "6e1f0a5c-3b1d-4c8e-9a57-2d1c0f4b7e10"
+#define OTA_CONTROL_CHARACTERISTIC_UUID      "6e1f0a5c-3b1d-4c8e-9a57-2d1c0f4b7e11"
+#define OTA_DATA_CHARACTERISTIC_UUID         "6e1f0a5c-3b1d-4c8e-9a57-2d1c0f4b7e12"
+
+#define OTA_BLE_MTU                 517             // Largest ATT MTU, a data packet carries up to 508 bytes of the image
+#define OTA_BLE_PACKET_HEADER_SIZE  4               // Little endian offset of the packet in the image
+#define OTA_BLE_WINDOW_SIZE         16384           // Bytes the client may send beyond the last acknowledged offset
+#define OTA_BLE_ACK_INTERVAL        4096            // Bytes written to flash between two acknowledgements
+#define OTA_BLE_WRITE_SIZE          2048            // Bytes taken from the window and written to flash at once
+#define OTA_BLE_RESEND_MS           1000            // Wait without new data before asking the client to resend from the last offset
+#define OTA_BLE_TIMEOUT_MS          15000           // Wait without new data before the update is aborted
+#define OTA_BLE_RESTART_DELAY_MS    1000            // Time for the last notification to reach the client before the restart
+#define OTA_BLE_SIGNATURE_MAX_SIZE  128             // Longest DER encoded signature of the image
+#define OTA_BLE_TASK_STACK_SIZE     8192            // The writer task verifies the signature and holds a write buffer
+#define OTA_BLE_NO_RESEND           UINT32_MAX      // No resend was requested yet, so a lost first packet is asked for at once
+
+/// @brief The state of the firmware update received over BLE
+enum OTASessionState {
+    OTA_SESSION_IDLE,           /* No update is running, `begin` starts one                              */
+    OTA_SESSION_STARTING,       /* The signature is being checked and the partition prepared             */
+    OTA_SESSION_RECEIVING,      /* The image is being received and written into the inactive partition   */
+    OTA_SESSION_FINISHING,      /* The image is complete and being verified, or the update is aborting   */
+};
+
+class OTAService;
+
+class OTAControlCharacteristicCallback : public NimBLECharacteristicCallbacks {
+    private:
+        OTAService* _pOTAService;
+    public:
+        OTAControlCharacteristicCallback(OTAService* pOTAService);
+        void onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) override;
+};
+
+class OTADataCharacteristicCallback : public NimBLECharacteristicCallbacks {
+    private:
+        OTAService* _pOTAService;
+    public:
+        OTADataCharacteristicCallback(OTAService* pOTAService);
+        void onWrite(NimBLECharacteristic* pCharacteristic, NimBLEConnInfo& connInfo) override;
+};
+
+/**
+ * @class OTAService
+ * @brief BLE service that receives a signed firmware image and writes it into the inactive OTA partition.
+ *
+ * The client starts the update on the control characteristic, then streams the image on the data
+ * characteristic with write without response. Every packet starts with its offset in the image, and
+ * the client never has more than `OTA_BLE_WINDOW_SIZE` bytes in flight beyond the last acknowledged
+ * offset. The device acknowledges every `OTA_BLE_ACK_INTERVAL` bytes written to flash, and asks for a
+ * resend from the first missing offset when a packet is lost. Only a bonded and encrypted connection
+ * can update the firmware, and the update holds `firmwareUpdateMutex` so it never runs with the one
+ * over WiFi. See `scripts/ota_ble` for a client.
+ */
+class OTAService {
+    public:
+        OTAService(NimBLEServer* pServer);
+        ~OTAService();
+        void startService();
+
+        void handleControl(JsonDocument& request, NimBLEConnInfo& connInfo);
+        void handleData(const uint8_t* data, size_t length);
+
+    private:
+        void begin(JsonObjectConst data, NimBLEConnInfo& connInfo);
+        bool isAuthorized(NimBLEConnInfo& connInfo);
+        bool prepare();
+        bool verifySignature();
+        bool finish();
+        void cleanup();
+        void requestResend(uint32_t offset);
+        void sendStatus(int statusCode);
+        void sendStatus(int statusCode, JsonDocument& data);
+
+        static void writeImage(void* parameter);
+
+        NimBLEServer* _pServer;
+        NimBLEService* _pService;
+        NimBLECharacteristic* _pControlChar;
+        NimBLECharacteristic* _pDataChar;
+
+        std::atomic<OTASessionState> _state;
+        std::atomic<bool> _abortRequested;
+        SemaphoreHandle_t _windowMutex;     /* Guards `_window` between the BLE host task and the writer task */
+        StreamBufferHandle_t _window;       /* Received bytes not written to flash yet                        */
+        esp_ota_handle_t _handle;
+        const esp_partition_t* _partition;
+        mbedtls_sha256_context _sha;
+        uint8_t _imageSha256[32];
+        uint8_t _signature[OTA_BLE_SIGNATURE_MAX_SIZE];
+        size_t _signatureLength;
+        uint32_t _imageSize;
+        uint16_t _packetSize;               /* Largest image bytes in one packet with the negotiated MTU      */
+        std::atomic<uint32_t> _received;    /* Offset of the next packet expected from the client             */
+        uint32_t _written;                  /* Bytes written to flash and acknowledged                        */
+        uint32_t _resendOffset;             /* Offset of the last resend request, asked only once per gap     */
+        std::atomic<uint32_t> _resends;
+        int64_t _startTime;
+};
+
+#endif
@@ -0,0 +1,560 @@
+#include "ReplicationNode.h"
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#define REPLICATION_STATE_VERSION   1
+#define REPLICATION_ENTRY_MAX_SIZE  (14 + REPLICATION_KEY_ACCESS_ID_SIZE + REPLICATION_UID_SIZE + REPLICATION_VISITOR_ID_SIZE + REPLICATION_NAME_SIZE)
+
+/// @brief Appends little endian fields to a buffer, and remembers if one did not fit
+struct ReplicationWriter {
+    uint8_t *data;
+    size_t size;
+    size_t length;
+    bool overflow;
+
+    ReplicationWriter(uint8_t *data, size_t size, size_t length = 0) : data(data), size(size), length(length), overflow(false) {}
+
+    void u8(uint8_t value) {
+        if (length + 1 > size) { overflow = true; return; }
+        data[length++] = value;
+    }
+
+    void u32(uint32_t value) {
+        if (length + 4 > size) { overflow = true; return; }
+        for (int i = 0; i < 4; i++) data[length++] = (uint8_t)(value >> (8 * i));
+    }
+
+    void str(const char *value, size_t maxSize) {
+        size_t stringLength = strnlen(value, maxSize - 1);
+        u8((uint8_t)stringLength);
+        if (length + stringLength > size) { overflow = true; return; }
+        memcpy(data + length, value, stringLength);
+        length += stringLength;
+    }
+};
+
+/// @brief Reads little endian fields from a buffer, and remembers if one was past its end
+struct ReplicationReader {
+    const uint8_t *data;
+    size_t length;
+    size_t offset;
+    bool failed;
+
+    ReplicationReader(const uint8_t *data, size_t length) : data(data), length(length), offset(0), failed(false) {}
+
+    uint8_t u8() {
+        if (offset + 1 > length) { failed = true; return 0; }
+        return data[offset++];
+    }
+
+    uint32_t u32() {
+        if (offset + 4 > length) { failed = true; return 0; }
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++) value |= (uint32_t)data[offset++] << (8 * i);
+        return value;
+    }
+
+    void str(char *value, size_t maxSize) {
+        size_t stringLength = u8();
+        if (failed || stringLength >= maxSize || offset + stringLength > length) {
+            failed = true;
+            value[0] = '\0';
+            return;
+        }
+        memcpy(value, data + offset, stringLength);
+        value[stringLength] = '\0';
+        offset += stringLength;
+    }
+};
+
+static void writeEntry(ReplicationWriter &writer, const ReplicationEntry &entry) {
+    writer.u32(entry.origin);
+    writer.u32(entry.sequence);
+    writer.u32(entry.clock);
+    writer.u8(entry.action);
+    writer.u8(entry.type);
+    writer.str(entry.keyAccessId, sizeof(entry.keyAccessId));
+    writer.str(entry.uidCard, sizeof(entry.uidCard));
+    writer.str(entry.visitorId, sizeof(entry.visitorId));
+    writer.str(entry.name, sizeof(entry.name));
+}
+
+static bool readEntry(ReplicationReader &reader, ReplicationEntry &entry) {
+    entry.origin = reader.u32();
+    entry.sequence = reader.u32();
+    entry.clock = reader.u32();
+    entry.action = reader.u8();
+    entry.type = reader.u8();
+    reader.str(entry.keyAccessId, sizeof(entry.keyAccessId));
+    reader.str(entry.uidCard, sizeof(entry.uidCard));
+    reader.str(entry.visitorId, sizeof(entry.visitorId));
+    reader.str(entry.name, sizeof(entry.name));
+    return !reader.failed && entry.keyAccessId[0] != '\0' && entry.action <= REPLICATION_REVOKE && entry.sequence > 0;
+}
+
+static uint32_t lookup(const std::map<uint32_t, uint32_t> &vector, uint32_t origin) {
+    auto sequence = vector.find(origin);
+    return sequence == vector.end() ? 0 : sequence->second;
+}
+
+ReplicationNode::ReplicationNode(uint32_t nodeId, uint32_t group, ReplicationSendFunction send, ReplicationApplyFunction apply, ReplicationMacFunction mac)
+    : _nodeId(nodeId), _group(group), _clock(0), _nextDigestMs(0), _jitterState(nodeId | 1), _digestScheduled(false),
+      _send(send), _apply(apply), _mac(mac) {
+    _vector[_nodeId] = 0;
+}
+
+/**
+ * @brief Record a change made on this node, and broadcast it to the other nodes right away.
+ *
+ * The change must already be applied to the key access store of this node.
+ *
+ * @param action Whether the key access is added or revoked
+ * @param type The `LockType` of the key access
+ * @param keyAccessId The Key Access ID
+ * @param uidCard The NFC Card UID of an added key access, `nullptr` otherwise
+ * @param visitorId The Visitor ID of an added key access, `nullptr` otherwise
+ * @param name The visitor name of an added key access, `nullptr` otherwise
+ * @return `true` if the change is recorded, `false` if the change log is full.
+ */
+bool ReplicationNode::record(ReplicationAction action, uint8_t type, const char *keyAccessId, const char *uidCard, const char *visitorId, const char *name) {
+    if (keyAccessId == nullptr || keyAccessId[0] == '\0') return false;
+
+    ReplicationEntry entry = {};
+    entry.origin = _nodeId;
+    entry.sequence = _vector[_nodeId] + 1;
+    entry.clock = ++_clock;
+    entry.action = action;
+    entry.type = type;
+    snprintf(entry.keyAccessId, sizeof(entry.keyAccessId), "%s", keyAccessId);
+    snprintf(entry.uidCard, sizeof(entry.uidCard), "%s", uidCard != nullptr ? uidCard : "");
+    snprintf(entry.visitorId, sizeof(entry.visitorId), "%s", visitorId != nullptr ? visitorId : "");
+    snprintf(entry.name, sizeof(entry.name), "%s", name != nullptr ? name : "");
+
+    if (!store(entry)) return false;
+    setSequence(_nodeId, entry.sequence);
+
+    sendPush(_nodeId, entry.sequence - 1, nullptr);
+    return true;
+}
+
+/**
+ * @brief Handle a datagram received from a peer
+ *
+ * @param data The datagram
+ * @param length The length of the datagram
+ * @param from The address the datagram came from, answers are sent there
+ * @return `true` if the state of the node changed and should be stored, `false` otherwise.
+ */
+bool ReplicationNode::receive(const uint8_t *data, size_t length, const ReplicationPeer &from) {
+    if (length < REPLICATION_HEADER_SIZE + REPLICATION_MAC_SIZE) return false;
+
+    ReplicationReader header(data, REPLICATION_HEADER_SIZE);
+    uint16_t magic = header.u8();
+    magic |= header.u8() << 8;
+    uint8_t version = header.u8();
+    uint8_t type = header.u8();
+    uint32_t group = header.u32();
+    uint32_t sender = header.u32();
+    if (magic != REPLICATION_MAGIC || version != REPLICATION_VERSION || group != _group || sender == _nodeId) return false;
+
+    // Compare every byte, so the time taken does not tell how much of the MAC is right
+    size_t bodyEnd = length - REPLICATION_MAC_SIZE;
+    uint8_t mac[32];
+    _mac(data, bodyEnd, mac);
+    uint8_t difference = 0;
+    for (size_t i = 0; i < REPLICATION_MAC_SIZE; i++) difference |= mac[i] ^ data[bodyEnd + i];
+    if (difference != 0) return false;
+
+    const uint8_t *body = data + REPLICATION_HEADER_SIZE;
+    size_t bodyLength = bodyEnd - REPLICATION_HEADER_SIZE;
+    if (type == REPLICATION_DIGEST) return handleDigest(body, bodyLength, from);
+    if (type == REPLICATION_PUSH) return handlePush(body, bodyLength, from);
+    return false;
+}
+
+/**
+ * @brief Broadcast the digest when it is due
+ *
+ * @param nowMs A monotonic time in ms
+ * @return The time in ms until the next digest is due
+ */
+uint32_t ReplicationNode::poll(uint32_t nowMs) {
+    if (!_digestScheduled || (int32_t)(nowMs - _nextDigestMs) >= 0) {
+        sendDigest(nullptr);
+        _nextDigestMs = nowMs + REPLICATION_DIGEST_INTERVAL_MS - REPLICATION_DIGEST_JITTER_MS / 2 + nextJitter() % REPLICATION_DIGEST_JITTER_MS;
+        _digestScheduled = true;
+    }
+    return _nextDigestMs - nowMs;
+}
+
+/**
+ * @brief Send the sequence vector of this node
+ *
+ * @param peer The peer to send it to, `nullptr` for every node of the network
+ */
+void ReplicationNode::sendDigest(const ReplicationPeer *peer) {
+    uint8_t data[REPLICATION_MAX_DATAGRAM];
+    ReplicationWriter writer(data, sizeof(data) - REPLICATION_MAC_SIZE, writeHeader(data, REPLICATION_DIGEST));
+
+    writer.u8((uint8_t)_vector.size());
+    for (const auto &sequence : _vector) {
+        writer.u32(sequence.first);
+        writer.u32(sequence.second);
+    }
+    if (!writer.overflow) finish(peer, data, writer.length);
+}
+
+/**
+ * @brief Serialize the state of the node, so it is restored with `load` after a restart
+ *
+ * @param data Filled with the state
+ * @return `true` if the state is serialized, `false` otherwise.
+ */
+bool ReplicationNode::save(std::vector<uint8_t> &data) const {
+    data.resize(12 + _vector.size() * 8 + _entries.size() * REPLICATION_ENTRY_MAX_SIZE);
+    ReplicationWriter writer(data.data(), data.size());
+
+    writer.u8(REPLICATION_STATE_VERSION);
+    writer.u32(_clock);
+    writer.u8((uint8_t)_vector.size());
+    for (const auto &sequence : _vector) {
+        writer.u32(sequence.first);
+        writer.u32(sequence.second);
+    }
+    writer.u32((uint32_t)_entries.size());
+    for (const auto &entry : _entries) writeEntry(writer, entry.second);
+
+    data.resize(writer.length);
+    return !writer.overflow;
+}
+
+/**
+ * @brief Restore the state of the node that was serialized with `save`
+ *
+ * @param data The state
+ * @param length The length of the state
+ * @return `true` if the state is restored, `false` if it is invalid and the node is left empty.
+ */
+bool ReplicationNode::load(const uint8_t *data, size_t length) {
+    ReplicationReader reader(data, length);
+    if (reader.u8() != REPLICATION_STATE_VERSION) return false;
+
+    uint32_t clock = reader.u32();
+    std::map<uint32_t, uint32_t> vector;
+    uint8_t origins = reader.u8();
+    for (uint8_t i = 0; i < origins && !reader.failed; i++) {
+        uint32_t origin = reader.u32();
+        vector[origin] = reader.u32();
+    }
+
+    std::unordered_map<std::string, ReplicationEntry> entries;
+    uint32_t count = reader.u32();
+    for (uint32_t i = 0; i < count && i < REPLICATION_MAX_ENTRIES; i++) {
+        ReplicationEntry entry = {};
+        if (!readEntry(reader, entry)) return false;
+        entries[entry.keyAccessId] = entry;
+    }
+    if (reader.failed) return false;
+
+    _clock = clock;
+    _vector = std::move(vector);
+    _vector.emplace(_nodeId, 0);
+    _entries = std::move(entries);
+    _journal.clear();
+    return true;
+}
+
+/**
+ * @brief Take the journal of the changes since the last call, for the owner to store them
+ *
+ * @param data Replaced with the records of the journal, empty if nothing changed
+ */
+void ReplicationNode::takeJournal(std::vector<uint8_t> &data) {
+    data.clear();
+    data.swap(_journal);
+}
+
+/**
+ * @brief Apply a stored journal on top of the state restored with `load`
+ *
+ * An entry only replaces an older change of its key access and a sequence only moves forward, so
+ * the records that are already in the state change nothing.
+ *
+ * @param data The records of the journal
+ * @param length The length of the journal
+ * @return `true` if every record is applied, `false` if the journal ends in a torn or invalid record,
+ * the records before it are kept.
+ */
+bool ReplicationNode::replay(const uint8_t *data, size_t length) {
+    ReplicationReader reader(data, length);
+    bool complete = true;
+
+    while (reader.offset < length) {
+        uint8_t kind = reader.u8();
+        if (kind == REPLICATION_JOURNAL_ENTRY) {
+            ReplicationEntry entry = {};
+            if (!readEntry(reader, entry)) {
+                complete = false;
+                break;
+            }
+            _clock = std::max(_clock, entry.clock);
+            auto current = _entries.find(entry.keyAccessId);
+            if (current == _entries.end() || isNewer(entry, current->second)) store(entry);
+        } else if (kind == REPLICATION_JOURNAL_SEQUENCE) {
+            uint32_t origin = reader.u32();
+            uint32_t sequence = reader.u32();
+            if (reader.failed) {
+                complete = false;
+                break;
+            }
+            auto held = _vector.find(origin);
+            if (held == _vector.end() && _vector.size() < REPLICATION_MAX_NODES) _vector[origin] = sequence;
+            else if (held != _vector.end() && sequence > held->second) held->second = sequence;
+        } else {
+            complete = false;
+            break;
+        }
+    }
+
+    // The replayed records are stored already
+    _journal.clear();
+    return complete;
+}
+
+uint32_t ReplicationNode::getNodeId() const {
+    return _nodeId;
+}
+
+/**
+ * @brief Get the highest sequence of an origin that this node holds everything up to
+ *
+ * @param origin The id of the origin node
+ * @return The sequence, 0 if nothing of the origin is known
+ */
+uint32_t ReplicationNode::getSequence(uint32_t origin) const {
+    return lookup(_vector, origin);
+}
+
+size_t ReplicationNode::getEntryCount() const {
+    return _entries.size();
+}
+
+/**
+ * @brief Get a FNV-1a hash of the resolved state of every key access, equal on nodes that converged
+ *
+ * @return The hash
+ */
+uint32_t ReplicationNode::getContentHash() const {
+    std::vector<const ReplicationEntry*> entries;
+    for (const auto &entry : _entries) entries.push_back(&entry.second);
+    std::sort(entries.begin(), entries.end(), [](const ReplicationEntry *a, const ReplicationEntry *b) {
+        return strcmp(a->keyAccessId, b->keyAccessId) < 0;
+    });
+
+    uint8_t buffer[REPLICATION_ENTRY_MAX_SIZE];
+    uint32_t hash = 2166136261u;
+    for (const ReplicationEntry *entry : entries) {
+        ReplicationWriter writer(buffer, sizeof(buffer));
+        writeEntry(writer, *entry);
+        for (size_t i = 0; i < writer.length; i++) hash = (hash ^ buffer[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Push the entries the peer is missing for every origin this node is ahead on, and ask for
+ * the entries this node is missing with its own digest.
+ *
+ */
+bool ReplicationNode::handleDigest(const uint8_t *body, size_t length, const ReplicationPeer &from) {
+    ReplicationReader reader(body, length);
+    std::map<uint32_t, uint32_t> peerVector;
+    uint8_t count = reader.u8();
+    for (uint8_t i = 0; i < count; i++) {
+        uint32_t origin = reader.u32();
+        peerVector[origin] = reader.u32();
+    }
+    if (reader.failed) return false;
+
+    for (const auto &sequence : _vector) {
+        uint32_t known = lookup(peerVector, sequence.first);
+        if (sequence.second > known) sendPush(sequence.first, known, &from);
+    }
+
+    for (const auto &sequence : peerVector) {
+        if (sequence.second > lookup(_vector, sequence.first)) {
+            sendDigest(&from);
+            break;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Apply the entries of a push that continues what this node holds of the origin.
+ *
+ * A push after a gap is ignored and the digest of this node is sent back, so the sender pushes
+ * the whole gap.
+ *
+ */
+bool ReplicationNode::handlePush(const uint8_t *body, size_t length, const ReplicationPeer &from) {
+    ReplicationReader reader(body, length);
+    uint32_t origin = reader.u32();
+    uint32_t after = reader.u32();
+    uint32_t upTo = reader.u32();
+    uint8_t count = reader.u8();
+    if (reader.failed || upTo < after) return false;
+
+    auto held = _vector.find(origin);
+    if (held == _vector.end()) {
+        if (_vector.size() >= REPLICATION_MAX_NODES) return false;
+        held = _vector.emplace(origin, 0).first;
+    }
+    if (after > held->second) {
+        sendDigest(&from);
+        return false;
+    }
+
+    bool changed = false;
+    for (uint8_t i = 0; i < count; i++) {
+        ReplicationEntry entry = {};
+        if (!readEntry(reader, entry) || entry.origin != origin || entry.sequence <= after || entry.sequence > upTo) return changed;
+
+        _clock = std::max(_clock, entry.clock);
+        if (entry.sequence <= held->second) continue;
+
+        auto current = _entries.find(entry.keyAccessId);
+        if (current == _entries.end() || isNewer(entry, current->second)) {
+            // Stop at the first entry that cannot be applied, the rest is pushed again after the next digest
+            if (!_apply(entry) || !store(entry)) return changed;
+        }
+        setSequence(origin, entry.sequence);
+        changed = true;
+    }
+
+    if (upTo > held->second) {
+        setSequence(origin, upTo);
+        changed = true;
+    }
+    return changed;
+}
+
+/**
+ * @brief Send the entries of an origin after a sequence, in as many datagrams as they need
+ *
+ * @param origin The id of the origin node
+ * @param after The sequence the receiver holds everything of the origin up to
+ * @param peer The peer to send them to, `nullptr` for every node of the network
+ */
+void ReplicationNode::sendPush(uint32_t origin, uint32_t after, const ReplicationPeer *peer) {
+    std::vector<const ReplicationEntry*> entries;
+    for (const auto &entry : _entries) {
+        if (entry.second.origin == origin && entry.second.sequence > after) entries.push_back(&entry.second);
+    }
+    std::sort(entries.begin(), entries.end(), [](const ReplicationEntry *a, const ReplicationEntry *b) {
+        return a->sequence < b->sequence;
+    });
+
+    size_t next = 0;
+    do {
+        uint8_t data[REPLICATION_MAX_DATAGRAM];
+        ReplicationWriter writer(data, sizeof(data) - REPLICATION_MAC_SIZE, writeHeader(data, REPLICATION_PUSH));
+        writer.u32(origin);
+        writer.u32(after);
+        size_t upToOffset = writer.length;
+        writer.u32(0);
+        size_t countOffset = writer.length;
+        writer.u8(0);
+
+        uint8_t count = 0;
+        while (next < entries.size() && count < UINT8_MAX && writer.length + REPLICATION_ENTRY_MAX_SIZE <= writer.size) {
+            writeEntry(writer, *entries[next++]);
+            count++;
+        }
+
+        // The last datagram tells the receiver it now holds everything this node holds of the origin
+        uint32_t upTo = next < entries.size() ? entries[next - 1]->sequence : lookup(_vector, origin);
+        ReplicationWriter(data, writer.size, upToOffset).u32(upTo);
+        data[countOffset] = count;
+
+        finish(peer, data, writer.length);
+        after = upTo;
+    } while (next < entries.size());
+}
+
+/**
+ * @brief Keep an entry as the last change of its key access
+ *
+ * When the log is full, the revoked key access with the oldest change is dropped to make room.
+ *
+ * @return `true` if the entry is kept, `false` if the log is full of added key access.
+ */
+bool ReplicationNode::store(const ReplicationEntry &entry) {
+    if (_entries.size() >= REPLICATION_MAX_ENTRIES && _entries.find(entry.keyAccessId) == _entries.end()) {
+        auto oldest = _entries.end();
+        for (auto it = _entries.begin(); it != _entries.end(); ++it) {
+            if (it->second.action == REPLICATION_REVOKE && (oldest == _entries.end() || it->second.clock < oldest->second.clock)) oldest = it;
+        }
+        if (oldest == _entries.end()) return false;
+        _entries.erase(oldest);
+    }
+
+    _entries[entry.keyAccessId] = entry;
+
+    uint8_t record[1 + REPLICATION_ENTRY_MAX_SIZE];
+    ReplicationWriter writer(record, sizeof(record));
+    writer.u8(REPLICATION_JOURNAL_ENTRY);
+    writeEntry(writer, entry);
+    _journal.insert(_journal.end(), record, record + writer.length);
+    return true;
+}
+
+/**
+ * @brief Set the sequence held of an origin, and add it to the journal
+ *
+ */
+void ReplicationNode::setSequence(uint32_t origin, uint32_t sequence) {
+    _vector[origin] = sequence;
+
+    uint8_t record[9];
+    ReplicationWriter writer(record, sizeof(record));
+    writer.u8(REPLICATION_JOURNAL_SEQUENCE);
+    writer.u32(origin);
+    writer.u32(sequence);
+    _journal.insert(_journal.end(), record, record + writer.length);
+}
+
+size_t ReplicationNode::writeHeader(uint8_t *data, ReplicationMessageType type) const {
+    ReplicationWriter writer(data, REPLICATION_HEADER_SIZE);
+    writer.u8(REPLICATION_MAGIC & 0xFF);
+    writer.u8(REPLICATION_MAGIC >> 8);
+    writer.u8(REPLICATION_VERSION);
+    writer.u8(type);
+    writer.u32(_group);
+    writer.u32(_nodeId);
+    return writer.length;
+}
+
+void ReplicationNode::finish(const ReplicationPeer *peer, uint8_t *data, size_t length) {
+    uint8_t mac[32];
+    _mac(data, length, mac);
+    memcpy(data + length, mac, REPLICATION_MAC_SIZE);
+    _send(peer, data, length + REPLICATION_MAC_SIZE);
+}
+
+uint32_t ReplicationNode::nextJitter() {
+    // xorshift32, only spreads the digests of the nodes over time
+    _jitterState ^= _jitterState << 13;
+    _jitterState ^= _jitterState >> 17;
+    _jitterState ^= _jitterState << 5;
+    return _jitterState;
+}
+
+bool ReplicationNode::isNewer(const ReplicationEntry &entry, const ReplicationEntry &current) {
+    if (entry.clock != current.clock) return entry.clock > current.clock;
+    // Of two changes with the same clock neither saw the other, the revoke wins
+    if (entry.action != current.action) return entry.action == REPLICATION_REVOKE;
+    return entry.origin > current.origin;
+}
@@ -0,0 +1,156 @@
+#ifndef REPLICATION_NODE_H
+#define REPLICATION_NODE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Replication of the key access between the door controllers of a network, shared by the firmware
+ * and the host tool in `scripts/replication_loopback`.
+ *
+ * Every change made on a controller is an entry of the change log with the id of the controller
+ * (its origin), a sequence number of that origin and a Lamport clock. The log is compacted to the
+ * last entry of each key access, so it never holds more entries than key access, and concurrent
+ * changes of a key access resolve to the entry with the highest clock, then to a revoke, then to the
+ * highest origin.
+ *
+ * Every node keeps a sequence vector, the highest sequence of each origin it holds everything up to.
+ * A new change is broadcast right away, and every node also broadcasts its vector as a digest from
+ * time to time. A node that sees a digest behind its own vector pushes the missing entries to that
+ * peer, and a node that sees a digest ahead of its own sends its digest back, so lost datagrams,
+ * restarted nodes and nodes that join later all converge without the backend.
+ *
+ * Every datagram is a `REPLICATION_HEADER_SIZE` header, the body, and the first `REPLICATION_MAC_SIZE`
+ * bytes of the HMAC-SHA256 of the header and the body, all little endian:
+ *   Header   magic (2) version (1) type (1) group (4) sender (4)
+ *   DIGEST   count (1), then count times origin (4) sequence (4)
+ *   PUSH     origin (4) after (4) upTo (4) count (1), then count entries
+ *   Entry    origin (4) sequence (4) clock (4) action (1) type (1), then the strings as length (1) and bytes
+ * A PUSH holds the entries of an origin after the sequence `after` in order, and once it is applied
+ * the receiver holds everything of that origin up to `upTo`.
+ *
+ * Every change of the state is also added to a journal, so the owner can store the changes as they
+ * come and a whole `save` only now and then. The journal is a list of records, each a kind (1) then
+ *   ENTRY    an entry as in a PUSH
+ *   SEQUENCE origin (4) sequence (4)
+ * and `replay` applies it on top of the last `load`, keeping the newest of each, so a record that is
+ * already in the saved state changes nothing.
+ */
+#define REPLICATION_MAGIC               0x5244      // "DR"
+#define REPLICATION_VERSION             1
+#define REPLICATION_HEADER_SIZE         12
+#define REPLICATION_MAC_SIZE            16          // Bytes of the truncated HMAC-SHA256 of a datagram
+#define REPLICATION_MAX_DATAGRAM        1200        // Largest datagram sent, stays under the MTU of the WiFi
+#define REPLICATION_MAX_NODES           32          // Origins kept in the sequence vector
+#define REPLICATION_MAX_ENTRIES         512         // Key access kept in the change log, the revoked ones included
+#ifndef REPLICATION_DIGEST_INTERVAL_MS
+#define REPLICATION_DIGEST_INTERVAL_MS  10000       // Delay between two digest broadcasts
+#endif
+#define REPLICATION_DIGEST_JITTER_MS    (REPLICATION_DIGEST_INTERVAL_MS / 4)    // So the nodes do not broadcast at once
+
+#define REPLICATION_KEY_ACCESS_ID_SIZE  40
+#define REPLICATION_UID_SIZE            32
+#define REPLICATION_VISITOR_ID_SIZE     40
+#define REPLICATION_NAME_SIZE           25
+
+/// @brief What a change does to its key access
+enum ReplicationAction : uint8_t {
+    REPLICATION_ADD,        /* The key access is added with its NFC Card UID       */
+    REPLICATION_REVOKE,     /* The key access is removed                           */
+};
+
+/// @brief Kind of a record of the journal
+enum ReplicationJournalRecord : uint8_t {
+    REPLICATION_JOURNAL_ENTRY = 1,      /* An entry kept as the last change of its key access   */
+    REPLICATION_JOURNAL_SEQUENCE = 2,   /* The sequence held of an origin                       */
+};
+
+/// @brief Type of a replication datagram
+enum ReplicationMessageType : uint8_t {
+    REPLICATION_DIGEST = 1, /* The sequence vector of the sender                    */
+    REPLICATION_PUSH = 2,   /* Entries of one origin the receiver is missing        */
+};
+
+/// @brief A change of the key access log
+struct ReplicationEntry {
+    uint32_t origin;                                /* Node that made the change                                */
+    uint32_t sequence;                              /* Sequence of the change on its origin, starts at 1        */
+    uint32_t clock;                                 /* Lamport clock, orders the changes of a key access        */
+    uint8_t action;                                 /* `ReplicationAction`                                      */
+    uint8_t type;                                   /* `LockType` of the key access                             */
+    char keyAccessId[REPLICATION_KEY_ACCESS_ID_SIZE];
+    char uidCard[REPLICATION_UID_SIZE];             /* NFC Card UID, empty for a revoke                         */
+    char visitorId[REPLICATION_VISITOR_ID_SIZE];
+    char name[REPLICATION_NAME_SIZE];
+};
+
+/// @brief IPv4 address and port of a node, both in network byte order
+struct ReplicationPeer {
+    uint32_t address;
+    uint16_t port;
+};
+
+/// @brief Sends a datagram to a peer, or to every node of the network if the peer is `nullptr`
+typedef std::function<void(const ReplicationPeer *peer, const uint8_t *data, size_t length)> ReplicationSendFunction;
+
+/// @brief Applies an entry received from a peer to the key access store, returns `false` to retry it later
+typedef std::function<bool(const ReplicationEntry &entry)> ReplicationApplyFunction;
+
+/// @brief Writes the 32 byte HMAC-SHA256 of the data with the key of the network
+typedef std::function<void(const uint8_t *data, size_t length, uint8_t *mac)> ReplicationMacFunction;
+
+/// @brief A node of the key access replication, it is not thread safe
+class ReplicationNode {
+public:
+    ReplicationNode(uint32_t nodeId, uint32_t group, ReplicationSendFunction send, ReplicationApplyFunction apply, ReplicationMacFunction mac);
+
+    bool record(ReplicationAction action, uint8_t type, const char *keyAccessId, const char *uidCard, const char *visitorId, const char *name);
+    bool receive(const uint8_t *data, size_t length, const ReplicationPeer &from);
+    uint32_t poll(uint32_t nowMs);
+    void sendDigest(const ReplicationPeer *peer);
+
+    bool save(std::vector<uint8_t> &data) const;
+    bool load(const uint8_t *data, size_t length);
+    void takeJournal(std::vector<uint8_t> &data);
+    bool replay(const uint8_t *data, size_t length);
+
+    uint32_t getNodeId() const;
+    uint32_t getSequence(uint32_t origin) const;
+    size_t getEntryCount() const;
+    uint32_t getContentHash() const;
+
+private:
+    uint32_t _nodeId;
+    uint32_t _group;
+    uint32_t _clock;
+    uint32_t _nextDigestMs;
+    uint32_t _jitterState;
+    bool _digestScheduled;
+
+    std::map<uint32_t, uint32_t> _vector;                       // Origin to the highest sequence held without a gap
+    std::unordered_map<std::string, ReplicationEntry> _entries; // Key Access ID to its last change
+    std::vector<uint8_t> _journal;                              // Records of the changes since the last `takeJournal`
+
+    ReplicationSendFunction _send;
+    ReplicationApplyFunction _apply;
+    ReplicationMacFunction _mac;
+
+    bool handleDigest(const uint8_t *body, size_t length, const ReplicationPeer &from);
+    bool handlePush(const uint8_t *body, size_t length, const ReplicationPeer &from);
+    void sendPush(uint32_t origin, uint32_t after, const ReplicationPeer *peer);
+    bool store(const ReplicationEntry &entry);
+    void setSequence(uint32_t origin, uint32_t sequence);
+    size_t writeHeader(uint8_t *data, ReplicationMessageType type) const;
+    void finish(const ReplicationPeer *peer, uint8_t *data, size_t length);
+    uint32_t nextJitter();
+
+    static bool isNewer(const ReplicationEntry &entry, const ReplicationEntry &current);
+};
+
+#endif
@@ -0,0 +1,107 @@
+#include "ReplicationSocket.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+
+ReplicationSocket::ReplicationSocket() : _socket(-1) {}
+
+ReplicationSocket::~ReplicationSocket() {
+    close();
+}
+
+/**
+ * @brief Open the socket and bind it to the port of the replication
+ *
+ * @param address The address to bind to in host byte order, `INADDR_ANY` for every interface
+ * @param port The port in host byte order
+ * @param broadcast Whether datagrams may be sent to a broadcast address
+ * @return `true` if the socket is open, `false` otherwise.
+ */
+bool ReplicationSocket::open(uint32_t address, uint16_t port, bool broadcast) {
+    close();
+
+    _socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (_socket < 0) return false;
+
+    int enable = 1;
+    setsockopt(_socket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (broadcast) setsockopt(_socket, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable));
+
+    struct sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(address);
+    local.sin_port = htons(port);
+    if (bind(_socket, (struct sockaddr*)&local, sizeof(local)) != 0) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void ReplicationSocket::close() {
+    if (_socket >= 0) ::close(_socket);
+    _socket = -1;
+}
+
+/**
+ * @brief Add a target of the broadcasts
+ *
+ * @param address The address in host byte order, `INADDR_BROADCAST` for the network of the device
+ * @param port The port in host byte order
+ */
+void ReplicationSocket::addTarget(uint32_t address, uint16_t port) {
+    _targets.push_back({htonl(address), htons(port)});
+}
+
+/**
+ * @brief Send a datagram, a failed send is dropped like a lost datagram
+ *
+ * @param peer The peer to send it to, `nullptr` for every target
+ * @param data The datagram
+ * @param length The length of the datagram
+ */
+void ReplicationSocket::send(const ReplicationPeer *peer, const uint8_t *data, size_t length) {
+    if (_socket < 0) return;
+
+    const ReplicationPeer *peers = peer != nullptr ? peer : _targets.data();
+    size_t count = peer != nullptr ? 1 : _targets.size();
+    for (size_t i = 0; i < count; i++) {
+        struct sockaddr_in remote = {};
+        remote.sin_family = AF_INET;
+        remote.sin_addr.s_addr = peers[i].address;
+        remote.sin_port = peers[i].port;
+        sendto(_socket, data, length, 0, (struct sockaddr*)&remote, sizeof(remote));
+    }
+}
+
+/**
+ * @brief Wait for a datagram
+ *
+ * @param buffer The buffer for the datagram
+ * @param size The size of the buffer
+ * @param from Set to the address the datagram came from
+ * @param timeoutMs How long to wait for it
+ * @return The length of the datagram, 0 on a timeout, negative on an error
+ */
+int ReplicationSocket::receive(uint8_t *buffer, size_t size, ReplicationPeer &from, uint32_t timeoutMs) {
+    if (_socket < 0) return -1;
+
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(_socket, &readable);
+    struct timeval timeout = {(time_t)(timeoutMs / 1000), (suseconds_t)((timeoutMs % 1000) * 1000)};
+    int ready = select(_socket + 1, &readable, nullptr, nullptr, &timeout);
+    if (ready <= 0) return ready;
+
+    struct sockaddr_in remote = {};
+    socklen_t remoteLength = sizeof(remote);
+    int length = recvfrom(_socket, buffer, size, 0, (struct sockaddr*)&remote, &remoteLength);
+    if (length < 0) return length;
+
+    from.address = remote.sin_addr.s_addr;
+    from.port = remote.sin_port;
+    return length;
+}
@@ -0,0 +1,33 @@
+#ifndef REPLICATION_SOCKET_H
+#define REPLICATION_SOCKET_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+#include "ReplicationNode.h"
+
+/**
+ * @brief UDP socket of the key access replication
+ *
+ * Uses the BSD socket api, which lwIP provides on the device, so the same code runs in the host
+ * tool. A broadcast is sent to every target, the network broadcast address on the device and the
+ * other nodes on the loopback in the host tool.
+ */
+class ReplicationSocket {
+public:
+    ReplicationSocket();
+    ~ReplicationSocket();
+
+    bool open(uint32_t address, uint16_t port, bool broadcast);
+    void close();
+    void addTarget(uint32_t address, uint16_t port);
+    void send(const ReplicationPeer *peer, const uint8_t *data, size_t length);
+    int receive(uint8_t *buffer, size_t size, ReplicationPeer &from, uint32_t timeoutMs);
+
+private:
+    int _socket;
+    std::vector<ReplicationPeer> _targets;
+};
+
+#endif
@@ -0,0 +1,192 @@
+#define HTTP_POOL_LOG_TAG "HTTP_POOL"
+
+#include "HttpConnectionPool.h"
+#include <esp_log.h>
+
+HttpConnectionPool::HttpConnectionPool() {
+    for (HttpConnection &connection : _connections) {
+        connection.host[0] = '\0';
+        connection.port = 0;
+        connection.secure = false;
+        connection.lastUsed = 0;
+        connection.requestCount = 0;
+        connection.inUse = false;
+    }
+
+    _poolMutex = xSemaphoreCreateMutex();
+    if (_poolMutex == NULL) ESP_LOGE(HTTP_POOL_LOG_TAG, "Failed to create HTTP connection pool mutex.");
+}
+
+/**
+ * @brief Get a connection to the host of the url, reusing the open connection to that host if it is still healthy.
+ *
+ * A kept connection is only reused if the socket is still connected and it has not been idle for longer
+ * than `HTTP_POOL_IDLE_TIMEOUT_MS`, otherwise it is closed and the caller has to open a new one.
+ * When every slot is taken by other hosts, the least recently used idle slot is closed and taken over.
+ *
+ * @param url The url of the request
+ * @param reused Set to `true` if the request will be sent over an already open TCP connection
+ * @return The connection to use, or nullptr if the url is invalid or every connection is in use
+ */
+HttpConnection *HttpConnectionPool::acquire(const char *url, bool &reused) {
+    reused = false;
+
+    char host[HTTP_POOL_MAX_HOST_LENGTH];
+    uint16_t port;
+    bool secure;
+    if (!parseHost(url, host, sizeof(host), port, secure)) {
+        ESP_LOGE(HTTP_POOL_LOG_TAG, "Invalid url: %s", url);
+        return nullptr;
+    }
+
+    if (xSemaphoreTake(_poolMutex, portMAX_DELAY) != pdTRUE) return nullptr;
+
+    HttpConnection *selected = nullptr;
+    for (HttpConnection &connection : _connections) {
+        if (!connection.inUse && connection.port == port && connection.secure == secure && strcmp(connection.host, host) == 0) {
+            selected = &connection;
+            break;
+        }
+    }
+
+    if (selected != nullptr) {
+        TickType_t idle = xTaskGetTickCount() - selected->lastUsed;
+        if (selected->client.connected() && idle < pdMS_TO_TICKS(HTTP_POOL_IDLE_TIMEOUT_MS)) {
+            reused = true;
+        } else {
+            ESP_LOGD(HTTP_POOL_LOG_TAG, "Connection to %s:%d is closed or idle for too long, reconnecting", host, port);
+            close(*selected);
+        }
+    } else {
+        // Take a free slot, or the least recently used idle one
+        for (HttpConnection &connection : _connections) {
+            if (connection.inUse) continue;
+            if (selected == nullptr || connection.host[0] == '\0'
+                || (selected->host[0] != '\0' && (int32_t)(connection.lastUsed - selected->lastUsed) < 0)) {
+                selected = &connection;
+            }
+        }
+
+        if (selected != nullptr) {
+            close(*selected);
+            snprintf(selected->host, sizeof(selected->host), "%s", host);
+            selected->port = port;
+            selected->secure = secure;
+            selected->client.setSecure(secure);
+        }
+    }
+
+    if (selected != nullptr) selected->inUse = true;
+    xSemaphoreGive(_poolMutex);
+
+    if (selected == nullptr) ESP_LOGE(HTTP_POOL_LOG_TAG, "Every HTTP connection is in use, cannot send request to %s:%d", host, port);
+    else ESP_LOGD(HTTP_POOL_LOG_TAG, "%s connection to %s:%d", reused ? "Reusing" : "Opening", host, port);
+    return selected;
+}
+
+/**
+ * @brief Give the connection back to the pool after the request has finished.
+ *
+ * @param connection The connection returned by `acquire`
+ * @param healthy `false` if the request failed on the transport, the socket is closed so it is never reused
+ */
+void HttpConnectionPool::release(HttpConnection *connection, bool healthy) {
+    if (connection == nullptr) return;
+
+    if (xSemaphoreTake(_poolMutex, portMAX_DELAY) == pdTRUE) {
+        if (!healthy) close(*connection);
+        else connection->requestCount++;
+
+        connection->lastUsed = xTaskGetTickCount();
+        connection->inUse = false;
+        xSemaphoreGive(_poolMutex);
+    }
+
+    if (healthy && _releaseWatcher) _releaseWatcher();
+}
+
+/**
+ * @brief Set the function called when a connection is kept open after a request, to close it once it is idle
+ *
+ * @param watcher Wakes up the job running `closeIdle`, called from the task that sent the request
+ */
+void HttpConnectionPool::watchRelease(std::function<void()> watcher) {
+    _releaseWatcher = watcher;
+}
+
+/**
+ * @brief Close every connection that has been idle for longer than `HTTP_POOL_IDLE_TIMEOUT_MS`.
+ *
+ * The server would close them soon anyway, closing them first frees the socket and avoids
+ * sending the next request to a connection that is about to be dropped.
+ *
+ * @return The time in ms until the next kept connection is idle for too long, 0 if none is kept open
+ */
+uint32_t HttpConnectionPool::closeIdle() {
+    if (xSemaphoreTake(_poolMutex, portMAX_DELAY) != pdTRUE) return 0;
+
+    TickType_t now = xTaskGetTickCount();
+    TickType_t nextIdle = portMAX_DELAY;
+    for (HttpConnection &connection : _connections) {
+        if (connection.inUse || connection.host[0] == '\0' || connection.requestCount == 0) continue;
+        TickType_t idle = now - connection.lastUsed;
+        if (idle >= pdMS_TO_TICKS(HTTP_POOL_IDLE_TIMEOUT_MS) || !connection.client.connected()) {
+            ESP_LOGD(HTTP_POOL_LOG_TAG, "Closing idle connection to %s:%d after %lu requests", connection.host, connection.port, (unsigned long)connection.requestCount);
+            close(connection);
+        } else if (pdMS_TO_TICKS(HTTP_POOL_IDLE_TIMEOUT_MS) - idle < nextIdle) {
+            nextIdle = pdMS_TO_TICKS(HTTP_POOL_IDLE_TIMEOUT_MS) - idle;
+        }
+    }
+
+    xSemaphoreGive(_poolMutex);
+    return nextIdle == portMAX_DELAY ? 0 : nextIdle * portTICK_PERIOD_MS;
+}
+
+/**
+ * @brief Close every connection that is not in use, e.g. after the WiFi has been reconnected.
+ */
+void HttpConnectionPool::closeAll() {
+    if (xSemaphoreTake(_poolMutex, portMAX_DELAY) != pdTRUE) return;
+
+    for (HttpConnection &connection : _connections) {
+        if (!connection.inUse) close(connection);
+    }
+
+    xSemaphoreGive(_poolMutex);
+}
+
+void HttpConnectionPool::close(HttpConnection &connection) {
+    // Also release the socket of a connection that was already closed by the server
+    connection.client.stop();
+    connection.requestCount = 0;
+}
+
+/**
+ * @brief Get the host and port of an `http://` or `https://` url.
+ *
+ * @param url The url of the request
+ * @param host The buffer to store the host
+ * @param size The size of the host buffer
+ * @param port Set to the port of the url, 80 or 443 if not written
+ * @param secure Set to `true` for an `https://` url
+ * @return `true` if the url has a host that fits in the buffer, `false` otherwise.
+ */
+bool HttpConnectionPool::parseHost(const char *url, char *host, size_t size, uint16_t &port, bool &secure) {
+    secure = strncmp(url, "https://", 8) == 0;
+    const char *start = strstr(url, "://");
+    start = start == nullptr ? url : start + 3;
+
+    size_t length = strcspn(start, ":/");
+    if (length == 0 || length >= size) return false;
+
+    memcpy(host, start, length);
+    host[length] = '\0';
+
+    port = secure ? 443 : 80;
+    if (start[length] == ':') {
+        int parsed = atoi(start + length + 1);
+        if (parsed <= 0 || parsed > 65535) return false;
+        port = parsed;
+    }
+    return true;
+}
@@ -0,0 +1,45 @@
+#ifndef HTTP_CONNECTION_POOL_H
+#define HTTP_CONNECTION_POOL_H
+
+#include "TlsClient.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <functional>
+
+#define HTTP_POOL_MAX_CONNECTIONS   2           // Keep-alive connections kept open at the same time, one per backend host
+#define HTTP_POOL_IDLE_TIMEOUT_MS   4000        // Close a connection idle for this long, shorter than the usual 5s server keep-alive
+#define HTTP_POOL_MAX_HOST_LENGTH   64
+
+/// @brief A keep-alive connection to a single backend host
+struct HttpConnection {
+    char host[HTTP_POOL_MAX_HOST_LENGTH];   /* Host of the connection, empty if the slot is free        */
+    uint16_t port;
+    bool secure;                            /* The connection is encrypted with TLS, for `https://` urls */
+    TlsClient client;
+    TickType_t lastUsed;                    /* Tick of the last finished request                        */
+    uint32_t requestCount;                  /* Requests sent over the current TCP connection            */
+    bool inUse;
+};
+
+/// @brief Pool of keep-alive HTTP connections, so requests to the same host skip the TCP and TLS handshakes
+class HttpConnectionPool {
+public:
+    HttpConnectionPool();
+
+    HttpConnection *acquire(const char *url, bool &reused);
+    void release(HttpConnection *connection, bool healthy);
+    void watchRelease(std::function<void()> watcher);
+    uint32_t closeIdle();
+    void closeAll();
+
+private:
+    HttpConnection _connections[HTTP_POOL_MAX_CONNECTIONS];
+    SemaphoreHandle_t _poolMutex;
+    std::function<void()> _releaseWatcher;
+
+    void close(HttpConnection &connection);
+    static bool parseHost(const char *url, char *host, size_t size, uint16_t &port, bool &secure);
+};
+
+#endif
@@ -0,0 +1,224 @@
+#define HTTP_ENGINE_LOG_TAG "HTTP_ENGINE"
+
+#include "HttpRequestEngine.h"
+#include <esp_log.h>
+
+HttpRequestEngine::HttpRequestEngine(Wifi *wifi) : _wifi(wifi), _taskHandle(nullptr), _submitOrder(0) {
+    for (HttpRequest &request : _requests) {
+        request.requestId = 0;
+        request.method = nullptr;
+        request.url[0] = '\0';
+        request.body[0] = '\0';
+        request.deadline = 0;
+        request.order = 0;
+        request.state = HTTP_REQUEST_FREE;
+    }
+
+    _engineMutex = xSemaphoreCreateMutex();
+    if (_engineMutex == NULL) ESP_LOGE(HTTP_ENGINE_LOG_TAG, "Failed to create HTTP engine mutex.");
+}
+
+/**
+ * @brief Create the task that sends the submitted requests one by one.
+ *
+ */
+void HttpRequestEngine::startTask() {
+    xTaskCreate(
+        loop,                           // Function to run in the task
+        "HTTP Engine",                  // Name of the task
+        HTTP_ENGINE_TASK_STACK_SIZE,    // Stack size (adjustable)
+        this,                           // Pass the `this` pointer to the task
+        5,                              // Task priority
+        &_taskHandle                    // Store the task handle for later control
+    );
+    ESP_LOGI(HTTP_ENGINE_LOG_TAG, "HTTP Engine task created successfully");
+}
+
+/**
+ * @brief Queue a request to be sent by the engine task, without waiting for the response.
+ *
+ * The callback is called from the engine task once the request is done, so it must not block.
+ * It is not called if the request is cancelled.
+ *
+ * @param requestId The id to match the result with the caller, see `nextQueueRequestId`
+ * @param method The HTTP method of the request, must be a string literal
+ * @param url The url of the api
+ * @param payload The json payload, null for no body. Moved into the request and only serialized when sent
+ * @param deadlineMs The time from now the request has to be done in, includes the time waiting in the engine
+ * @param callback Called with the result of the request
+ * @return `true` if the request is queued, `false` if the url is too long or there are already `HTTP_ENGINE_MAX_REQUESTS` requests.
+ */
+bool HttpRequestEngine::submit(int requestId, const char *method, const std::string &url, JsonDocument payload, uint32_t deadlineMs, HttpCallback callback) {
+    if (url.size() >= HTTP_ENGINE_MAX_URL_LENGTH) {
+        ESP_LOGE(HTTP_ENGINE_LOG_TAG, "Url of %s request %d is too long: %s", method, requestId, url.c_str());
+        return false;
+    }
+
+    if (xSemaphoreTake(_engineMutex, portMAX_DELAY) != pdTRUE) return false;
+
+    HttpRequest *slot = nullptr;
+    for (HttpRequest &request : _requests) {
+        if (request.state == HTTP_REQUEST_FREE) {
+            slot = &request;
+            break;
+        }
+    }
+
+    if (slot != nullptr) {
+        slot->requestId = requestId;
+        slot->method = method;
+        memcpy(slot->url, url.c_str(), url.size() + 1);
+        slot->payload = std::move(payload);
+        slot->deadline = xTaskGetTickCount() + pdMS_TO_TICKS(deadlineMs);
+        slot->order = _submitOrder++;
+        slot->callback = callback;
+        slot->state = HTTP_REQUEST_PENDING;
+    }
+    xSemaphoreGive(_engineMutex);
+
+    if (slot == nullptr) {
+        ESP_LOGW(HTTP_ENGINE_LOG_TAG, "Too many requests in flight, rejecting %s request %d", method, requestId);
+        return false;
+    }
+
+    ESP_LOGD(HTTP_ENGINE_LOG_TAG, "Queued %s request %d with deadline %lu ms", method, requestId, (unsigned long)deadlineMs);
+    if (_taskHandle != nullptr) xTaskNotifyGive(_taskHandle);
+    return true;
+}
+
+/**
+ * @brief Cancel a request, its callback will not be called after this returns.
+ *
+ * A request that is waiting is removed right away. A request that is already being sent
+ * runs to the end, but its result is dropped.
+ *
+ * @param requestId The id given when the request was submitted
+ * @return `true` if the request was found, `false` if it was already done.
+ */
+bool HttpRequestEngine::cancel(int requestId) {
+    if (xSemaphoreTake(_engineMutex, portMAX_DELAY) != pdTRUE) return false;
+
+    bool found = false;
+    for (HttpRequest &request : _requests) {
+        if (request.requestId != requestId || request.state == HTTP_REQUEST_FREE) continue;
+
+        if (request.state == HTTP_REQUEST_PENDING) {
+            request.state = HTTP_REQUEST_FREE;
+            request.callback = nullptr;
+        } else {
+            request.state = HTTP_REQUEST_CANCELLED;
+        }
+        found = true;
+    }
+    xSemaphoreGive(_engineMutex);
+
+    if (found) ESP_LOGI(HTTP_ENGINE_LOG_TAG, "Request %d cancelled", requestId);
+    return found;
+}
+
+/**
+ * @brief Cancel every submitted request, e.g. when the WiFi connection is lost.
+ *
+ */
+void HttpRequestEngine::cancelAll() {
+    if (xSemaphoreTake(_engineMutex, portMAX_DELAY) != pdTRUE) return;
+
+    for (HttpRequest &request : _requests) {
+        if (request.state == HTTP_REQUEST_PENDING) {
+            request.state = HTTP_REQUEST_FREE;
+            request.callback = nullptr;
+        } else if (request.state == HTTP_REQUEST_RUNNING) {
+            request.state = HTTP_REQUEST_CANCELLED;
+        }
+    }
+    xSemaphoreGive(_engineMutex);
+}
+
+/**
+ * @brief Get the number of requests that are waiting or being sent.
+ *
+ * @return The number of used request slots
+ */
+size_t HttpRequestEngine::inFlight() {
+    size_t count = 0;
+    if (xSemaphoreTake(_engineMutex, portMAX_DELAY) == pdTRUE) {
+        for (const HttpRequest &request : _requests) {
+            if (request.state != HTTP_REQUEST_FREE) count++;
+        }
+        xSemaphoreGive(_engineMutex);
+    }
+    return count;
+}
+
+/**
+ * @brief Mark the oldest pending request as running.
+ *
+ * @return The request to send, or nullptr if there is none
+ */
+HttpRequest *HttpRequestEngine::takeNextRequest() {
+    if (xSemaphoreTake(_engineMutex, portMAX_DELAY) != pdTRUE) return nullptr;
+
+    HttpRequest *next = nullptr;
+    for (HttpRequest &request : _requests) {
+        if (request.state != HTTP_REQUEST_PENDING) continue;
+        if (next == nullptr || (int32_t)(request.order - next->order) < 0) next = &request;
+    }
+    if (next != nullptr) next->state = HTTP_REQUEST_RUNNING;
+
+    xSemaphoreGive(_engineMutex);
+    return next;
+}
+
+/**
+ * @brief Function to be run by the HTTP Engine task.
+ *
+ * The remaining time until the deadline is used as the connect and read timeout of the request,
+ * so a slow backend never holds a request longer than the caller is willing to wait.
+ *
+ * @param params Pointer to the task parameters (in this case, the HttpRequestEngine instance).
+ */
+void HttpRequestEngine::loop(void *params) {
+    HttpRequestEngine* engine = (HttpRequestEngine*)params;
+
+    while (1) {
+        HttpRequest *request = engine->takeNextRequest();
+        if (request == nullptr) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        // The response body is read straight into the fixed buffer of the slot
+        HttpResponseBuffer response = { request->body, sizeof(request->body), 0, 0, false };
+        request->body[0] = '\0';
+
+        HttpResult result;
+        result.requestId = request->requestId;
+
+        int32_t remaining = (int32_t)(request->deadline - xTaskGetTickCount());
+        if (remaining <= 0) {
+            ESP_LOGW(HTTP_ENGINE_LOG_TAG, "Deadline of %s request %d passed before it could be sent", request->method, request->requestId);
+            result.statusCode = HTTP_ENGINE_ERROR_DEADLINE_EXCEEDED;
+        } else {
+            result.statusCode = engine->_wifi->sendRequest(request->method, request->url, request->payload.as<JsonVariantConst>(), response, remaining * portTICK_PERIOD_MS);
+        }
+
+        result.body = request->body;
+        result.length = response.length;
+        result.bodyLength = response.bodyLength;
+        result.truncated = response.truncated;
+
+        // Free the slot before calling back, so the callback can already submit the next request.
+        // The body stays untouched until the callback returns, as only this task writes it
+        HttpCallback callback;
+        if (xSemaphoreTake(engine->_engineMutex, portMAX_DELAY) == pdTRUE) {
+            if (request->state == HTTP_REQUEST_RUNNING) callback = std::move(request->callback);
+            request->callback = nullptr;
+            request->state = HTTP_REQUEST_FREE;
+            request->payload.clear();
+            xSemaphoreGive(engine->_engineMutex);
+        }
+
+        if (callback) callback(result);
+        else ESP_LOGD(HTTP_ENGINE_LOG_TAG, "Request %d was cancelled, dropping the result", result.requestId);
+    }
+}
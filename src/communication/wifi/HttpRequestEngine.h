@@ -0,0 +1,78 @@
+#ifndef HTTP_REQUEST_ENGINE_H
+#define HTTP_REQUEST_ENGINE_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include <functional>
+#include <string>
+
+#include "Wifi.h"
+
+#define HTTP_ENGINE_MAX_REQUESTS            4           // Requests waiting or running at the same time, `submit` fails above this
+#define HTTP_ENGINE_TASK_STACK_SIZE         8192        // The TLS handshake runs on the engine task
+#define HTTP_ENGINE_MAX_URL_LENGTH          128
+#define HTTP_ENGINE_MAX_BODY_SIZE           512         // Response body kept per request
+#define HTTP_ENGINE_ERROR_DEADLINE_EXCEEDED (-100)      // Status code of a request whose deadline passed before it could be sent
+
+/// @brief The result of an asynchronous HTTP request, passed to the request callback
+struct HttpResult {
+    int requestId;          /* The id given when the request was submitted                                  */
+    int statusCode;         /* HTTP status code, or a negative `HTTPClient`/`HTTP_ENGINE_ERROR_*` error code  */
+    const char *body;       /* The response body, null terminated, only valid during the callback            */
+    size_t length;          /* Bytes of the body in `body`                                                   */
+    size_t bodyLength;      /* Bytes of the body sent by the server, more than `length` if truncated         */
+    bool truncated;         /* The body did not fit in `HTTP_ENGINE_MAX_BODY_SIZE`                           */
+};
+
+typedef std::function<void(const HttpResult &result)> HttpCallback;
+
+/**
+ * @enum HttpRequestState
+ * @brief The state of a request slot of the `HttpRequestEngine`.
+ *
+ */
+enum HttpRequestState : uint8_t {
+    HTTP_REQUEST_FREE,          /* The slot is not used                                                     */
+    HTTP_REQUEST_PENDING,       /* The request is waiting to be sent                                        */
+    HTTP_REQUEST_RUNNING,       /* The request is being sent by the engine task                             */
+    HTTP_REQUEST_CANCELLED,     /* The request was cancelled while running, the result will be dropped      */
+};
+
+/// @brief A request slot of the `HttpRequestEngine`
+struct HttpRequest {
+    int requestId;
+    const char *method;
+    char url[HTTP_ENGINE_MAX_URL_LENGTH];
+    JsonDocument payload;       /* Serialized straight to the socket when the request is sent */
+    char body[HTTP_ENGINE_MAX_BODY_SIZE];
+    TickType_t deadline;
+    uint32_t order;             /* Submit order, the oldest pending request is sent first */
+    HttpCallback callback;
+    HttpRequestState state;
+};
+
+/// @brief Runs the HTTP requests on its own task, so the callers never block on a slow backend
+class HttpRequestEngine {
+public:
+    HttpRequestEngine(Wifi *wifi);
+    void startTask();
+
+    bool submit(int requestId, const char *method, const std::string &url, JsonDocument payload, uint32_t deadlineMs, HttpCallback callback);
+    bool cancel(int requestId);
+    void cancelAll();
+    size_t inFlight();
+
+private:
+    Wifi *_wifi;
+    HttpRequest _requests[HTTP_ENGINE_MAX_REQUESTS];
+    SemaphoreHandle_t _engineMutex;
+    TaskHandle_t _taskHandle;
+    uint32_t _submitOrder;
+
+    HttpRequest *takeNextRequest();
+    static void loop(void *parameter);
+};
+
+#endif
@@ -0,0 +1,496 @@
+#define HTTP_STREAM_LOG_TAG "HTTP_STREAM"
+
+#include "HttpStream.h"
+#include <esp_log.h>
+#include <ctype.h>
+
+/**
+ * @brief Copy the value of a header line if it is the given header.
+ *
+ * @param line The header line as received
+ * @param name The lowercase header name with its colon
+ * @param value The buffer for the value, left empty if the value does not fit
+ * @param size The size of the buffer
+ */
+static void copyHeaderValue(const char *line, const char *name, char *value, size_t size) {
+    size_t nameLength = strlen(name);
+    if (strncasecmp(line, name, nameLength) != 0) return;
+
+    const char *start = line + nameLength;
+    while (*start == ' ' || *start == '\t') start++;
+    if (strlen(start) < size) strcpy(value, start);
+}
+
+HttpStream::HttpStream(Client &client, TickType_t deadline)
+    : _client(client), _deadline(deadline), _writeLength(0), _writeFailed(false), _timedOut(false),
+      _bodyChunked(false), _bodyUntilClose(false), _bodyDone(true), _bodyFailed(false), _bodyRemaining(0), _peekedByte(-1) {
+    // `read` already waits for the data up to the deadline, the `Stream` helpers must not wait again after the body ended
+    setTimeout(0);
+}
+
+/**
+ * @brief Write the request line, the headers and the json payload to the socket.
+ *
+ * The payload is serialized straight into a small write buffer, so it is never stored as a whole in memory.
+ * The `Content-Length` is measured from the payload before it is written.
+ *
+ * @param method The HTTP method of the request
+ * @param host The host of the server, for the `Host` header
+ * @param port The port of the server
+ * @param path The path and query of the request
+ * @param payload The json payload, null for no body
+ * @param validators The validators of the cached resource to make the request conditional, null for none
+ * @return `true` if the whole request is written, `false` otherwise.
+ */
+bool HttpStream::writeRequest(const char *method, const char *host, uint16_t port, const char *path, JsonVariantConst payload,
+                              const HttpCacheValidators *validators) {
+    writeRequestLine(method, host, port, path);
+
+    if (validators != nullptr && validators->etag[0] != '\0') {
+        print("If-None-Match: ");
+        print(validators->etag);
+        print("\r\n");
+    }
+    if (validators != nullptr && validators->lastModified[0] != '\0') {
+        print("If-Modified-Since: ");
+        print(validators->lastModified);
+        print("\r\n");
+    }
+
+    if (!payload.isNull()) {
+        print("Content-Type: application/json\r\nContent-Length: ");
+        print(measureJson(payload));
+        print("\r\n");
+    }
+    print("\r\n");
+
+    if (!payload.isNull()) serializeJson(payload, *this);
+    flush();
+
+    if (_writeFailed) ESP_LOGW(HTTP_STREAM_LOG_TAG, "Failed to write %s request to %s", method, host);
+    return !_writeFailed;
+}
+
+/**
+ * @brief Write the request line and the headers of a request whose body is sent with `writeChunk`.
+ *
+ * The body is sent with the chunked transfer encoding, so its length does not have to be known
+ * upfront. The request is only complete once `endChunkedRequest` is called, a request that is cut
+ * before is discarded by the server.
+ *
+ * @param method The HTTP method of the request
+ * @param host The host of the server, for the `Host` header
+ * @param port The port of the server
+ * @param path The path and query of the request
+ * @param contentType The `Content-Type` of the body
+ * @param contentEncoding The `Content-Encoding` of the body, null for none
+ * @return `true` if the headers are written, `false` otherwise.
+ */
+bool HttpStream::writeChunkedRequest(const char *method, const char *host, uint16_t port, const char *path,
+                                     const char *contentType, const char *contentEncoding) {
+    writeRequestLine(method, host, port, path);
+
+    print("Content-Type: ");
+    print(contentType);
+    if (contentEncoding != nullptr) {
+        print("\r\nContent-Encoding: ");
+        print(contentEncoding);
+    }
+    print("\r\nTransfer-Encoding: chunked\r\n\r\n");
+
+    if (_writeFailed) ESP_LOGW(HTTP_STREAM_LOG_TAG, "Failed to write %s request to %s", method, host);
+    return !_writeFailed;
+}
+
+/**
+ * @brief Write the next chunk of the body, it is gathered in the write buffer like the rest of the request
+ *
+ * @return `true` if the chunk is written, `false` if the socket failed.
+ */
+bool HttpStream::writeChunk(const uint8_t *data, size_t length) {
+    if (length == 0) return !_writeFailed;
+
+    print(length, HEX);
+    print("\r\n");
+    write(data, length);
+    print("\r\n");
+    return !_writeFailed;
+}
+
+/**
+ * @brief Write the last empty chunk, which completes the request
+ *
+ * @return `true` if the whole request is written, `false` otherwise.
+ */
+bool HttpStream::endChunkedRequest() {
+    print("0\r\n\r\n");
+    flush();
+    return !_writeFailed;
+}
+
+/**
+ * @brief Read the response of the request from the socket.
+ *
+ * The body is read straight from the socket into the caller buffer, with `Content-Length`,
+ * chunked and read-until-close bodies supported. A body longer than the buffer is still read
+ * to the end so the connection can be reused, and the response is flagged as truncated.
+ *
+ * @param response The buffer to store the body
+ * @param keepAlive Set to `true` if the server keeps the connection open for the next request
+ * @param received Set to `true` once any byte of the response has been received
+ * @return HTTP status code of the response, or a negative `HTTPClient` error code if the request failed
+ */
+int HttpStream::readResponse(HttpResponseBuffer &response, bool &keepAlive, bool &received) {
+    response.length = 0;
+    response.bodyLength = 0;
+    response.truncated = false;
+    if (response.capacity > 0) response.data[0] = '\0';
+
+    int statusCode = readResponseHeaders(keepAlive, received);
+    if (statusCode < 0) return statusCode;
+
+    char line[HTTP_STREAM_LINE_SIZE];
+    bool complete = true;
+    if (_bodyDone) {
+        // No body for this response
+    } else if (_bodyChunked) {
+        while (complete) {
+            complete = readLine(line, sizeof(line));
+            if (!complete) break;
+
+            unsigned long chunkSize = strtoul(line, nullptr, 16);
+            if (chunkSize == 0) {
+                // Skip the trailer headers until the empty line
+                while ((complete = readLine(line, sizeof(line))) && line[0] != '\0') {}
+                break;
+            }
+            complete = readBody(response, chunkSize) && readLine(line, sizeof(line));
+        }
+    } else if (!_bodyUntilClose) {
+        complete = readBody(response, _bodyRemaining);
+    } else {
+        // The body ends when the server closes the connection
+        int byte;
+        while ((byte = readByte()) >= 0) {
+            uint8_t data = byte;
+            store(response, &data, 1);
+        }
+        complete = !_timedOut;
+    }
+    _bodyDone = true;
+
+    if (!complete) {
+        keepAlive = false;
+        return _timedOut ? HTTPC_ERROR_READ_TIMEOUT : HTTPC_ERROR_CONNECTION_LOST;
+    }
+
+    if (response.truncated) {
+        ESP_LOGW(HTTP_STREAM_LOG_TAG, "Response body of %d bytes is truncated to %d bytes", response.bodyLength, response.length);
+    }
+    return statusCode;
+}
+
+/**
+ * @brief Read the status line and the headers of the response, the body is then read with the `Stream` methods.
+ *
+ * @param keepAlive Set to `true` if the server keeps the connection open for the next request
+ * @param received Set to `true` once any byte of the response has been received
+ * @param validators Set to the `ETag` and `Last-Modified` of the response, empty if it has none. Null to ignore them
+ * @return HTTP status code of the response, or a negative `HTTPClient` error code if the request failed
+ */
+int HttpStream::readResponseHeaders(bool &keepAlive, bool &received, HttpCacheValidators *validators) {
+    keepAlive = false;
+    received = false;
+    _bodyChunked = false;
+    _bodyUntilClose = false;
+    _bodyDone = true;
+    _bodyFailed = false;
+    _bodyRemaining = 0;
+    _peekedByte = -1;
+
+    if (validators != nullptr) {
+        validators->etag[0] = '\0';
+        validators->lastModified[0] = '\0';
+    }
+
+    char line[HTTP_STREAM_LINE_SIZE];
+    if (!readLine(line, sizeof(line))) return _timedOut ? HTTPC_ERROR_READ_TIMEOUT : HTTPC_ERROR_CONNECTION_LOST;
+    received = true;
+
+    int statusCode;
+    if (sscanf(line, "HTTP/%*d.%*d %d", &statusCode) != 1) {
+        ESP_LOGE(HTTP_STREAM_LOG_TAG, "Invalid status line: %s", line);
+        return HTTPC_ERROR_NO_HTTP_SERVER;
+    }
+
+    // HTTP/1.1 keeps the connection open unless the server says otherwise
+    keepAlive = strncmp(line, "HTTP/1.1", 8) == 0;
+    long contentLength = -1;
+    bool chunked = false;
+
+    while (true) {
+        if (!readLine(line, sizeof(line))) return _timedOut ? HTTPC_ERROR_READ_TIMEOUT : HTTPC_ERROR_CONNECTION_LOST;
+        if (line[0] == '\0') break;
+
+        // The validators are sent back to the server as they are, so they are kept before the line is lowercased
+        if (validators != nullptr) {
+            copyHeaderValue(line, "etag:", validators->etag, sizeof(validators->etag));
+            copyHeaderValue(line, "last-modified:", validators->lastModified, sizeof(validators->lastModified));
+        }
+
+        // Only the header names and keywords are compared, so the whole line can be lowercase
+        for (char *c = line; *c != '\0'; c++) *c = tolower((unsigned char)*c);
+
+        if (strncmp(line, "content-length:", 15) == 0) contentLength = strtol(line + 15, nullptr, 10);
+        else if (strncmp(line, "transfer-encoding:", 18) == 0) chunked = strstr(line + 18, "chunked") != nullptr;
+        else if (strncmp(line, "connection:", 11) == 0) {
+            if (strstr(line + 11, "close") != nullptr) keepAlive = false;
+            else if (strstr(line + 11, "keep-alive") != nullptr) keepAlive = true;
+        }
+    }
+
+    if (statusCode == 204 || statusCode == 304 || (statusCode >= 100 && statusCode < 200)) {
+        // No body for these responses
+    } else if (chunked) {
+        _bodyChunked = true;
+        _bodyDone = false;
+    } else if (contentLength >= 0) {
+        _bodyRemaining = contentLength;
+        _bodyDone = contentLength == 0;
+    } else {
+        // The body ends when the server closes the connection
+        keepAlive = false;
+        _bodyUntilClose = true;
+        _bodyDone = false;
+    }
+    return statusCode;
+}
+
+/**
+ * @brief Read the rest of the body that was not read through the `Stream` methods, so the connection can be reused.
+ *
+ * @return `true` if the whole body was received, `false` if the connection was closed or timed out.
+ */
+bool HttpStream::finishBody() {
+    _peekedByte = -1;
+    while (readBodyByte() >= 0) {}
+    return !_bodyFailed;
+}
+
+int HttpStream::available() {
+    if (_peekedByte >= 0) return 1;
+    if (_bodyDone) return 0;
+
+    int available = _client.available();
+    if (available <= 0) return 0;
+    if (_bodyChunked) return 1;     // The socket also holds the chunk framing
+    if (!_bodyUntilClose && (size_t)available > _bodyRemaining) return _bodyRemaining;
+    return available;
+}
+
+int HttpStream::read() {
+    if (_peekedByte >= 0) {
+        int byte = _peekedByte;
+        _peekedByte = -1;
+        return byte;
+    }
+    return readBodyByte();
+}
+
+int HttpStream::peek() {
+    if (_peekedByte < 0) _peekedByte = readBodyByte();
+    return _peekedByte;
+}
+
+/**
+ * @brief Start a request with its request line and the headers every request has
+ *
+ */
+void HttpStream::writeRequestLine(const char *method, const char *host, uint16_t port, const char *path) {
+    _writeLength = 0;
+    _writeFailed = false;
+
+    print(method);
+    print(' ');
+    print(path);
+    print(" HTTP/1.1\r\nHost: ");
+    print(host);
+    if (port != 80 && port != 443) {
+        print(':');
+        print(port);
+    }
+    print("\r\nUser-Agent: ESP32\r\nConnection: keep-alive\r\n");
+}
+
+size_t HttpStream::write(uint8_t byte) {
+    if (_writeLength == sizeof(_writeBuffer)) flush();
+    _writeBuffer[_writeLength++] = byte;
+    return 1;
+}
+
+size_t HttpStream::write(const uint8_t *buffer, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        if (_writeLength == sizeof(_writeBuffer)) flush();
+
+        size_t chunk = size - written;
+        if (chunk > sizeof(_writeBuffer) - _writeLength) chunk = sizeof(_writeBuffer) - _writeLength;
+        memcpy(_writeBuffer + _writeLength, buffer + written, chunk);
+        _writeLength += chunk;
+        written += chunk;
+    }
+    return written;
+}
+
+/**
+ * @brief Send the gathered bytes to the socket.
+ *
+ */
+void HttpStream::flush() {
+    if (_writeLength == 0) return;
+    if (!_writeFailed && _client.write(_writeBuffer, _writeLength) != _writeLength) _writeFailed = true;
+    _writeLength = 0;
+}
+
+/**
+ * @brief Wait until there is data to read, the connection is closed, or the deadline has passed.
+ *
+ * @return `true` if there is data to read, `false` otherwise.
+ */
+bool HttpStream::waitAvailable() {
+    while (_client.available() <= 0) {
+        if (!_client.connected()) return false;
+        if ((int32_t)(xTaskGetTickCount() - _deadline) >= 0) {
+            _timedOut = true;
+            return false;
+        }
+        vTaskDelay(1);
+    }
+    return true;
+}
+
+int HttpStream::readByte() {
+    if (!waitAvailable()) return -1;
+    return _client.read();
+}
+
+/**
+ * @brief Read the next byte of the body, with the chunk framing removed.
+ *
+ * @return The byte, or -1 at the end of the body or if the connection was closed or timed out.
+ */
+int HttpStream::readBodyByte() {
+    if (_bodyDone) return -1;
+
+    char line[HTTP_STREAM_LINE_SIZE];
+    if (_bodyChunked && _bodyRemaining == 0) {
+        if (!readLine(line, sizeof(line))) {
+            _bodyFailed = true;
+            _bodyDone = true;
+            return -1;
+        }
+
+        _bodyRemaining = strtoul(line, nullptr, 16);
+        if (_bodyRemaining == 0) {
+            // Skip the trailer headers until the empty line
+            bool complete;
+            while ((complete = readLine(line, sizeof(line))) && line[0] != '\0') {}
+            _bodyFailed = !complete;
+            _bodyDone = true;
+            return -1;
+        }
+    }
+
+    int byte = readByte();
+    if (byte < 0) {
+        // Only a read-until-close body may end with the connection
+        _bodyFailed = !_bodyUntilClose || _timedOut;
+        _bodyDone = true;
+        return -1;
+    }
+    if (_bodyUntilClose) return byte;
+
+    _bodyRemaining--;
+    if (_bodyRemaining == 0) {
+        if (!_bodyChunked) _bodyDone = true;
+        else if (!readLine(line, sizeof(line))) {
+            // The line ending after the chunk data
+            _bodyFailed = true;
+            _bodyDone = true;
+        }
+    }
+    return byte;
+}
+
+/**
+ * @brief Read a CRLF terminated line, the line is cut to fit the buffer.
+ *
+ * @param line The buffer to store the line without the line ending
+ * @param size The size of the buffer
+ * @return `true` if a whole line is read, `false` if the connection was closed or timed out.
+ */
+bool HttpStream::readLine(char *line, size_t size) {
+    size_t length = 0;
+    while (true) {
+        int byte = readByte();
+        if (byte < 0) return false;
+        if (byte == '\n') break;
+        if (byte != '\r' && length < size - 1) line[length++] = byte;
+    }
+    line[length] = '\0';
+    return true;
+}
+
+/**
+ * @brief Read `length` bytes of the body straight into the response buffer.
+ *
+ * @param response The buffer to store the body
+ * @param length The number of bytes to read
+ * @return `true` if every byte is read, `false` if the connection was closed or timed out.
+ */
+bool HttpStream::readBody(HttpResponseBuffer &response, size_t length) {
+    uint8_t discard[64];
+
+    while (length > 0) {
+        if (!waitAvailable()) return false;
+
+        int read;
+        size_t space = response.capacity > response.length + 1 ? response.capacity - response.length - 1 : 0;
+        if (space > 0) {
+            read = _client.read((uint8_t*)response.data + response.length, length < space ? length : space);
+            if (read > 0) {
+                response.length += read;
+                response.data[response.length] = '\0';
+            }
+        } else {
+            // Keep reading to the end of the body, so the connection stays usable
+            read = _client.read(discard, length < sizeof(discard) ? length : sizeof(discard));
+            if (read > 0) response.truncated = true;
+        }
+
+        if (read <= 0) continue;
+        response.bodyLength += read;
+        length -= read;
+    }
+    return true;
+}
+
+/**
+ * @brief Store bytes of a body that has no known length.
+ *
+ * @param response The buffer to store the body
+ * @param data The bytes to store
+ * @param length The number of bytes
+ */
+void HttpStream::store(HttpResponseBuffer &response, const uint8_t *data, size_t length) {
+    response.bodyLength += length;
+
+    size_t space = response.capacity > response.length + 1 ? response.capacity - response.length - 1 : 0;
+    size_t stored = length < space ? length : space;
+    if (stored > 0) {
+        memcpy(response.data + response.length, data, stored);
+        response.length += stored;
+        response.data[response.length] = '\0';
+    }
+    if (stored < length) response.truncated = true;
+}
@@ -0,0 +1,85 @@
+#ifndef HTTP_STREAM_H
+#define HTTP_STREAM_H
+
+#include <Client.h>
+#include <HTTPClient.h>
+#include <ArduinoJson.h>
+#include <freertos/FreeRTOS.h>
+
+#define HTTP_STREAM_WRITE_BUFFER_SIZE   512     // Bytes gathered before a write to the socket, over TLS every write is a record
+#define HTTP_STREAM_LINE_SIZE           128     // Longest status or header line kept, longer lines are cut
+#define HTTP_VALIDATOR_SIZE             64      // Longest `ETag` or `Last-Modified` value kept, longer values are ignored
+
+/// @brief Caller supplied buffer that receives the response body
+struct HttpResponseBuffer {
+    char *data;                 /* Buffer for the body, always null terminated                             */
+    size_t capacity;            /* Size of `data`, at most `capacity - 1` bytes of the body are kept       */
+    size_t length;              /* Bytes of the body stored in `data`                                      */
+    size_t bodyLength;          /* Bytes of the body received from the server, more than `length` if cut   */
+    bool truncated;             /* The body did not fit in `data`                                          */
+};
+
+/// @brief The cache validators of a resource, sent back with a conditional GET so an unchanged resource costs a 304
+struct HttpCacheValidators {
+    char etag[HTTP_VALIDATOR_SIZE];             /* `ETag` of the last response, sent as `If-None-Match`              */
+    char lastModified[HTTP_VALIDATOR_SIZE];     /* `Last-Modified` of the last response, sent as `If-Modified-Since` */
+};
+
+/**
+ * @brief Minimal HTTP/1.1 client over an open socket that streams the request and response bodies without copying them
+ *
+ * The request body is either a json payload serialized straight to the socket with `writeRequest`, or
+ * a body of unknown length sent in chunks with `writeChunkedRequest`, `writeChunk` and `endChunkedRequest`.
+ *
+ * The response body is either read into a `HttpResponseBuffer` with `readResponse`, or read as a `Stream`
+ * after `readResponseHeaders` and finished with `finishBody`, e.g. to parse a large json body
+ * straight from the socket.
+ */
+class HttpStream : public Stream {
+public:
+    HttpStream(Client &client, TickType_t deadline);
+
+    bool writeRequest(const char *method, const char *host, uint16_t port, const char *path, JsonVariantConst payload,
+                      const HttpCacheValidators *validators = nullptr);
+    bool writeChunkedRequest(const char *method, const char *host, uint16_t port, const char *path,
+                             const char *contentType, const char *contentEncoding = nullptr);
+    bool writeChunk(const uint8_t *data, size_t length);
+    bool endChunkedRequest();
+    int readResponse(HttpResponseBuffer &response, bool &keepAlive, bool &received);
+    int readResponseHeaders(bool &keepAlive, bool &received, HttpCacheValidators *validators = nullptr);
+    bool finishBody();
+
+    int available() override;
+    int read() override;
+    int peek() override;
+
+    size_t write(uint8_t byte) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    void flush() override;
+
+private:
+    Client &_client;
+    TickType_t _deadline;
+    uint8_t _writeBuffer[HTTP_STREAM_WRITE_BUFFER_SIZE];
+    size_t _writeLength;
+    bool _writeFailed;
+    bool _timedOut;
+
+    // Framing of the response body, set by `readResponseHeaders`
+    bool _bodyChunked;
+    bool _bodyUntilClose;
+    bool _bodyDone;
+    bool _bodyFailed;
+    size_t _bodyRemaining;      /* Bytes left of the body, or of the current chunk */
+    int _peekedByte;
+
+    void writeRequestLine(const char *method, const char *host, uint16_t port, const char *path);
+    bool waitAvailable();
+    int readByte();
+    int readBodyByte();
+    bool readLine(char *line, size_t size);
+    bool readBody(HttpResponseBuffer &response, size_t length);
+    void store(HttpResponseBuffer &response, const uint8_t *data, size_t length);
+};
+
+#endif
@@ -0,0 +1,249 @@
+#define MQTT_LOG_TAG "MQTT"
+
+#include "MqttClient.h"
+#include <esp_log.h>
+#include <esp_idf_version.h>
+#include <esp_crt_bundle.h>
+#include <string.h>
+
+MqttClient::MqttClient()
+    : _client(nullptr), _connected(false), _message(nullptr), _messageLength(0), _messageDropped(false),
+      _trackedId(-1), _acknowledgedId(-1), _delivered(true) {
+    _topic[0] = '\0';
+    _messageTopic[0] = '\0';
+    _trackedMutex = xSemaphoreCreateMutex();
+    if (_trackedMutex == NULL) ESP_LOGE(MQTT_LOG_TAG, "Failed to create the tracked publish mutex.");
+}
+
+MqttClient::~MqttClient() {
+    if (_client != nullptr) {
+        esp_mqtt_client_stop(_client);
+        esp_mqtt_client_destroy(_client);
+    }
+    free(_message);
+}
+
+/**
+ * @brief Connect to the broker and subscribe to the topic, the client keeps reconnecting in the background.
+ *
+ * The broker certificate is checked against `MQTT_CA_CERT` if it is set, or else against the
+ * certificate bundle of ESP-IDF.
+ *
+ * @param uri The uri of the broker, it must be `mqtts://host:8883`
+ * @param username The login of the device on the broker
+ * @param password The password of the login
+ * @param clientId The client id, the broker keeps the session of the device under this id
+ * @param topic The topic to subscribe to
+ * @param onMessage Called from the MQTT task with every message received on the topic
+ * @return `true` if the client is started, `false` otherwise.
+ */
+bool MqttClient::start(const char *uri, const char *username, const char *password, const char *clientId, const char *topic, MqttMessageHandler onMessage) {
+    if (_client != nullptr) return true;
+
+    if (strncmp(uri, "mqtts://", strlen("mqtts://")) != 0) {
+        ESP_LOGE(MQTT_LOG_TAG, "Broker %s is not over TLS, the client is not started", uri);
+        return false;
+    }
+    if (username == nullptr || username[0] == '\0' || password == nullptr || password[0] == '\0') {
+        ESP_LOGE(MQTT_LOG_TAG, "No login for the broker, the client is not started");
+        return false;
+    }
+
+    if (strlen(topic) >= sizeof(_topic)) {
+        ESP_LOGE(MQTT_LOG_TAG, "Topic %s is too long", topic);
+        return false;
+    }
+    strcpy(_topic, topic);
+    _onMessage = onMessage;
+
+    _message = (char*)malloc(MQTT_MESSAGE_MAX_SIZE + 1);
+    if (_message == nullptr) {
+        ESP_LOGE(MQTT_LOG_TAG, "Failed to allocate the message buffer");
+        return false;
+    }
+
+    // The broker keeps the messages sent while the device is offline, as the clean session is disabled
+    esp_mqtt_client_config_t config = {};
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    config.broker.address.uri = uri;
+#ifdef MQTT_CA_CERT
+    config.broker.verification.certificate = MQTT_CA_CERT;
+#else
+    config.broker.verification.crt_bundle_attach = esp_crt_bundle_attach;
+#endif
+    config.credentials.client_id = clientId;
+    config.credentials.username = username;
+    config.credentials.authentication.password = password;
+    config.session.keepalive = MQTT_KEEPALIVE_S;
+    config.session.disable_clean_session = true;
+    config.network.reconnect_timeout_ms = MQTT_RECONNECT_MS;
+    config.task.stack_size = MQTT_TASK_STACK_SIZE;
+#else
+    config.uri = uri;
+#ifdef MQTT_CA_CERT
+    config.cert_pem = MQTT_CA_CERT;
+#else
+    config.crt_bundle_attach = esp_crt_bundle_attach;
+#endif
+    config.client_id = clientId;
+    config.username = username;
+    config.password = password;
+    config.keepalive = MQTT_KEEPALIVE_S;
+    config.disable_clean_session = true;
+    config.reconnect_timeout_ms = MQTT_RECONNECT_MS;
+    config.task_stack = MQTT_TASK_STACK_SIZE;
+#endif
+
+    _client = esp_mqtt_client_init(&config);
+    if (_client == nullptr) {
+        ESP_LOGE(MQTT_LOG_TAG, "Failed to create the MQTT client");
+        return false;
+    }
+
+    esp_mqtt_client_register_event(_client, MQTT_EVENT_ANY, handleEvent, this);
+    esp_err_t err = esp_mqtt_client_start(_client);
+    if (err != ESP_OK) {
+        ESP_LOGE(MQTT_LOG_TAG, "Failed to start the MQTT client: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    ESP_LOGI(MQTT_LOG_TAG, "MQTT client started, broker %s, topic %s", uri, topic);
+    return true;
+}
+
+/**
+ * @brief Check if the client is connected to the broker
+ *
+ * @return `true` if connected, `false` otherwise.
+ */
+bool MqttClient::isConnected() {
+    return _connected;
+}
+
+/**
+ * @brief Publish a message with QoS 1, the client sends it again until the broker acknowledges it
+ *
+ * @param topic The topic to publish to
+ * @param data The message
+ * @param length The length of the message
+ * @return The message id, or -1 if the message could not be published
+ */
+int MqttClient::publish(const char *topic, const char *data, size_t length) {
+    if (_client == nullptr || !_connected) return -1;
+    return esp_mqtt_client_publish(_client, topic, data, length, 1, 0);
+}
+
+/**
+ * @brief Publish a message with QoS 1 and be called back once the broker acknowledged it
+ *
+ * Only the latest tracked publish is followed, a new one replaces the previous one.
+ *
+ * @param topic The topic to publish to
+ * @param data The message
+ * @param length The length of the message
+ * @param onDelivered Called from the MQTT task once the broker acknowledged the message
+ * @return The message id, or -1 if the message could not be published
+ */
+int MqttClient::publishTracked(const char *topic, const char *data, size_t length, MqttDeliveredHandler onDelivered) {
+    // Stop following the previous publish, the MQTT task may be about to call its handler
+    if (xSemaphoreTake(_trackedMutex, portMAX_DELAY) != pdTRUE) return -1;
+    _trackedId = -1;
+    _onDelivered = onDelivered;
+    _delivered = false;
+    xSemaphoreGive(_trackedMutex);
+
+    int messageId = publish(topic, data, length);
+    if (messageId < 0) return messageId;
+
+    // The acknowledgement may already have been handled before the id was known
+    bool acknowledged = false;
+    if (xSemaphoreTake(_trackedMutex, portMAX_DELAY) == pdTRUE) {
+        _trackedId = messageId;
+        acknowledged = _acknowledgedId == messageId;
+        xSemaphoreGive(_trackedMutex);
+    }
+    if (acknowledged) handleAcknowledged(messageId);
+    return messageId;
+}
+
+/**
+ * @brief Call the handler of the tracked publish once, from whichever side sees its acknowledgement first.
+ *
+ * The handler is copied under the lock and called after it, so a new `publishTracked` can replace it meanwhile.
+ *
+ * @param messageId The message id of the tracked publish
+ */
+void MqttClient::handleAcknowledged(int messageId) {
+    MqttDeliveredHandler onDelivered;
+    if (xSemaphoreTake(_trackedMutex, portMAX_DELAY) != pdTRUE) return;
+    if (_trackedId == messageId && !_delivered) {
+        _delivered = true;
+        onDelivered = _onDelivered;
+    }
+    xSemaphoreGive(_trackedMutex);
+
+    if (onDelivered) onDelivered(messageId);
+}
+
+/**
+ * @brief Gather the data events of a message, and pass the whole message to the handler.
+ *
+ * @param event The data event
+ */
+void MqttClient::handleData(esp_mqtt_event_handle_t event) {
+    // Only the first data event of a message carries its topic
+    if (event->current_data_offset == 0) {
+        _messageLength = 0;
+        _messageDropped = event->total_data_len > MQTT_MESSAGE_MAX_SIZE || event->topic_len >= (int)sizeof(_messageTopic);
+        if (_messageDropped) {
+            ESP_LOGW(MQTT_LOG_TAG, "Dropping message of %d bytes, too long", event->total_data_len);
+            return;
+        }
+        memcpy(_messageTopic, event->topic, event->topic_len);
+        _messageTopic[event->topic_len] = '\0';
+    }
+    if (_messageDropped) return;
+
+    memcpy(_message + event->current_data_offset, event->data, event->data_len);
+    _messageLength = event->current_data_offset + event->data_len;
+    if (_messageLength < (size_t)event->total_data_len) return;
+
+    _message[_messageLength] = '\0';
+    _onMessage(_messageTopic, _message, _messageLength);
+}
+
+void MqttClient::handleEvent(void *handlerArgs, esp_event_base_t base, int32_t eventId, void *eventData) {
+    MqttClient *client = (MqttClient*)handlerArgs;
+    esp_mqtt_event_handle_t event = (esp_mqtt_event_handle_t)eventData;
+
+    switch ((esp_mqtt_event_id_t)eventId) {
+        case MQTT_EVENT_CONNECTED:
+            ESP_LOGI(MQTT_LOG_TAG, "Connected to the broker, session present %d", event->session_present);
+            client->_connected = true;
+            // A kept session still has the subscription, subscribing again is harmless
+            esp_mqtt_client_subscribe(client->_client, client->_topic, 1);
+            break;
+        case MQTT_EVENT_DISCONNECTED:
+            ESP_LOGW(MQTT_LOG_TAG, "Disconnected from the broker");
+            client->_connected = false;
+            break;
+        case MQTT_EVENT_SUBSCRIBED:
+            ESP_LOGI(MQTT_LOG_TAG, "Subscribed to %s", client->_topic);
+            break;
+        case MQTT_EVENT_PUBLISHED:
+            if (xSemaphoreTake(client->_trackedMutex, portMAX_DELAY) == pdTRUE) {
+                client->_acknowledgedId = event->msg_id;
+                xSemaphoreGive(client->_trackedMutex);
+            }
+            client->handleAcknowledged(event->msg_id);
+            break;
+        case MQTT_EVENT_DATA:
+            client->handleData(event);
+            break;
+        case MQTT_EVENT_ERROR:
+            ESP_LOGE(MQTT_LOG_TAG, "MQTT error, type %d", event->error_handle->error_type);
+            break;
+        default:
+            break;
+    }
+}
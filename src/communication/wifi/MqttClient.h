@@ -0,0 +1,66 @@
+#ifndef MQTT_CLIENT_H
+#define MQTT_CLIENT_H
+
+#include <mqtt_client.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <atomic>
+#include <functional>
+
+#define MQTT_KEEPALIVE_S            30          // Keep-alive of the connection, a dead broker is noticed after 1.5x this
+#define MQTT_RECONNECT_MS           5000        // Delay between reconnect attempts to the broker
+#define MQTT_TASK_STACK_SIZE        8192        // The received messages are handled on the MQTT task, e.g. written to the SD Card
+#define MQTT_MESSAGE_MAX_SIZE       1024        // Longest message kept, longer messages are dropped
+#define MQTT_MAX_TOPIC_LENGTH       64
+
+/// @brief Handles a whole received message, only valid during the call
+typedef std::function<void(const char *topic, const char *data, size_t length)> MqttMessageHandler;
+
+/// @brief Called once the broker acknowledged a tracked publish
+typedef std::function<void(int messageId)> MqttDeliveredHandler;
+
+/**
+ * @brief Persistent MQTT connection to the broker on top of the ESP-IDF MQTT client
+ *
+ * The connection runs on its own task and reconnects by itself. The session is kept on the broker
+ * and the topic is subscribed with QoS 1, so the messages published while the device was offline
+ * are delivered once it is back. Only a broker over TLS that takes a login is used, as its messages
+ * change the key access.
+ */
+class MqttClient {
+public:
+    MqttClient();
+    ~MqttClient();
+
+    bool start(const char *uri, const char *username, const char *password, const char *clientId, const char *topic, MqttMessageHandler onMessage);
+    bool isConnected();
+    int publish(const char *topic, const char *data, size_t length);
+    int publishTracked(const char *topic, const char *data, size_t length, MqttDeliveredHandler onDelivered);
+
+private:
+    esp_mqtt_client_handle_t _client;
+    std::atomic<bool> _connected;
+    char _topic[MQTT_MAX_TOPIC_LENGTH];
+    MqttMessageHandler _onMessage;
+
+    // The message being received, a long message arrives in several data events
+    char _messageTopic[MQTT_MAX_TOPIC_LENGTH];
+    char *_message;
+    size_t _messageLength;
+    bool _messageDropped;
+
+    // The tracked publish, its acknowledgement may arrive before `publishTracked` knows its message id
+    // Set by the publishing task and read by the MQTT task, only under `_trackedMutex`
+    SemaphoreHandle_t _trackedMutex;
+    MqttDeliveredHandler _onDelivered;
+    int _trackedId;
+    int _acknowledgedId;
+    bool _delivered;
+
+    void handleData(esp_mqtt_event_handle_t event);
+    void handleAcknowledged(int messageId);
+    static void handleEvent(void *handlerArgs, esp_event_base_t base, int32_t eventId, void *eventData);
+};
+
+#endif
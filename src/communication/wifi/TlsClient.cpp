@@ -0,0 +1,429 @@
+#define TLS_CLIENT_LOG_TAG "TLS_CLIENT"
+
+#include "TlsClient.h"
+#include "config/Config.h"
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_idf_version.h>
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#include <esp_random.h>
+#endif
+#include <esp_timer.h>
+#include <esp_crt_bundle.h>
+#include <mbedtls/net_sockets.h>
+#include <nvs.h>
+
+mbedtls_ssl_config TlsClient::_config;
+mbedtls_x509_crt TlsClient::_caCertificate;
+bool TlsClient::_configReady = false;
+SemaphoreHandle_t TlsClient::_sessionMutex = xSemaphoreCreateMutex();
+TlsSession TlsClient::_sessions[TLS_SESSION_CACHE_SIZE];
+uint8_t TlsClient::_sessionScratch[TLS_SESSION_MAX_SIZE];
+
+TlsClient::TlsClient() : _secure(false), _sslReady(false), _closed(false), _peekedByte(-1) {
+    mbedtls_ssl_init(&_ssl);
+}
+
+TlsClient::~TlsClient() {
+    stop();
+}
+
+/**
+ * @brief Set if the next connection is encrypted with TLS, the open connection is not changed
+ *
+ * @param secure `true` for TLS, `false` for a plain TCP connection
+ */
+void TlsClient::setSecure(bool secure) {
+    _secure = secure;
+}
+
+bool TlsClient::isSecure() {
+    return _secure;
+}
+
+int TlsClient::connect(IPAddress ip, uint16_t port) {
+    return connect(ip.toString().c_str(), port);
+}
+
+int TlsClient::connect(const char *host, uint16_t port) {
+    return connect(host, port, 5000);
+}
+
+/**
+ * @brief Open the TCP connection, and do the TLS handshake if the client is secure.
+ *
+ * @param host The host of the server, also checked against the server certificate
+ * @param port The port of the server
+ * @param timeoutMs The time the connection and the handshake may take
+ * @return 1 if connected, 0 otherwise
+ */
+int TlsClient::connect(const char *host, uint16_t port, int32_t timeoutMs) {
+    stop();
+
+    TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(timeoutMs);
+    if (!_socket.connect(host, port, timeoutMs)) return 0;
+    if (!_secure) return 1;
+
+    if (!handshake(host, port, deadline)) {
+        stop();
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Do the TLS handshake over the open socket, resuming the last session of the host if there is one.
+ *
+ * @param host The host of the server
+ * @param port The port of the server
+ * @param deadline The tick the handshake has to be done by
+ * @return `true` if the TLS connection is established, `false` otherwise.
+ */
+bool TlsClient::handshake(const char *host, uint16_t port, TickType_t deadline) {
+    if (!setupConfig()) return false;
+
+    int ret = mbedtls_ssl_setup(&_ssl, &_config);
+    if (ret == 0) ret = mbedtls_ssl_set_hostname(&_ssl, host);
+    if (ret != 0) {
+        ESP_LOGE(TLS_CLIENT_LOG_TAG, "Failed to set up the TLS connection: -0x%04x", -ret);
+        return false;
+    }
+    _sslReady = true;
+
+    mbedtls_ssl_set_bio(&_ssl, &_socket, sendCallback, receiveCallback, nullptr);
+    loadSession(host, port, &_ssl);
+
+    int64_t started = esp_timer_get_time();
+    while ((ret = mbedtls_ssl_handshake(&_ssl)) != 0) {
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+            ESP_LOGE(TLS_CLIENT_LOG_TAG, "TLS handshake with %s:%d failed: -0x%04x", host, port, -ret);
+            return false;
+        }
+        if ((int32_t)(xTaskGetTickCount() - deadline) >= 0) {
+            ESP_LOGE(TLS_CLIENT_LOG_TAG, "TLS handshake with %s:%d timed out", host, port);
+            return false;
+        }
+        vTaskDelay(1);
+    }
+
+    ESP_LOGI(TLS_CLIENT_LOG_TAG, "TLS handshake with %s:%d in %lu ms, %s", host, port,
+        (unsigned long)((esp_timer_get_time() - started) / 1000), mbedtls_ssl_get_ciphersuite(&_ssl));
+
+    storeSession(host, port, &_ssl);
+    return true;
+}
+
+size_t TlsClient::write(uint8_t byte) {
+    return write(&byte, 1);
+}
+
+size_t TlsClient::write(const uint8_t *buffer, size_t size) {
+    if (!_secure) return _socket.write(buffer, size);
+    if (!_sslReady || _closed) return 0;
+
+    size_t written = 0;
+    while (written < size) {
+        int ret = mbedtls_ssl_write(&_ssl, buffer + written, size - written);
+        if (ret > 0) {
+            written += ret;
+        } else if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            if (!_socket.connected()) break;
+            vTaskDelay(1);
+        } else {
+            ESP_LOGW(TLS_CLIENT_LOG_TAG, "TLS write failed: -0x%04x", -ret);
+            _closed = true;
+            break;
+        }
+    }
+    return written;
+}
+
+/**
+ * @brief Get the decrypted bytes that can be read without waiting.
+ *
+ * A TLS record is only decrypted as a whole, so when the socket has data but no record is decrypted yet,
+ * one byte is read to decrypt the next record.
+ *
+ * @return The number of bytes that can be read
+ */
+int TlsClient::available() {
+    if (!_secure) return _socket.available();
+    if (!_sslReady) return 0;
+
+    int pending = mbedtls_ssl_get_bytes_avail(&_ssl);
+    if (_peekedByte >= 0) return pending + 1;
+    if (pending > 0) return pending;
+    if (_closed || _socket.available() <= 0) return 0;
+
+    uint8_t byte;
+    int ret = mbedtls_ssl_read(&_ssl, &byte, 1);
+    if (ret == 1) {
+        _peekedByte = byte;
+        return mbedtls_ssl_get_bytes_avail(&_ssl) + 1;
+    }
+    if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE) {
+        // Also the end of a connection the server closed with a close notify
+        if (ret != 0 && ret != MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) ESP_LOGW(TLS_CLIENT_LOG_TAG, "TLS read failed: -0x%04x", -ret);
+        _closed = true;
+    }
+    return 0;
+}
+
+int TlsClient::read() {
+    uint8_t byte;
+    return read(&byte, 1) == 1 ? byte : -1;
+}
+
+int TlsClient::read(uint8_t *buffer, size_t size) {
+    if (!_secure) return _socket.read(buffer, size);
+    if (size == 0 || available() <= 0) return -1;
+
+    size_t length = 0;
+    if (_peekedByte >= 0) {
+        buffer[length++] = _peekedByte;
+        _peekedByte = -1;
+    }
+
+    // Only take what is already decrypted, so the read never waits on the socket
+    size_t pending = mbedtls_ssl_get_bytes_avail(&_ssl);
+    if (pending > size - length) pending = size - length;
+    if (pending > 0) {
+        int ret = mbedtls_ssl_read(&_ssl, buffer + length, pending);
+        if (ret > 0) length += ret;
+    }
+    return length;
+}
+
+int TlsClient::peek() {
+    if (!_secure) return _socket.peek();
+    if (available() <= 0) return -1;
+
+    if (_peekedByte < 0) {
+        uint8_t byte;
+        if (mbedtls_ssl_read(&_ssl, &byte, 1) != 1) return -1;
+        _peekedByte = byte;
+    }
+    return _peekedByte;
+}
+
+void TlsClient::flush() {
+    _socket.flush();
+}
+
+/**
+ * @brief Close the connection, a TLS connection is closed with a close notify so its session stays resumable.
+ *
+ */
+void TlsClient::stop() {
+    if (_sslReady) {
+        if (!_closed && _socket.connected()) mbedtls_ssl_close_notify(&_ssl);
+        close();
+    }
+    _socket.stop();
+    _closed = false;
+    _peekedByte = -1;
+}
+
+uint8_t TlsClient::connected() {
+    if (!_secure) return _socket.connected();
+    if (!_sslReady) return false;
+    return available() > 0 || (!_closed && _socket.connected());
+}
+
+TlsClient::operator bool() {
+    return connected();
+}
+
+/**
+ * @brief Free the TLS connection, its buffers are only allocated while it is open.
+ *
+ */
+void TlsClient::close() {
+    mbedtls_ssl_free(&_ssl);
+    mbedtls_ssl_init(&_ssl);
+    _sslReady = false;
+}
+
+/**
+ * @brief Set up the TLS configuration shared by every connection, once.
+ *
+ * The server certificate is checked against `BACKEND_CA_CERT` if it is set, or else against the
+ * certificate bundle of ESP-IDF.
+ *
+ * @return `true` if the configuration is ready, `false` otherwise.
+ */
+bool TlsClient::setupConfig() {
+    if (xSemaphoreTake(_sessionMutex, portMAX_DELAY) != pdTRUE) return false;
+    if (_configReady) {
+        xSemaphoreGive(_sessionMutex);
+        return true;
+    }
+
+    mbedtls_ssl_config_init(&_config);
+    mbedtls_x509_crt_init(&_caCertificate);
+
+    int ret = mbedtls_ssl_config_defaults(&_config, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    if (ret == 0) {
+        mbedtls_ssl_conf_authmode(&_config, MBEDTLS_SSL_VERIFY_REQUIRED);
+        mbedtls_ssl_conf_rng(&_config, randomCallback, nullptr);
+        mbedtls_ssl_conf_session_tickets(&_config, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#ifdef BACKEND_CA_CERT
+        ret = mbedtls_x509_crt_parse(&_caCertificate, (const unsigned char*)BACKEND_CA_CERT, sizeof(BACKEND_CA_CERT));
+        if (ret == 0) mbedtls_ssl_conf_ca_chain(&_config, &_caCertificate, nullptr);
+#else
+        ret = esp_crt_bundle_attach(&_config);
+#endif
+    }
+
+    if (ret != 0) {
+        ESP_LOGE(TLS_CLIENT_LOG_TAG, "Failed to set up the TLS configuration: -0x%04x", -ret);
+        mbedtls_ssl_config_free(&_config);
+        mbedtls_x509_crt_free(&_caCertificate);
+    }
+    _configReady = ret == 0;
+
+    xSemaphoreGive(_sessionMutex);
+    return _configReady;
+}
+
+/**
+ * @brief Set the last session of the host to the connection, so the handshake resumes it.
+ *
+ * @param host The host of the server
+ * @param port The port of the server
+ * @param ssl The connection before its handshake
+ */
+void TlsClient::loadSession(const char *host, uint16_t port, mbedtls_ssl_context *ssl) {
+    if (xSemaphoreTake(_sessionMutex, portMAX_DELAY) != pdTRUE) return;
+
+    TlsSession *session = findSession(host, port, false);
+    if (session != nullptr && session->length > 0) {
+        mbedtls_ssl_session saved;
+        mbedtls_ssl_session_init(&saved);
+
+        int ret = mbedtls_ssl_session_load(&saved, session->data, session->length);
+        if (ret == 0) ret = mbedtls_ssl_set_session(ssl, &saved);
+        if (ret != 0) {
+            ESP_LOGW(TLS_CLIENT_LOG_TAG, "Saved TLS session of %s:%d is not usable: -0x%04x", host, port, -ret);
+            session->length = 0;
+        }
+        session->lastUsed = xTaskGetTickCount();
+        mbedtls_ssl_session_free(&saved);
+    }
+
+    xSemaphoreGive(_sessionMutex);
+}
+
+/**
+ * @brief Keep the session of a finished handshake, it is only written to NVS when it changed.
+ *
+ * @param host The host of the server
+ * @param port The port of the server
+ * @param ssl The connection after its handshake
+ */
+void TlsClient::storeSession(const char *host, uint16_t port, mbedtls_ssl_context *ssl) {
+    if (xSemaphoreTake(_sessionMutex, portMAX_DELAY) != pdTRUE) return;
+
+    mbedtls_ssl_session current;
+    mbedtls_ssl_session_init(&current);
+
+    size_t length = 0;
+    int ret = mbedtls_ssl_get_session(ssl, &current);
+    if (ret == 0) ret = mbedtls_ssl_session_save(&current, _sessionScratch, sizeof(_sessionScratch), &length);
+    mbedtls_ssl_session_free(&current);
+
+    TlsSession *session = ret == 0 ? findSession(host, port, true) : nullptr;
+    if (ret != 0) {
+        ESP_LOGW(TLS_CLIENT_LOG_TAG, "Failed to save the TLS session of %s:%d: -0x%04x", host, port, -ret);
+    } else if (session != nullptr && (session->length != length || memcmp(session->data, _sessionScratch, length) != 0)) {
+        memcpy(session->data, _sessionScratch, length);
+        session->length = length;
+
+        char key[16];
+        nvs_handle_t handle;
+        sessionKey(host, port, key, sizeof(key));
+        if (nvs_open(TLS_SESSION_NVS_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK) {
+            if (nvs_set_blob(handle, key, session->data, length) == ESP_OK) nvs_commit(handle);
+            nvs_close(handle);
+        }
+        ESP_LOGD(TLS_CLIENT_LOG_TAG, "Stored new TLS session of %s:%d, %d bytes", host, port, length);
+    }
+
+    xSemaphoreGive(_sessionMutex);
+}
+
+/**
+ * @brief Find the session slot of a host, loading its session from NVS into the least recently used slot if needed.
+ *
+ * @param host The host of the server
+ * @param port The port of the server
+ * @param create `true` to take a slot for the host even if it has no saved session
+ * @return The slot, or nullptr if the host has no session and `create` is `false`
+ */
+TlsSession *TlsClient::findSession(const char *host, uint16_t port, bool create) {
+    TlsSession *selected = nullptr;
+    for (TlsSession &session : _sessions) {
+        if (session.port == port && strcmp(session.host, host) == 0) return &session;
+        if (selected == nullptr || session.host[0] == '\0'
+            || (selected->host[0] != '\0' && (int32_t)(session.lastUsed - selected->lastUsed) < 0)) {
+            selected = &session;
+        }
+    }
+    if (strlen(host) >= sizeof(selected->host)) return nullptr;
+
+    char key[16];
+    size_t length = sizeof(selected->data);
+    nvs_handle_t handle;
+    sessionKey(host, port, key, sizeof(key));
+
+    bool loaded = false;
+    if (nvs_open(TLS_SESSION_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        loaded = nvs_get_blob(handle, key, selected->data, &length) == ESP_OK;
+        nvs_close(handle);
+    }
+    if (!loaded && !create) return nullptr;
+
+    strcpy(selected->host, host);
+    selected->port = port;
+    selected->length = loaded ? length : 0;
+    selected->lastUsed = xTaskGetTickCount();
+    return selected;
+}
+
+/**
+ * @brief Get the NVS key of the session of a host, NVS keys are too short for the host itself.
+ *
+ * @param host The host of the server
+ * @param port The port of the server
+ * @param key The buffer for the key
+ * @param size The size of the buffer, at least 10 bytes
+ */
+void TlsClient::sessionKey(const char *host, uint16_t port, char *key, size_t size) {
+    // FNV-1a hash of the host and port
+    uint32_t hash = 2166136261u;
+    for (const char *c = host; *c != '\0'; c++) hash = (hash ^ (uint8_t)*c) * 16777619u;
+    hash = (hash ^ (port & 0xFF)) * 16777619u;
+    hash = (hash ^ (port >> 8)) * 16777619u;
+    snprintf(key, size, "s%08lx", (unsigned long)hash);
+}
+
+int TlsClient::sendCallback(void *context, const unsigned char *buffer, size_t length) {
+    WiFiClient *socket = (WiFiClient*)context;
+    if (!socket->connected()) return MBEDTLS_ERR_NET_CONN_RESET;
+
+    size_t written = socket->write(buffer, length);
+    return written > 0 ? (int)written : MBEDTLS_ERR_SSL_WANT_WRITE;
+}
+
+int TlsClient::receiveCallback(void *context, unsigned char *buffer, size_t length) {
+    WiFiClient *socket = (WiFiClient*)context;
+    if (socket->available() <= 0) return socket->connected() ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_CONN_RESET;
+
+    int read = socket->read(buffer, length);
+    return read > 0 ? read : MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+int TlsClient::randomCallback(void *context, unsigned char *output, size_t length) {
+    esp_fill_random(output, length);
+    return 0;
+}
@@ -0,0 +1,82 @@
+#ifndef TLS_CLIENT_H
+#define TLS_CLIENT_H
+
+#include <WiFiClient.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/x509_crt.h>
+
+#define TLS_SESSION_CACHE_SIZE      2           // Hosts whose TLS session is kept, same as the connections of the pool
+#define TLS_SESSION_MAX_SIZE        2048        // Largest serialized session kept, it holds the ticket and the server certificate
+#define TLS_SESSION_MAX_HOST_LENGTH 64
+#define TLS_SESSION_NVS_NAMESPACE   "tls"       // NVS namespace of the sessions, so they are resumed after a reboot
+
+/// @brief A serialized TLS session of a host, resumed with a short handshake on the next connection
+struct TlsSession {
+    char host[TLS_SESSION_MAX_HOST_LENGTH];     /* Host of the session, empty if the slot is free                  */
+    uint16_t port;
+    uint8_t data[TLS_SESSION_MAX_SIZE];         /* The session as written by `mbedtls_ssl_session_save`           */
+    size_t length;
+    TickType_t lastUsed;
+};
+
+/**
+ * @brief Client of a TCP connection that is encrypted with TLS when it is secure
+ *
+ * Every secure connection tries to resume the last TLS session of its host, with the session ticket
+ * or the session id, which skips the certificate exchange and the key agreement of a full handshake.
+ * The sessions are kept in RAM and in NVS, so they also survive a reboot. A plain connection is
+ * passed through to the socket as it is.
+ */
+class TlsClient : public Client {
+public:
+    TlsClient();
+    ~TlsClient();
+
+    void setSecure(bool secure);
+    bool isSecure();
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char *host, uint16_t port) override;
+    int connect(const char *host, uint16_t port, int32_t timeoutMs);
+    size_t write(uint8_t byte) override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t *buffer, size_t size) override;
+    int peek() override;
+    void flush() override;
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override;
+
+private:
+    WiFiClient _socket;
+    mbedtls_ssl_context _ssl;
+    bool _secure;
+    bool _sslReady;             /* `_ssl` holds an established TLS connection                       */
+    bool _closed;               /* The server closed the TLS connection or it failed                */
+    int _peekedByte;            /* A byte decrypted by `available` to find out if there is data     */
+
+    bool handshake(const char *host, uint16_t port, TickType_t deadline);
+    void close();
+
+    static bool setupConfig();
+    static void loadSession(const char *host, uint16_t port, mbedtls_ssl_context *ssl);
+    static void storeSession(const char *host, uint16_t port, mbedtls_ssl_context *ssl);
+    static TlsSession *findSession(const char *host, uint16_t port, bool create);
+    static void sessionKey(const char *host, uint16_t port, char *key, size_t size);
+    static int sendCallback(void *context, const unsigned char *buffer, size_t length);
+    static int receiveCallback(void *context, unsigned char *buffer, size_t length);
+    static int randomCallback(void *context, unsigned char *output, size_t length);
+
+    static mbedtls_ssl_config _config;
+    static mbedtls_x509_crt _caCertificate;
+    static bool _configReady;
+    static SemaphoreHandle_t _sessionMutex;
+    static TlsSession _sessions[TLS_SESSION_CACHE_SIZE];
+    static uint8_t _sessionScratch[TLS_SESSION_MAX_SIZE];
+};
+
+#endif
@@ -1,34 +1,47 @@
 #include "Wifi.h"
 #include <esp_log.h>
-#include <HTTPClient.h>
-#include <WiFiClient.h> // Declare a WiFiClient object for non-secure communication
+#include <esp_random.h>
 
-WiFiClient client;
-HTTPClient http;
 #define WIFI_LOG_TAG "WIFI"
 
 Wifi::Wifi(const char* ssid, QueueHandle_t statusQueue)
-    : _apName(ssid), _wifiStatusQueue(statusQueue) {}
+    : _apName(ssid), _wifiStatusQueue(statusQueue), _state(NOT_INITIALIZED), _linkLost(false), _portalRequested(false),
+      _watcher(nullptr), _backoffMs(0), _attemptStarted(0), _nextAttempt(0) {}
 
-/// @brief Initialize the WiFi connection where using WiFi Manager to manage the lifectcle of the WiFi
+/**
+ * @brief Initialize the WiFi connection where using WiFi Manager to manage the lifectcle of the WiFi
+ *
+ * With saved credentials the connection is only started here and completes in the background,
+ * see `maintainConnection`. The config portal is only opened on the first boot when there are
+ * no saved credentials yet, afterwards only through `requestConfigPortal`.
+ */
 void Wifi::init() {
     ESP_LOGI(WIFI_LOG_TAG, "Initializing WiFi Manager Server and Service...");
     WiFi.mode(WIFI_STA);
+
+    // The reconnect is done with backoff from `maintainConnection` instead of the driver
+    WiFi.setAutoReconnect(false);
+    WiFi.onEvent([this](arduino_event_id_t event, arduino_event_info_t info) { handleEvent(event, info); });
     
     // Configurations for the WiFi Manager
     _wifiManager.setConnectTimeout(20);
-    _wifiManager.setConfigPortalTimeout(60);
-
-    _wifiManager.autoConnect(_apName);
+    _wifiManager.setConfigPortalTimeout(WIFI_PORTAL_TIMEOUT_S);
+    _state = INITIALIZED;
 
-    bool connected = isConnected();
-    if (connected) {
-        ESP_LOGI(WIFI_LOG_TAG, "ESP has been successfully connected to Wifi/Internet: %s", WiFi.SSID().c_str());
-        // WiFi.begin();  // Save the credential so automatically will connect to last credential that has been connected
+    if (_wifiManager.getWiFiIsSaved()) {
+        ESP_LOGI(WIFI_LOG_TAG, "Connecting to the saved WiFi in the background...");
+        _state = CONNECTING;
+        _attemptStarted = xTaskGetTickCount();
+        WiFi.begin();
     } else {
-        // Failed to connect or user didn't provide credentials
-        ESP_LOGE(WIFI_LOG_TAG, "Failed to connect to WiFi or config portal timed out.");
+        // Nothing to connect to yet, the portal is the only way to get the credentials
+        ESP_LOGW(WIFI_LOG_TAG, "No saved WiFi credentials, launching WiFiManager configuration portal...");
+        openConfigPortal();
     }
+
+    // Keep the system clock in UTC synced with SNTP, so the access timestamps are meaningful
+    // The SNTP client will keep retrying on the background until the WiFi is connected
+    configTime(0, 0, NTP_SERVER_PRIMARY, NTP_SERVER_SECONDARY);
     vTaskDelay(100 / portTICK_PERIOD_MS); // Give enough time so task watchdog can process this 
 }
 
@@ -44,43 +57,164 @@ bool Wifi::isConnected() {
 }
 
 /**
- * @brief Attempts to reconnect to WiFi if not already connected.
+ * @brief Set the function called on every WiFi event, it wakes up the job that runs `maintainConnection`.
+ *
+ * @param watcher Called from the WiFi event task, must not block
+ */
+void Wifi::watchConnection(std::function<void()> watcher) {
+    _watcher = watcher;
+}
+
+/**
+ * @brief Run one step of the background reconnect, should be called again after the returned delay
+ * or as soon as the watcher is called.
  *
- * Logs a warning if WiFi is not connected, then triggers auto-connect.
- * Sends the new connection status to the status queue.
+ * The saved credentials are always kept. After the link is lost the first attempt starts right away,
+ * then the delay doubles from `WIFI_RECONNECT_MIN_MS` up to `WIFI_RECONNECT_MAX_MS` with a random jitter
+ * of up to half the delay, so many locks do not hit the access point at the same time after an outage.
  *
- * @return true if reconnection was attempted, false if already connected.
+ * @param linkLost Set to `true` if the link was lost since the last call, the kept connections are already closed
+ * @return The time in ms until the next step, 0 if there is nothing to do until the next WiFi event
  */
-bool Wifi::reconnect() {
-    if (!isConnected()){
-        ESP_LOGW(WIFI_LOG_TAG, "WiFi not connected. Attempting to reconnect...");
+uint32_t Wifi::maintainConnection(bool &linkLost) {
+    linkLost = _linkLost.exchange(false);
+    if (linkLost) {
+        ESP_LOGW(WIFI_LOG_TAG, "WiFi link lost, reconnecting in the background");
+        // The kept connections belong to the previous network session
+        _connectionPool.closeAll();
+    }
 
-        // Reset settings as there's no use for trying to reconnect to last credentials
-        ESP_LOGI(WIFI_LOG_TAG, "Clearing saved credentials to force new configuration.");
-        _wifiManager.resetSettings();
-    
-        ESP_LOGI(WIFI_LOG_TAG, "Launching WiFiManager configuration portal...");
-        _wifiManager.autoConnect(_apName);
+    if (_portalRequested.exchange(false)) openConfigPortal();
+
+    if (WiFi.status() == WL_CONNECTED) {
+        if (_backoffMs > 0) ESP_LOGI(WIFI_LOG_TAG, "Reconnected to %s", WiFi.SSID().c_str());
+        _backoffMs = 0;
+        return 0;
+    }
+
+    if (!_wifiManager.getWiFiIsSaved()) {
+        _state = WAITING_FOR_CREDENTIALS;
+        return 0;
+    }
+
+    TickType_t now = xTaskGetTickCount();
+
+    // Give the attempt in progress its time instead of restarting it
+    WifiState state = _state;
+    if (state == CONNECTING || state == WAITING_FOR_IP) {
+        int32_t remaining = (int32_t)(_attemptStarted + pdMS_TO_TICKS(WIFI_CONNECT_TIMEOUT_MS) - now);
+        if (remaining > 0) return remaining * portTICK_PERIOD_MS;
+    }
+
+    int32_t untilNext = (int32_t)(_nextAttempt - now);
+    if (_backoffMs > 0 && untilNext > 0) return untilNext * portTICK_PERIOD_MS;
 
-        bool connected = isConnected();
-        ESP_LOGI(WIFI_LOG_TAG, "Reconnection result: %s", connected ? "SUCCESS" : "FAILED");
-        return true;
+    _backoffMs = _backoffMs == 0 ? WIFI_RECONNECT_MIN_MS : _backoffMs * 2;
+    if (_backoffMs > WIFI_RECONNECT_MAX_MS) _backoffMs = WIFI_RECONNECT_MAX_MS;
+    uint32_t delayMs = _backoffMs / 2 + esp_random() % (_backoffMs / 2 + 1);
+
+    ESP_LOGI(WIFI_LOG_TAG, "Reconnecting to the saved WiFi, next attempt in %lu ms", (unsigned long)delayMs);
+    _state = CONNECTING;
+    _attemptStarted = now;
+    _nextAttempt = now + pdMS_TO_TICKS(delayMs);
+    WiFi.begin();
+
+    return delayMs;
+}
+
+/**
+ * @brief Ask for the config portal to change the WiFi, it is opened from the watcher task.
+ *
+ * The saved credentials are kept until new ones are entered in the portal.
+ */
+void Wifi::requestConfigPortal() {
+    ESP_LOGI(WIFI_LOG_TAG, "WiFi config portal requested");
+    _portalRequested = true;
+    notifyWatcher();
+}
+
+/**
+ * @brief Gets the state of the background connection.
+ *
+ * @return The current `WifiState`
+ */
+WifiState Wifi::getConnectionState() {
+    return _state;
+}
+
+/**
+ * @brief Handler of the WiFi events, runs on the WiFi event task so it only records the state.
+ *
+ * @param event The id of the event
+ * @param info The data of the event
+ */
+void Wifi::handleEvent(arduino_event_id_t event, arduino_event_info_t info) {
+    switch (event) {
+        case ARDUINO_EVENT_WIFI_STA_CONNECTED:
+            ESP_LOGI(WIFI_LOG_TAG, "Associated with the access point, waiting for IP");
+            _state = WAITING_FOR_IP;
+            break;
+
+        case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+            ESP_LOGI(WIFI_LOG_TAG, "ESP has been successfully connected to Wifi/Internet: %s", WiFi.SSID().c_str());
+            _state = CONNECTED;
+            updateStatus(true);
+            notifyWatcher();
+            break;
+
+        case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+        case ARDUINO_EVENT_WIFI_STA_LOST_IP:
+            if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED) {
+                ESP_LOGW(WIFI_LOG_TAG, "WiFi disconnected, reason: %d", info.wifi_sta_disconnected.reason);
+            }
+            if (_state.exchange(DISCONNECTED) == CONNECTED) {
+                _linkLost = true;
+                updateStatus(false);
+            }
+            notifyWatcher();
+            break;
+
+        default:
+            break;
     }
-    ESP_LOGI(WIFI_LOG_TAG, "Already connected. No reconnection needed.");
-    return false;
+}
+
+void Wifi::notifyWatcher() {
+    if (_watcher) _watcher();
+}
+
+/**
+ * @brief Open the WiFiManager config portal, blocks until it is done or `WIFI_PORTAL_TIMEOUT_S` has passed.
+ *
+ */
+void Wifi::openConfigPortal() {
+    _state = WAITING_FOR_CREDENTIALS;
+    _connectionPool.closeAll();
+
+    bool connected = _wifiManager.startConfigPortal(_apName);
+    ESP_LOGI(WIFI_LOG_TAG, "Config portal result: %s", connected ? "CONNECTED" : "TIMEOUT");
+
+    // Start over with the new or the kept credentials
+    _state = connected ? CONNECTED : DISCONNECTED;
+    _backoffMs = 0;
 }
 
 /**
  * @brief Sends the WiFi connection status to the FreeRTOS queue.
  *
+ * Never blocks, as it is called from the WiFi event handler.
+ *
  * @param status Current connection status (true if connected).
  */
 void Wifi::updateStatus(bool status){
     if (_wifiStatusQueue != NULL) {
-        xQueueSendToBack(_wifiStatusQueue, &status, portMAX_DELAY);
-        ESP_LOGD(WIFI_LOG_TAG, "Updated WiFi status queue with value: %s", status ? "true" : "false");
+        if (xQueueSendToBack(_wifiStatusQueue, &status, 0) == pdTRUE) {
+            ESP_LOGD(WIFI_LOG_TAG, "Updated WiFi status queue with value: %s", status ? "true" : "false");
+        } else {
+            ESP_LOGW(WIFI_LOG_TAG, "WiFi status queue is full. Dropping status update.");
+        }
     } else {
-        ESP_LOGW(WIFI_LOG_TAG, "WiFi status queue is NULL. Cannot update status.");
+        ESP_LOGD(WIFI_LOG_TAG, "WiFi status queue is NULL. Cannot update status.");
     }
 }
 
@@ -120,84 +254,191 @@ wl_status_t Wifi::get_state(){
 }
 
 /**
- * @brief Sending post request to API
+ * @brief Set the function called when a connection is kept open after a request
  *
- * @param url The pointer location of the url string of the api
- * @param payload The pointer location of the payload string in form of json application 
- * @return response of the api
+ * @param watcher Wakes up the job running `closeIdleConnections`
  */
-std::string Wifi::sendPostRequest(const std::string &url, const std::string &payload){
-    ESP_LOGI(WIFI_LOG_TAG, "Sending POST request to URL: %s", url.c_str());
-    ESP_LOGD(WIFI_LOG_TAG, "Payload: %s", payload.c_str());
+void Wifi::watchIdleConnections(std::function<void()> watcher){
+    _connectionPool.watchRelease(watcher);
+}
 
-    http.begin(client, url.c_str());
-    http.addHeader("Content-Type", "application/json");
-    int httpResponseCode = http.POST(payload.c_str());
+/**
+ * @brief Close the kept connections that have been idle for too long
+ *
+ * @return The time in ms until the next kept connection is idle for too long, 0 if none is kept open
+ */
+uint32_t Wifi::closeIdleConnections(){
+    return _connectionPool.closeIdle();
+}
 
-    std::string response;
-    response = http.getString().c_str();
+/**
+ * @brief Send a request over a keep-alive connection from the pool
+ *
+ * The json payload is serialized straight to the socket and the response body is read straight
+ * into the caller buffer, see `HttpStream`.
+ *
+ * @param method The HTTP method of the request
+ * @param url The url of the api
+ * @param payload The json payload, null for no body
+ * @param response The buffer to store the response body of the api
+ * @param timeoutMs The total time the request may take, including the retry
+ * @return HTTP status code of the response, or a negative `HTTPClient` error code if the request failed
+ */
+int Wifi::sendRequest(const char *method, const char *url, JsonVariantConst payload, HttpResponseBuffer &response, uint32_t timeoutMs){
+    response.length = 0;
+    response.bodyLength = 0;
+    response.truncated = false;
+    if (response.capacity > 0) response.data[0] = '\0';
 
-    if (httpResponseCode > 0) ESP_LOGI(WIFI_LOG_TAG, "HTTP Response: %d, %s", httpResponseCode, response.c_str());
-    else ESP_LOGE(WIFI_LOG_TAG, "Error on sending POST request: %s", http.errorToString(httpResponseCode).c_str());
+    int httpResponseCode = exchange(method, url,
+        [&](HttpStream &stream, const char *host, uint16_t port, const char *path) {
+            return stream.writeRequest(method, host, port, path, payload);
+        },
+        [&response](HttpStream &stream, bool &keepAlive, bool &received) {
+            return stream.readResponse(response, keepAlive, received);
+        }, timeoutMs);
 
-    http.end();
-    return response;
+    if (httpResponseCode > 0) ESP_LOGI(WIFI_LOG_TAG, "HTTP Response: %d, %s", httpResponseCode, response.capacity > 0 ? response.data : "");
+    return httpResponseCode;
 }
 
 /**
- * @brief Sending get request to API
+ * @brief Send a conditional GET over a keep-alive connection from the pool, and stream the body if the resource changed
+ *
+ * The request carries `If-None-Match` and `If-Modified-Since` from the validators, so an unchanged
+ * resource is answered with an empty 304. On a 2xx response the body is passed to `onBody` as a
+ * stream straight from the socket, and the validators are replaced with the ones of the response.
  *
- * @param url The pointer location of the url string of the api
- * @param payload The pointer location of the payload string in form of json application 
- * @return response of the api
+ * @param url The url of the resource
+ * @param validators The validators of the cached resource, updated on a 2xx response
+ * @param onBody Called with the body of a 2xx response, what it does not read is skipped
+ * @param timeoutMs The total time the request may take, including the retry
+ * @return HTTP status code of the response, or a negative `HTTPClient` error code if the request failed
  */
-std::string Wifi::sendGetRequest(const std::string &url){
-    if (!isConnected()) {
-        return "WiFi not connected!";
-    }
+int Wifi::sendConditionalGet(const char *url, HttpCacheValidators &validators, HttpBodyHandler onBody, uint32_t timeoutMs){
+    HttpCacheValidators responseValidators;
 
-    http.begin(client, url.c_str());
+    int httpResponseCode = exchange("GET", url,
+        [&validators](HttpStream &stream, const char *host, uint16_t port, const char *path) {
+            return stream.writeRequest("GET", host, port, path, JsonVariantConst(), &validators);
+        },
+        [&](HttpStream &stream, bool &keepAlive, bool &received) {
+            int statusCode = stream.readResponseHeaders(keepAlive, received, &responseValidators);
+            if (statusCode < 0) return statusCode;
 
-    int httpResponseCode = http.GET();
+            bool success = statusCode >= 200 && statusCode < 300;
+            if (success) onBody(stream);
 
-    std::string response;
-    if (httpResponseCode > 0) {
-        response = http.getString().c_str();
-        ESP_LOGI(WIFI_LOG_TAG, "HTTP Response: %d, %s", httpResponseCode, response.c_str());
-    }
-    else {
-        ESP_LOGE(WIFI_LOG_TAG, "Error on sending GET request: %s", http.errorToString(httpResponseCode).c_str());
-    }
+            // Skip what the handler did not read, so the connection can be reused
+            if (!stream.finishBody()) {
+                keepAlive = false;
+                return (int)HTTPC_ERROR_CONNECTION_LOST;
+            }
+            if (success) validators = responseValidators;
+            return statusCode;
+        }, timeoutMs);
 
-    http.end();
-    return response;
+    if (httpResponseCode > 0) ESP_LOGI(WIFI_LOG_TAG, "HTTP Response: %d", httpResponseCode);
+    return httpResponseCode;
 }
 
 /**
- * @brief Sending delete request to API
+ * @brief Send a request with a body of unknown length over a keep-alive connection from the pool
+ *
+ * The body is sent with the chunked transfer encoding as `produceBody` writes it, so it is never held
+ * as a whole in memory. If the producer aborts, the request is cut before its last chunk and the
+ * connection is closed, so the server never sees a complete request. The producer is called again
+ * from the start if the request is retried on a new connection.
  *
- * @param url The pointer location of the url string of the api
- * @param payload The pointer location of the payload string in form of json application 
- * @return response of the api
+ * @param method The HTTP method of the request
+ * @param url The url of the api
+ * @param contentType The `Content-Type` of the body
+ * @param contentEncoding The `Content-Encoding` of the body, null for none
+ * @param produceBody Writes the body in parts with the writer it is given
+ * @param response The buffer to store the response body of the api
+ * @param timeoutMs The total time the request may take, including the retry
+ * @return HTTP status code of the response, or a negative `HTTPClient` error code if the request failed
  */
-std::string Wifi::sendDeleteRequest(const std::string &url){
-    if (!isConnected()) {
-        return "WiFi not connected!";
-    }
-    http.begin(client, url.c_str());
-    http.addHeader("Content-Type", "application/json");
+int Wifi::sendStreamedRequest(const char *method, const char *url, const char *contentType, const char *contentEncoding,
+                              HttpBodyProducer produceBody, HttpResponseBuffer &response, uint32_t timeoutMs){
+    response.length = 0;
+    response.bodyLength = 0;
+    response.truncated = false;
+    if (response.capacity > 0) response.data[0] = '\0';
 
-    int httpResponseCode = http.sendRequest("DELETE");
+    int httpResponseCode = exchange(method, url,
+        [&](HttpStream &stream, const char *host, uint16_t port, const char *path) {
+            if (!stream.writeChunkedRequest(method, host, port, path, contentType, contentEncoding)) return false;
 
-    std::string response;
-    if (httpResponseCode > 0) {
-        response = http.getString().c_str();
-        ESP_LOGI(WIFI_LOG_TAG, "HTTP Response: %d, %s", httpResponseCode, response.c_str());
-    }
-    else {
-        ESP_LOGE(WIFI_LOG_TAG, "Error on sending DELETE request: %s", http.errorToString(httpResponseCode).c_str());
+            HttpChunkWriter writer = [&stream](const uint8_t *data, size_t length) { return stream.writeChunk(data, length); };
+            return produceBody(writer) && stream.endChunkedRequest();
+        },
+        [&response](HttpStream &stream, bool &keepAlive, bool &received) {
+            return stream.readResponse(response, keepAlive, received);
+        }, timeoutMs);
+
+    if (httpResponseCode > 0) ESP_LOGI(WIFI_LOG_TAG, "HTTP Response: %d, %s", httpResponseCode, response.capacity > 0 ? response.data : "");
+    return httpResponseCode;
+}
+
+/**
+ * @brief Write a request to a keep-alive connection from the pool and read its response
+ *
+ * If a reused connection turns out to be already closed by the server, the request is sent once
+ * more over a new connection. Only failures before any response is received are retried, and never
+ * a timeout, so the server does not process the same request twice because of this retry.
+ *
+ * @param method The HTTP method of the request, for the logs
+ * @param url The url of the api
+ * @param writeRequest Writes the request to the stream
+ * @param readResponse Reads the response from the stream
+ * @param timeoutMs The total time the request may take, including the retry
+ * @return HTTP status code of the response, or a negative `HTTPClient` error code if the request failed
+ */
+int Wifi::exchange(const char *method, const char *url, HttpRequestWriter writeRequest, HttpResponseReader readResponse, uint32_t timeoutMs){
+    ESP_LOGI(WIFI_LOG_TAG, "Sending %s request to URL: %s", method, url);
+
+    const char *hostStart = strstr(url, "://");
+    const char *path = strchr(hostStart == nullptr ? url : hostStart + 3, '/');
+    if (path == nullptr) path = "/";
+
+    TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(timeoutMs);
+    int httpResponseCode = HTTPC_ERROR_CONNECTION_LOST;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int32_t remaining = (int32_t)(deadline - xTaskGetTickCount()) * portTICK_PERIOD_MS;
+        if (remaining <= 0) {
+            httpResponseCode = HTTPC_ERROR_READ_TIMEOUT;
+            break;
+        }
+
+        bool reused = false;
+        HttpConnection *connection = _connectionPool.acquire(url, reused);
+        if (connection == nullptr) return HTTPC_ERROR_CONNECTION_REFUSED;
+
+        if (!reused && !connection->client.connect(connection->host, connection->port, remaining)) {
+            _connectionPool.release(connection, false);
+            httpResponseCode = HTTPC_ERROR_CONNECTION_REFUSED;
+            break;
+        }
+
+        HttpStream stream(connection->client, deadline);
+        bool keepAlive = false;
+        bool received = false;
+        httpResponseCode = HTTPC_ERROR_SEND_HEADER_FAILED;
+        if (writeRequest(stream, connection->host, connection->port, path)) {
+            httpResponseCode = readResponse(stream, keepAlive, received);
+        }
+
+        // Keeps the connection open for the next request unless the server asked to close it
+        _connectionPool.release(connection, httpResponseCode > 0 && keepAlive);
+
+        bool stale = reused && !received && httpResponseCode != HTTPC_ERROR_READ_TIMEOUT;
+        if (!stale) break;
+
+        ESP_LOGW(WIFI_LOG_TAG, "Kept connection was closed by the server, retrying %s request on a new connection", method);
     }
 
-    http.end();
-    return response;
-}
\ No newline at end of file
+    if (httpResponseCode <= 0) ESP_LOGE(WIFI_LOG_TAG, "Error on sending %s request: %s", method, HTTPClient::errorToString(httpResponseCode).c_str());
+    return httpResponseCode;
+}
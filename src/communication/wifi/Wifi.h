@@ -2,10 +2,34 @@
 #define WIFI_H
 
 #include "WiFiManager.h"
+#include "HttpConnectionPool.h"
+#include "HttpStream.h"
 #include "enum/WifiState.h"
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/task.h>
+
+#include <atomic>
+#include <functional>
+
+#define NTP_SERVER_PRIMARY          "pool.ntp.org"
+#define NTP_SERVER_SECONDARY        "time.google.com"
+#define HTTP_DEFAULT_TIMEOUT_MS     5000
+
+#define WIFI_RECONNECT_MIN_MS       500             // First reconnect delay after the link is lost
+#define WIFI_RECONNECT_MAX_MS       (60 * 1000)     // The reconnect delay doubles on every failed attempt up to this
+#define WIFI_CONNECT_TIMEOUT_MS     10000           // Time given to a single connect attempt before starting the next one
+#define WIFI_PORTAL_TIMEOUT_S       60              // The config portal closes by itself after this
+
+/// @brief Reads the body of a streamed response, only valid during the call
+typedef std::function<void(Stream &body)> HttpBodyHandler;
+
+/// @brief Sends the next part of a streamed request body, returns `false` if the connection failed
+typedef std::function<bool(const uint8_t *data, size_t length)> HttpChunkWriter;
+
+/// @brief Produces a streamed request body with the writer, returns `false` to abort the request
+typedef std::function<bool(const HttpChunkWriter &write)> HttpBodyProducer;
 
 /// @brief Class wrapper for WiFo operation. For now it include api service in here
 class Wifi{
@@ -14,20 +38,44 @@ class Wifi{
 
         void init(void);
         bool isConnected(void);
-        bool reconnect(void);
-        void resetSettings(void);
+        void watchConnection(std::function<void()> watcher);
+        uint32_t maintainConnection(bool &linkLost);
+        void requestConfigPortal(void);
+        WifiState getConnectionState(void);
         const char* getSSID(void);
         const char* getIpAddress(void);
         void updateStatus(bool status);
         wl_status_t get_state(void);
-        std::string sendPostRequest(const std::string &url, const std::string &payload);
-        std::string sendGetRequest(const std::string &url);
-        std::string sendDeleteRequest(const std::string &url);
+        int sendRequest(const char *method, const char *url, JsonVariantConst payload, HttpResponseBuffer &response, uint32_t timeoutMs = HTTP_DEFAULT_TIMEOUT_MS);
+        int sendConditionalGet(const char *url, HttpCacheValidators &validators, HttpBodyHandler onBody, uint32_t timeoutMs = HTTP_DEFAULT_TIMEOUT_MS);
+        int sendStreamedRequest(const char *method, const char *url, const char *contentType, const char *contentEncoding,
+                                HttpBodyProducer produceBody, HttpResponseBuffer &response, uint32_t timeoutMs = HTTP_DEFAULT_TIMEOUT_MS);
+        void watchIdleConnections(std::function<void()> watcher);
+        uint32_t closeIdleConnections(void);
 
     private:
         const char* _apName;
         QueueHandle_t _wifiStatusQueue;
         WiFiManager _wifiManager;
+        HttpConnectionPool _connectionPool;
+
+        // Connection state, written from the WiFi event handler
+        std::atomic<WifiState> _state;
+        std::atomic<bool> _linkLost;
+        std::atomic<bool> _portalRequested;
+        std::function<void()> _watcher;
+
+        uint32_t _backoffMs;
+        TickType_t _attemptStarted;
+        TickType_t _nextAttempt;
+
+        typedef std::function<bool(HttpStream &stream, const char *host, uint16_t port, const char *path)> HttpRequestWriter;
+        typedef std::function<int(HttpStream &stream, bool &keepAlive, bool &received)> HttpResponseReader;
+        int exchange(const char *method, const char *url, HttpRequestWriter writeRequest, HttpResponseReader readResponse, uint32_t timeoutMs);
+
+        void handleEvent(arduino_event_id_t event, arduino_event_info_t info);
+        void notifyWatcher(void);
+        void openConfigPortal(void);
 };
 
 #endif
\ No newline at end of file
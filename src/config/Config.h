@@ -5,4 +5,70 @@
 #define WIFI_SSID "DC House"
 #define WIFI_PASSWORD "Dc170117"
 
+// Backend server of the key access api, override with `-DBACKEND_URL=...`
+// An `https://` url is sent over TLS, set `BACKEND_CA_CERT` to the PEM of a private CA, by default the ESP-IDF bundle is used
+#ifndef BACKEND_URL
+#define BACKEND_URL "http://203.100.57.59:3000/api/v1"
+#endif
+
+// Firmware update server, override with `-DOTA_SERVER_URL=...` to test against `scripts/ota_server`
+#ifndef OTA_SERVER_URL
+#define OTA_SERVER_URL "http://203.100.57.59:3000/api/v1/firmware"
+#endif
+
+// Broker of the credential update channel, there is no default as its messages add key access
+// Give `MQTT_BROKER_URL` (an `mqtts://` url), `MQTT_USERNAME` and `MQTT_PASSWORD` in the build environment,
+// and `MQTT_CA_CERT_FILE` for a private CA. Without them the key access only change with the pull
+#define MQTT_KEY_ACCESS_TOPIC "vehicle/" VIN "/key-access"  // Key access added or revoked on the server, pushed to the device
+#define MQTT_EVENTS_TOPIC "vehicle/" VIN "/events"          // Access events published by the device
+
+// Hybrid online/offline auth, a key access on the SD Card also needs a lease that the server renews in bulk
+// Enable with `-DKEY_ACCESS_LEASE_MODE=1`, otherwise the SD Card is the only authority
+#ifndef KEY_ACCESS_LEASE_MODE
+#define KEY_ACCESS_LEASE_MODE 0
+#endif
+#ifndef KEY_ACCESS_LEASE_GRACE_S
+#define KEY_ACCESS_LEASE_GRACE_S (24 * 60 * 60)     // An expired lease still unlocks this long while the server cannot be reached
+#endif
+#define KEY_ACCESS_LEASE_DEFAULT_TTL_S (15 * 60)    // Lease of a key access enrolled on the device, until the next refresh
+
+// Bearer token of the HTTP admin api on the local network (`src/service/AdminService.h`)
+// There is no default, give it with `ADMIN_API_TOKEN` in the build environment or store it in NVS,
+// the admin api is not started without one
+
+// Key access replication between the door controllers of a network (`src/service/ReplicationService.h`)
+// Enable with `-DREPLICATION_ENABLED=1`, the controllers of the same group share their NFC Cards and revokes
+#ifndef REPLICATION_ENABLED
+#define REPLICATION_ENABLED 0
+#endif
+#ifndef REPLICATION_GROUP
+#define REPLICATION_GROUP VIN
+#endif
+// Key that authenticates the datagrams, shared by the controllers of the group
+// There is no default, give it with `REPLICATION_KEY` in the build environment
+#if REPLICATION_ENABLED && !defined(REPLICATION_KEY)
+#error "REPLICATION_KEY is not set, build with REPLICATION_KEY=<key> to enable the replication"
+#endif
+
+// Backup of the key access store to the backend server (`src/repository/BackupModule/BackupModule.h`)
+// Enable with `-DKEY_ACCESS_BACKUP_ENABLED=1`, a device with an empty store is restored from the last backup
+#ifndef KEY_ACCESS_BACKUP_ENABLED
+#define KEY_ACCESS_BACKUP_ENABLED 0
+#endif
+// Key of the HMAC that authenticates the backups, a restore only applies backups made with it
+// There is no default, give it with `KEY_ACCESS_BACKUP_KEY` in the build environment
+#if KEY_ACCESS_BACKUP_ENABLED && !defined(KEY_ACCESS_BACKUP_KEY)
+#error "KEY_ACCESS_BACKUP_KEY is not set, build with KEY_ACCESS_BACKUP_KEY=<key> to enable the backups"
+#endif
+
+// Public key that verifies the signature of the firmware manifests and of the BLE updates, there is no default key
+// Set `OTA_MANIFEST_PUBLIC_KEY_FILE` to its PEM file when building, `scripts/get_build_secrets.py` passes it to the build.
+// Without it the firmware updates from the server and over BLE are left out, the LAN ArduinoOTA still works
+#ifdef OTA_MANIFEST_PUBLIC_KEY
+#define OTA_SIGNED_UPDATES_ENABLED 1
+#else
+#define OTA_SIGNED_UPDATES_ENABLED 0
+#warning "OTA_MANIFEST_PUBLIC_KEY is not set, the signed firmware updates are disabled. Build with OTA_MANIFEST_PUBLIC_KEY_FILE=<public key PEM> to enable them"
+#endif
+
 #endif // CONFIG_H
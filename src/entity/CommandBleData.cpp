@@ -1,77 +1,41 @@
 #include "CommandBleData.h"
 
-CommandBleData commandBleData;
-CommandBleData::CommandBleData() : _command(nullptr), _name(nullptr), _keyAccess(nullptr), _visitorId(nullptr) {}
-CommandBleData::~CommandBleData()
+CommandBleQueue commandBleQueue;
+CommandBleQueue::CommandBleQueue() : _queue(nullptr) {}
+
+/**
+ * @brief Create the queue in its static storage, has to run before the BLE starts receiving
+ *
+ * @return `true` if the queue is ready, `false` otherwise.
+ */
+bool CommandBleQueue::setup()
 {
-    if (_command)
-        free(_command);
-    if (_name)
-        free(_name);
-    if (_keyAccess)
-        free(_keyAccess);
-    if (_visitorId)
-        free(_visitorId);
+    if (_queue == nullptr)
+        _queue = xQueueCreateStatic(BLE_COMMAND_QUEUE_LENGTH, sizeof(CommandBleData), _storage, &_queueBuffer);
+    return _queue != nullptr;
 }
 
-void CommandBleData::setCommand(const char *newCommand)
+/**
+ * @brief Queue a command without waiting, called from the NimBLE host task
+ *
+ * @return `false` if the queue is full, the command is not queued then
+ */
+bool CommandBleQueue::push(const CommandBleData &command)
 {
-    if (_command)
-        free(_command);
-    _command = strdup(newCommand);
+    return _queue != nullptr && xQueueSend(_queue, &command, 0) == pdTRUE;
 }
 
-void CommandBleData::setName(const char *newName)
+/**
+ * @brief Take the oldest command, waiting up to `timeout` for one
+ *
+ * @return `true` if a command was copied to `command`, `false` on timeout
+ */
+bool CommandBleQueue::receive(CommandBleData &command, TickType_t timeout)
 {
-    if (_name)
-        free(_name);
-    _name = strdup(newName);
+    return _queue != nullptr && xQueueReceive(_queue, &command, timeout) == pdTRUE;
 }
 
-void CommandBleData::setKeyAccess(const char *newKeyAccess)
+size_t CommandBleQueue::pending() const
 {
-    if (_keyAccess)
-        free(_keyAccess);
-    _keyAccess = strdup(newKeyAccess);
-}
-
-void CommandBleData::setVisitorId(const char *newVisitorId)
-{
-    if (_visitorId)
-        free(_visitorId);
-    _visitorId = strdup(newVisitorId);
-}
-
-const char *CommandBleData::getCommand() const { return _command; }
-const char *CommandBleData::getName() const { return _name; }
-const char *CommandBleData::getKeyAccess() const { return _keyAccess; }
-const char *CommandBleData::getVisitorId() const { return _visitorId; }
-
-void CommandBleData::clear()
-{
-    if (_command)
-        free(_command);
-    if (_name)
-        free(_name);
-    if (_keyAccess)
-        free(_keyAccess);
-    if (_visitorId)
-        free(_visitorId);
-
-    _command = nullptr;
-    _name = nullptr;
-    _visitorId = nullptr;
-    _keyAccess = nullptr;
-}
-
-// Helper function to duplicate a string (uses malloc)
-char *CommandBleData::strdup(const char *str)
-{
-    if (!str)
-        return nullptr;
-    size_t len = strlen(str) + 1;
-    char *copy = (char *)malloc(len);
-    if (copy)
-        memcpy(copy, str, len);
-    return copy;
+    return _queue != nullptr ? uxQueueMessagesWaiting(_queue) : 0;
 }
@@ -1,38 +1,55 @@
 #ifndef COMMAND_BLE_DATA_H
 #define COMMAND_BLE_DATA_H
 #include <cstring>
+#include <cstdint>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+#include "enum/SystemState.h"
+
+#define BLE_COMMAND_QUEUE_LENGTH    4       // Commands the head unit can send ahead of the one running, then it gets a busy notification
+#define BLE_COMMAND_NAME_SIZE       24
+#define BLE_COMMAND_USERNAME_SIZE   25
+#define BLE_COMMAND_ID_SIZE         40
+
+/// @brief A validated BLE command, copied whole into the command queue so it owns no pointer
+struct CommandBleData {
+    uint32_t id;                                /* Optional id of the head unit, echoed in the acknowledgement, 0 if none   */
+    SystemState state;                          /* The state that runs the command, from the command table                  */
+    char command[BLE_COMMAND_NAME_SIZE];        /* The command name, e.g. `register_fp`                                     */
+    char name[BLE_COMMAND_USERNAME_SIZE];       /* The visitor name, empty if not given                                     */
+    char keyAccess[BLE_COMMAND_ID_SIZE];        /* The Key Access ID, empty if not given                                    */
+    char visitorId[BLE_COMMAND_ID_SIZE];        /* The Visitor ID, empty if not given                                       */
+    uint32_t from;                              /* Start of the time range of `get_access_log`                              */
+    uint32_t to;                                /* End of the time range of `get_access_log`                                */
+
+    // Getters, `nullptr` for a field that was not given
+    const char *getName() const { return name[0] != '\0' ? name : nullptr; }
+    const char *getKeyAccess() const { return keyAccess[0] != '\0' ? keyAccess : nullptr; }
+    const char *getVisitorId() const { return visitorId[0] != '\0' ? visitorId : nullptr; }
+};
 
-// TODO : Find a better way perhaps to move this data to main thread loop rather using malloc
-class CommandBleData{
+/**
+ * @brief Bounded queue of the BLE commands between the NimBLE host task and the main dispatcher.
+ *
+ * The storage of the queue is static, so a command never allocates. When the queue is full the
+ * command is refused, never dropped or overwritten, and the head unit is told it is busy.
+ */
+class CommandBleQueue {
 public:
-    CommandBleData();
-    ~CommandBleData();
-
-    // Setters
-    void setCommand(const char *newCommand);
-    void setName(const char *newName);
-    void setKeyAccess(const char *newKeyAccess);
-    void setVisitorId(const char *newVisitorId);
+    CommandBleQueue();
+    bool setup();
 
-    // Getters
-    const char *getCommand() const;
-    const char *getName() const;
-    const char *getKeyAccess() const;
-    const char *getVisitorId() const;
-
-    // Clear/reset values
-    void clear();
+    bool push(const CommandBleData &command);
+    bool receive(CommandBleData &command, TickType_t timeout);
+    size_t pending() const;
 
 private:
-    char *_command;
-    char *_name;
-    char *_keyAccess;
-    char *_visitorId;
-
-    // Helper function to duplicate a string (uses malloc)
-    char *strdup(const char *str);
+    QueueHandle_t _queue;
+    StaticQueue_t _queueBuffer;
+    uint8_t _storage[BLE_COMMAND_QUEUE_LENGTH * sizeof(CommandBleData)];
 };
 
-extern CommandBleData commandBleData;
+extern CommandBleQueue commandBleQueue;
 
 #endif
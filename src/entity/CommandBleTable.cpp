@@ -0,0 +1,28 @@
+#include "CommandBleTable.h"
+
+/**
+ * @brief Find a command of the Door characteristic, one hash and one string compare whatever the command
+ *
+ * @return The command, or `nullptr` if there is no command of that name
+ */
+const CommandBleSpec *findBleCommand(const char *name) {
+    if (name == nullptr) return nullptr;
+
+    uint8_t index = command_ble_table::SLOTS[command_ble_table::slotOf(name, command_ble_table::SEED)];
+    if (index == BLE_COMMAND_NO_SLOT || strcmp(BLE_COMMANDS[index].name, name) != 0) return nullptr;
+    return &BLE_COMMANDS[index];
+}
+
+/**
+ * @brief Check the fields given with a command against the ones it requires
+ *
+ * @param present The `CommandBleField` given with the command
+ * @return 0 if the command can run, otherwise the status code to send back
+ */
+int checkBleCommandFields(const CommandBleSpec &spec, uint8_t present) {
+    uint8_t missing = spec.required & ~present;
+    if (missing == FIELD_NONE) return 0;
+
+    // A missing name has its own status code, but only when the other required fields are given
+    return missing == FIELD_NAME ? spec.missingNameError : spec.missingFieldError;
+}
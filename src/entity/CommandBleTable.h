@@ -0,0 +1,108 @@
+#ifndef COMMAND_BLE_TABLE_H
+#define COMMAND_BLE_TABLE_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "StatusCodes.h"
+#include "enum/SystemState.h"
+
+#define BLE_COMMAND_HASH_SLOTS      64      // Slots of the perfect hash, a power of two well above the commands so a seed is found quickly
+#define BLE_COMMAND_NO_SLOT         0xFF    // Slot with no command
+
+/// @brief Fields of a BLE command, a bit each so a command lists the ones it requires
+enum CommandBleField : uint8_t {
+    FIELD_NONE          = 0,
+    FIELD_NAME          = 1 << 0,   /* `data.name`                                              */
+    FIELD_KEY_ACCESS    = 1 << 1,   /* `data.key_access_id`                                     */
+    FIELD_VISITOR_ID    = 1 << 2,   /* `data.visitor_id`                                        */
+    FIELD_TIME_RANGE    = 1 << 3,   /* `data.from` and `data.to`, with `from` not after `to`    */
+};
+
+/// @brief A command of the Door characteristic, how it is checked and the state that runs it
+struct CommandBleSpec {
+    const char *name;               /* The `command` value sent by the head unit                                    */
+    SystemState state;              /* The state of the main dispatcher that runs the command                       */
+    uint8_t required;               /* The `CommandBleField` the command cannot run without                         */
+    int missingFieldError;          /* Status code sent when a required field other than the name is missing        */
+    int missingNameError;           /* Status code sent when only the required name is missing                      */
+};
+
+/**
+ * @brief Every command of the Door characteristic, adding a command is adding a line here and the case
+ * of its state in the main dispatcher
+ */
+constexpr CommandBleSpec BLE_COMMANDS[] = {
+    {"register_fp",         ENROLL_FP,          FIELD_NAME | FIELD_KEY_ACCESS | FIELD_VISITOR_ID,   FAILED_TO_DELETE_FINGERPRINT_NO_ID,                     FAILED_TO_REGISTER_FINGERPRINT_NO_NAME},
+    {"delete_fp",           DELETE_FP,          FIELD_KEY_ACCESS,                                   FAILED_TO_DELETE_FINGERPRINT_NO_ID,                     0},
+    {"delete_fp_user",      DELETE_FP_USER,     FIELD_VISITOR_ID,                                   FAILED_TO_DELETE_FINGERPRINT_NO_ID,                     0},
+    {"delete_fp_sensor",    DELETE_FP_SENSOR,   FIELD_NONE,                                         0,                                                      0},
+    {"delete_fp_fs",        DELETE_FP_FS,       FIELD_NONE,                                         0,                                                      0},
+    {"register_rfid",       ENROLL_RFID,        FIELD_NAME | FIELD_KEY_ACCESS | FIELD_VISITOR_ID,   FAILED_TO_REGISTER_NFC_NO_VISITOR_ID_OR_KEY_ACCESS_ID,  FAILED_TO_REGISTER_NFC_NO_NAME},
+    {"delete_rfid",         DELETE_RFID,        FIELD_KEY_ACCESS,                                   FAILED_TO_DELETE_NFC_NO_ID,                             0},
+    {"delete_rfid_user",    DELETE_RFID_USER,   FIELD_VISITOR_ID,                                   FAILED_TO_DELETE_NFC_NO_ID,                             0},
+    {"delete_rfid_fs",      DELETE_RFID_FS,     FIELD_NONE,                                         0,                                                      0},
+    {"update_visitor",      UPDATE_VISITOR,     FIELD_NONE,                                         0,                                                      0},
+    {"delete_access_user",  DELETE_ACCESS_USER, FIELD_VISITOR_ID,                                   FAILED_TO_DELETE_NFC_NO_ID,                             0},
+    {"door_lock",           DOOR_LOCK,          FIELD_NONE,                                         0,                                                      0},
+    {"door_unlock",         DOOR_UNLOCK,        FIELD_NONE,                                         0,                                                      0},
+    {"get_access_log",      GET_ACCESS_LOG,     FIELD_TIME_RANGE,                                   FAILED_TO_QUERY_ACCESS_LOG_NO_TIME_RANGE,               0},
+    {"wifi_config",         WIFI_CONFIG,        FIELD_NONE,                                         0,                                                      0},
+    {"update_firmware",     UPDATE_FIRMWARE,    FIELD_NONE,                                         0,                                                      0},
+};
+
+constexpr size_t BLE_COMMAND_COUNT = sizeof(BLE_COMMANDS) / sizeof(BLE_COMMANDS[0]);
+static_assert(BLE_COMMAND_COUNT < BLE_COMMAND_NO_SLOT, "Too many BLE commands for the slot table");
+static_assert((BLE_COMMAND_HASH_SLOTS & (BLE_COMMAND_HASH_SLOTS - 1)) == 0, "BLE_COMMAND_HASH_SLOTS must be a power of two");
+
+// The helpers below are single return constexpr functions, as the toolchain builds with C++11
+namespace command_ble_table {
+
+/// @brief FNV-1a of a command name, started from the seed so the seed changes every slot
+constexpr uint32_t hash(const char *name, uint32_t value) {
+    return *name == '\0' ? value ^ (value >> 16) : hash(name + 1, (value ^ (uint8_t)*name) * 16777619u);
+}
+
+constexpr uint32_t slotOf(const char *name, uint32_t seed) {
+    return hash(name, 2166136261u ^ (seed * 2654435761u)) & (BLE_COMMAND_HASH_SLOTS - 1);
+}
+
+constexpr bool isPerfect(uint32_t seed, size_t i = 0, size_t j = 1) {
+    return i >= BLE_COMMAND_COUNT ? true
+         : j >= BLE_COMMAND_COUNT ? isPerfect(seed, i + 1, i + 2)
+         : slotOf(BLE_COMMANDS[i].name, seed) != slotOf(BLE_COMMANDS[j].name, seed) && isPerfect(seed, i, j + 1);
+}
+
+/// @brief First seed with no two commands in the same slot, found while compiling
+constexpr uint32_t findSeed(uint32_t seed = 0) {
+    return isPerfect(seed) ? seed : findSeed(seed + 1);
+}
+
+constexpr uint32_t SEED = findSeed();
+
+constexpr uint8_t commandInSlot(size_t slot, size_t i = 0) {
+    return i >= BLE_COMMAND_COUNT ? BLE_COMMAND_NO_SLOT
+         : slotOf(BLE_COMMANDS[i].name, SEED) == slot ? (uint8_t)i
+         : commandInSlot(slot, i + 1);
+}
+
+template <size_t... I> struct IndexList {};
+template <size_t N, size_t... I> struct MakeIndexList : MakeIndexList<N - 1, N - 1, I...> {};
+template <size_t... I> struct MakeIndexList<0, I...> { typedef IndexList<I...> type; };
+
+template <size_t... I>
+constexpr std::array<uint8_t, sizeof...(I)> buildSlots(IndexList<I...>) {
+    return {{ commandInSlot(I)... }};
+}
+
+/// @brief Index of the command of every slot, `BLE_COMMAND_NO_SLOT` for an empty one
+constexpr std::array<uint8_t, BLE_COMMAND_HASH_SLOTS> SLOTS = buildSlots(MakeIndexList<BLE_COMMAND_HASH_SLOTS>::type());
+
+}
+
+const CommandBleSpec *findBleCommand(const char *name);
+int checkBleCommandFields(const CommandBleSpec &spec, uint8_t present);
+
+#endif
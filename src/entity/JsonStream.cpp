@@ -0,0 +1,88 @@
+#include "JsonStream.h"
+
+/**
+ * @brief Skip the whitespace of a json text
+ *
+ * @return The next character, not consumed, or -1 at the end of the stream
+ */
+int JsonStream::skipWhitespace(Stream &stream){
+    int c = stream.peek();
+    while (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+        stream.read();
+        c = stream.peek();
+    }
+    return c;
+}
+
+/**
+ * @brief Consume the next character of a json text if it is the expected one
+ *
+ */
+bool JsonStream::consume(Stream &stream, char expected){
+    if (skipWhitespace(stream) != expected) return false;
+    stream.read();
+    return true;
+}
+
+/**
+ * @brief Skip a json value without keeping it
+ *
+ * A number is skipped here, the parser would also take the character after it.
+ */
+bool JsonStream::skipValue(Stream &stream){
+    int c = skipWhitespace(stream);
+    if (c == '-' || (c >= '0' && c <= '9')) {
+        while (c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E' || (c >= '0' && c <= '9')) {
+            stream.read();
+            c = stream.peek();
+        }
+        return true;
+    }
+
+    JsonDocument filter;
+    filter.set(false);
+    JsonDocument skipped;
+    return !deserializeJson(skipped, stream, DeserializationOption::Filter(filter));
+}
+
+/**
+ * @brief Read a json object one member at a time
+ *
+ * @param stream The json text, at the start of the object
+ * @param onMember Called with the name of every member, it has to read the value and return `false` if it is invalid
+ * @return `true` if the whole object is valid, `false` otherwise.
+ */
+bool JsonStream::readObject(Stream &stream, const std::function<bool(const char *name)> &onMember){
+    if (!consume(stream, '{')) return false;
+
+    bool first = true;
+    while (!consume(stream, '}')) {
+        if (!first && !consume(stream, ',')) return false;
+        first = false;
+
+        JsonDocument key;
+        if (skipWhitespace(stream) != '"' || deserializeJson(key, stream) || !key.is<const char*>() || !consume(stream, ':')) return false;
+        if (!onMember(key.as<const char*>())) return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Read a json array one element at a time
+ *
+ * @param stream The json text, at the start of the array
+ * @param onElement Called at the start of every element, it has to read the element and return `false` if it is invalid
+ * @return `true` if the whole array is valid, `false` otherwise.
+ */
+bool JsonStream::readArray(Stream &stream, const std::function<bool()> &onElement){
+    if (!consume(stream, '[')) return false;
+
+    bool first = true;
+    while (!consume(stream, ']')) {
+        if (!first && !consume(stream, ',')) return false;
+        first = false;
+
+        if (!onElement()) return false;
+    }
+    return true;
+}
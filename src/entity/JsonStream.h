@@ -0,0 +1,24 @@
+#ifndef JSON_STREAM_H
+#define JSON_STREAM_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <functional>
+
+/**
+ * @brief Reads a large json text one member or element at a time, straight from a file or a socket.
+ *
+ * Only the member or element being read is ever held in a `JsonDocument`, so the memory used does not
+ * grow with the size of the text. Nothing is read past the value being read, so the stream never has
+ * to give a character back.
+ */
+class JsonStream {
+public:
+    static int skipWhitespace(Stream &stream);
+    static bool consume(Stream &stream, char expected);
+    static bool skipValue(Stream &stream);
+    static bool readObject(Stream &stream, const std::function<bool(const char *name)> &onMember);
+    static bool readArray(Stream &stream, const std::function<bool()> &onElement);
+};
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef MESSAGE_POOL_H
+#define MESSAGE_POOL_H
+
+#include <freertos/FreeRTOS.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Fixed set of message blocks shared between tasks, so a queue only carries the pointer of a message.
+ *
+ * The blocks are a static array and the free ones are chained by index, no heap is used after start.
+ * `acquire` and `release` may be called from any task, a block is owned by whoever took it last from
+ * a queue until it is released.
+ *
+ * @tparam T Message type of a block
+ * @tparam N Number of blocks, at most 254
+ */
+template <typename T, size_t N>
+class MessagePool {
+    static_assert(N > 0 && N < 0xFF, "MessagePool holds 1 to 254 blocks");
+
+public:
+    MessagePool() : _free(0) {
+        for (size_t i = 0; i < N; i++) _next[i] = i + 1 < N ? i + 1 : NO_BLOCK;
+    }
+
+    /**
+     * @brief Take a free block, its content is left from the previous message
+     *
+     * @return The block, or `nullptr` if every block is in use
+     */
+    T *acquire() {
+        portENTER_CRITICAL(&_lock);
+        uint8_t index = _free;
+        if (index != NO_BLOCK) _free = _next[index];
+        portEXIT_CRITICAL(&_lock);
+        return index != NO_BLOCK ? &_blocks[index] : nullptr;
+    }
+
+    /**
+     * @brief Give a block back to the pool, `nullptr` and pointers outside of the pool are ignored
+     *
+     */
+    void release(T *block) {
+        if (block < _blocks || block >= _blocks + N) return;
+
+        uint8_t index = block - _blocks;
+        portENTER_CRITICAL(&_lock);
+        _next[index] = _free;
+        _free = index;
+        portEXIT_CRITICAL(&_lock);
+    }
+
+private:
+    static const uint8_t NO_BLOCK = 0xFF;
+
+    T _blocks[N];
+    uint8_t _next[N];       // Index of the next free block after this one, `NO_BLOCK` ends the chain
+    uint8_t _free;          // Index of the first free block
+    portMUX_TYPE _lock = portMUX_INITIALIZER_UNLOCKED;
+};
+
+#endif
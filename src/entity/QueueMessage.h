@@ -4,34 +4,51 @@
 #include "Arduino.h"
 #include "enum/SystemState.h"
 
-struct NFCQueueRequest {
-    int request_id;
-    char username[25];
-    char keyAccessId[40];
-    char uidCard[32]; 
-    char vehicleInformationNumber[24];
-    SystemState state;
-    int statusCode;
-};
+#include "MessagePool.h"
+#include "SpscRing.h"
 
-struct NFCQueueResponse {
-    int request_id;
-    char response[512];
+#include <atomic>
+
+#define QUEUE_RESPONSE_TIMEOUT_MS   5000    // Deadline of the server request of a message to the WiFi Task
+#define QUEUE_REQUEST_POOL_SIZE     4       // Requests to the WiFi Task in flight at once, shared by the services, also the length of each request queue
+#define ACCESS_EVENT_RING_SIZE      8       // Unlocks waiting for the WiFi Task per sensor, a power of two
+
+/**
+ * @brief Get a new unique `request_id` for a queue message, so the response of the server can be matched with its request
+ *
+ * @return The next request id, never 0
+ */
+inline int nextQueueRequestId() {
+    static std::atomic<int> requestId(0);
+    int id = ++requestId;
+    return id != 0 ? id : ++requestId;
+}
+
+/// @brief An unlock sent to the WiFi Task to be stored in the outbox, the hot path so it is kept small and never queued by value
+struct AccessEvent {
+    uint16_t fingerprintId;         /* The Fingerprint ID of the access, 0 for RFID                     */
+    char keyAccessId[40];           /* The Key Access ID of the access                                  */
+    char uidCard[24];               /* The NFC Card UID of the access, empty for Fingerprint            */
 };
 
-struct FingerprintQueueRequest {
+/// @brief Delete request sent to the WiFi Task, lives in `queueRequestPool()` and only its pointer is queued
+struct QueueRequest {
     int request_id;
-    int fingerprintId;
+    SystemState state;
     char username[25];
     char keyAccessId[40];
     char vehicleInformationNumber[24];
-    SystemState state;
-    int statusCode;
 };
 
-struct FingerprintQueueResponse{  
-    int request_id;
-    char response[512];
-};
+typedef SpscRing<AccessEvent, ACCESS_EVENT_RING_SIZE> AccessEventRing;
+
+/**
+ * @brief Blocks of the requests to the WiFi Task, taken by the sending service and released by the WiFi Task
+ *
+ */
+inline MessagePool<QueueRequest, QUEUE_REQUEST_POOL_SIZE> &queueRequestPool() {
+    static MessagePool<QueueRequest, QUEUE_REQUEST_POOL_SIZE> pool;
+    return pool;
+}
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,70 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Lock-free ring of messages between exactly one producer task and one consumer task.
+ *
+ * The producer writes the message straight into its slot with `claim` then makes it visible with
+ * `publish`, the consumer reads it in place with `front` then frees the slot with `pop`, so a message
+ * is never copied through the ring. The ring never blocks, a waiting consumer has to be woken up by
+ * the producer by other means.
+ *
+ * @tparam T Message type of a slot
+ * @tparam N Number of slots, a power of two
+ */
+template <typename T, size_t N>
+class SpscRing {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "SpscRing size must be a power of two");
+
+public:
+    SpscRing() : _head(0), _tail(0) {}
+
+    /**
+     * @brief Producer side, get the next free slot to write a message in
+     *
+     * @return The slot, or `nullptr` if the ring is full
+     */
+    T *claim() {
+        uint32_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail - _head.load(std::memory_order_acquire) >= N) return nullptr;
+        return &_slots[tail & (N - 1)];
+    }
+
+    /**
+     * @brief Producer side, hand the slot returned by `claim` to the consumer
+     *
+     */
+    void publish() {
+        _tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief Consumer side, get the oldest message without taking it out of the ring
+     *
+     * @return The message, or `nullptr` if the ring is empty
+     */
+    T *front() {
+        uint32_t head = _head.load(std::memory_order_relaxed);
+        if (head == _tail.load(std::memory_order_acquire)) return nullptr;
+        return &_slots[head & (N - 1)];
+    }
+
+    /**
+     * @brief Consumer side, free the slot of the message returned by `front`
+     *
+     */
+    void pop() {
+        _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    T _slots[N];
+    std::atomic<uint32_t> _head;    // Count of the messages popped, only written by the consumer
+    std::atomic<uint32_t> _tail;    // Count of the messages published, only written by the producer
+};
+
+#endif
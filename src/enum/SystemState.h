@@ -23,6 +23,9 @@ enum SystemState{
     UPDATE_VISITOR,     /* The state to change system transtition to sync service between esp32 and titan       */
     DOOR_LOCK,          /* The state where the door is locked through a relay or other mechanism.               */
     DOOR_UNLOCK,        /* The state where the door is unlocked, allowing access.                               */
+    GET_ACCESS_LOG,     /* The state to send the local access log of a time range over BLE                      */
+    WIFI_CONFIG,        /* The state to open the WiFi config portal to change the WiFi credentials              */
+    UPDATE_FIRMWARE,    /* The state to pull the delta firmware update from the server                          */
 };
 
 
@@ -12,6 +12,11 @@
 #include "AdafruitNFCSensor.h"
 #include "DoorRelay.h"
 #include "repository/SDCardModule/SDCardModule.h"
+#include "repository/UsageStatsModule/UsageStatsModule.h"
+#include "repository/AuditLogModule/AuditLogModule.h"
+#include "repository/OutboxModule/OutboxModule.h"
+#include "repository/LeaseModule/LeaseModule.h"
+#include "repository/BackupModule/BackupModule.h"
 
 #include "communication/ble/core/BLEModule.h"
 #include "ota/ota.h"
@@ -19,7 +24,10 @@
 #include "service/FingerprintService.h"
 #include "service/NFCService.h"
 #include "service/SyncService.h"
+#include "service/AuditLogService.h"
 #include "service/WifiService.h"
+#include "service/AdminService.h"
+#include "service/ReplicationService.h"
 
 #include "tasks/NFCTask/NFCTask.h"
 #include "tasks/FingerprintTask/FingerprintTask.h"
@@ -33,9 +41,10 @@ static SystemState systemState = RUNNING;
 
 // Initialize queues for sending message between fingerprint, nfc tasks to others
 QueueHandle_t fingerprintQueueRequest;
-QueueHandle_t fingerprintQueueResponse;
 QueueHandle_t nfcQueueRequest;
-QueueHandle_t nfcQueueResponse;
+SemaphoreHandle_t accessEventSignal;
+AccessEventRing nfcAccessEvents;
+AccessEventRing fingerprintAccessEvents;
 
 extern "C" void app_main(void){
     // Initialize the NVS Storage for Bluetooth and Wifi credentials
@@ -51,38 +60,63 @@ extern "C" void app_main(void){
     BLEModule *bleModule = new BLEModule();
     OTA *otaModule = new OTA();
 
-    // Setup BLE
+    // Setup BLE, the command queue has to exist before the first command is written
+    commandBleQueue.setup();
     bleModule -> initBLE();
     bleModule -> setupCharacteristic();
     bleModule -> setupAdvertising();
     
-    // Create a queue for handling WiFi States
-    fingerprintQueueRequest = xQueueCreate(10, sizeof(FingerprintQueueRequest));
-    fingerprintQueueResponse = xQueueCreate(10, sizeof(FingerprintQueueResponse));
-    nfcQueueRequest = xQueueCreate(10, sizeof(NFCQueueRequest));
-    nfcQueueResponse = xQueueCreate(10, sizeof(NFCQueueResponse));
+    // Create a queue for handling WiFi States, the messages live in the pools so the queues only hold their pointers
+    fingerprintQueueRequest = xQueueCreate(QUEUE_REQUEST_POOL_SIZE, sizeof(QueueRequest *));
+    nfcQueueRequest = xQueueCreate(QUEUE_REQUEST_POOL_SIZE, sizeof(QueueRequest *));
+
+    // Wakes up the WiFi Task when an unlock is put in either access event ring
+    accessEventSignal = xSemaphoreCreateBinary();
 
     // Initialize the Sensor and Electrical Components
     SDCardModule *sdCardModule = new SDCardModule();
+    UsageStatsModule *usageStatsModule = new UsageStatsModule();
+    AuditLogModule *auditLogModule = new AuditLogModule();
+    OutboxModule *outboxModule = new OutboxModule();
+    LeaseModule *leaseModule = new LeaseModule();
+    BackupModule *backupModule = new BackupModule(sdCardModule);
+    ReplicationService *replicationService = new ReplicationService(sdCardModule, leaseModule);
     FingerprintSensor *adafruitFingerprintSensor = new AdafruitFingerprintSensor();
     AdafruitNFCSensor *adafruitNFCSensor = new AdafruitNFCSensor();
     DoorRelay *doorRelay = new DoorRelay();
 
+    // The usage statistic, the lease and the replication of a key access go with it, whichever path removed it from the SD Card
+    sdCardModule -> watchRemoved([usageStatsModule, leaseModule, replicationService](LockType type, const char *keyAccessId) {
+        usageStatsModule -> removeKeyAccess(keyAccessId);
+        leaseModule -> revoke(keyAccessId);
+        replicationService -> recordRevoke(type, keyAccessId);
+    });
+
     // Initialize the Service
-    FingerprintService *fingerprintService = new FingerprintService(adafruitFingerprintSensor, sdCardModule, doorRelay, bleModule, fingerprintQueueRequest, fingerprintQueueResponse);
-    NFCService *nfcService = new NFCService(adafruitNFCSensor, sdCardModule, doorRelay, bleModule, nfcQueueRequest, nfcQueueResponse);
-    SyncService *syncService = new SyncService(sdCardModule, bleModule);
-    WifiService *wifiService = new WifiService(bleModule, otaModule, sdCardModule);
+    FingerprintService *fingerprintService = new FingerprintService(adafruitFingerprintSensor, sdCardModule, usageStatsModule, auditLogModule, leaseModule, replicationService, doorRelay, bleModule, &fingerprintAccessEvents, accessEventSignal, fingerprintQueueRequest);
+    NFCService *nfcService = new NFCService(adafruitNFCSensor, sdCardModule, usageStatsModule, auditLogModule, leaseModule, replicationService, doorRelay, bleModule, &nfcAccessEvents, accessEventSignal, nfcQueueRequest);
+    SyncService *syncService = new SyncService(sdCardModule, usageStatsModule, bleModule);
+    AuditLogService *auditLogService = new AuditLogService(auditLogModule, bleModule);
+    WifiService *wifiService = new WifiService(bleModule, otaModule, sdCardModule, outboxModule, leaseModule, backupModule);
+    AdminService *adminService = new AdminService(sdCardModule, outboxModule);
 
     // Initialize the Task
     NFCTask *nfcTask = new NFCTask("NFC Task", 3, nfcService);
     FingerprintTask *fingerprintTask = new FingerprintTask("Fingerprint Task", 3, fingerprintService);
-    WifiTask *wifiTask = new WifiTask("Wifi Task", 10, wifiService, nfcQueueRequest, nfcQueueResponse, fingerprintQueueRequest, fingerprintQueueResponse);
+    WifiTask *wifiTask = new WifiTask("Wifi Task", 10, wifiService, outboxModule, &nfcAccessEvents, &fingerprintAccessEvents, accessEventSignal, nfcQueueRequest, fingerprintQueueRequest);
 
     // Start Task
     nfcTask -> startTask();
     fingerprintTask -> startTask();
     wifiTask -> startTask();     // Setup Wifi Task
+    usageStatsModule -> startFlushTask();
+    adminService -> start();     // Only with a token, answers on the local network once the WiFi is connected
+    replicationService -> start();   // Gossips the key access with the other controllers when `REPLICATION_ENABLED`
+
+    // A new firmware is kept once its tasks run and the key access store can be read, without waiting
+    // for the WiFi, so an update over BLE on a device without network does not roll back on the next reset
+    if (sdCardModule -> selfTest()) otaModule -> confirmRunningImage();
+    else ESP_LOGE(LOG_TAG, "Self-test failed, a new firmware rolls back on the next restart");
 
     // Checking the heap size after task init start task creation
     ESP_LOGI(LOG_TAG, "Heap Size Information!");
@@ -90,70 +124,31 @@ extern "C" void app_main(void){
     ESP_LOGI(LOG_TAG, "Free heap: %u bytes", ESP.getFreeHeap());
     ESP_LOGI(LOG_TAG, "Minimum free heap ever: %u bytes", ESP.getMinFreeHeap());
      
+    // Holds the command being run, copied out of the queue so the BLE can queue the next ones meanwhile
+    CommandBleData commandData;
+
     // Loop Main Mechanism
     while (1) {
+        // Sleep until DoorInfoService queues a command, then run it right away
+        if (!commandBleQueue.receive(commandData, portMAX_DELAY)) continue;
         ESP_LOGD(LOG_TAG, "Running Main Thread");
 
-        // Access current command data from extern static
-        const char *command = commandBleData.getCommand();
-        const char *name = commandBleData.getName();
-        const char *visitorId = commandBleData.getVisitorId();
-        const char *keyAccessId = commandBleData.getKeyAccess();
+        const char *command = commandData.command;
+        const char *name = commandData.getName();
+        const char *visitorId = commandData.getVisitorId();
+        const char *keyAccessId = commandData.getKeyAccess();
+
+        // The BLE already looked the command up in the command table
+        systemState = commandData.state;
 
         switch (systemState) {
-            case RUNNING:
-                if (command != nullptr) {
-                    if (strcmp(command, "register_fp") == 0) {
-                        systemState = ENROLL_FP;
-                    }
-                    if (strcmp(command, "delete_fp") == 0) {
-                        systemState = DELETE_FP;
-                    }
-                    if (strcmp(command, "delete_fp_user") == 0){
-                        systemState = DELETE_FP_USER;
-                    }
-                    if (strcmp(command, "delete_fp_sensor") == 0){
-                        systemState = DELETE_FP_SENSOR;
-                    }
-                    if (strcmp(command, "delete_fp_fs") == 0){
-                        systemState = DELETE_FP_FS;
-                    }
-                    if (strcmp(command, "register_rfid") == 0) {
-                        systemState = ENROLL_RFID;
-                    }
-                    if (strcmp(command, "delete_rfid") == 0) {
-                        systemState = DELETE_RFID;
-                    }
-                    if (strcmp(command, "delete_rfid_user") == 0){
-                        systemState = DELETE_RFID_USER;
-                    }
-                    if (strcmp(command, "delete_rfid_fs") == 0){
-                        systemState = DELETE_RFID_FS;
-                    }
-                    if (strcmp(command, "update_visitor") == 0) {
-                        systemState = UPDATE_VISITOR;
-                    }
-                    if (strcmp(command, "delete_access_user") == 0){
-                        systemState = DELETE_ACCESS_USER;
-                    }
-                    if (strcmp(command, "door_lock") == 0){
-                        systemState = DOOR_LOCK;
-                    }
-                    if (strcmp(command, "door_unlock") == 0){
-                        systemState = DOOR_UNLOCK;
-                    }
-                }
-                break;
-            
             case ENROLL_RFID:
                 ESP_LOGI(LOG_TAG,"Start Registering RFID!");
                 nfcTask -> suspendTask();
 
                 nfcService->addNFC(name, visitorId, keyAccessId);
-                vTaskDelay(1000 / portTICK_PERIOD_MS);
 
                 systemState = RUNNING;
-                commandBleData.clear();
                 nfcTask->resumeTask();
                 break;
 
@@ -162,10 +157,8 @@ extern "C" void app_main(void){
                 nfcTask->suspendTask();
 
                 nfcService->deleteNFC(keyAccessId);
-                vTaskDelay(1000 / portTICK_PERIOD_MS);
 
                 systemState = RUNNING;
-                commandBleData.clear();
                 nfcTask->resumeTask();
                 break;
 
@@ -174,10 +167,8 @@ extern "C" void app_main(void){
                 nfcTask->suspendTask();
 
                 nfcService->deleteNFCsUser(visitorId);
-                vTaskDelay(1000 / portTICK_PERIOD_MS);
 
                 systemState = RUNNING;
-                commandBleData.clear();
                 nfcTask->resumeTask();
                 break;
 
@@ -186,10 +177,8 @@ extern "C" void app_main(void){
                 nfcTask->suspendTask();
 
                 nfcService->deleteNFCAccessFile();
-                vTaskDelay(1000 / portTICK_PERIOD_MS);
 
                 systemState = RUNNING;
-                commandBleData.clear();
                 nfcTask->resumeTask();
                 break;
 
@@ -198,10 +187,8 @@ extern "C" void app_main(void){
                 fingerprintTask->suspendTask();
 
                 fingerprintService->addFingerprint(name, visitorId, keyAccessId);
-                vTaskDelay(1000 / portTICK_PERIOD_MS);
 
                 systemState = RUNNING;
-                commandBleData.clear();
                 fingerprintTask->resumeTask();
                 break;
 
@@ -210,10 +197,8 @@ extern "C" void app_main(void){
                 fingerprintTask->suspendTask();
                 
                 fingerprintService->deleteFingerprint(keyAccessId);
-                vTaskDelay(1000 / portTICK_PERIOD_MS);
                 
                 systemState = RUNNING;
-                commandBleData.clear();
                 fingerprintTask->resumeTask();
                 break;
                 
@@ -222,10 +207,8 @@ extern "C" void app_main(void){
                 fingerprintTask->suspendTask();
 
                 fingerprintService->deleteFingerprintsUser(visitorId);
-                vTaskDelay(1000 / portTICK_PERIOD_MS);
 
                 systemState = RUNNING;
-                commandBleData.clear();
                 fingerprintTask->resumeTask();
                 break;
 
@@ -234,10 +217,8 @@ extern "C" void app_main(void){
                 fingerprintTask->suspendTask();
 
                 fingerprintService->deleteFingerprintAccessFile();
-                vTaskDelay(1000 / portTICK_PERIOD_MS);
 
                 systemState = RUNNING;
-                commandBleData.clear();
                 fingerprintTask->resumeTask();
                 break;
 
@@ -246,10 +227,8 @@ extern "C" void app_main(void){
                 fingerprintTask->suspendTask();
 
                 fingerprintService->deleteAllFingerprintModel();
-                vTaskDelay(1000 / portTICK_PERIOD_MS);
 
                 systemState = RUNNING;
-                commandBleData.clear();
                 fingerprintTask->resumeTask();
                 break;
 
@@ -288,10 +267,8 @@ extern "C" void app_main(void){
                     ESP_LOGW(LOG_TAG, "Both key access entries failed to delete for Visitor ID: %s", visitorId);
                     bleModule->sendReport(FAILED_DELETE_USERS_KEY_ACCESS);
                 }
-                vTaskDelay(1000 / portTICK_PERIOD_MS);
                 
                 systemState = RUNNING;
-                commandBleData.clear();
                 fingerprintTask->resumeTask();
                 nfcTask->resumeTask();
                 }
@@ -303,10 +280,8 @@ extern "C" void app_main(void){
                 nfcTask->suspendTask();
 
                 syncService->sync();
-                vTaskDelay(1000 / portTICK_PERIOD_MS);
 
                 systemState = RUNNING;
-                commandBleData.clear();
                 fingerprintTask->resumeTask();
                 nfcTask->resumeTask();
                 break;
@@ -315,26 +290,50 @@ extern "C" void app_main(void){
                 ESP_LOGI(LOG_TAG, "Closing the Door!");
                 doorRelay->lockRelay();
 
-                vTaskDelay(100 / portTICK_PERIOD_MS);
-
                 systemState = RUNNING;
-                commandBleData.clear();
                 break;
 
             case DOOR_UNLOCK:
                 ESP_LOGI(LOG_TAG, "Opening the Door!");
                 doorRelay->unlockRelay();
 
-                vTaskDelay(100 / portTICK_PERIOD_MS);
+                systemState = RUNNING;
+                break;
+
+            case GET_ACCESS_LOG:
+                ESP_LOGI(LOG_TAG, "Start Sending Access Log!");
+                auditLogService->sendAccessLog(commandData.from, commandData.to);
 
                 systemState = RUNNING;
-                commandBleData.clear();
+                break;
+
+            case WIFI_CONFIG:
+                ESP_LOGI(LOG_TAG, "Opening WiFi Config Portal!");
+                // The portal runs on the WiFi reconnect job, the saved WiFi is kept until a new one is entered
+                wifiService->openConfigPortal();
+
+                systemState = RUNNING;
+                break;
+
+            case UPDATE_FIRMWARE:
+                {
+                ESP_LOGI(LOG_TAG, "Start Updating Firmware!");
+                OTAResult result = wifiService->updateFirmware();
+
+                if (result == OTA_UPDATED) {
+                    bleModule->sendReport(SUCCESS_UPDATING_FIRMWARE);
+                    vTaskDelay(1000 / portTICK_PERIOD_MS); // Give time for the report to be sent before restarting
+                    esp_restart();
+                }
+                bleModule->sendReport(result == OTA_UP_TO_DATE ? STATUS_FIRMWARE_UP_TO_DATE : FAILED_TO_UPDATE_FIRMWARE);
+
+                systemState = RUNNING;
+                }
                 break;
 
             default:
+                ESP_LOGW(LOG_TAG, "Unknown command '%s', skipping it", command);
                 break;
         }
-
-        vTaskDelay(50 / portTICK_PERIOD_MS);
     }
 }
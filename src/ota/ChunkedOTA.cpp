@@ -0,0 +1,388 @@
+#define CHUNKED_OTA_LOG_TAG "CHUNKED_OTA"
+
+#include "ChunkedOTA.h"
+#include <esp_log.h>
+#include <esp_ota_ops.h>
+#include <nvs.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/sha256.h>
+
+#include "config/Config.h"
+
+static bool decodeHex(const char *hex, uint8_t *data, size_t size) {
+    if (hex == nullptr || strlen(hex) != size * 2) return false;
+
+    for (size_t i = 0; i < size; i++) {
+        char byte[3] = { hex[i * 2], hex[i * 2 + 1], '\0' };
+        char *end;
+        data[i] = strtoul(byte, &end, 16);
+        if (*end != '\0') return false;
+    }
+    return true;
+}
+
+ChunkedOTA::ChunkedOTA() {}
+
+/**
+ * @brief Download the firmware of the manifest into the inactive OTA partition, resuming a previous download.
+ *
+ * Every chunk is requested with a `Range` header, written to flash while it is received and checked
+ * against its SHA-256 from the signed manifest. The progress is saved in NVS after every verified
+ * chunk, so a lost connection or a reboot only costs the chunk that was in flight. A manifest for a
+ * different image, or another target partition, starts the download over.
+ *
+ * @param manifestUrl The url of the signed manifest
+ * @param imageUrl The url of the firmware image, must support `Range` requests
+ * @param currentVersion The version of the running firmware, nothing is downloaded if the manifest has the same
+ * @return `OTA_UPDATED` if the device should be restarted, see `OTAResult`
+ */
+OTAResult ChunkedOTA::update(const char *manifestUrl, const char *imageUrl, const char *currentVersion) {
+    OTAManifest manifest;
+    manifest.chunkSha256 = nullptr;
+    if (!fetchManifest(manifestUrl, manifest)) {
+        free(manifest.chunkSha256);
+        return OTA_FAILED;
+    }
+
+    if (strcmp(manifest.version, currentVersion) == 0) {
+        ESP_LOGI(CHUNKED_OTA_LOG_TAG, "Firmware %s is up to date.", currentVersion);
+        free(manifest.chunkSha256);
+        clearProgress();
+        return OTA_UP_TO_DATE;
+    }
+
+    const esp_partition_t *partition = esp_ota_get_next_update_partition(NULL);
+    if (partition == NULL || manifest.size > partition->size) {
+        ESP_LOGE(CHUNKED_OTA_LOG_TAG, "Firmware %s does not fit the OTA partition.", manifest.version);
+        free(manifest.chunkSha256);
+        return OTA_FAILED;
+    }
+
+    OTAChunkProgress progress;
+    bool resumed = loadProgress(progress)
+        && memcmp(progress.imageSha256, manifest.imageSha256, sizeof(progress.imageSha256)) == 0
+        && progress.partitionAddress == partition->address
+        && progress.chunkSize == manifest.chunkSize
+        && progress.nextChunk <= manifest.chunkCount;
+
+    if (!resumed) {
+        memcpy(progress.imageSha256, manifest.imageSha256, sizeof(progress.imageSha256));
+        progress.partitionAddress = partition->address;
+        progress.chunkSize = manifest.chunkSize;
+        progress.nextChunk = 0;
+        saveProgress(progress);
+    }
+
+    ESP_LOGI(CHUNKED_OTA_LOG_TAG, "%s firmware %s at chunk %lu of %lu into partition %s.", resumed ? "Resuming" : "Downloading",
+        manifest.version, (unsigned long)progress.nextChunk, (unsigned long)manifest.chunkCount, partition->label);
+
+    WiFiClient client;
+    HTTPClient http;
+    http.setReuse(true);        // Every chunk is requested over the same connection
+    http.setTimeout(OTA_CHUNK_TIMEOUT_MS);
+
+    uint32_t received = 0;
+    bool complete = true;
+    while (progress.nextChunk < manifest.chunkCount) {
+        bool verified = false;
+        for (int attempt = 0; attempt < OTA_CHUNK_RETRIES && !verified; attempt++) {
+            verified = downloadChunk(http, client, imageUrl, partition, manifest, progress.nextChunk, received);
+        }
+
+        if (!verified) {
+            ESP_LOGE(CHUNKED_OTA_LOG_TAG, "Failed to download chunk %lu, will resume from it later.", (unsigned long)progress.nextChunk);
+            complete = false;
+            break;
+        }
+
+        progress.nextChunk++;
+        saveProgress(progress);
+        ESP_LOGI(CHUNKED_OTA_LOG_TAG, "OTA Progress: %lu/%lu chunks", (unsigned long)progress.nextChunk, (unsigned long)manifest.chunkCount);
+    }
+    http.end();
+
+    ESP_LOGI(CHUNKED_OTA_LOG_TAG, "Received %lu bytes for a %lu byte image in this session.", (unsigned long)received, (unsigned long)manifest.size);
+    if (!complete) {
+        free(manifest.chunkSha256);
+        return OTA_FAILED;
+    }
+
+    // The partition could have been written by another update since the chunks were verified
+    bool valid = verifyImage(partition, manifest);
+    free(manifest.chunkSha256);
+    clearProgress();
+
+    // Also validates the app image before it can be booted
+    if (!valid || esp_ota_set_boot_partition(partition) != ESP_OK) {
+        ESP_LOGE(CHUNKED_OTA_LOG_TAG, "Firmware in partition %s is not valid, the download starts over next time.", partition->label);
+        return OTA_FAILED;
+    }
+
+    ESP_LOGI(CHUNKED_OTA_LOG_TAG, "OTA update finished. Will boot partition %s on the next restart.", partition->label);
+    return OTA_UPDATED;
+}
+
+/**
+ * @brief Check if a download was interrupted and should be resumed.
+ *
+ * @return `true` if there is saved progress of a download, `false` otherwise.
+ */
+bool ChunkedOTA::hasPendingUpdate() {
+    OTAChunkProgress progress;
+    return loadProgress(progress);
+}
+
+/**
+ * @brief Download the manifest and check its signature.
+ *
+ * @param manifestUrl The url of the manifest
+ * @param manifest The manifest to fill, `chunkSha256` is allocated and must be freed by the caller
+ * @return `true` if the manifest is valid and signed with `OTA_MANIFEST_PUBLIC_KEY`, `false` otherwise.
+ */
+bool ChunkedOTA::fetchManifest(const char *manifestUrl, OTAManifest &manifest) {
+    WiFiClient client;
+    HTTPClient http;
+    http.useHTTP10(true);       // No chunked encoding, the manifest is parsed straight from the socket
+    http.setTimeout(OTA_CHUNK_TIMEOUT_MS);
+    http.begin(client, manifestUrl);
+
+    int httpResponseCode = http.GET();
+    if (httpResponseCode != HTTP_CODE_OK) {
+        ESP_LOGE(CHUNKED_OTA_LOG_TAG, "Failed to download the manifest: %d", httpResponseCode);
+        http.end();
+        return false;
+    }
+
+    JsonDocument document;
+    DeserializationError error = deserializeJson(document, http.getStream());
+    http.end();
+
+    if (error) {
+        ESP_LOGE(CHUNKED_OTA_LOG_TAG, "Failed to parse the manifest: %s", error.c_str());
+        return false;
+    }
+    return parseManifest(document, manifest);
+}
+
+/**
+ * @brief Read the fields of the manifest and check its signature.
+ *
+ * The manifest is `{"version", "size", "chunk_size", "sha256", "chunks": [...], "signature"}` with the
+ * hashes in hex and the signature as a hex DER ECDSA signature, see `verifySignature`.
+ *
+ * @param document The parsed manifest
+ * @param manifest The manifest to fill
+ * @return `true` if the manifest is valid, `false` otherwise.
+ */
+bool ChunkedOTA::parseManifest(JsonDocument &document, OTAManifest &manifest) {
+    const char *version = document["version"];
+    JsonArrayConst chunks = document["chunks"];
+    const char *signatureHex = document["signature"];
+
+    manifest.size = document["size"] | 0;
+    manifest.chunkSize = document["chunk_size"] | 0;
+    manifest.chunkCount = chunks.size();
+
+    if (version == nullptr || strlen(version) >= sizeof(manifest.version) || signatureHex == nullptr
+        || manifest.size == 0 || manifest.chunkSize < OTA_CHUNK_MIN_SIZE || manifest.chunkSize % OTA_CHUNK_MIN_SIZE != 0
+        || manifest.chunkCount == 0 || manifest.chunkCount > OTA_CHUNK_MAX_COUNT
+        || manifest.chunkCount != (manifest.size + manifest.chunkSize - 1) / manifest.chunkSize
+        || !decodeHex(document["sha256"], manifest.imageSha256, sizeof(manifest.imageSha256))) {
+        ESP_LOGE(CHUNKED_OTA_LOG_TAG, "Invalid manifest.");
+        return false;
+    }
+    snprintf(manifest.version, sizeof(manifest.version), "%s", version);
+
+    manifest.chunkSha256 = (uint8_t (*)[32])malloc(manifest.chunkCount * 32);
+    if (manifest.chunkSha256 == nullptr) {
+        ESP_LOGE(CHUNKED_OTA_LOG_TAG, "Not enough memory for %lu chunk hashes.", (unsigned long)manifest.chunkCount);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < manifest.chunkCount; i++) {
+        if (!decodeHex(chunks[i], manifest.chunkSha256[i], 32)) {
+            ESP_LOGE(CHUNKED_OTA_LOG_TAG, "Invalid hash of chunk %lu in the manifest.", (unsigned long)i);
+            return false;
+        }
+    }
+
+    uint8_t signature[OTA_SIGNATURE_MAX_SIZE];
+    size_t signatureLength = strlen(signatureHex) / 2;
+    if (signatureLength > sizeof(signature) || !decodeHex(signatureHex, signature, signatureLength)) {
+        ESP_LOGE(CHUNKED_OTA_LOG_TAG, "Invalid signature encoding in the manifest.");
+        return false;
+    }
+    return verifySignature(manifest, signature, signatureLength);
+}
+
+/**
+ * @brief Check the ECDSA P-256 signature of the manifest with `OTA_MANIFEST_PUBLIC_KEY`.
+ *
+ * The signed message is the version, a newline, the size and the chunk size as little endian
+ * 32 bit integers, the image hash and every chunk hash, hashed with SHA-256.
+ *
+ * @return `true` if the signature is valid, `false` otherwise.
+ */
+bool ChunkedOTA::verifySignature(const OTAManifest &manifest, const uint8_t *signature, size_t length) {
+#if !OTA_SIGNED_UPDATES_ENABLED
+    ESP_LOGE(CHUNKED_OTA_LOG_TAG, "Built without OTA_MANIFEST_PUBLIC_KEY, no manifest can be trusted");
+    return false;
+#else
+    uint8_t sizes[8];
+    for (int i = 0; i < 4; i++) {
+        sizes[i] = manifest.size >> (8 * i);
+        sizes[4 + i] = manifest.chunkSize >> (8 * i);
+    }
+
+    uint8_t digest[32];
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+    mbedtls_sha256_update(&sha, (const uint8_t*)manifest.version, strlen(manifest.version));
+    mbedtls_sha256_update(&sha, (const uint8_t*)"\n", 1);
+    mbedtls_sha256_update(&sha, sizes, sizeof(sizes));
+    mbedtls_sha256_update(&sha, manifest.imageSha256, sizeof(manifest.imageSha256));
+    mbedtls_sha256_update(&sha, (const uint8_t*)manifest.chunkSha256, manifest.chunkCount * 32);
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+
+    mbedtls_pk_context key;
+    mbedtls_pk_init(&key);
+    const char *publicKey = OTA_MANIFEST_PUBLIC_KEY;
+    int result = mbedtls_pk_parse_public_key(&key, (const uint8_t*)publicKey, strlen(publicKey) + 1);
+    if (result == 0) result = mbedtls_pk_verify(&key, MBEDTLS_MD_SHA256, digest, sizeof(digest), signature, length);
+    mbedtls_pk_free(&key);
+
+    if (result != 0) ESP_LOGE(CHUNKED_OTA_LOG_TAG, "Manifest signature is not valid: -0x%04x", -result);
+    return result == 0;
+#endif
+}
+
+/**
+ * @brief Download a chunk of the image into the partition and check its hash.
+ *
+ * @param http The client kept over the whole update, so the connection is reused
+ * @param client The socket of the client
+ * @param imageUrl The url of the firmware image
+ * @param partition The partition to write to
+ * @param manifest The manifest of the image
+ * @param index The index of the chunk
+ * @param received Increased by the number of bytes received
+ * @return `true` if the chunk is written and its hash matches, `false` otherwise.
+ */
+bool ChunkedOTA::downloadChunk(HTTPClient &http, WiFiClient &client, const char *imageUrl, const esp_partition_t *partition,
+                               const OTAManifest &manifest, uint32_t index, uint32_t &received) {
+    uint32_t offset = index * manifest.chunkSize;
+    uint32_t length = manifest.size - offset < manifest.chunkSize ? manifest.size - offset : manifest.chunkSize;
+
+    // Chunks are whole sectors, the partition ends on a sector too
+    uint32_t eraseLength = (length + OTA_CHUNK_MIN_SIZE - 1) / OTA_CHUNK_MIN_SIZE * OTA_CHUNK_MIN_SIZE;
+    if (esp_partition_erase_range(partition, offset, eraseLength) != ESP_OK) {
+        ESP_LOGE(CHUNKED_OTA_LOG_TAG, "Failed to erase chunk %lu.", (unsigned long)index);
+        return false;
+    }
+
+    char range[48];
+    snprintf(range, sizeof(range), "bytes=%lu-%lu", (unsigned long)offset, (unsigned long)(offset + length - 1));
+    http.begin(client, imageUrl);
+    http.addHeader("Range", range);
+
+    int httpResponseCode = http.GET();
+    if (httpResponseCode != HTTP_CODE_PARTIAL_CONTENT || http.getSize() != (int)length) {
+        ESP_LOGW(CHUNKED_OTA_LOG_TAG, "Unexpected response for chunk %lu: %d, %d bytes", (unsigned long)index, httpResponseCode, http.getSize());
+        http.end();
+        return false;
+    }
+
+    uint8_t buffer[OTA_CHUNK_BUFFER_SIZE];
+    WiFiClient *stream = http.getStreamPtr();
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+
+    uint32_t written = 0;
+    while (written < length) {
+        size_t wanted = length - written < sizeof(buffer) ? length - written : sizeof(buffer);
+        size_t read = stream->readBytes(buffer, wanted);
+        if (read == 0) break;
+
+        received += read;
+        mbedtls_sha256_update(&sha, buffer, read);
+        if (esp_partition_write(partition, offset + written, buffer, read) != ESP_OK) break;
+        written += read;
+    }
+
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+
+    // A short read leaves the connection in an unknown state, the next chunk opens a new one
+    if (written < length) {
+        ESP_LOGW(CHUNKED_OTA_LOG_TAG, "Chunk %lu interrupted after %lu of %lu bytes.", (unsigned long)index, (unsigned long)written, (unsigned long)length);
+        client.stop();
+        http.end();
+        return false;
+    }
+    http.end();
+
+    if (memcmp(digest, manifest.chunkSha256[index], sizeof(digest)) != 0) {
+        ESP_LOGW(CHUNKED_OTA_LOG_TAG, "Hash of chunk %lu does not match the manifest.", (unsigned long)index);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Check the whole image in the partition against the hash of the manifest.
+ *
+ * @return `true` if the image matches, `false` otherwise.
+ */
+bool ChunkedOTA::verifyImage(const esp_partition_t *partition, const OTAManifest &manifest) {
+    uint8_t buffer[OTA_CHUNK_BUFFER_SIZE];
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+
+    bool ok = true;
+    for (uint32_t offset = 0; offset < manifest.size && ok; offset += sizeof(buffer)) {
+        size_t length = manifest.size - offset < sizeof(buffer) ? manifest.size - offset : sizeof(buffer);
+        ok = esp_partition_read(partition, offset, buffer, length) == ESP_OK;
+        if (ok) mbedtls_sha256_update(&sha, buffer, length);
+    }
+
+    uint8_t digest[32];
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    return ok && memcmp(digest, manifest.imageSha256, sizeof(digest)) == 0;
+}
+
+bool ChunkedOTA::loadProgress(OTAChunkProgress &progress) {
+    nvs_handle_t handle;
+    if (nvs_open(OTA_CHUNK_NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) return false;
+
+    size_t length = sizeof(progress);
+    esp_err_t err = nvs_get_blob(handle, OTA_CHUNK_NVS_KEY, &progress, &length);
+    nvs_close(handle);
+    return err == ESP_OK && length == sizeof(progress);
+}
+
+bool ChunkedOTA::saveProgress(const OTAChunkProgress &progress) {
+    nvs_handle_t handle;
+    if (nvs_open(OTA_CHUNK_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) return false;
+
+    esp_err_t err = nvs_set_blob(handle, OTA_CHUNK_NVS_KEY, &progress, sizeof(progress));
+    if (err == ESP_OK) err = nvs_commit(handle);
+    nvs_close(handle);
+
+    if (err != ESP_OK) ESP_LOGE(CHUNKED_OTA_LOG_TAG, "Failed to save the download progress: %s", esp_err_to_name(err));
+    return err == ESP_OK;
+}
+
+void ChunkedOTA::clearProgress() {
+    nvs_handle_t handle;
+    if (nvs_open(OTA_CHUNK_NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) return;
+
+    nvs_erase_key(handle, OTA_CHUNK_NVS_KEY);
+    nvs_commit(handle);
+    nvs_close(handle);
+}
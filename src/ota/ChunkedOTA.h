@@ -0,0 +1,58 @@
+#ifndef CHUNKED_OTA_H
+#define CHUNKED_OTA_H
+
+#include <HTTPClient.h>
+#include <ArduinoJson.h>
+#include <esp_partition.h>
+
+#include "ota.h"
+
+#define OTA_CHUNK_NVS_NAMESPACE     "ota"
+#define OTA_CHUNK_NVS_KEY           "progress"
+#define OTA_CHUNK_MIN_SIZE          4096            // Chunks are whole flash sectors, so a chunk is erased without touching the others
+#define OTA_CHUNK_MAX_COUNT         512             // Most chunks in a manifest, enough for a full app partition of 4 KB chunks
+#define OTA_CHUNK_RETRIES           3               // Downloads of a chunk whose hash does not match before giving up
+#define OTA_CHUNK_BUFFER_SIZE       1024            // Bytes of a chunk read from the socket at once
+#define OTA_CHUNK_TIMEOUT_MS        15000           // Longest wait for the next bytes of a chunk
+#define OTA_SIGNATURE_MAX_SIZE      128             // Longest DER encoded signature of the manifest
+
+/// @brief The download progress kept in NVS, so an update resumes after a reconnect or a reboot
+struct OTAChunkProgress {
+    uint8_t imageSha256[32];    /* SHA-256 of the image being downloaded, a new manifest starts over    */
+    uint32_t partitionAddress;  /* The partition the chunks are written to                               */
+    uint32_t chunkSize;
+    uint32_t nextChunk;         /* The first chunk that is not written and verified yet                  */
+};
+
+/// @brief The signed description of a firmware image, split in chunks of `chunkSize` bytes
+struct OTAManifest {
+    char version[32];
+    uint32_t size;              /* Bytes of the image                                                    */
+    uint32_t chunkSize;
+    uint32_t chunkCount;
+    uint8_t imageSha256[32];
+    uint8_t (*chunkSha256)[32]; /* SHA-256 of every chunk, the last chunk may be shorter                 */
+};
+
+/// @brief Downloads a full firmware image in verified chunks, resuming from the first unverified chunk
+class ChunkedOTA {
+public:
+    ChunkedOTA();
+
+    OTAResult update(const char *manifestUrl, const char *imageUrl, const char *currentVersion);
+    bool hasPendingUpdate();
+    bool fetchManifest(const char *manifestUrl, OTAManifest &manifest);
+
+private:
+    bool parseManifest(JsonDocument &document, OTAManifest &manifest);
+    bool verifySignature(const OTAManifest &manifest, const uint8_t *signature, size_t length);
+    bool downloadChunk(HTTPClient &http, WiFiClient &client, const char *imageUrl, const esp_partition_t *partition,
+                       const OTAManifest &manifest, uint32_t index, uint32_t &received);
+    bool verifyImage(const esp_partition_t *partition, const OTAManifest &manifest);
+
+    bool loadProgress(OTAChunkProgress &progress);
+    bool saveProgress(const OTAChunkProgress &progress);
+    void clearProgress();
+};
+
+#endif
@@ -0,0 +1,217 @@
+#include "DeltaPatch.h"
+#include <string.h>
+
+// Kept free of any ESP-IDF or Arduino dependency, so the host tool applies patches with the same code
+static uint32_t readUint32(const uint8_t *data) {
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static void writeUint32(uint8_t *data, uint32_t value) {
+    data[0] = value;
+    data[1] = value >> 8;
+    data[2] = value >> 16;
+    data[3] = value >> 24;
+}
+
+DeltaPatch::DeltaPatch(DeltaReadFunction readOld, DeltaWriteFunction writeNew)
+    : _readOld(readOld), _writeNew(writeNew), _state(DELTA_STATE_FAILED), _oldSize(0), _newSize(0),
+      _oldPosition(0), _newPosition(0), _controlLength(0), _diffRemaining(0), _extraRemaining(0), _seek(0) {}
+
+/**
+ * @brief Parse the header at the start of a patch.
+ *
+ * @param data The first bytes of the patch
+ * @param length The number of bytes, at least `DELTA_HEADER_SIZE`
+ * @param header The header to fill
+ * @return `true` if the header is valid and of a supported version, `false` otherwise.
+ */
+bool DeltaPatch::parseHeader(const uint8_t *data, size_t length, DeltaHeader &header) {
+    if (length < DELTA_HEADER_SIZE || memcmp(data, DELTA_MAGIC, DELTA_MAGIC_SIZE) != 0) return false;
+
+    header.version = readUint32(data + 8);
+    header.oldSize = readUint32(data + 12);
+    header.newSize = readUint32(data + 16);
+    header.flags = readUint32(data + 20);
+    memcpy(header.oldSha256, data + 24, sizeof(header.oldSha256));
+    memcpy(header.newSha256, data + 56, sizeof(header.newSha256));
+
+    return header.version == DELTA_VERSION && header.flags == 0;
+}
+
+/**
+ * @brief Write the header at the start of a patch.
+ *
+ * @param header The header to write
+ * @param data The buffer of `DELTA_HEADER_SIZE` bytes
+ */
+void DeltaPatch::serializeHeader(const DeltaHeader &header, uint8_t *data) {
+    memcpy(data, DELTA_MAGIC, DELTA_MAGIC_SIZE);
+    writeUint32(data + 8, header.version);
+    writeUint32(data + 12, header.oldSize);
+    writeUint32(data + 16, header.newSize);
+    writeUint32(data + 20, header.flags);
+    memcpy(data + 24, header.oldSha256, sizeof(header.oldSha256));
+    memcpy(data + 56, header.newSha256, sizeof(header.newSha256));
+}
+
+/**
+ * @brief Start applying a new patch.
+ *
+ * @param header The header of the patch, see `parseHeader`
+ */
+void DeltaPatch::begin(const DeltaHeader &header) {
+    _oldSize = header.oldSize;
+    _newSize = header.newSize;
+    _oldPosition = 0;
+    _newPosition = 0;
+    _controlLength = 0;
+    _state = _newSize == 0 ? DELTA_STATE_DONE : DELTA_STATE_CONTROL;
+}
+
+/**
+ * @brief Apply the next decompressed bytes of the patch records.
+ *
+ * The bytes can be split anywhere, a record may span several calls.
+ *
+ * @param data The decompressed patch bytes
+ * @param length The number of bytes
+ * @return `true` if the bytes are applied, `false` if the patch is invalid or the old image could
+ * not be read or the new image could not be written.
+ */
+bool DeltaPatch::write(const uint8_t *data, size_t length) {
+    while (length > 0 && _state != DELTA_STATE_FAILED) {
+        size_t used = 0;
+
+        switch (_state) {
+            case DELTA_STATE_CONTROL:
+                used = DELTA_CONTROL_SIZE - _controlLength;
+                if (used > length) used = length;
+                memcpy(_control + _controlLength, data, used);
+                _controlLength += used;
+                if (_controlLength == DELTA_CONTROL_SIZE && !startRecord()) _state = DELTA_STATE_FAILED;
+                break;
+
+            case DELTA_STATE_DIFF:
+                used = applyDiff(data, length);
+                break;
+
+            case DELTA_STATE_EXTRA:
+                used = applyExtra(data, length);
+                break;
+
+            default:
+                // Bytes after the end of the new image
+                _state = DELTA_STATE_FAILED;
+                break;
+        }
+
+        data += used;
+        length -= used;
+    }
+    return _state != DELTA_STATE_FAILED;
+}
+
+/**
+ * @brief Check if the whole new image has been written.
+ *
+ * @return `true` if every byte of the new image is written, `false` otherwise.
+ */
+bool DeltaPatch::isComplete() const {
+    return _state == DELTA_STATE_DONE;
+}
+
+/**
+ * @brief Check if the patch could not be applied.
+ *
+ * @return `true` if the patch is invalid or a read/write failed, `false` otherwise.
+ */
+bool DeltaPatch::hasFailed() const {
+    return _state == DELTA_STATE_FAILED;
+}
+
+/**
+ * @brief Get the number of bytes of the new image written so far.
+ *
+ * @return The number of bytes
+ */
+uint32_t DeltaPatch::written() const {
+    return _newPosition;
+}
+
+/**
+ * @brief Start the record of the control block that was just read.
+ *
+ * @return `true` if the record stays inside the old and new image, `false` otherwise.
+ */
+bool DeltaPatch::startRecord() {
+    _controlLength = 0;
+    _diffRemaining = readUint32(_control);
+    _extraRemaining = readUint32(_control + 4);
+    _seek = (int32_t)readUint32(_control + 8);
+
+    if ((uint64_t)_newPosition + _diffRemaining + _extraRemaining > _newSize) return false;
+    if (_diffRemaining > 0 && (_oldPosition < 0 || _oldPosition + _diffRemaining > _oldSize)) return false;
+
+    if (_diffRemaining > 0) _state = DELTA_STATE_DIFF;
+    else if (_extraRemaining > 0) _state = DELTA_STATE_EXTRA;
+    else endRecord();
+    return true;
+}
+
+void DeltaPatch::endRecord() {
+    _oldPosition += _seek;
+    _state = _newPosition == _newSize ? DELTA_STATE_DONE : DELTA_STATE_CONTROL;
+}
+
+/**
+ * @brief Add the diff bytes to the old image and write the result to the new image.
+ *
+ * @return The number of bytes used
+ */
+size_t DeltaPatch::applyDiff(const uint8_t *data, size_t length) {
+    size_t used = _diffRemaining;
+    if (used > length) used = length;
+    if (used > sizeof(_oldChunk)) used = sizeof(_oldChunk);
+
+    if (!_readOld((uint32_t)_oldPosition, _oldChunk, used)) {
+        _state = DELTA_STATE_FAILED;
+        return used;
+    }
+
+    for (size_t i = 0; i < used; i++) _oldChunk[i] += data[i];
+    if (!_writeNew(_oldChunk, used)) {
+        _state = DELTA_STATE_FAILED;
+        return used;
+    }
+
+    _oldPosition += used;
+    _newPosition += used;
+    _diffRemaining -= used;
+
+    if (_diffRemaining == 0) {
+        if (_extraRemaining > 0) _state = DELTA_STATE_EXTRA;
+        else endRecord();
+    }
+    return used;
+}
+
+/**
+ * @brief Write the extra bytes straight to the new image.
+ *
+ * @return The number of bytes used
+ */
+size_t DeltaPatch::applyExtra(const uint8_t *data, size_t length) {
+    size_t used = _extraRemaining;
+    if (used > length) used = length;
+
+    if (!_writeNew(data, used)) {
+        _state = DELTA_STATE_FAILED;
+        return used;
+    }
+
+    _newPosition += used;
+    _extraRemaining -= used;
+
+    if (_extraRemaining == 0) endRecord();
+    return used;
+}
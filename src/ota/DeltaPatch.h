@@ -0,0 +1,86 @@
+#ifndef DELTA_PATCH_H
+#define DELTA_PATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <functional>
+
+/**
+ * The delta patch format, shared by the firmware and the host tool in `scripts/ota_delta`.
+ *
+ * A patch is the uncompressed `DeltaHeader` followed by a zlib stream of records. Every record is
+ * a 12 byte control block (diff length, extra length, seek, all little endian) followed by the
+ * diff bytes, added to the old image at the current old position, and the extra bytes, copied as is.
+ * After the record the old position is moved by the seek, which can be negative.
+ */
+#define DELTA_MAGIC             "ESPDELTA"
+#define DELTA_MAGIC_SIZE        8
+#define DELTA_VERSION           1
+#define DELTA_HEADER_SIZE       88      // Bytes of the serialized `DeltaHeader`
+#define DELTA_CONTROL_SIZE      12      // Bytes of the control block of a record
+#define DELTA_OLD_CHUNK_SIZE    256     // Bytes of the old image read at once
+
+/// @brief The header of a delta patch
+struct DeltaHeader {
+    uint32_t version;
+    uint32_t oldSize;           /* Bytes of the image the patch applies to                 */
+    uint32_t newSize;           /* Bytes of the image built by the patch                   */
+    uint32_t flags;             /* Reserved, always 0                                      */
+    uint8_t oldSha256[32];      /* SHA-256 of the image the patch applies to               */
+    uint8_t newSha256[32];      /* SHA-256 of the image built by the patch                 */
+};
+
+/// @brief Reads `length` bytes of the old image at `offset`
+typedef std::function<bool(uint32_t offset, uint8_t *buffer, size_t length)> DeltaReadFunction;
+
+/// @brief Writes the next `length` bytes of the new image
+typedef std::function<bool(const uint8_t *buffer, size_t length)> DeltaWriteFunction;
+
+/// @brief Applies the records of a delta patch as they are streamed in, the new image is written in order
+class DeltaPatch {
+public:
+    DeltaPatch(DeltaReadFunction readOld, DeltaWriteFunction writeNew);
+
+    static bool parseHeader(const uint8_t *data, size_t length, DeltaHeader &header);
+    static void serializeHeader(const DeltaHeader &header, uint8_t *data);
+
+    void begin(const DeltaHeader &header);
+    bool write(const uint8_t *data, size_t length);
+    bool isComplete() const;
+    bool hasFailed() const;
+    uint32_t written() const;
+
+private:
+    enum DeltaState : uint8_t {
+        DELTA_STATE_CONTROL,    /* Reading the control block of the next record        */
+        DELTA_STATE_DIFF,       /* Reading the diff bytes of the record                 */
+        DELTA_STATE_EXTRA,      /* Reading the extra bytes of the record                */
+        DELTA_STATE_DONE,       /* The whole new image is written                       */
+        DELTA_STATE_FAILED,     /* The patch is invalid or a read/write failed          */
+    };
+
+    DeltaReadFunction _readOld;
+    DeltaWriteFunction _writeNew;
+    DeltaState _state;
+
+    uint32_t _oldSize;
+    uint32_t _newSize;
+    int64_t _oldPosition;
+    uint32_t _newPosition;
+
+    uint8_t _control[DELTA_CONTROL_SIZE];
+    size_t _controlLength;
+    uint32_t _diffRemaining;
+    uint32_t _extraRemaining;
+    int32_t _seek;
+
+    uint8_t _oldChunk[DELTA_OLD_CHUNK_SIZE];
+
+    bool startRecord();
+    void endRecord();
+    size_t applyDiff(const uint8_t *data, size_t length);
+    size_t applyExtra(const uint8_t *data, size_t length);
+};
+
+#endif
@@ -1,10 +1,23 @@
 #include "ota.h"
 #include <esp_log.h>
+#include <HTTPClient.h>
+#include <mbedtls/sha256.h>
+#include "esp32/rom/miniz.h"
 
 #define OTA_LOG_TAG "OTA"
 
 OTA::OTA(){}
 
+/**
+ * @brief The lock of the inactive OTA partition, held for a whole update whether it comes over WiFi or BLE
+ *
+ * @return The mutex, created on the first call
+ */
+SemaphoreHandle_t firmwareUpdateMutex(){
+    static SemaphoreHandle_t mutex = xSemaphoreCreateMutex();
+    return mutex;
+}
+
 /**
  * @brief Initialize the OTA configurations
  * 
@@ -49,4 +62,218 @@ void OTA::init(){
 void OTA::handleOTA(){
     // Start the service of ArduinoOTA to listen for any request of OTA updates
     ArduinoOTA.handle();
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Download a delta patch against the running firmware and apply it into the inactive OTA partition.
+ *
+ * The compressed patch is inflated and applied while it is streamed from the server, so neither the
+ * patch nor the new image is ever held in memory. The header of the patch is not signed, so the image
+ * it builds has to be the one of the signed manifest, the patch is refused before anything is written
+ * otherwise. The running image is checked against the patch, and the new image is checked against the
+ * SHA-256 of the manifest and validated by `esp_ota_end` before it becomes the boot partition. The new
+ * image has to confirm itself with `confirmRunningImage` after the restart, otherwise the bootloader rolls back.
+ *
+ * @param url The url of the patch for the running firmware, the server answers 204 if there is no update
+ * @param imageSize The size of the new image, from the signed manifest
+ * @param imageSha256 The SHA-256 of the new image, from the signed manifest
+ * @return `OTA_UPDATED` if the device should be restarted, see `OTAResult`
+ */
+OTAResult OTA::pullDeltaUpdate(const char *url, uint32_t imageSize, const uint8_t *imageSha256){
+    ESP_LOGI(OTA_LOG_TAG, "Checking for delta update: %s", url);
+
+    WiFiClient client;
+    HTTPClient http;
+    http.useHTTP10(true);       // No chunked encoding, the body is read straight from the socket
+    http.setTimeout(OTA_DELTA_TIMEOUT_MS);
+    http.begin(client, url);
+
+    int httpResponseCode = http.GET();
+    if (httpResponseCode == HTTP_CODE_NO_CONTENT || httpResponseCode == HTTP_CODE_NOT_MODIFIED) {
+        ESP_LOGI(OTA_LOG_TAG, "Firmware is up to date.");
+        http.end();
+        return OTA_UP_TO_DATE;
+    }
+    if (httpResponseCode != HTTP_CODE_OK) {
+        ESP_LOGE(OTA_LOG_TAG, "Failed to download delta update: %d", httpResponseCode);
+        http.end();
+        return OTA_FAILED;
+    }
+
+    WiFiClient *stream = http.getStreamPtr();
+    uint8_t headerData[DELTA_HEADER_SIZE];
+    DeltaHeader header;
+    if (stream->readBytes(headerData, sizeof(headerData)) != sizeof(headerData) || !DeltaPatch::parseHeader(headerData, sizeof(headerData), header)) {
+        ESP_LOGE(OTA_LOG_TAG, "Invalid delta update header.");
+        http.end();
+        return OTA_FAILED;
+    }
+
+    if (header.newSize != imageSize || memcmp(header.newSha256, imageSha256, sizeof(header.newSha256)) != 0) {
+        ESP_LOGE(OTA_LOG_TAG, "Delta update does not build the image of the signed manifest.");
+        http.end();
+        return OTA_FAILED;
+    }
+
+    const esp_partition_t *running = esp_ota_get_running_partition();
+    const esp_partition_t *target = esp_ota_get_next_update_partition(NULL);
+    if (target == NULL || header.oldSize > running->size || header.newSize > target->size) {
+        ESP_LOGE(OTA_LOG_TAG, "Delta update does not fit the OTA partitions.");
+        http.end();
+        return OTA_FAILED;
+    }
+
+    // The patch only works against the exact image it was made from
+    uint8_t digest[32];
+    if (!hashRunningImage(running, header.oldSize, digest) || memcmp(digest, header.oldSha256, sizeof(digest)) != 0) {
+        ESP_LOGE(OTA_LOG_TAG, "Delta update was not made from the running firmware.");
+        http.end();
+        return OTA_FAILED;
+    }
+
+    esp_ota_handle_t handle;
+    if (esp_ota_begin(target, header.newSize, &handle) != ESP_OK) {
+        ESP_LOGE(OTA_LOG_TAG, "Failed to start writing partition %s.", target->label);
+        http.end();
+        return OTA_FAILED;
+    }
+    ESP_LOGI(OTA_LOG_TAG, "Applying delta update of %lu bytes into partition %s.", (unsigned long)header.newSize, target->label);
+
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+
+    uint32_t lastProgress = 0;
+    DeltaPatch patch(
+        [running](uint32_t offset, uint8_t *buffer, size_t length) {
+            return esp_partition_read(running, offset, buffer, length) == ESP_OK;
+        },
+        [&](const uint8_t *buffer, size_t length) {
+            mbedtls_sha256_update(&sha, buffer, length);
+            if (esp_ota_write(handle, buffer, length) != ESP_OK) return false;
+
+            uint32_t progress = (patch.written() + length) * 10 / header.newSize;
+            if (progress != lastProgress) {
+                lastProgress = progress;
+                ESP_LOGI(OTA_LOG_TAG, "OTA Progress: %lu%%", (unsigned long)progress * 10);
+            }
+            return true;
+        });
+    patch.begin(header);
+
+    bool applied = applyDeltaStream(stream, patch);
+    http.end();
+
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+
+    if (!applied || memcmp(digest, imageSha256, sizeof(digest)) != 0) {
+        ESP_LOGE(OTA_LOG_TAG, "Delta update failed after %lu bytes, keeping the running firmware.", (unsigned long)patch.written());
+        esp_ota_abort(handle);
+        return OTA_FAILED;
+    }
+
+    // Also validates the app image before it can be booted
+    if (esp_ota_end(handle) != ESP_OK || esp_ota_set_boot_partition(target) != ESP_OK) {
+        ESP_LOGE(OTA_LOG_TAG, "New firmware in partition %s is not a valid image.", target->label);
+        return OTA_FAILED;
+    }
+
+    ESP_LOGI(OTA_LOG_TAG, "OTA update finished. Will boot partition %s on the next restart.", target->label);
+    return OTA_UPDATED;
+}
+
+/**
+ * @brief Mark the running firmware as working, so the bootloader does not roll back to the previous one.
+ *
+ * Should be called once the firmware has proven itself, a restart of a new image before this
+ * rolls back to the previous firmware.
+ */
+void OTA::confirmRunningImage(){
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) != ESP_OK) return;
+
+    if (state == ESP_OTA_IMG_PENDING_VERIFY) {
+        if (esp_ota_mark_app_valid_cancel_rollback() == ESP_OK) ESP_LOGI(OTA_LOG_TAG, "New firmware confirmed, rollback cancelled.");
+        else ESP_LOGE(OTA_LOG_TAG, "Failed to confirm the new firmware.");
+    }
+}
+
+/**
+ * @brief Compute the SHA-256 of the first bytes of the running partition.
+ *
+ * @param partition The running partition
+ * @param size The number of bytes to hash, the size of the image the patch was made from
+ * @param digest The buffer of 32 bytes for the hash
+ * @return `true` if the partition could be read, `false` otherwise.
+ */
+bool OTA::hashRunningImage(const esp_partition_t *partition, uint32_t size, uint8_t *digest){
+    uint8_t buffer[OTA_PARTITION_READ_SIZE];
+    mbedtls_sha256_context sha;
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+
+    bool ok = true;
+    for (uint32_t offset = 0; offset < size && ok; offset += sizeof(buffer)) {
+        size_t length = size - offset < sizeof(buffer) ? size - offset : sizeof(buffer);
+        ok = esp_partition_read(partition, offset, buffer, length) == ESP_OK;
+        if (ok) mbedtls_sha256_update(&sha, buffer, length);
+    }
+
+    mbedtls_sha256_finish(&sha, digest);
+    mbedtls_sha256_free(&sha);
+    return ok;
+}
+
+/**
+ * @brief Inflate the compressed patch records from the socket and apply them.
+ *
+ * Uses the inflater of the ROM, the 32 KB output window doubles as the dictionary of the stream.
+ *
+ * @param stream The socket positioned after the patch header
+ * @param patch The patch to apply the records to
+ * @return `true` if the whole new image is written, `false` otherwise.
+ */
+bool OTA::applyDeltaStream(WiFiClient *stream, DeltaPatch &patch){
+    tinfl_decompressor *inflator = (tinfl_decompressor*)malloc(sizeof(tinfl_decompressor));
+    uint8_t *window = (uint8_t*)malloc(TINFL_LZ_DICT_SIZE);
+    uint8_t *input = (uint8_t*)malloc(OTA_DELTA_INPUT_SIZE);
+    if (inflator == NULL || window == NULL || input == NULL) {
+        ESP_LOGE(OTA_LOG_TAG, "Not enough memory to inflate the delta update.");
+        free(inflator);
+        free(window);
+        free(input);
+        return false;
+    }
+
+    tinfl_init(inflator);
+    size_t windowOffset = 0;
+    tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+
+    while (status == TINFL_STATUS_NEEDS_MORE_INPUT && !patch.hasFailed()) {
+        size_t inputLength = stream->readBytes(input, OTA_DELTA_INPUT_SIZE);
+        if (inputLength == 0) {
+            ESP_LOGE(OTA_LOG_TAG, "Delta update stream ended early.");
+            break;
+        }
+
+        size_t inputOffset = 0;
+        do {
+            size_t inputBytes = inputLength - inputOffset;
+            size_t outputBytes = TINFL_LZ_DICT_SIZE - windowOffset;
+            status = tinfl_decompress(inflator, input + inputOffset, &inputBytes, window, window + windowOffset, &outputBytes,
+                                      TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+            inputOffset += inputBytes;
+
+            if (outputBytes > 0 && !patch.write(window + windowOffset, outputBytes)) break;
+            windowOffset = (windowOffset + outputBytes) & (TINFL_LZ_DICT_SIZE - 1);
+        } while (status == TINFL_STATUS_HAS_MORE_OUTPUT || (status == TINFL_STATUS_NEEDS_MORE_INPUT && inputOffset < inputLength));
+    }
+
+    if (status < TINFL_STATUS_DONE) ESP_LOGE(OTA_LOG_TAG, "Delta update stream is corrupted: %d", status);
+
+    free(inflator);
+    free(window);
+    free(input);
+    return status == TINFL_STATUS_DONE && patch.isComplete();
+}
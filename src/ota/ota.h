@@ -2,6 +2,26 @@
 #define OTA_H
 
 #include <ArduinoOTA.h>
+#include <esp_ota_ops.h>
+
+#include "DeltaPatch.h"
+
+#define OTA_DELTA_INPUT_SIZE        1024        // Bytes of the compressed patch read from the socket at once
+#define OTA_DELTA_TIMEOUT_MS        15000       // Longest wait for the next bytes of the patch
+#define OTA_PARTITION_READ_SIZE     1024        // Bytes of the running partition hashed at once
+
+/**
+ * @enum OTAResult
+ * @brief The result of a pull delta update.
+ *
+ */
+enum OTAResult {
+    OTA_UPDATED,            /* The new image is written and set as the boot partition, restart to run it    */
+    OTA_UP_TO_DATE,         /* The server has no update for the running firmware                            */
+    OTA_FAILED,             /* The update failed, the running firmware stays the boot partition             */
+};
+
+SemaphoreHandle_t firmwareUpdateMutex();
 
 class OTA{
     public:
@@ -9,6 +29,13 @@ class OTA{
 
         void init(void);
         void handleOTA(void);
+
+        OTAResult pullDeltaUpdate(const char *url, uint32_t imageSize, const uint8_t *imageSha256);
+        void confirmRunningImage(void);
+
+    private:
+        bool hashRunningImage(const esp_partition_t *partition, uint32_t size, uint8_t *digest);
+        bool applyDeltaStream(WiFiClient *stream, DeltaPatch &patch);
 };
 
-#endif
\ No newline at end of file
+#endif
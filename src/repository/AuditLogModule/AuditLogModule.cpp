@@ -0,0 +1,307 @@
+#define AUDIT_LOG_LOG_TAG "AUDIT_LOG"
+
+#include "esp_log.h"
+#include "AuditLogModule.h"
+
+#include <algorithm>
+
+AuditLogModule::AuditLogModule() : _lastTimestamp(0) {
+    _logMutex = xSemaphoreCreateMutex();
+    if (_logMutex == NULL) ESP_LOGE(AUDIT_LOG_LOG_TAG, "Failed to create Audit Log mutex.");
+    setup();
+}
+
+/**
+ * @brief Load the summary of every access log segment stored in the SD Card.
+ *
+ * Only the first and the last record of each segment are read, so this stay cheap even
+ * with months of history.
+ *
+ * @return `true` if the access log directory is ready, `false` otherwise.
+ */
+bool AuditLogModule::setup() {
+    ESP_LOGI(AUDIT_LOG_LOG_TAG, "Start Audit Log Module Setup!");
+
+    if (!SD.exists(AUDIT_LOG_DIRECTORY) && !SD.mkdir(AUDIT_LOG_DIRECTORY)) {
+        ESP_LOGE(AUDIT_LOG_LOG_TAG, "Failed to create the access log directory %s", AUDIT_LOG_DIRECTORY);
+        return false;
+    }
+
+    File directory = SD.open(AUDIT_LOG_DIRECTORY);
+    if (!directory) {
+        ESP_LOGE(AUDIT_LOG_LOG_TAG, "Error opening the access log directory %s", AUDIT_LOG_DIRECTORY);
+        return false;
+    }
+
+    File entry = directory.openNextFile();
+    while (entry) {
+        // Depending on the core version, the name may or may not include the directory
+        const char *name = strrchr(entry.name(), '/');
+        name = name ? name + 1 : entry.name();
+
+        unsigned long id;
+        if (!entry.isDirectory() && strstr(name, ".log") != nullptr && sscanf(name, "seg_%lu.log", &id) == 1) {
+            AccessLogSegment segment = {};
+            segment.id = id;
+            segment.recordCount = entry.size() / sizeof(AccessLogRecord);
+
+            // A torn write from a power loss, don't append anything more to this segment
+            segment.sealed = entry.size() % sizeof(AccessLogRecord) != 0;
+
+            AccessLogRecord record;
+            if (segment.recordCount > 0 && entry.read((uint8_t*)&record, sizeof(record)) == sizeof(record)) {
+                segment.firstTimestamp = record.timestamp;
+            }
+            if (segment.recordCount > 0 && entry.seek((segment.recordCount - 1) * sizeof(AccessLogRecord))
+                && entry.read((uint8_t*)&record, sizeof(record)) == sizeof(record)) {
+                segment.lastTimestamp = record.timestamp;
+            }
+            _segments.push_back(segment);
+        }
+        entry.close();
+        entry = directory.openNextFile();
+    }
+    directory.close();
+
+    std::sort(_segments.begin(), _segments.end(), [](const AccessLogSegment &a, const AccessLogSegment &b) {
+        return a.id < b.id;
+    });
+
+    for (const AccessLogSegment &segment : _segments) {
+        if (segment.recordCount > 0) _lastTimestamp = std::max(_lastTimestamp, segment.lastTimestamp);
+    }
+
+    ESP_LOGI(AUDIT_LOG_LOG_TAG, "Audit Log ready with %d segments, last event timestamp %lu", _segments.size(), (unsigned long)_lastTimestamp);
+    return true;
+}
+
+/**
+ * @brief Append an access event to the current access log segment.
+ *
+ * The record has a fixed size, so an append is a single write at the end of the segment plus
+ * one index entry for every `AUDIT_LOG_INDEX_STRIDE` records. Timestamps are kept non-decreasing
+ * across the whole log, if the clock is not synced yet or it went backward the last known
+ * timestamp is used instead and the record is flagged as not synced.
+ *
+ * @param type The type of the Key Access (RFID or Fingerprint)
+ * @param granted Wether the access was granted or denied
+ * @param keyAccessId The Key Access ID of the event, can be nullptr if not registered
+ * @param uidCard The NFC Card UID of the event, can be nullptr for Fingerprint
+ * @param fingerprintId The Fingerprint ID of the event, 0 for RFID
+ * @return `true` if the event is stored to the SD Card, `false` otherwise.
+ */
+bool AuditLogModule::append(LockType type, bool granted, const char *keyAccessId, const char *uidCard, int fingerprintId) {
+    AccessLogRecord record = {};
+    time_t now = time(nullptr);
+    record.type = type;
+    record.granted = granted ? 1 : 0;
+    record.clockSynced = now >= AUDIT_LOG_MIN_VALID_TIMESTAMP ? 1 : 0;
+    record.fingerprintId = fingerprintId > 0 ? fingerprintId : 0;
+    snprintf(record.keyAccessId, sizeof(record.keyAccessId), "%s", keyAccessId ? keyAccessId : "");
+    snprintf(record.uidCard, sizeof(record.uidCard), "%s", uidCard ? uidCard : "");
+
+    if (xSemaphoreTake(_logMutex, portMAX_DELAY) != pdTRUE) return false;
+
+    record.timestamp = (uint32_t)now;
+    if (!record.clockSynced || record.timestamp < _lastTimestamp) {
+        record.timestamp = std::max(record.timestamp, _lastTimestamp);
+        record.clockSynced = 0;
+    }
+
+    if (_segments.empty() || _segments.back().sealed || _segments.back().recordCount >= AUDIT_LOG_SEGMENT_MAX_RECORDS) {
+        openNewSegment();
+    }
+    AccessLogSegment &segment = _segments.back();
+
+    char path[40];
+    segmentPath(path, sizeof(path), segment.id, "log");
+    File file = SD.open(path, FILE_APPEND);
+    if (!file) {
+        ESP_LOGE(AUDIT_LOG_LOG_TAG, "Error opening the access log segment %s", path);
+        xSemaphoreGive(_logMutex);
+        return false;
+    }
+    size_t written = file.write((const uint8_t*)&record, sizeof(record));
+    file.close();
+
+    if (written != sizeof(record)) {
+        ESP_LOGE(AUDIT_LOG_LOG_TAG, "Failed to write access event to %s, sealing the segment", path);
+        segment.sealed = true;
+        xSemaphoreGive(_logMutex);
+        return false;
+    }
+
+    // Keep the sparse index, one entry for every stride of records
+    if (segment.recordCount % AUDIT_LOG_INDEX_STRIDE == 0) {
+        AccessLogIndexEntry indexEntry = { record.timestamp, segment.recordCount };
+        segmentPath(path, sizeof(path), segment.id, "idx");
+        File indexFile = SD.open(path, FILE_APPEND);
+        if (indexFile) {
+            indexFile.write((const uint8_t*)&indexEntry, sizeof(indexEntry));
+            indexFile.close();
+        } else {
+            ESP_LOGW(AUDIT_LOG_LOG_TAG, "Failed to update the access log index %s", path);
+        }
+    }
+
+    if (segment.recordCount == 0) segment.firstTimestamp = record.timestamp;
+    segment.lastTimestamp = record.timestamp;
+    segment.recordCount++;
+    _lastTimestamp = record.timestamp;
+
+    xSemaphoreGive(_logMutex);
+    ESP_LOGD(AUDIT_LOG_LOG_TAG, "Access event stored to segment %lu, record %lu", (unsigned long)segment.id, (unsigned long)segment.recordCount);
+    return true;
+}
+
+/**
+ * @brief Get the access events between two timestamps.
+ *
+ * Segments that does not overlap with the range are skipped without opening them, and in the
+ * overlapping segments the sparse index is used to seek close to the first matching record.
+ *
+ * @param from The start of the range (inclusive) in epoch time
+ * @param to The end of the range (inclusive) in epoch time
+ * @param callback Called for every matching record in time order, return `false` to stop the query
+ * @return The number of records passed to the callback
+ */
+size_t AuditLogModule::query(uint32_t from, uint32_t to, const std::function<bool(const AccessLogRecord&)> &callback) {
+    ESP_LOGI(AUDIT_LOG_LOG_TAG, "Querying access log from %lu to %lu", (unsigned long)from, (unsigned long)to);
+
+    // Only hold the lock to take a snapshot, so the query never blocks the access events
+    std::vector<AccessLogSegment> segments;
+    if (xSemaphoreTake(_logMutex, portMAX_DELAY) == pdTRUE) {
+        segments = _segments;
+        xSemaphoreGive(_logMutex);
+    }
+
+    size_t count = 0;
+    bool stopped = false;
+    for (const AccessLogSegment &segment : segments) {
+        if (segment.recordCount == 0 || segment.lastTimestamp < from) continue;
+        if (segment.firstTimestamp > to) break;
+
+        count += scanSegment(segment, from, to, callback, stopped);
+        if (stopped) break;
+    }
+
+    ESP_LOGI(AUDIT_LOG_LOG_TAG, "Found %d access events", count);
+    return count;
+}
+
+/**
+ * @brief Create the summary for a new segment, the file itself is created on the first append.
+ */
+void AuditLogModule::openNewSegment() {
+    AccessLogSegment segment = {};
+    segment.id = _segments.empty() ? 0 : _segments.back().id + 1;
+    _segments.push_back(segment);
+    ESP_LOGI(AUDIT_LOG_LOG_TAG, "Rotating access log to segment %lu", (unsigned long)segment.id);
+
+    while (_segments.size() > AUDIT_LOG_MAX_SEGMENTS) {
+        removeOldestSegment();
+    }
+}
+
+/**
+ * @brief Remove the oldest segment and its index from the SD Card.
+ */
+void AuditLogModule::removeOldestSegment() {
+    char path[40];
+    uint32_t id = _segments.front().id;
+
+    segmentPath(path, sizeof(path), id, "log");
+    SD.remove(path);
+    segmentPath(path, sizeof(path), id, "idx");
+    SD.remove(path);
+
+    _segments.erase(_segments.begin());
+    ESP_LOGI(AUDIT_LOG_LOG_TAG, "Removed oldest access log segment %lu", (unsigned long)id);
+}
+
+/**
+ * @brief Find the record position to start scanning from by using the sparse index of the segment.
+ *
+ * @param segment The segment to search
+ * @param from The start of the range in epoch time
+ * @return The record position that is not after the first record with timestamp >= `from`
+ */
+uint32_t AuditLogModule::findStartRecord(const AccessLogSegment &segment, uint32_t from) {
+    if (segment.firstTimestamp >= from) return 0;
+
+    char path[40];
+    segmentPath(path, sizeof(path), segment.id, "idx");
+    File indexFile = SD.open(path, FILE_READ);
+    if (!indexFile) {
+        ESP_LOGW(AUDIT_LOG_LOG_TAG, "No index for segment %lu, scanning from the start", (unsigned long)segment.id);
+        return 0;
+    }
+
+    // The index is small (one entry for every stride), so it is fine to read it whole
+    std::vector<AccessLogIndexEntry> entries(indexFile.size() / sizeof(AccessLogIndexEntry));
+    size_t bytesRead = indexFile.read((uint8_t*)entries.data(), entries.size() * sizeof(AccessLogIndexEntry));
+    indexFile.close();
+    entries.resize(bytesRead / sizeof(AccessLogIndexEntry));
+
+    // Last index entry that is still before the range
+    auto it = std::lower_bound(entries.begin(), entries.end(), from, [](const AccessLogIndexEntry &entry, uint32_t value) {
+        return entry.timestamp < value;
+    });
+    if (it == entries.begin()) return 0;
+    return std::min((it - 1)->recordNumber, segment.recordCount);
+}
+
+/**
+ * @brief Read the matching records of a single segment.
+ *
+ * @param segment The segment to read
+ * @param from The start of the range (inclusive) in epoch time
+ * @param to The end of the range (inclusive) in epoch time
+ * @param callback Called for every matching record
+ * @param stopped Set to `true` if the callback asked to stop the query
+ * @return The number of records passed to the callback
+ */
+size_t AuditLogModule::scanSegment(const AccessLogSegment &segment, uint32_t from, uint32_t to, const std::function<bool(const AccessLogRecord&)> &callback, bool &stopped) {
+    char path[40];
+    segmentPath(path, sizeof(path), segment.id, "log");
+    File file = SD.open(path, FILE_READ);
+    if (!file) {
+        ESP_LOGE(AUDIT_LOG_LOG_TAG, "Error opening the access log segment %s", path);
+        return 0;
+    }
+
+    uint32_t position = findStartRecord(segment, from);
+    if (!file.seek(position * sizeof(AccessLogRecord))) {
+        file.close();
+        return 0;
+    }
+
+    size_t count = 0;
+    AccessLogRecord record;
+    while (position < segment.recordCount && file.read((uint8_t*)&record, sizeof(record)) == sizeof(record)) {
+        position++;
+        if (record.timestamp < from) continue;
+        if (record.timestamp > to) break;
+
+        count++;
+        if (!callback(record)) {
+            stopped = true;
+            break;
+        }
+    }
+
+    file.close();
+    return count;
+}
+
+/**
+ * @brief Build the path of a segment file.
+ *
+ * @param buffer The buffer to write the path into
+ * @param size The size of the buffer
+ * @param id The segment ID
+ * @param extension `log` for the records or `idx` for the sparse index
+ */
+void AuditLogModule::segmentPath(char *buffer, size_t size, uint32_t id, const char *extension) {
+    snprintf(buffer, size, "%s/seg_%08lu.%s", AUDIT_LOG_DIRECTORY, (unsigned long)id, extension);
+}
@@ -0,0 +1,66 @@
+#ifndef AUDIT_LOG_MODULE_H
+#define AUDIT_LOG_MODULE_H
+
+#include <SD.h>
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <functional>
+#include <vector>
+#include "enum/LockType.h"
+
+#define AUDIT_LOG_DIRECTORY             "/audit"            // Directory for storing the access log segments
+#define AUDIT_LOG_SEGMENT_MAX_RECORDS   4096                // Rotate to a new segment after this many records (~288KB)
+#define AUDIT_LOG_MAX_SEGMENTS          64                  // Remove the oldest segment when there are more segments than this
+#define AUDIT_LOG_INDEX_STRIDE          64                  // Write one sparse index entry for every this many records
+#define AUDIT_LOG_MIN_VALID_TIMESTAMP   1704067200          // 2024-01-01, any time before this means the clock is not synced yet
+
+/// @brief A single access event stored in the access log segment. Fixed size so a record can be seek directly
+struct AccessLogRecord {
+    uint32_t timestamp;         /* Epoch time of the access event                                   */
+    uint8_t type;               /* The type of the Key Access (RFID or Fingerprint), see `LockType` */
+    uint8_t granted;            /* 1 if the access was granted, 0 if it was denied                  */
+    uint8_t clockSynced;        /* 0 if the clock was not synced yet and the timestamp is estimated */
+    uint8_t fingerprintId;      /* The Fingerprint ID of the event, 0 for RFID                      */
+    char keyAccessId[40];       /* The Key Access ID of the event, empty if it is not registered    */
+    char uidCard[24];           /* The NFC Card UID of the event, empty for Fingerprint             */
+};
+
+/// @brief One entry of the sparse time index of a segment
+struct AccessLogIndexEntry {
+    uint32_t timestamp;         /* Timestamp of the record at `recordNumber`                        */
+    uint32_t recordNumber;      /* Position of the record inside the segment                        */
+};
+
+/// @brief In memory summary of an access log segment
+struct AccessLogSegment {
+    uint32_t id;
+    uint32_t firstTimestamp;
+    uint32_t lastTimestamp;
+    uint32_t recordCount;
+    bool sealed;                /* No more records should be appended, e.g. the file has a torn write */
+};
+
+/// @brief Time-indexed local access log on the SD Card, stored as rotating segments with a sparse time index
+class AuditLogModule {
+public:
+    AuditLogModule();
+    bool setup();
+
+    bool append(LockType type, bool granted, const char *keyAccessId, const char *uidCard, int fingerprintId);
+    size_t query(uint32_t from, uint32_t to, const std::function<bool(const AccessLogRecord&)> &callback);
+
+private:
+    std::vector<AccessLogSegment> _segments;
+    SemaphoreHandle_t _logMutex;
+    uint32_t _lastTimestamp;
+
+    void openNewSegment();
+    void removeOldestSegment();
+    uint32_t findStartRecord(const AccessLogSegment &segment, uint32_t from);
+    size_t scanSegment(const AccessLogSegment &segment, uint32_t from, uint32_t to, const std::function<bool(const AccessLogRecord&)> &callback, bool &stopped);
+    static void segmentPath(char *buffer, size_t size, uint32_t id, const char *extension);
+};
+
+#endif
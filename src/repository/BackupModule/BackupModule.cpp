@@ -0,0 +1,533 @@
+#define BACKUP_LOG_TAG "BACKUP"
+
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp32/rom/miniz.h"
+#include "BackupModule.h"
+
+/**
+ * @brief Start the HMAC of a member, keyed with `KEY_ACCESS_BACKUP_KEY`
+ *
+ * @return `true` if the HMAC is started, `false` if there is no key or no memory for it.
+ */
+static bool startBackupMac(mbedtls_md_context_t *mac){
+#ifdef KEY_ACCESS_BACKUP_KEY
+    static const char key[] = KEY_ACCESS_BACKUP_KEY;
+    return mbedtls_md_hmac_starts(mac, (const unsigned char*)key, sizeof(key) - 1) == 0;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Finish the HMAC of a member into its hex form of the footer
+ *
+ */
+static void finishBackupMac(mbedtls_md_context_t *mac, char *hex){
+    uint8_t digest[BACKUP_MAC_SIZE];
+    mbedtls_md_hmac_finish(mac, digest);
+    for (size_t i = 0; i < sizeof(digest); i++) sprintf(hex + 2 * i, "%02x", digest[i]);
+}
+
+BackupModule::BackupModule(SDCardModule *sdCardModule)
+    : _sdCardModule(sdCardModule), _hasState(false), _sequence(0), _logId(0), _logOffset(0), _restorePending(false), _restoreAttempts(0) {
+    loadState();
+
+#if KEY_ACCESS_BACKUP_ENABLED
+    // Only a device that never took part in a backup and has no key access is restored, like one with
+    // a new SD Card, so a restore never overwrites key access that are not on the server yet. The tasks
+    // do not run yet, and the decision is saved, so nothing written before the restore can skip it.
+    size_t nfcCount, fingerprintCount;
+    _sdCardModule->getKeyAccessCount(nfcCount, fingerprintCount);
+    if (!_hasState && nfcCount == 0 && fingerprintCount == 0) {
+        _hasState = true;
+        _restorePending = true;
+        saveState();
+        ESP_LOGI(BACKUP_LOG_TAG, "Key access store is empty, restoring it before the first backup");
+    }
+#endif
+}
+
+/**
+ * @brief Check if the store still waits for its restore from the server.
+ *
+ * The key access list is not pulled and nothing is backed up meanwhile, the restore replaces the
+ * key access files and an empty store would replace the backup it should be restored from.
+ *
+ * @return `true` while the restore is not done or given up, `false` otherwise.
+ */
+bool BackupModule::isRestorePending() {
+    return _restorePending;
+}
+
+/**
+ * @brief Plan the next backup, incremental if the server has every change before the change log position.
+ *
+ * A full backup restarts the change log, so the changes made while it is sent are in the next
+ * incremental backup.
+ *
+ * @param plan Set to the backup to send
+ * @return `true` if there is something to back up, `false` otherwise.
+ */
+bool BackupModule::plan(BackupPlan &plan) {
+    uint32_t logId;
+    size_t logSize;
+    bool hasLog = _sdCardModule->getChangeLogInfo(logId, logSize);
+
+    plan.sequence = _sequence + 1;
+    if (hasLog && _hasState && _logId == logId && _logOffset <= logSize) {
+        if (logSize == _logOffset) return false;
+
+        plan.mode = BACKUP_INCREMENTAL;
+        plan.base = _sequence;
+        plan.logId = logId;
+        plan.logStart = _logOffset;
+        plan.logEnd = logSize;
+        plan.revision = _sdCardModule->getRevision();
+        return true;
+    }
+
+    // A deleted key access file is only created again by the next save
+    _sdCardModule->createEmptyJsonFileIfNotExists(RFID_FILE_PATH);
+    _sdCardModule->createEmptyJsonFileIfNotExists(FINGERPRINT_FILE_PATH);
+
+    plan.mode = BACKUP_FULL;
+    plan.base = 0;
+    if (_sdCardModule->restartChangeLog() == 0 || !_sdCardModule->getChangeLogInfo(plan.logId, plan.logEnd)) {
+        ESP_LOGE(BACKUP_LOG_TAG, "Failed to restart the change log for a full backup");
+        return false;
+    }
+    plan.logStart = plan.logEnd;
+    plan.revision = _sdCardModule->getRevision();
+    return true;
+}
+
+/**
+ * @brief Compress the backup of a plan into the output, reading the store in small parts.
+ *
+ * The task waits `BACKUP_YIELD_TICKS` after every part read from the SD Card, so the tasks handling
+ * the access events get the SD Card and the CPU in between. A full backup is dropped if a key access
+ * changes while it is read, it would not be a consistent snapshot.
+ *
+ * @param plan The backup to write
+ * @param output Receives the compressed backup, returns `false` to stop it
+ * @return `true` if the whole backup was written, `false` otherwise.
+ */
+bool BackupModule::writeSnapshot(const BackupPlan &plan, const SDStreamWriter &output) {
+    mbedtls_md_context_t mac;
+    mbedtls_md_init(&mac);
+    if (mbedtls_md_setup(&mac, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) != 0 || !startBackupMac(&mac)) {
+        ESP_LOGE(BACKUP_LOG_TAG, "Backup %lu cannot be authenticated, is KEY_ACCESS_BACKUP_KEY set?", (unsigned long)plan.sequence);
+        mbedtls_md_free(&mac);
+        return false;
+    }
+
+    DeflateStream *deflate = new DeflateStream(output);
+    uint32_t crc = 0;
+
+    SDStreamWriter write = [&](const uint8_t *data, size_t length) {
+        crc = esp_rom_crc32_le(crc, data, length);
+        mbedtls_md_hmac_update(&mac, data, length);
+        return deflate->write(data, length);
+    };
+    SDStreamWriter writePart = [&](const uint8_t *data, size_t length) {
+        bool written = write(data, length);
+        vTaskDelay(BACKUP_YIELD_TICKS);
+        return written;
+    };
+    auto writeText = [&](const char *text) {
+        return write((const uint8_t*)text, strlen(text));
+    };
+
+    char line[BACKUP_LINE_SIZE];
+    snprintf(line, sizeof(line), "{\"backup\":%d,\"vin\":\"%s\",\"mode\":\"%s\",\"sequence\":%lu,\"base\":%lu}\n",
+        BACKUP_FORMAT_VERSION, VIN, plan.mode == BACKUP_FULL ? "full" : "incremental", (unsigned long)plan.sequence, (unsigned long)plan.base);
+    bool complete = writeText(line);
+
+    if (plan.mode == BACKUP_FULL) {
+        complete = complete
+            && writeText("{\"rfids\":")
+            && _sdCardModule->streamKeyAccessFile(LockType::RFID, writePart)
+            && writeText(",\"fingerprints\":")
+            && _sdCardModule->streamKeyAccessFile(LockType::FINGERPRINT, writePart)
+            && writeText("}\n");
+
+        if (complete && _sdCardModule->getRevision() != plan.revision) {
+            ESP_LOGW(BACKUP_LOG_TAG, "Key access changed during the full backup, dropping it");
+            complete = false;
+        }
+    } else {
+        complete = complete && _sdCardModule->streamChangeLog(plan.logId, plan.logStart, plan.logEnd - plan.logStart, writePart);
+    }
+
+    if (complete) {
+        // The footer is not part of its own CRC and HMAC
+        char hmac[2 * BACKUP_MAC_SIZE + 1];
+        finishBackupMac(&mac, hmac);
+        snprintf(line, sizeof(line), "{\"end\":true,\"crc32\":\"%08lx\",\"hmac\":\"%s\"}\n", (unsigned long)crc, hmac);
+        complete = deflate->write((const uint8_t*)line, strlen(line)) && deflate->finish();
+    }
+
+    if (complete) {
+        ESP_LOGI(BACKUP_LOG_TAG, "%s backup %lu written, %lu bytes compressed to %lu", plan.mode == BACKUP_FULL ? "Full" : "Incremental",
+            (unsigned long)plan.sequence, (unsigned long)deflate->getInputLength(), (unsigned long)deflate->getOutputLength());
+    } else {
+        ESP_LOGE(BACKUP_LOG_TAG, "Backup %lu could not be written", (unsigned long)plan.sequence);
+    }
+
+    delete deflate;
+    mbedtls_md_free(&mac);
+    return complete;
+}
+
+/**
+ * @brief Keep the position of a backup the server accepted, the next incremental backup starts there
+ *
+ */
+void BackupModule::commit(const BackupPlan &plan) {
+    _hasState = true;
+    _sequence = plan.sequence;
+    _logId = plan.logId;
+    _logOffset = plan.logEnd;
+    saveState();
+}
+
+/**
+ * @brief Make the next backup a full one, when the server does not have the backup the next one builds on
+ *
+ */
+void BackupModule::requireFull() {
+    _hasState = true;
+    _restorePending = false;
+    _logId = 0;
+    _logOffset = 0;
+    saveState();
+}
+
+/**
+ * @brief Inflate the members of a restore response into the restore file on the SD Card.
+ *
+ * Uses the inflater of the ROM like the delta updates, the 32 KB window is only allocated during a restore.
+ *
+ * @param body The body of the restore response
+ * @return `true` if every member was inflated completely, `false` otherwise.
+ */
+bool BackupModule::receiveRestore(Stream &body) {
+    tinfl_decompressor *inflator = (tinfl_decompressor*)malloc(sizeof(tinfl_decompressor));
+    uint8_t *window = (uint8_t*)malloc(TINFL_LZ_DICT_SIZE);
+    uint8_t *input = (uint8_t*)malloc(RESTORE_INPUT_SIZE);
+    File file = SD.open(RESTORE_FILE_PATH, FILE_WRITE);
+    if (inflator == NULL || window == NULL || input == NULL || !file) {
+        ESP_LOGE(BACKUP_LOG_TAG, "Not enough memory or SD Card to receive the restore.");
+        free(inflator);
+        free(window);
+        free(input);
+        if (file) file.close();
+        return false;
+    }
+
+    bool complete = true;
+    int members = 0;
+    uint8_t prefix[4];
+    while (complete && body.readBytes(prefix, sizeof(prefix)) == sizeof(prefix)) {
+        uint32_t memberLength = ((uint32_t)prefix[0] << 24) | ((uint32_t)prefix[1] << 16) | ((uint32_t)prefix[2] << 8) | prefix[3];
+
+        // Each member is a zlib stream of its own, the length keeps the inflater from reading into the next one
+        tinfl_init(inflator);
+        size_t windowOffset = 0;
+        tinfl_status status = TINFL_STATUS_NEEDS_MORE_INPUT;
+
+        while (complete && memberLength > 0 && status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+            size_t inputLength = body.readBytes(input, memberLength < RESTORE_INPUT_SIZE ? memberLength : RESTORE_INPUT_SIZE);
+            if (inputLength == 0) {
+                ESP_LOGE(BACKUP_LOG_TAG, "Restore stream ended early.");
+                complete = false;
+                break;
+            }
+            memberLength -= inputLength;
+
+            size_t inputOffset = 0;
+            do {
+                size_t inputBytes = inputLength - inputOffset;
+                size_t outputBytes = TINFL_LZ_DICT_SIZE - windowOffset;
+                status = tinfl_decompress(inflator, input + inputOffset, &inputBytes, window, window + windowOffset, &outputBytes,
+                                          TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+                inputOffset += inputBytes;
+
+                if (outputBytes > 0 && file.write(window + windowOffset, outputBytes) != outputBytes) complete = false;
+                windowOffset = (windowOffset + outputBytes) & (TINFL_LZ_DICT_SIZE - 1);
+            } while (complete && (status == TINFL_STATUS_HAS_MORE_OUTPUT || (status == TINFL_STATUS_NEEDS_MORE_INPUT && inputOffset < inputLength)));
+        }
+
+        if (complete && (status != TINFL_STATUS_DONE || memberLength != 0)) {
+            ESP_LOGE(BACKUP_LOG_TAG, "Restore member %d is corrupted: %d", members, status);
+            complete = false;
+        }
+        if (complete) members++;
+    }
+
+    file.close();
+    free(inflator);
+    free(window);
+    free(input);
+
+    ESP_LOGI(BACKUP_LOG_TAG, "Restore received, %d members", members);
+    return complete && members > 0;
+}
+
+/**
+ * @brief Check the received restore and apply it to the key access files.
+ *
+ * The whole restore is checked before anything is applied, so a corrupted or forged restore changes
+ * nothing. The change log is then the base of the next incremental backup, as the server has what was
+ * restored. After `RESTORE_MAX_ATTEMPTS` restores that fail their check the backup on the server is
+ * given up, the store is then backed up in full over it.
+ *
+ * @return `true` if the restore was applied, `false` otherwise.
+ */
+bool BackupModule::applyRestore() {
+    uint32_t sequence;
+    bool applied = readRestoreFile(false, sequence) && readRestoreFile(true, sequence);
+    SD.remove(RESTORE_FILE_PATH);
+    if (!applied) {
+        if (++_restoreAttempts >= RESTORE_MAX_ATTEMPTS) {
+            ESP_LOGE(BACKUP_LOG_TAG, "Backup failed its check %d times, giving up the restore", _restoreAttempts);
+            requireFull();
+        }
+        return false;
+    }
+
+    _hasState = true;
+    _restorePending = false;
+    _sequence = sequence;
+    if (!_sdCardModule->getChangeLogInfo(_logId, _logOffset)) _logId = 0;
+    saveState();
+
+    ESP_LOGI(BACKUP_LOG_TAG, "Backup %lu restored", (unsigned long)sequence);
+    return true;
+}
+
+/**
+ * @brief Read the restore file member by member, the lines are at most `BACKUP_LINE_SIZE` except the key access document.
+ *
+ * @param apply Apply the members, otherwise they are only checked
+ * @param sequence Set to the sequence of the last member
+ * @return `true` if every member is complete and valid, `false` otherwise.
+ */
+bool BackupModule::readRestoreFile(bool apply, uint32_t &sequence) {
+    File file = SD.open(RESTORE_FILE_PATH, FILE_READ);
+    if (!file) {
+        ESP_LOGE(BACKUP_LOG_TAG, "Error opening the file: %s", RESTORE_FILE_PATH);
+        return false;
+    }
+
+    mbedtls_md_context_t mac;
+    mbedtls_md_init(&mac);
+    if (mbedtls_md_setup(&mac, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) != 0) {
+        ESP_LOGE(BACKUP_LOG_TAG, "Not enough memory to check the restore.");
+        file.close();
+        return false;
+    }
+
+    RestoreState state = {};
+    state.apply = apply;
+    state.part = RESTORE_HEADER;
+    state.mac = &mac;
+
+    uint8_t chunk[SD_STREAM_CHUNK_SIZE];
+    char line[BACKUP_LINE_SIZE];
+    size_t lineLength = 0;
+    bool valid = true;
+
+    while (valid && file.available() > 0) {
+        size_t length = file.read(chunk, sizeof(chunk));
+        if (length == 0) break;
+
+        size_t offset = 0;
+        while (valid && offset < length) {
+            const uint8_t *newline = (const uint8_t*)memchr(chunk + offset, '\n', length - offset);
+            size_t end = newline != nullptr ? newline - chunk + 1 : length;
+
+            if (state.part == RESTORE_DOCUMENT) {
+                // The document is copied as it is read, it can be much bigger than a line
+                state.crc = esp_rom_crc32_le(state.crc, chunk + offset, end - offset);
+                mbedtls_md_hmac_update(state.mac, chunk + offset, end - offset);
+                if (state.document && state.document.write(chunk + offset, end - offset) != end - offset) valid = false;
+
+                if (valid && newline != nullptr) {
+                    state.part = RESTORE_BODY;
+                    if (state.document) {
+                        state.document.close();
+                        int nfcUsers, fingerprintUsers;
+                        valid = _sdCardModule->importKeyAccess(IMPORT_FILE_PATH, nfcUsers, fingerprintUsers);
+                    }
+                }
+            } else if (lineLength + end - offset >= sizeof(line)) {
+                ESP_LOGE(BACKUP_LOG_TAG, "Restore line is too long");
+                valid = false;
+            } else {
+                memcpy(line + lineLength, chunk + offset, end - offset);
+                lineLength += end - offset;
+                if (newline != nullptr) {
+                    valid = readRestoreLine(state, line, lineLength);
+                    lineLength = 0;
+                }
+            }
+            offset = end;
+        }
+    }
+    file.close();
+    if (state.document) state.document.close();
+    mbedtls_md_free(&mac);
+
+    if (valid && (state.part != RESTORE_HEADER || lineLength > 0 || state.members == 0)) {
+        ESP_LOGE(BACKUP_LOG_TAG, "Restore ends inside a member");
+        valid = false;
+    }
+    sequence = state.sequence;
+    return valid;
+}
+
+/**
+ * @brief Read a header, change or footer line of a restored member.
+ *
+ * @param state The progress of the restore, updated with the line
+ * @param line The line, with its newline
+ * @param length The length of the line
+ * @return `true` if the line is valid, `false` otherwise.
+ */
+bool BackupModule::readRestoreLine(RestoreState &state, const char *line, size_t length) {
+    JsonDocument document;
+    DeserializationError error = deserializeJson(document, line, length);
+    if (error) {
+        ESP_LOGE(BACKUP_LOG_TAG, "Failed to deserialize a restore line: %s", error.c_str());
+        return false;
+    }
+
+    if (state.part == RESTORE_HEADER) {
+        const char *mode = document["mode"];
+        uint32_t memberSequence = document["sequence"] | (uint32_t)0;
+        uint32_t base = document["base"] | (uint32_t)0;
+        if (document["backup"] != BACKUP_FORMAT_VERSION || mode == nullptr) {
+            ESP_LOGE(BACKUP_LOG_TAG, "Restore member %d has no valid header", state.members);
+            return false;
+        }
+
+        bool full = strcmp(mode, "full") == 0;
+        if (!full && (strcmp(mode, "incremental") != 0 || state.members == 0 || base != state.sequence)) {
+            ESP_LOGE(BACKUP_LOG_TAG, "Restore member %lu does not follow member %lu", (unsigned long)memberSequence, (unsigned long)state.sequence);
+            return false;
+        }
+
+        if (!startBackupMac(state.mac)) {
+            ESP_LOGE(BACKUP_LOG_TAG, "Restore cannot be authenticated, is KEY_ACCESS_BACKUP_KEY set?");
+            return false;
+        }
+        state.crc = esp_rom_crc32_le(0, (const uint8_t*)line, length);
+        mbedtls_md_hmac_update(state.mac, (const uint8_t*)line, length);
+        state.memberSequence = memberSequence;
+        state.part = full ? RESTORE_DOCUMENT : RESTORE_BODY;
+
+        if (full && state.apply) {
+            state.document = SD.open(IMPORT_FILE_PATH, FILE_WRITE);
+            if (!state.document) {
+                ESP_LOGE(BACKUP_LOG_TAG, "Error opening the file: %s", IMPORT_FILE_PATH);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    if (document["end"] == true) {
+        char crc[9];
+        snprintf(crc, sizeof(crc), "%08lx", (unsigned long)state.crc);
+        if (document["crc32"] != crc) {
+            ESP_LOGE(BACKUP_LOG_TAG, "Restore member %lu has a wrong CRC", (unsigned long)state.memberSequence);
+            return false;
+        }
+
+        // Compared in full, so the time taken does not tell how much of a forged HMAC matched
+        char hmac[2 * BACKUP_MAC_SIZE + 1];
+        finishBackupMac(state.mac, hmac);
+        const char *expected = document["hmac"] | "";
+        uint8_t difference = strlen(expected) != strlen(hmac);
+        for (size_t i = 0; i < strlen(hmac) && expected[i] != '\0'; i++) difference |= expected[i] ^ hmac[i];
+        if (difference != 0) {
+            ESP_LOGE(BACKUP_LOG_TAG, "Restore member %lu is not authentic", (unsigned long)state.memberSequence);
+            return false;
+        }
+
+        state.sequence = state.memberSequence;
+        state.members++;
+        state.part = RESTORE_HEADER;
+        return true;
+    }
+
+    state.crc = esp_rom_crc32_le(state.crc, (const uint8_t*)line, length);
+    mbedtls_md_hmac_update(state.mac, (const uint8_t*)line, length);
+    if (state.apply && !_sdCardModule->applyChange(document.as<JsonObjectConst>())) {
+        ESP_LOGE(BACKUP_LOG_TAG, "Failed to apply a change of restore member %lu", (unsigned long)state.memberSequence);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Read the position of the last backup from the SD Card
+ *
+ */
+void BackupModule::loadState() {
+    File file = SD.open(BACKUP_STATE_FILE_PATH, FILE_READ);
+    if (!file) {
+        ESP_LOGI(BACKUP_LOG_TAG, "No backup state, the first backup is a full one");
+        return;
+    }
+
+    JsonDocument document;
+    DeserializationError error = deserializeJson(document, file);
+    file.close();
+    if (error) {
+        ESP_LOGE(BACKUP_LOG_TAG, "Failed to deserialize the backup state: %s", error.c_str());
+        return;
+    }
+
+    _hasState = true;
+    _sequence = document["sequence"] | (uint32_t)0;
+    _logId = document["log_id"] | (uint32_t)0;
+    _logOffset = document["log_offset"] | (size_t)0;
+    _restorePending = document["restore_pending"] | false;
+    ESP_LOGI(BACKUP_LOG_TAG, "Backup state loaded, sequence %lu, log offset %d", (unsigned long)_sequence, _logOffset);
+}
+
+/**
+ * @brief Store the position of the last backup, through a temporary file so a torn write keeps the old one
+ *
+ * @return `true` if the state was stored, `false` otherwise.
+ */
+bool BackupModule::saveState() {
+    File file = SD.open(BACKUP_STATE_TEMP_PATH, FILE_WRITE);
+    if (!file) {
+        ESP_LOGE(BACKUP_LOG_TAG, "Error opening the file: %s", BACKUP_STATE_TEMP_PATH);
+        return false;
+    }
+
+    JsonDocument document;
+    document["sequence"] = _sequence;
+    document["log_id"] = _logId;
+    document["log_offset"] = _logOffset;
+    if (_restorePending) document["restore_pending"] = true;
+    bool written = serializeJson(document, file) > 0;
+    file.close();
+
+    if (!written) {
+        ESP_LOGE(BACKUP_LOG_TAG, "Failed to write the backup state");
+        return false;
+    }
+
+    SD.remove(BACKUP_STATE_FILE_PATH);
+    if (!SD.rename(BACKUP_STATE_TEMP_PATH, BACKUP_STATE_FILE_PATH)) {
+        ESP_LOGE(BACKUP_LOG_TAG, "Failed to replace the backup state");
+        return false;
+    }
+    return true;
+}
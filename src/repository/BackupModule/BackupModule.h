@@ -0,0 +1,108 @@
+#ifndef BACKUP_MODULE_H
+#define BACKUP_MODULE_H
+
+#include <SD.h>
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <mbedtls/md.h>
+
+#include "DeflateStream.h"
+#include "repository/SDCardModule/SDCardModule.h"
+#include "config/Config.h"
+
+#define BACKUP_STATE_FILE_PATH  "/backup_state.json"    // Sequence and change log position of the last backup the server accepted
+#define BACKUP_STATE_TEMP_PATH  "/backup_state.tmp"     // The state is written here first, then renamed over the old one
+#define RESTORE_FILE_PATH       "/restore.tmp"          // Inflated backup downloaded for a restore, checked before it is applied
+#define BACKUP_FORMAT_VERSION   2                       // 2 adds the HMAC of every member to its footer
+#define BACKUP_LINE_SIZE        512                     // Longest line of a backup, except the key access document of a full backup
+#define BACKUP_YIELD_TICKS      1                       // Delay after every part read from the SD Card, so the access events go first
+#define RESTORE_INPUT_SIZE      512                     // Compressed bytes read from the socket at once during a restore
+#define RESTORE_MAX_ATTEMPTS    5                       // Restores that fail their check before the device gives up on the backup
+#define BACKUP_MAC_SIZE         32                      // Bytes of the HMAC-SHA256 of a member, written in hex in its footer
+
+/// @brief Kind of a backup
+enum BackupMode : uint8_t {
+    BACKUP_FULL,            /* Both key access files, replaces every backup before it on the server     */
+    BACKUP_INCREMENTAL,     /* The changes of the change log since the previous backup                  */
+};
+
+/// @brief A backup to send, from `plan` until it is committed
+struct BackupPlan {
+    BackupMode mode;        /* Full or incremental                                                      */
+    uint32_t sequence;      /* Sequence of this backup, one more than the last accepted one             */
+    uint32_t base;          /* Sequence the incremental backup applies on, 0 for a full backup          */
+    uint32_t logId;         /* Id of the change log the backup was planned from                         */
+    size_t logStart;        /* Offset of the first change of an incremental backup                      */
+    size_t logEnd;          /* Offset the next incremental backup starts at once this one is committed  */
+    uint32_t revision;      /* Revision of the key access files, a full backup is dropped if it changes */
+};
+
+/// @brief Part of a member expected next while a restored backup is read
+enum RestorePart : uint8_t {
+    RESTORE_HEADER,         /* The header line of the next member                                       */
+    RESTORE_DOCUMENT,       /* The key access document line of a full member                            */
+    RESTORE_BODY,           /* The change lines of an incremental member, or the footer                 */
+};
+
+/// @brief Progress of reading the members of a restored backup
+struct RestoreState {
+    bool apply;             /* Apply the members, otherwise they are only checked                       */
+    RestorePart part;       /* Part of the member expected next                                         */
+    uint32_t crc;           /* CRC32 of the member read so far                                          */
+    mbedtls_md_context_t *mac; /* HMAC of the member read so far                                       */
+    uint32_t sequence;      /* Sequence of the last complete member                                     */
+    uint32_t memberSequence;/* Sequence of the member being read                                        */
+    int members;            /* Complete members read                                                    */
+    File document;          /* Import file the key access document is copied to when applied           */
+};
+
+/**
+ * @brief Backs up the key access store to the backend server and restores it from there.
+ *
+ * A backup is a zlib stream of json lines: a header line, then either the whole key access document
+ * (full) or the lines of the SD Card change log since the previous backup (incremental), then a
+ * footer line with the CRC32 and the HMAC-SHA256 of the lines before it. The HMAC is keyed with
+ * `KEY_ACCESS_BACKUP_KEY`, which the server does not have, so a restore only applies backups made by
+ * a device of the same key, whatever the server or the network sent. The server keeps the last full
+ * backup and the incremental backups on top of it, and answers a restore with all of them, each
+ * prefixed with its length as 4 bytes big endian.
+ *
+ * The backup is compressed while it is read from the SD Card, in parts of `SD_STREAM_CHUNK_SIZE`, so
+ * it runs in a few KB of RAM however big the store is. A restore inflates to a file on the SD Card
+ * first, and only applies it once every member is complete and its CRC and HMAC match.
+ *
+ * Whether the store needs a restore is decided once, when the module is made before the tasks start,
+ * and saved with the backup state until the restore is done, so a key access written meanwhile or a
+ * restart does not skip it. The pull and the backups wait for it, see `isRestorePending`.
+ */
+class BackupModule {
+public:
+    BackupModule(SDCardModule *sdCardModule);
+
+    bool isRestorePending();
+    bool plan(BackupPlan &plan);
+    bool writeSnapshot(const BackupPlan &plan, const SDStreamWriter &output);
+    void commit(const BackupPlan &plan);
+    void requireFull();
+
+    bool receiveRestore(Stream &body);
+    bool applyRestore();
+
+private:
+    SDCardModule *_sdCardModule;
+    bool _hasState;         // A backup was accepted, restored, there was none to restore, or a restore is pending
+    uint32_t _sequence;     // Sequence of the last backup the server accepted
+    uint32_t _logId;        // Change log the last backup was taken from, 0 forces a full backup
+    size_t _logOffset;      // Offset in the change log the next incremental backup starts at
+    bool _restorePending;   // The store was empty without a backup state, cleared once restored or given up
+    int _restoreAttempts;   // Restores received since the start that failed their check
+
+    void loadState();
+    bool saveState();
+    bool readRestoreFile(bool apply, uint32_t &sequence);
+    bool readRestoreLine(RestoreState &state, const char *line, size_t length);
+};
+
+#endif
@@ -0,0 +1,202 @@
+#include "DeflateStream.h"
+#include <string.h>
+
+#define ADLER_MODULO    65521
+
+static const uint16_t LENGTH_BASE[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t LENGTH_EXTRA[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t DISTANCE_BASE[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t DISTANCE_EXTRA[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+/**
+ * @brief Reverse the order of the bits of a Huffman code, deflate packs the codes from their most significant bit
+ *
+ */
+static uint32_t reverseBits(uint32_t code, uint8_t length) {
+    uint32_t reversed = 0;
+    for (uint8_t i = 0; i < length; i++) {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+    return reversed;
+}
+
+DeflateStream::DeflateStream(DeflateOutputFunction output)
+    : _output(output), _bufferStart(0), _bufferLength(0), _position(0), _bitBuffer(0), _bitCount(0),
+      _outputLength(0), _outputTotal(0), _adlerA(1), _adlerB(0), _started(false), _failed(false) {
+    memset(_head, 0, sizeof(_head));
+}
+
+/**
+ * @brief Compress the next part of the stream, the output is called whenever enough compressed bytes are ready
+ *
+ * @return `false` if the output stopped the compression, `true` otherwise.
+ */
+bool DeflateStream::write(const uint8_t *data, size_t length) {
+    if (!_started) {
+        // zlib header of a deflate stream with the default level, then the final block with the fixed codes
+        putByte(0x78);
+        putByte(0x01);
+        putBits(1, 1);
+        putBits(1, 2);
+        _started = true;
+    }
+
+    while (length > 0 && !_failed) {
+        if (_bufferLength == DEFLATE_BUFFER_SIZE) {
+            // Keep the window behind the next byte to encode, and what is not encoded yet
+            size_t drop = _position - _bufferStart > DEFLATE_WINDOW_SIZE ? _position - _bufferStart - DEFLATE_WINDOW_SIZE : 0;
+            memmove(_buffer, _buffer + drop, _bufferLength - drop);
+            _bufferStart += drop;
+            _bufferLength -= drop;
+        }
+
+        size_t part = DEFLATE_BUFFER_SIZE - _bufferLength;
+        if (part > length) part = length;
+        memcpy(_buffer + _bufferLength, data, part);
+
+        // Adler-32 of the uncompressed stream, part is small enough for the sums not to overflow
+        for (size_t i = 0; i < part; i++) {
+            _adlerA += data[i];
+            _adlerB += _adlerA;
+        }
+        _adlerA %= ADLER_MODULO;
+        _adlerB %= ADLER_MODULO;
+
+        _bufferLength += part;
+        data += part;
+        length -= part;
+        encode(false);
+    }
+    return !_failed;
+}
+
+/**
+ * @brief Encode the rest of the stream, end the block and write the Adler-32 trailer
+ *
+ * @return `true` if the whole compressed stream was passed to the output, `false` otherwise.
+ */
+bool DeflateStream::finish() {
+    if (!_started) write(nullptr, 0);
+    encode(true);
+
+    // End of block, then the trailer starts on a byte boundary
+    putLiteral(256);
+    if (_bitCount > 0) putBits(0, 8 - _bitCount);
+
+    uint32_t adler = (_adlerB << 16) | _adlerA;
+    for (int shift = 24; shift >= 0; shift -= 8) putByte(adler >> shift);
+    return flushOutput() && !_failed;
+}
+
+uint32_t DeflateStream::getInputLength() const {
+    return _bufferStart + _bufferLength;
+}
+
+uint32_t DeflateStream::getOutputLength() const {
+    return _outputTotal + _outputLength;
+}
+
+/**
+ * @brief Encode the buffered bytes, keeping a full match length unencoded unless it is the end of the stream
+ *
+ */
+void DeflateStream::encode(bool final) {
+    uint32_t end = _bufferStart + _bufferLength;
+
+    while (!_failed && _position < end && (final || end - _position >= DEFLATE_MAX_MATCH)) {
+        const uint8_t *current = _buffer + (_position - _bufferStart);
+        size_t available = end - _position;
+        size_t bestLength = 0;
+        size_t bestDistance = 0;
+
+        if (available >= DEFLATE_MIN_MATCH) {
+            uint32_t key = hash(current);
+            uint32_t candidate = _head[key];
+            _head[key] = _position + 1;
+
+            // The head holds the position plus one, so 0 is an empty slot
+            if (candidate > 0 && candidate - 1 >= _bufferStart && _position - (candidate - 1) <= DEFLATE_WINDOW_SIZE) {
+                const uint8_t *match = _buffer + (candidate - 1 - _bufferStart);
+                size_t limit = available < DEFLATE_MAX_MATCH ? available : DEFLATE_MAX_MATCH;
+                size_t length = 0;
+                while (length < limit && match[length] == current[length]) length++;
+
+                if (length >= DEFLATE_MIN_MATCH) {
+                    bestLength = length;
+                    bestDistance = _position - (candidate - 1);
+                }
+            }
+        }
+
+        if (bestLength == 0) {
+            putLiteral(*current);
+            _position++;
+            continue;
+        }
+
+        putMatch(bestLength, bestDistance);
+
+        // Index the positions inside the match too, the next matches often start there
+        for (size_t i = 1; i < bestLength; i++) {
+            uint32_t position = _position + i;
+            if (end - position >= DEFLATE_MIN_MATCH) _head[hash(_buffer + (position - _bufferStart))] = position + 1;
+        }
+        _position += bestLength;
+    }
+}
+
+void DeflateStream::putBits(uint32_t bits, uint8_t count) {
+    _bitBuffer |= bits << _bitCount;
+    _bitCount += count;
+    while (_bitCount >= 8) {
+        putByte(_bitBuffer & 0xFF);
+        _bitBuffer >>= 8;
+        _bitCount -= 8;
+    }
+}
+
+void DeflateStream::putByte(uint8_t byte) {
+    _outputBuffer[_outputLength++] = byte;
+    if (_outputLength == DEFLATE_OUTPUT_SIZE) flushOutput();
+}
+
+/**
+ * @brief Write a literal or length symbol with its fixed Huffman code
+ *
+ */
+void DeflateStream::putLiteral(uint16_t symbol) {
+    if (symbol < 144) putBits(reverseBits(0x30 + symbol, 8), 8);
+    else if (symbol < 256) putBits(reverseBits(0x190 + symbol - 144, 9), 9);
+    else if (symbol < 280) putBits(reverseBits(symbol - 256, 7), 7);
+    else putBits(reverseBits(0xC0 + symbol - 280, 8), 8);
+}
+
+void DeflateStream::putMatch(size_t length, size_t distance) {
+    int lengthCode = sizeof(LENGTH_BASE) / sizeof(LENGTH_BASE[0]) - 1;
+    while (LENGTH_BASE[lengthCode] > length) lengthCode--;
+    putLiteral(257 + lengthCode);
+    putBits(length - LENGTH_BASE[lengthCode], LENGTH_EXTRA[lengthCode]);
+
+    int distanceCode = sizeof(DISTANCE_BASE) / sizeof(DISTANCE_BASE[0]) - 1;
+    while (DISTANCE_BASE[distanceCode] > distance) distanceCode--;
+    putBits(reverseBits(distanceCode, 5), 5);
+    putBits(distance - DISTANCE_BASE[distanceCode], DISTANCE_EXTRA[distanceCode]);
+}
+
+bool DeflateStream::flushOutput() {
+    if (_outputLength == 0 || _failed) {
+        _outputLength = 0;
+        return !_failed;
+    }
+
+    if (!_output(_outputBuffer, _outputLength)) _failed = true;
+    _outputTotal += _outputLength;
+    _outputLength = 0;
+    return !_failed;
+}
+
+uint32_t DeflateStream::hash(const uint8_t *data) const {
+    uint32_t value = ((uint32_t)data[0] << 16) | ((uint32_t)data[1] << 8) | data[2];
+    return (value * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
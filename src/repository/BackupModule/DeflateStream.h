@@ -0,0 +1,65 @@
+#ifndef DEFLATE_STREAM_H
+#define DEFLATE_STREAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <functional>
+
+/**
+ * A small zlib (RFC 1950/1951) compressor for the key access backups, so any zlib can inflate them.
+ *
+ * The whole stream is a single deflate block with the fixed Huffman codes, and the matches are found
+ * with one hash candidate per position inside a `DEFLATE_WINDOW_SIZE` window. It compresses the json
+ * of the key access files to about a third, with a fixed memory use and no dynamic table to build.
+ */
+#define DEFLATE_WINDOW_SIZE     2048    // Farthest match distance, the restore inflater accepts any window
+#define DEFLATE_BUFFER_SIZE     (2 * DEFLATE_WINDOW_SIZE)
+#define DEFLATE_HASH_BITS       10
+#define DEFLATE_HASH_SIZE       (1 << DEFLATE_HASH_BITS)
+#define DEFLATE_MIN_MATCH       3
+#define DEFLATE_MAX_MATCH       258
+#define DEFLATE_OUTPUT_SIZE     256     // Compressed bytes gathered before they are passed to the output
+
+/// @brief Receives the next part of the compressed stream, returns `false` to stop the compression
+typedef std::function<bool(const uint8_t *data, size_t length)> DeflateOutputFunction;
+
+/// @brief Compresses a stream written in parts of any size, about 9 KB so it should live on the heap
+class DeflateStream {
+public:
+    DeflateStream(DeflateOutputFunction output);
+
+    bool write(const uint8_t *data, size_t length);
+    bool finish();
+
+    uint32_t getInputLength() const;
+    uint32_t getOutputLength() const;
+
+private:
+    DeflateOutputFunction _output;
+    uint8_t _buffer[DEFLATE_BUFFER_SIZE];
+    uint32_t _head[DEFLATE_HASH_SIZE];      // Hash of 3 bytes to the last stream position they were seen at, plus one
+    uint8_t _outputBuffer[DEFLATE_OUTPUT_SIZE];
+
+    uint32_t _bufferStart;                  // Stream position of `_buffer[0]`
+    size_t _bufferLength;
+    uint32_t _position;                     // Stream position of the next byte to encode
+    uint32_t _bitBuffer;
+    uint8_t _bitCount;
+    size_t _outputLength;
+    uint32_t _outputTotal;
+    uint32_t _adlerA;
+    uint32_t _adlerB;
+    bool _started;
+    bool _failed;
+
+    void encode(bool final);
+    void putBits(uint32_t bits, uint8_t count);
+    void putByte(uint8_t byte);
+    void putLiteral(uint16_t symbol);
+    void putMatch(size_t length, size_t distance);
+    bool flushOutput();
+    uint32_t hash(const uint8_t *data) const;
+};
+
+#endif
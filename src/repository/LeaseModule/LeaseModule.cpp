@@ -0,0 +1,225 @@
+#define LEASE_LOG_TAG "LEASE"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "LeaseModule.h"
+#include "entity/JsonStream.h"
+
+#define LEASE_REVOKED_EXPIRY    INT64_MIN       // Expiry of a key access that was revoked by the server
+
+LeaseModule::LeaseModule() : _complete(false), _refreshing(false), _nextRefreshMs(0) {
+    _leaseMutex = xSemaphoreCreateMutex();
+    if (_leaseMutex == NULL) ESP_LOGE(LEASE_LOG_TAG, "Failed to create Lease mutex.");
+    _createdAt = now();
+}
+
+/**
+ * @brief Whether the hybrid online/offline auth is enabled with `KEY_ACCESS_LEASE_MODE`
+ *
+ * @return `true` if a key access needs a lease to unlock, `false` if the SD Card is the only authority.
+ */
+bool LeaseModule::isEnabled() {
+    return KEY_ACCESS_LEASE_MODE != 0;
+}
+
+/**
+ * @brief Set the function that wakes up the job renewing the leases, it is called when an expired lease is presented
+ *
+ * @param revalidate Wakes up the job renewing the leases, must not block
+ */
+void LeaseModule::setRevalidationJob(std::function<void()> revalidate) {
+    _revalidate = revalidate;
+}
+
+/**
+ * @brief Wake the revalidation job to renew the leases now, instead of when the next refresh is due
+ *
+ */
+void LeaseModule::requestRefresh() {
+    if (isEnabled() && _revalidate) _revalidate();
+}
+
+/**
+ * @brief Decide from the RAM table if a key access that is on the SD Card may unlock.
+ *
+ * A lease that is not valid wakes the revalidation job, so it is renewed in the background
+ * and the next tap is decided with the answer of the server.
+ *
+ * @param keyAccessId The Key Access ID that was presented
+ * @return `true` if the lease is valid or in its offline grace period, `false` otherwise.
+ */
+bool LeaseModule::authorize(const std::string &keyAccessId) {
+    LeaseState state = getState(keyAccessId);
+    if (state == LEASE_VALID) return true;
+
+    requestRefresh();
+
+    if (state == LEASE_GRACE) {
+        ESP_LOGW(LEASE_LOG_TAG, "Lease of Key Access ID %s expired, granted in the offline grace period", keyAccessId.c_str());
+        return true;
+    }
+    ESP_LOGW(LEASE_LOG_TAG, "Lease of Key Access ID %s is %s", keyAccessId.c_str(), state == LEASE_REVOKED ? "revoked" : "expired");
+    return false;
+}
+
+/**
+ * @brief Get the state of the lease of a key access, with a single lookup in the RAM table
+ *
+ * @param keyAccessId The Key Access ID
+ * @return The state of the lease, always `LEASE_VALID` if the leases are not enabled.
+ */
+LeaseState LeaseModule::getState(const std::string &keyAccessId) {
+    if (!isEnabled()) return LEASE_VALID;
+
+    int64_t expiresAt = LEASE_REVOKED_EXPIRY;
+    if (xSemaphoreTake(_leaseMutex, portMAX_DELAY) == pdTRUE) {
+        auto lease = _leases.find(keyAccessId);
+        if (lease != _leases.end()) expiresAt = lease->second;
+        else if (!_complete) expiresAt = _createdAt;
+        xSemaphoreGive(_leaseMutex);
+    }
+
+    if (expiresAt == LEASE_REVOKED_EXPIRY) return LEASE_REVOKED;
+
+    int64_t current = now();
+    if (current < expiresAt) return LEASE_VALID;
+    if (current < expiresAt + KEY_ACCESS_LEASE_GRACE_S) return LEASE_GRACE;
+    return LEASE_EXPIRED;
+}
+
+/**
+ * @brief Note that a bulk refresh is requested from the server, called before the request is sent
+ *
+ * The grants and revokes from then on are kept aside, so `renew` merges them into the answer of
+ * the server, which does not know them yet.
+ */
+void LeaseModule::beginRefresh() {
+    if (xSemaphoreTake(_leaseMutex, portMAX_DELAY) == pdTRUE) {
+        _changedDuringRefresh.clear();
+        _refreshing = true;
+        xSemaphoreGive(_leaseMutex);
+    }
+}
+
+/**
+ * @brief Replace the table with the leases of a bulk refresh of the server.
+ *
+ * The leases are read from the `{"data": [...]}` answer one at a time, each is an object with
+ * `key_access_id` and `expires_in`, the seconds from now until it expires. A key access that is not
+ * in the refresh is revoked, except one granted after the refresh started, like an NFC Card enrolled
+ * meanwhile, which keeps its grant. A key access revoked after the refresh started stays revoked.
+ * The next refresh is due when half of the shortest lease has passed.
+ *
+ * @param leases The answer of the server, at the start of the object
+ * @return `true` if the leases are renewed, `false` if the answer is invalid and the table is not changed
+ */
+bool LeaseModule::renew(Stream &leases) {
+    std::unordered_map<std::string, int64_t> renewed;
+
+    JsonDocument filter;
+    filter["key_access_id"] = true;
+    filter["expires_in"] = true;
+
+    int64_t current = now();
+    int64_t shortest = LEASE_REFRESH_MAX_MS / 1000 * 2;
+    int count = 0;
+    bool hasData = false;
+    bool valid = JsonStream::readObject(leases, [&](const char *name) {
+        if (strcmp(name, "data") != 0 || hasData) return JsonStream::skipValue(leases);
+        hasData = true;
+
+        return JsonStream::readArray(leases, [&]() {
+            JsonDocument lease;
+            if (JsonStream::skipWhitespace(leases) != '{' || deserializeJson(lease, leases, DeserializationOption::Filter(filter))) return false;
+            count++;
+
+            const char *keyAccessId = lease["key_access_id"];
+            int64_t expiresIn = lease["expires_in"] | 0;
+            if (keyAccessId == nullptr || expiresIn <= 0) return true;
+
+            renewed[keyAccessId] = current + expiresIn;
+            if (expiresIn < shortest) shortest = expiresIn;
+            return true;
+        });
+    });
+    if (!valid || !hasData) {
+        ESP_LOGE(LEASE_LOG_TAG, "Invalid leases from the server");
+        return false;
+    }
+
+    // Build the table before the lock, so an unlock only waits for the merge and the swap
+    if (xSemaphoreTake(_leaseMutex, portMAX_DELAY) == pdTRUE) {
+        for (const auto &change : _changedDuringRefresh) {
+            if (change.second == LEASE_REVOKED_EXPIRY) renewed[change.first] = LEASE_REVOKED_EXPIRY;
+            else renewed.emplace(change.first, change.second);
+        }
+        _changedDuringRefresh.clear();
+        _refreshing = false;
+
+        _leases.swap(renewed);
+        _complete = true;
+        xSemaphoreGive(_leaseMutex);
+    }
+
+    uint32_t delayMs = shortest * 1000 / 2;
+    _nextRefreshMs = delayMs < LEASE_REFRESH_MIN_MS ? LEASE_REFRESH_MIN_MS : delayMs > LEASE_REFRESH_MAX_MS ? LEASE_REFRESH_MAX_MS : delayMs;
+    ESP_LOGI(LEASE_LOG_TAG, "Leases renewed for %d key access, next refresh in %lu s", count, (unsigned long)(_nextRefreshMs / 1000));
+    return true;
+}
+
+/**
+ * @brief Give a lease to a key access that was just enrolled with the server, until the next refresh.
+ *
+ * @param keyAccessId The Key Access ID
+ */
+void LeaseModule::grant(const char *keyAccessId) {
+    if (keyAccessId == nullptr || !isEnabled()) return;
+
+    int64_t expiresAt = now() + KEY_ACCESS_LEASE_DEFAULT_TTL_S;
+    if (xSemaphoreTake(_leaseMutex, portMAX_DELAY) == pdTRUE) {
+        _leases[keyAccessId] = expiresAt;
+        if (_refreshing) _changedDuringRefresh[keyAccessId] = expiresAt;
+        xSemaphoreGive(_leaseMutex);
+    }
+}
+
+/**
+ * @brief Revoke the lease of a key access right away, without waiting for the next refresh.
+ *
+ * @param keyAccessId The Key Access ID
+ */
+void LeaseModule::revoke(const char *keyAccessId) {
+    if (keyAccessId == nullptr || !isEnabled()) return;
+
+    if (xSemaphoreTake(_leaseMutex, portMAX_DELAY) == pdTRUE) {
+        _leases[keyAccessId] = LEASE_REVOKED_EXPIRY;
+        if (_refreshing) _changedDuringRefresh[keyAccessId] = LEASE_REVOKED_EXPIRY;
+        xSemaphoreGive(_leaseMutex);
+    }
+}
+
+/**
+ * @brief Retry the refresh sooner after it failed, the leases keep their expiry.
+ *
+ */
+void LeaseModule::refreshFailed() {
+    if (xSemaphoreTake(_leaseMutex, portMAX_DELAY) == pdTRUE) {
+        _changedDuringRefresh.clear();
+        _refreshing = false;
+        xSemaphoreGive(_leaseMutex);
+    }
+    _nextRefreshMs = LEASE_RETRY_MS;
+}
+
+/**
+ * @brief Get the delay until the next bulk refresh is due.
+ *
+ * @return The delay in ms, 0 before the first refresh.
+ */
+uint32_t LeaseModule::nextRefreshDelayMs() {
+    return _nextRefreshMs;
+}
+
+int64_t LeaseModule::now() {
+    return esp_timer_get_time() / 1000000;
+}
@@ -0,0 +1,68 @@
+#ifndef LEASE_MODULE_H
+#define LEASE_MODULE_H
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include "config/Config.h"
+
+#define LEASE_REFRESH_MIN_MS        (60 * 1000)         // Shortest delay between two bulk refreshes of the leases
+#define LEASE_REFRESH_MAX_MS        (30 * 60 * 1000)    // Longest delay between two bulk refreshes of the leases
+#define LEASE_RETRY_MS              (30 * 1000)         // Delay before the next refresh after a failed one
+
+/// @brief State of the lease of a key access when it is presented
+enum LeaseState {
+    LEASE_VALID,        /* The lease has not expired yet                                        */
+    LEASE_GRACE,        /* The lease expired, but the server could not be reached to renew it   */
+    LEASE_EXPIRED,      /* The lease expired longer than the offline grace period ago           */
+    LEASE_REVOKED,      /* The server did not renew the lease of the key access                 */
+};
+
+/**
+ * @brief RAM table of the server leases of the key access, for the hybrid online/offline auth
+ *
+ * Every key access on the SD Card also needs a lease that the server renews in bulk. An unlock is
+ * decided from this table only, so the tap-to-unlock path never waits on the network. A lease that
+ * expired still unlocks for `KEY_ACCESS_LEASE_GRACE_S` while the server cannot be reached, and wakes
+ * the revalidation job so it is renewed in the background. A key access that the server left out
+ * of the last refresh is revoked right away.
+ *
+ * The expiries are kept in uptime seconds, so they do not depend on the wall clock being set. The
+ * table is not stored, after a reboot every lease counts as expired at boot until the first refresh.
+ */
+class LeaseModule {
+public:
+    LeaseModule();
+    bool isEnabled();
+    void setRevalidationJob(std::function<void()> revalidate);
+    void requestRefresh();
+
+    bool authorize(const std::string &keyAccessId);
+    LeaseState getState(const std::string &keyAccessId);
+
+    void beginRefresh();
+    bool renew(Stream &leases);
+    void grant(const char *keyAccessId);
+    void revoke(const char *keyAccessId);
+    void refreshFailed();
+    uint32_t nextRefreshDelayMs();
+
+private:
+    std::unordered_map<std::string, int64_t> _leases;  // Key Access ID to the uptime in seconds its lease expires
+    std::unordered_map<std::string, int64_t> _changedDuringRefresh; // Grants and revokes since the refresh in flight started
+    SemaphoreHandle_t _leaseMutex;
+    std::function<void()> _revalidate;
+    int64_t _createdAt;             // Uptime in seconds of the boot, the lease of an unknown key access expired then
+    bool _complete;                 // The table holds every lease of the last refresh, an unknown key access is revoked
+    bool _refreshing;               // A refresh was requested from the server and not renewed or failed yet
+    uint32_t _nextRefreshMs;
+
+    static int64_t now();
+};
+
+#endif
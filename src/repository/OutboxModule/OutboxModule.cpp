@@ -0,0 +1,337 @@
+#define OUTBOX_LOG_TAG "OUTBOX"
+
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "OutboxModule.h"
+
+#include <stddef.h>
+
+OutboxModule::OutboxModule() : _header(), _ready(false) {
+    _outboxMutex = xSemaphoreCreateMutex();
+    if (_outboxMutex == NULL) ESP_LOGE(OUTBOX_LOG_TAG, "Failed to create Outbox mutex.");
+    setup();
+}
+
+/**
+ * @brief Open the outbox file from the SD Card, or create a new one if it does not exist yet.
+ *
+ * Both copies of the header are read and the newest valid one is used, so the pending events
+ * survive a power loss in the middle of a header write.
+ *
+ * @return `true` if the outbox is ready to be used, `false` otherwise.
+ */
+bool OutboxModule::setup() {
+    ESP_LOGI(OUTBOX_LOG_TAG, "Start Outbox Module Setup!");
+
+    File file = SD.open(OUTBOX_FILE_PATH, FILE_READ);
+    if (!file) {
+        ESP_LOGI(OUTBOX_LOG_TAG, "No outbox stored yet, creating %s", OUTBOX_FILE_PATH);
+        _ready = createFile();
+        return _ready;
+    }
+
+    OutboxHeader headers[2];
+    bool valid[2] = {false, false};
+    for (int i = 0; i < 2; i++) {
+        if (file.read((uint8_t*)&headers[i], sizeof(OutboxHeader)) != sizeof(OutboxHeader)) break;
+        valid[i] = headers[i].magic == OUTBOX_MAGIC && headers[i].version == OUTBOX_VERSION
+            && headers[i].capacity == OUTBOX_CAPACITY && headers[i].crc == headerChecksum(headers[i]);
+    }
+    file.close();
+
+    if (!valid[0] && !valid[1]) {
+        ESP_LOGE(OUTBOX_LOG_TAG, "Outbox header is corrupted or from another version, recreating %s", OUTBOX_FILE_PATH);
+        _ready = createFile();
+        return _ready;
+    }
+
+    // Take the copy that was written last
+    if (valid[0] && valid[1]) _header = (int32_t)(headers[1].generation - headers[0].generation) > 0 ? headers[1] : headers[0];
+    else _header = valid[0] ? headers[0] : headers[1];
+
+    _ready = true;
+    ESP_LOGI(OUTBOX_LOG_TAG, "Outbox ready with %lu pending events, %lu events dropped so far",
+        (unsigned long)(_header.tail - _header.head), (unsigned long)_header.dropped);
+    return true;
+}
+
+/**
+ * @brief Push a granted access event to the outbox, to be stored later in the backend access history.
+ *
+ * @param type The type of the Key Access (RFID or Fingerprint)
+ * @param keyAccessId The Key Access ID that was granted the access
+ * @param uidCard The NFC Card UID of the event, can be nullptr for Fingerprint
+ * @param fingerprintId The Fingerprint ID of the event, 0 for RFID
+ * @return `true` if the event is stored to the SD Card, `false` otherwise.
+ */
+bool OutboxModule::pushAccess(LockType type, const char *keyAccessId, const char *uidCard, int fingerprintId) {
+    OutboxEvent event = {};
+    event.action = OUTBOX_ACCESS;
+    event.type = type;
+    event.fingerprintId = fingerprintId > 0 && fingerprintId <= UINT8_MAX ? fingerprintId : 0;
+    snprintf(event.keyAccessId, sizeof(event.keyAccessId), "%s", keyAccessId ? keyAccessId : "");
+    snprintf(event.uidCard, sizeof(event.uidCard), "%s", uidCard ? uidCard : "");
+    return push(event);
+}
+
+/**
+ * @brief Push a server-side cleanup of a Key Access to the outbox.
+ *
+ * @param type The type of the Key Access (RFID or Fingerprint)
+ * @param keyAccessId The Key Access ID to be deleted from the backend
+ * @return `true` if the event is stored to the SD Card, `false` otherwise.
+ */
+bool OutboxModule::pushDelete(LockType type, const char *keyAccessId) {
+    OutboxEvent event = {};
+    event.action = OUTBOX_DELETE;
+    event.type = type;
+    snprintf(event.keyAccessId, sizeof(event.keyAccessId), "%s", keyAccessId ? keyAccessId : "");
+    return push(event);
+}
+
+/**
+ * @brief Read the oldest pending events without removing them from the outbox.
+ *
+ * Slots that fail the checksum are skipped. If every examined slot is broken they are dropped
+ * right away, so a single bad slot can never block the outbox.
+ *
+ * @param events The buffer to fill, in sequence order
+ * @param maxCount The maximum number of events to read
+ * @return The number of events stored in `events`
+ */
+size_t OutboxModule::peek(OutboxEvent *events, size_t maxCount) {
+    if (!_ready || xSemaphoreTake(_outboxMutex, portMAX_DELAY) != pdTRUE) return 0;
+
+    uint32_t pending = _header.tail - _header.head;
+    uint32_t examined = pending < maxCount ? pending : maxCount;
+    size_t count = 0;
+
+    File file = SD.open(OUTBOX_FILE_PATH, FILE_READ);
+    if (!file) {
+        ESP_LOGE(OUTBOX_LOG_TAG, "Error opening the file: %s", OUTBOX_FILE_PATH);
+        xSemaphoreGive(_outboxMutex);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < examined; i++) {
+        uint32_t sequence = _header.head + i;
+        OutboxEvent &event = events[count];
+        if (!file.seek(slotOffset(sequence)) || file.read((uint8_t*)&event, sizeof(OutboxEvent)) != sizeof(OutboxEvent)
+            || event.crc != eventChecksum(event) || event.sequence != sequence) {
+            ESP_LOGW(OUTBOX_LOG_TAG, "Outbox slot of event %lu is corrupted, skipping it", (unsigned long)sequence);
+            continue;
+        }
+        count++;
+    }
+    file.close();
+
+    if (count == 0 && examined > 0) {
+        OutboxHeader header = _header;
+        header.head += examined;
+        header.dropped += examined;
+
+        file = SD.open(OUTBOX_FILE_PATH, "r+");
+        if (file && writeHeader(file, header)) _header = header;
+        if (file) file.close();
+    }
+
+    xSemaphoreGive(_outboxMutex);
+    return count;
+}
+
+/**
+ * @brief Remove every pending event up to and including `lastSequence`, after they are delivered.
+ *
+ * @param lastSequence The sequence of the last delivered event
+ * @return `true` if the outbox header is stored to the SD Card, `false` otherwise.
+ */
+bool OutboxModule::pop(uint32_t lastSequence) {
+    if (!_ready || xSemaphoreTake(_outboxMutex, portMAX_DELAY) != pdTRUE) return false;
+
+    uint32_t head = lastSequence + 1;
+
+    // The events may already be gone if the outbox was full and overwrote them while uploading
+    if ((int32_t)(head - _header.head) <= 0) {
+        xSemaphoreGive(_outboxMutex);
+        return true;
+    }
+    if ((int32_t)(head - _header.tail) > 0) head = _header.tail;
+
+    OutboxHeader header = _header;
+    header.head = head;
+
+    bool stored = false;
+    File file = SD.open(OUTBOX_FILE_PATH, "r+");
+    if (file) {
+        stored = writeHeader(file, header);
+        file.close();
+    }
+
+    if (stored) _header = header;
+    else ESP_LOGE(OUTBOX_LOG_TAG, "Failed to remove delivered events from the outbox, they will be sent again");
+
+    xSemaphoreGive(_outboxMutex);
+    return stored;
+}
+
+/**
+ * @brief Get the number of pending events in the outbox.
+ *
+ * @return The number of events that are not delivered yet
+ */
+uint32_t OutboxModule::size() {
+    uint32_t pending = 0;
+    if (xSemaphoreTake(_outboxMutex, portMAX_DELAY) == pdTRUE) {
+        pending = _header.tail - _header.head;
+        xSemaphoreGive(_outboxMutex);
+    }
+    return pending;
+}
+
+/**
+ * @brief Get the Key Access IDs of the delete events that are not delivered yet.
+ *
+ * Read by the pull of the key access list, so a key access deleted on the device is not added back
+ * before the server got its delete.
+ *
+ * @param keyAccessIds Filled with the Key Access IDs of the pending deletes
+ */
+void OutboxModule::getPendingDeletes(std::vector<std::string> &keyAccessIds) {
+    keyAccessIds.clear();
+    if (!_ready || xSemaphoreTake(_outboxMutex, portMAX_DELAY) != pdTRUE) return;
+
+    File file = SD.open(OUTBOX_FILE_PATH, FILE_READ);
+    if (file) {
+        OutboxEvent event;
+        for (uint32_t sequence = _header.head; sequence != _header.tail; sequence++) {
+            if (!file.seek(slotOffset(sequence)) || file.read((uint8_t*)&event, sizeof(OutboxEvent)) != sizeof(OutboxEvent)
+                || event.crc != eventChecksum(event) || event.sequence != sequence) continue;
+            if (event.action == OUTBOX_DELETE) keyAccessIds.push_back(std::string(event.keyAccessId, strnlen(event.keyAccessId, sizeof(event.keyAccessId))));
+        }
+        file.close();
+    } else {
+        ESP_LOGE(OUTBOX_LOG_TAG, "Error opening the file: %s", OUTBOX_FILE_PATH);
+    }
+
+    xSemaphoreGive(_outboxMutex);
+}
+
+/**
+ * @brief Store an event in the next slot of the ring buffer and then move the tail forward.
+ *
+ * The slot is written before the header, so a power loss in between only loses the new event.
+ * When the outbox is full the oldest event is overwritten.
+ *
+ * @param event The event to store, the sequence and the checksum are filled here
+ * @return `true` if the event is stored to the SD Card, `false` otherwise.
+ */
+bool OutboxModule::push(OutboxEvent &event) {
+    if (!_ready || xSemaphoreTake(_outboxMutex, portMAX_DELAY) != pdTRUE) return false;
+
+    OutboxHeader header = _header;
+    if (header.tail - header.head >= OUTBOX_CAPACITY) {
+        ESP_LOGW(OUTBOX_LOG_TAG, "Outbox is full, dropping the oldest event %lu", (unsigned long)header.head);
+        header.head++;
+        header.dropped++;
+    }
+
+    event.sequence = header.tail;
+    event.timestamp = (uint32_t)time(nullptr);
+    event.crc = eventChecksum(event);
+    header.tail++;
+
+    File file = SD.open(OUTBOX_FILE_PATH, "r+");
+    if (!file) {
+        ESP_LOGE(OUTBOX_LOG_TAG, "Error opening the file: %s", OUTBOX_FILE_PATH);
+        xSemaphoreGive(_outboxMutex);
+        return false;
+    }
+
+    bool stored = file.seek(slotOffset(event.sequence))
+        && file.write((const uint8_t*)&event, sizeof(OutboxEvent)) == sizeof(OutboxEvent);
+    file.flush();
+    stored = stored && writeHeader(file, header);
+    file.close();
+
+    if (stored) {
+        _header = header;
+        ESP_LOGD(OUTBOX_LOG_TAG, "Event %lu stored to the outbox, %lu pending", (unsigned long)event.sequence, (unsigned long)(header.tail - header.head));
+    } else {
+        ESP_LOGE(OUTBOX_LOG_TAG, "Failed to store event %lu to the outbox", (unsigned long)event.sequence);
+    }
+
+    xSemaphoreGive(_outboxMutex);
+    return stored;
+}
+
+/**
+ * @brief Create an empty outbox file with every slot allocated up front.
+ *
+ * Allocating the whole file once means a push never has to grow the file.
+ *
+ * @return `true` if the file is created, `false` otherwise.
+ */
+bool OutboxModule::createFile() {
+    File file = SD.open(OUTBOX_FILE_PATH, FILE_WRITE);
+    if (!file) {
+        ESP_LOGE(OUTBOX_LOG_TAG, "Failed to create the file: %s", OUTBOX_FILE_PATH);
+        return false;
+    }
+
+    OutboxHeader header = {};
+    header.magic = OUTBOX_MAGIC;
+    header.version = OUTBOX_VERSION;
+    header.capacity = OUTBOX_CAPACITY;
+    header.crc = headerChecksum(header);
+
+    bool stored = file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header);
+
+    // The second header copy and every slot start zeroed, which never pass the checksum
+    uint8_t zeros[512] = {};
+    size_t remaining = sizeof(OutboxHeader) + (size_t)OUTBOX_CAPACITY * sizeof(OutboxEvent);
+    while (stored && remaining > 0) {
+        size_t chunk = remaining < sizeof(zeros) ? remaining : sizeof(zeros);
+        stored = file.write(zeros, chunk) == chunk;
+        remaining -= chunk;
+    }
+    file.close();
+
+    if (!stored) {
+        ESP_LOGE(OUTBOX_LOG_TAG, "Failed to allocate the file: %s", OUTBOX_FILE_PATH);
+        SD.remove(OUTBOX_FILE_PATH);
+        return false;
+    }
+
+    _header = header;
+    ESP_LOGI(OUTBOX_LOG_TAG, "Outbox created with %d slots", OUTBOX_CAPACITY);
+    return true;
+}
+
+/**
+ * @brief Write the header to the copy that was not written last.
+ *
+ * @param file The outbox file opened for update
+ * @param header The header to write, the generation and the checksum are filled here
+ * @return `true` if the header is written, `false` otherwise.
+ */
+bool OutboxModule::writeHeader(File &file, OutboxHeader &header) {
+    header.generation++;
+    header.crc = headerChecksum(header);
+
+    bool written = file.seek((header.generation % 2) * sizeof(OutboxHeader))
+        && file.write((const uint8_t*)&header, sizeof(OutboxHeader)) == sizeof(OutboxHeader);
+    file.flush();
+    return written;
+}
+
+uint32_t OutboxModule::headerChecksum(const OutboxHeader &header) {
+    return esp_rom_crc32_le(0, (const uint8_t*)&header, offsetof(OutboxHeader, crc));
+}
+
+uint32_t OutboxModule::eventChecksum(const OutboxEvent &event) {
+    return esp_rom_crc32_le(0, (const uint8_t*)&event, offsetof(OutboxEvent, crc));
+}
+
+size_t OutboxModule::slotOffset(uint32_t sequence) {
+    return 2 * sizeof(OutboxHeader) + (size_t)(sequence % OUTBOX_CAPACITY) * sizeof(OutboxEvent);
+}
@@ -0,0 +1,80 @@
+#ifndef OUTBOX_MODULE_H
+#define OUTBOX_MODULE_H
+
+#include <SD.h>
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <string>
+#include <vector>
+#include "enum/LockType.h"
+
+#define OUTBOX_FILE_PATH        "/outbox.bin"       // File path for the persistent outbound event ring buffer
+#define OUTBOX_CAPACITY         1024                // Maximum pending events, the oldest is overwritten when full (~80KB)
+#define OUTBOX_MAGIC            0x584F424F          // "OBOX"
+#define OUTBOX_VERSION          1
+
+/**
+ * @enum OutboxAction
+ * @brief The kind of mutation an outbound event carries to the backend.
+ *
+ */
+enum OutboxAction : uint8_t {
+    OUTBOX_ACCESS = 1,          /* A granted access that has to be stored in the backend access history   */
+    OUTBOX_DELETE = 2,          /* A server-side cleanup of a Key Access that failed to be stored locally  */
+};
+
+/// @brief A single outbound event stored in a slot of the outbox. Fixed size so a slot can be seek directly
+struct OutboxEvent {
+    uint32_t sequence;          /* Monotonic sequence number, the backend can use it to drop duplicates */
+    uint32_t timestamp;         /* Epoch time when the event was pushed                                 */
+    uint8_t action;             /* The mutation of the event, see `OutboxAction`                        */
+    uint8_t type;               /* The type of the Key Access (RFID or Fingerprint), see `LockType`     */
+    uint8_t fingerprintId;      /* The Fingerprint ID of the event, 0 for RFID                          */
+    uint8_t reserved;
+    char keyAccessId[40];       /* The Key Access ID of the event                                       */
+    char uidCard[24];           /* The NFC Card UID of the event, empty for Fingerprint                 */
+    uint32_t crc;               /* CRC32 of all the fields above, detects torn or never written slots   */
+};
+
+/// @brief Header of the outbox file, stored twice and written alternately so a torn write never loses both
+struct OutboxHeader {
+    uint32_t magic;
+    uint32_t generation;        /* Incremented on every header write, the newest valid copy wins        */
+    uint32_t head;              /* Sequence of the oldest pending event                                 */
+    uint32_t tail;              /* Sequence of the next event to be pushed                              */
+    uint32_t dropped;           /* Events overwritten because the outbox was full                       */
+    uint16_t capacity;
+    uint16_t version;
+    uint32_t reserved;
+    uint32_t crc;               /* CRC32 of all the fields above                                        */
+};
+
+/// @brief Persistent ring buffer on the SD Card for events that have to be delivered to the backend
+class OutboxModule {
+public:
+    OutboxModule();
+    bool setup();
+
+    bool pushAccess(LockType type, const char *keyAccessId, const char *uidCard, int fingerprintId);
+    bool pushDelete(LockType type, const char *keyAccessId);
+    size_t peek(OutboxEvent *events, size_t maxCount);
+    bool pop(uint32_t lastSequence);
+    uint32_t size();
+    void getPendingDeletes(std::vector<std::string> &keyAccessIds);
+
+private:
+    OutboxHeader _header;
+    SemaphoreHandle_t _outboxMutex;
+    bool _ready;
+
+    bool push(OutboxEvent &event);
+    bool createFile();
+    bool writeHeader(File &file, OutboxHeader &header);
+    static uint32_t headerChecksum(const OutboxHeader &header);
+    static uint32_t eventChecksum(const OutboxEvent &event);
+    static size_t slotOffset(uint32_t sequence);
+};
+
+#endif
@@ -1,12 +1,62 @@
 #define SD_CARD_LOG_TAG "SD_CARD"
 
 #include "esp_log.h"
+#include "esp_random.h"
 #include "SDCardModule.h"
+#include "entity/JsonStream.h"
+
+#include <algorithm>
+
+/// @brief Holds the storage mutex until the end of the scope, so every return path gives it back
+class StorageLock {
+public:
+    explicit StorageLock(SDCardModule *module) : _module(module) { _module->lockStorage(); }
+    ~StorageLock() { _module->unlockStorage(); }
+
+private:
+    SDCardModule *_module;
+};
+
+SDCardModule::SDCardModule() : _storageDepth(0), _revision(0), _changeLogId(0) {
+    _indexMutex = xSemaphoreCreateMutex();
+    if (_indexMutex == NULL) ESP_LOGE(SD_CARD_LOG_TAG, "Failed to create Key Access index mutex.");
+
+    // Recursive, a bulk change writes the files through the single key access changes
+    _storageMutex = xSemaphoreCreateRecursiveMutex();
+    if (_storageMutex == NULL) ESP_LOGE(SD_CARD_LOG_TAG, "Failed to create Key Access storage mutex.");
 
-SDCardModule::SDCardModule() {
     setup();
     createEmptyJsonFileIfNotExists(FINGERPRINT_FILE_PATH);
     createEmptyJsonFileIfNotExists(RFID_FILE_PATH);
+    loadIndex();
+    loadChangeLog();
+}
+
+/**
+ * @brief Check the SD Card is mounted and both key access files can be opened
+ *
+ * @return `true` if the key access store is usable, `false` otherwise.
+ */
+bool SDCardModule::selfTest() {
+    if (SD.cardType() == CARD_NONE) return false;
+
+    const char *filePaths[] = {RFID_FILE_PATH, FINGERPRINT_FILE_PATH};
+    for (const char *filePath : filePaths) {
+        File file = SD.open(filePath, FILE_READ);
+        if (!file) return false;
+        file.close();
+    }
+    return true;
+}
+
+/**
+ * @brief Watch the key access removed from the key access files, by any of the delete paths
+ *
+ * @param watcher Called from the task that removed the key access once it released the storage
+ * mutex, so the watcher may take its own locks
+ */
+void SDCardModule::watchRemoved(KeyAccessWatcher watcher) {
+    _removedWatcher = watcher;
 }
 
 /**
@@ -72,40 +122,20 @@ bool SDCardModule::setup() {
 bool SDCardModule::isFingerprintIdRegistered(int id) {
     ESP_LOGI(SD_CARD_LOG_TAG, "Checking if Fingerprint ID %d is already registered on the SD Card", id);
 
-    // Open the file and create a new Static JsonDocument
-    File file = SD.open(FINGERPRINT_FILE_PATH, FILE_READ);
-    JsonDocument document;
-
-    if (file) {
-        DeserializationError error = deserializeJson(document, file);
-        if (error) {
-            ESP_LOGE(SD_CARD_LOG_TAG, "Failed to deserialize JSON: %s", error.c_str());
-            file.close();
-            return false;
-        }
-        file.close();
-    } else {
-        ESP_LOGE(SD_CARD_LOG_TAG, "Error opening the file: %s", FINGERPRINT_FILE_PATH);
-        return false;
-    }
-
-    // Iterate through users
-    for (JsonObject user : document.as<JsonArray>()) {
-        const char *currentUsername = user["name"];
-
-        // Iterate through fingerprints for the current user
-        JsonArray fingerprints = user["fingerprints"].as<JsonArray>();
-        for (JsonObject fingerprint : fingerprints) {
-            // Check if the fingerprintId matches
-            if (fingerprint["fingerprint_id"].as<int>() == id) {
-                ESP_LOGI(SD_CARD_LOG_TAG, "Fingerprint ID %d found under user %s", id, currentUsername);
-                return true;
+    bool found = false;
+    if (xSemaphoreTake(_indexMutex, portMAX_DELAY) == pdTRUE) {
+        for (const FingerprintIndexEntry &fingerprint : _fingerprintIndex) {
+            if (fingerprint.fingerprintId == id) {
+                ESP_LOGI(SD_CARD_LOG_TAG, "Fingerprint ID %d found under user %s", id, _stringPool.get(fingerprint.name));
+                found = true;
+                break;
             }
         }
+        xSemaphoreGive(_indexMutex);
     }
 
-    ESP_LOGW(SD_CARD_LOG_TAG, "Fingerprint ID %d not found in any user", id);
-    return false;
+    if (!found) ESP_LOGW(SD_CARD_LOG_TAG, "Fingerprint ID %d not found in any user", id);
+    return found;
 }
 
 /**
@@ -121,6 +151,7 @@ bool SDCardModule::isFingerprintIdRegistered(int id) {
  * @return `true` if the fingerprint data was successfully saved, `false` otherwise.
  */
 bool SDCardModule::saveFingerprintToSDCard(const char *username, int fingerprintId, const char *visitorId, const char *keyAccessId) {
+    StorageLock lock(this);
     ESP_LOGI(SD_CARD_LOG_TAG, "Saving Fingerprint ID Data, Username %s, ID %d, VisitorId %s, KeyAccessId %s", username, fingerprintId, visitorId, keyAccessId);
     createEmptyJsonFileIfNotExists(FINGERPRINT_FILE_PATH);
 
@@ -180,8 +211,18 @@ bool SDCardModule::saveFingerprintToSDCard(const char *username, int fingerprint
     if (file) {
         serializeJson(document, file);
         file.close();
+        rebuildIndex(LockType::FINGERPRINT, document.as<JsonArrayConst>());
         document.clear();
 
+        JsonDocument change;
+        change["op"] = "add";
+        change["type"] = "FINGERPRINT";
+        change["key_access_id"] = keyAccessId;
+        change["visitor_id"] = visitorId;
+        change["name"] = username;
+        change["fingerprint_id"] = fingerprintId;
+        appendChange(change);
+
         ESP_LOGI(SD_CARD_LOG_TAG, "Fingerprint data successfully stored to SD Card");
         return true;
     } else {
@@ -201,6 +242,7 @@ bool SDCardModule::saveFingerprintToSDCard(const char *username, int fingerprint
  * @return `true` if the fingerprint ID was successfully deleted, `false` otherwise.
  */
 bool SDCardModule::deleteFingerprintFromSDCard(const char* keyAccessId) {
+    StorageLock lock(this);
     ESP_LOGI(SD_CARD_LOG_TAG, "Deleting Fingerprint ID Data, KeyAccessId: %s", keyAccessId);
 
     // Open the file and create new Static JsonDocument
@@ -264,6 +306,15 @@ bool SDCardModule::deleteFingerprintFromSDCard(const char* keyAccessId) {
                 return false;
             }
             file.close();
+            rebuildIndex(LockType::FINGERPRINT, document.as<JsonArrayConst>());
+
+            JsonDocument change;
+            change["op"] = "delete";
+            change["type"] = "FINGERPRINT";
+            change["key_access_id"] = keyAccessId;
+            appendChange(change);
+            notifyRemoved(LockType::FINGERPRINT, {keyAccessId});
+
             ESP_LOGI(SD_CARD_LOG_TAG, "Fingerprint data change is successfully stored to SD Card");
             return true;
         } else {
@@ -282,9 +333,11 @@ bool SDCardModule::deleteFingerprintFromSDCard(const char* keyAccessId) {
  * Searches for the given visitorId that associated the specified fingerprints.
  *
  * @param visitorId The visitor ID of the user
+ * @param removedKeyAccessIds Set to the Key Access IDs that were deleted, can be `nullptr`
  * @return `true` if the fingerprints was successfully deleted, `false` otherwise.
  */
-bool SDCardModule::deleteFingerprintsUserFromSDCard(const char* visitorId){
+bool SDCardModule::deleteFingerprintsUserFromSDCard(const char* visitorId, std::vector<std::string> *removedKeyAccessIds){
+    StorageLock lock(this);
     ESP_LOGI(SD_CARD_LOG_TAG, "Deleting Fingerprints User, Visitor ID: %s", visitorId);
 
     // Open the file and create new Static JsonDocument
@@ -306,6 +359,7 @@ bool SDCardModule::deleteFingerprintsUserFromSDCard(const char* visitorId){
 
     // Search for the user with the given visitor_id
     bool userFound = false;
+    std::vector<std::string> removed;
     JsonArray users = document.as<JsonArray>();
     for (int i = 0; i < users.size(); i++) {
         JsonObject user = users[i].as<JsonObject>();
@@ -319,6 +373,10 @@ bool SDCardModule::deleteFingerprintsUserFromSDCard(const char* visitorId){
         }
 
         if (strcmp(userVisitorId, visitorId) == 0) {
+            for (JsonObjectConst entry : user["fingerprints"].as<JsonArrayConst>()) {
+                const char *keyAccessId = entry["key_access_id"];
+                if (keyAccessId != nullptr) removed.push_back(keyAccessId);
+            }
             users.remove(i);
             userFound = true;
             ESP_LOGI(SD_CARD_LOG_TAG, "User with Visitor ID %s deleted in memory", visitorId);
@@ -336,6 +394,16 @@ bool SDCardModule::deleteFingerprintsUserFromSDCard(const char* visitorId){
                 return false;
             }
             file.close();
+            rebuildIndex(LockType::FINGERPRINT, document.as<JsonArrayConst>());
+
+            JsonDocument change;
+            change["op"] = "delete_user";
+            change["type"] = "FINGERPRINT";
+            change["visitor_id"] = visitorId;
+            appendChange(change);
+            notifyRemoved(LockType::FINGERPRINT, removed);
+            if (removedKeyAccessIds != nullptr) *removedKeyAccessIds = removed;
+
             ESP_LOGI(SD_CARD_LOG_TAG, "Fingerprint data change is successfully stored to SD Card");
             return true;
         } else {
@@ -357,57 +425,24 @@ bool SDCardModule::deleteFingerprintsUserFromSDCard(const char* visitorId){
 int SDCardModule::getFingerprintIdByKeyAccessId(const char* keyAccessId) {
     ESP_LOGI(SD_CARD_LOG_TAG, "Searching for Fingerprint ID by KeyAccessId: %s", keyAccessId);
 
-    JsonDocument document;
-
-    // Open the file containing fingerprint data
-    File file = SD.open(FINGERPRINT_FILE_PATH, FILE_READ);
-
-    if (!file) {
-        ESP_LOGE(SD_CARD_LOG_TAG, "Error opening the file: %s", FINGERPRINT_FILE_PATH);
-        return -1;
-    }
-
-    // Deserialize the JSON data
-    DeserializationError error = deserializeJson(document, file);
-    file.close();
-
-    if (error) {
-        ESP_LOGE(SD_CARD_LOG_TAG, "Failed to deserialize JSON: %s", error.c_str());
-        return -1;
-    }
-
-    // Check if the document is a valid array
-    if (!document.is<JsonArray>()) {
-        ESP_LOGE(SD_CARD_LOG_TAG, "JSON file does not contain an array.");
-        return -1;
-    }
-
-    // Search for the KeyAccessId in the "fingerprints" array of each user
-    ESP_LOGI(SD_CARD_LOG_TAG, "Begin Searching in %s File", FINGERPRINT_FILE_PATH);
-    for (JsonObject user : document.as<JsonArray>()) {
-        JsonArray fingerprints = user["fingerprints"].as<JsonArray>();
-        
-        // Iterate through fingerprints array to find the keyAccessId
-        for (JsonObject fingerprint : fingerprints) {
-            const char* currentKeyAccessId = fingerprint["key_access_id"];
-            
-            // Check first if there is named key_access_id, to prevent nullptr comparison
-            if (currentKeyAccessId == nullptr) {
-                ESP_LOGW(SD_CARD_LOG_TAG, "Fingerprint entry missing key_access_id. Skipping.");
-                continue;
-            }
-            
-            // If the keyAccessId matches, return the associated fingerprintId
-            if (strcmp(currentKeyAccessId, keyAccessId) == 0) {
-                int fingerprintId = fingerprint["fingerprint_id"].as<int>();
-                ESP_LOGI(SD_CARD_LOG_TAG, "Fingerprint model found for KeyAccessId: %s, FingerprintId: %d", keyAccessId, fingerprintId);
-                return fingerprintId;
+    int fingerprintId = -1;
+    if (xSemaphoreTake(_indexMutex, portMAX_DELAY) == pdTRUE) {
+        // A string that was never interned cannot be in the index
+        StringHandle keyAccessHandle = _stringPool.find(keyAccessId);
+        if (keyAccessHandle != INVALID_STRING_HANDLE) {
+            for (const FingerprintIndexEntry &fingerprint : _fingerprintIndex) {
+                if (fingerprint.keyAccessId == keyAccessHandle) {
+                    fingerprintId = fingerprint.fingerprintId;
+                    break;
+                }
             }
         }
+        xSemaphoreGive(_indexMutex);
     }
 
-    ESP_LOGW(SD_CARD_LOG_TAG, "Fingerprint model with KeyAccessId: %s not found", keyAccessId);
-    return -1;
+    if (fingerprintId > 0) ESP_LOGI(SD_CARD_LOG_TAG, "Fingerprint model found for KeyAccessId: %s, FingerprintId: %d", keyAccessId, fingerprintId);
+    else ESP_LOGW(SD_CARD_LOG_TAG, "Fingerprint model with KeyAccessId: %s not found", keyAccessId);
+    return fingerprintId;
 }
 
 /**
@@ -421,44 +456,19 @@ std::vector<int> SDCardModule::getFingerprintIdsByVisitorId(const char *visitorI
 
     ESP_LOGI(SD_CARD_LOG_TAG, "Fetching Fingerprint IDs for Visitor ID %s", visitorId);
 
-    // Read the JSON from SD card
-    File file = SD.open(FINGERPRINT_FILE_PATH, FILE_READ);
-    JsonDocument document;
-
-    if (file) {
-        DeserializationError error = deserializeJson(document, file);
-        if (error) {
-            ESP_LOGE(SD_CARD_LOG_TAG, "Failed to deserialize JSON: %s", error.c_str());
-            file.close();
-            return fingerprintIds;
-        }
-        file.close();
-    } else {
-        ESP_LOGE(SD_CARD_LOG_TAG, "Error opening the file: %s", FINGERPRINT_FILE_PATH);
-        return fingerprintIds;
-    }
-
-    // Search for the user with the given visitor_id
-    bool userFound = false;
-    for (JsonObject user : document.as<JsonArray>()) {
-        if (user["visitor_id"] == visitorId) {
-            // User found, now extract the fingerprint IDs
-            JsonArray fingerprints = user["fingerprints"].as<JsonArray>();
-            for (JsonObject fingerprint : fingerprints) {
-                int fingerprintId = fingerprint["fingerprint_id"];
-                fingerprintIds.push_back(fingerprintId);
+    if (xSemaphoreTake(_indexMutex, portMAX_DELAY) == pdTRUE) {
+        StringHandle visitorHandle = _stringPool.find(visitorId);
+        if (visitorHandle != INVALID_STRING_HANDLE) {
+            for (const FingerprintIndexEntry &fingerprint : _fingerprintIndex) {
+                if (fingerprint.visitorId == visitorHandle) fingerprintIds.push_back(fingerprint.fingerprintId);
             }
-
-            userFound = true;
-            ESP_LOGI(SD_CARD_LOG_TAG, "Found %d fingerprints for Visitor ID %s", fingerprintIds.size(), visitorId);
-            break;
         }
+        xSemaphoreGive(_indexMutex);
     }
 
     // If user is not found, fingerprintIds will remain empty
-    if (!userFound) {
-        ESP_LOGE(SD_CARD_LOG_TAG, "Visitor ID %s not found", visitorId);
-    }
+    if (fingerprintIds.empty()) ESP_LOGE(SD_CARD_LOG_TAG, "Visitor ID %s not found", visitorId);
+    else ESP_LOGI(SD_CARD_LOG_TAG, "Found %d fingerprints for Visitor ID %s", fingerprintIds.size(), visitorId);
 
     return fingerprintIds;
 }
@@ -471,40 +481,22 @@ std::vector<int> SDCardModule::getFingerprintIdsByVisitorId(const char *visitorI
  */
 std::string* SDCardModule::getKeyAccessIdByFingerprintId(int fingerprintId) {
     ESP_LOGI(SD_CARD_LOG_TAG, "Get KeyAccessId by Fingerprint ID %d in SD Card", fingerprintId);
-    File file = SD.open(FINGERPRINT_FILE_PATH, FILE_READ);
-    JsonDocument document;
-
-    if (file) {
-        DeserializationError error = deserializeJson(document, file);
-        if (error) {
-            ESP_LOGE(SD_CARD_LOG_TAG, "Failed to deserialize JSON: %s", error.c_str());
-            file.close();
-            return nullptr;
-        }
-        file.close();
-    } else {
-        ESP_LOGE(SD_CARD_LOG_TAG, "Error opening the file: %s", FINGERPRINT_FILE_PATH);
-        return nullptr;
-    }
 
-    // Loop through each user in the JSON array
-    for (JsonObject user : document.as<JsonArray>()) {
-        JsonArray fingerprints = user["fingerprints"].as<JsonArray>();
-        if (!fingerprints.isNull()) {
-            for (JsonObject fingerprint : fingerprints) {
-                int storedId = fingerprint["fingerprint_id"];
-                const char* keyAccessId = fingerprint["key_access_id"];
-
-                if (storedId == fingerprintId && keyAccessId != nullptr) {
-                    ESP_LOGI(SD_CARD_LOG_TAG, "Found keyAccessId %s for Fingerprint ID %d", keyAccessId, fingerprintId);
-                    return new std::string(keyAccessId);
-                }
+    std::string *keyAccessId = nullptr;
+    if (xSemaphoreTake(_indexMutex, portMAX_DELAY) == pdTRUE) {
+        for (const FingerprintIndexEntry &fingerprint : _fingerprintIndex) {
+            const char *storedKeyAccessId = _stringPool.get(fingerprint.keyAccessId);
+            if (fingerprint.fingerprintId == fingerprintId && storedKeyAccessId != nullptr) {
+                keyAccessId = new std::string(storedKeyAccessId);
+                break;
             }
         }
+        xSemaphoreGive(_indexMutex);
     }
 
-    ESP_LOGW(SD_CARD_LOG_TAG, "keyAccessId for Fingerprint ID %d not found", fingerprintId);
-    return nullptr;
+    if (keyAccessId != nullptr) ESP_LOGI(SD_CARD_LOG_TAG, "Found keyAccessId %s for Fingerprint ID %d", keyAccessId->c_str(), fingerprintId);
+    else ESP_LOGW(SD_CARD_LOG_TAG, "keyAccessId for Fingerprint ID %d not found", fingerprintId);
+    return keyAccessId;
 }
 
 /**
@@ -516,50 +508,23 @@ std::string* SDCardModule::getKeyAccessIdByFingerprintId(int fingerprintId) {
 bool SDCardModule::isNFCIdRegistered(const char *id) {
     ESP_LOGI(SD_CARD_LOG_TAG, "Checking if NFC ID %s already exists in SD Card", id);
 
-    // Open the file and then close it and create new Static in heap
-    File file = SD.open(RFID_FILE_PATH, FILE_READ);
-    JsonDocument document;
-
-    if (file) {
-        DeserializationError error = deserializeJson(document, file);
-        if (error) {
-            ESP_LOGE(SD_CARD_LOG_TAG, "Failed to deserialize JSON: %s", error.c_str());
-            file.close();
-            return false;
-        }
-        file.close();
-    } else {
-        ESP_LOGE(SD_CARD_LOG_TAG, "Error opening the file: %s", RFID_FILE_PATH);
-        return false;
-    }
-
-    // Loop through each user in the JSON array
-    for (JsonObject user : document.as<JsonArray>()) {
-        const char *currentUsername = user["name"];
-
-        // Get the nfcs array for the current user
-        JsonArray nfcs = user["nfcs"].as<JsonArray>();
-
-        // Loop through each NFC entry for the current user
-        for (JsonObject nfc : nfcs) {
-            const char *nfcId = nfc["nfc_uid"];
-
-            // Check first if there is named key_access_id, to prevent nullptr comparison
-            if (nfcId == nullptr) {
-                ESP_LOGW(SD_CARD_LOG_TAG, "NFC entry missing key_access_id. Skipping.");
-                continue;
-            }
-
-            // Check if the current NFC ID matches the one we're looking for
-            if (strcmp(nfcId, id) == 0) {
-                ESP_LOGI(SD_CARD_LOG_TAG, "NFC ID %s found under User %s", id, currentUsername);
-                return true;
+    bool found = false;
+    if (xSemaphoreTake(_indexMutex, portMAX_DELAY) == pdTRUE) {
+        StringHandle uidHandle = _stringPool.find(id);
+        if (uidHandle != INVALID_STRING_HANDLE) {
+            for (const NFCIndexEntry &nfc : _nfcIndex) {
+                if (nfc.uidCard == uidHandle) {
+                    ESP_LOGI(SD_CARD_LOG_TAG, "NFC ID %s found under User %s", id, _stringPool.get(nfc.name));
+                    found = true;
+                    break;
+                }
             }
         }
+        xSemaphoreGive(_indexMutex);
     }
 
-    ESP_LOGW(SD_CARD_LOG_TAG, "NFC ID %s not found in any user", id);
-    return false;
+    if (!found) ESP_LOGW(SD_CARD_LOG_TAG, "NFC ID %s not found in any user", id);
+    return found;
 }
 
 /**
@@ -572,6 +537,7 @@ bool SDCardModule::isNFCIdRegistered(const char *id) {
  * @return `true` if the NFC data was successfully saved, `false` otherwise.
  */
 bool SDCardModule::saveNFCToSDCard(const char *username, const char *uidCard, const char *visitorId, const char *keyAccessId) {
+    StorageLock lock(this);
     ESP_LOGI(SD_CARD_LOG_TAG, "Saving NFC Data, Username %s, NFC UID %s, Visitor ID %s, Key Access ID %s", username, uidCard, visitorId, keyAccessId);
 
     createEmptyJsonFileIfNotExists(RFID_FILE_PATH);
@@ -634,8 +600,18 @@ bool SDCardModule::saveNFCToSDCard(const char *username, const char *uidCard, co
     if (file) {
         serializeJson(document, file);
         file.close();
+        rebuildIndex(LockType::RFID, document.as<JsonArrayConst>());
         document.clear();
 
+        JsonDocument change;
+        change["op"] = "add";
+        change["type"] = "RFID";
+        change["key_access_id"] = keyAccessId;
+        change["visitor_id"] = visitorId;
+        change["name"] = username;
+        change["nfc_uid"] = uidCard;
+        appendChange(change);
+
         ESP_LOGI(SD_CARD_LOG_TAG, "NFC data is successfully stored to SD Card");
         return true;
     } else {
@@ -658,6 +634,7 @@ bool SDCardModule::saveNFCToSDCard(const char *username, const char *uidCard, co
  * @return `true` if the NFC ID was successfully deleted, `false` otherwise.
  */
 bool SDCardModule::deleteNFCFromSDCard(const char *keyAccessId) {
+    StorageLock lock(this);
     ESP_LOGI(SD_CARD_LOG_TAG, "Delete NFC Data, Key Access ID %s", keyAccessId);
 
     // Open the file for reading the data
@@ -718,8 +695,16 @@ bool SDCardModule::deleteNFCFromSDCard(const char *keyAccessId) {
         if (file) {
             serializeJson(document, file);
             file.close();
+            rebuildIndex(LockType::RFID, document.as<JsonArrayConst>());
             document.clear();
 
+            JsonDocument change;
+            change["op"] = "delete";
+            change["type"] = "RFID";
+            change["key_access_id"] = keyAccessId;
+            appendChange(change);
+            notifyRemoved(LockType::RFID, {keyAccessId});
+
             ESP_LOGI(SD_CARD_LOG_TAG, "NFC data successfully updated in SD Card");
             return true;
         } else {
@@ -741,9 +726,11 @@ bool SDCardModule::deleteNFCFromSDCard(const char *keyAccessId) {
  * Searches for the given visitorId that associated the specified NFC Card access.
  *
  * @param visitorId The visitor ID of the user
+ * @param removedKeyAccessIds Set to the Key Access IDs that were deleted, can be `nullptr`
  * @return `true` if the NFCs was successfully deleted, `false` otherwise.
  */
-bool SDCardModule::deleteNFCsUserFromSDCard(const char *visitorId){
+bool SDCardModule::deleteNFCsUserFromSDCard(const char *visitorId, std::vector<std::string> *removedKeyAccessIds){
+    StorageLock lock(this);
     ESP_LOGI(SD_CARD_LOG_TAG, "Delete NFC Data User, Visitor ID %s", visitorId);
 
     // Open the file for reading the data
@@ -765,6 +752,7 @@ bool SDCardModule::deleteNFCsUserFromSDCard(const char *visitorId){
 
     // Search for the user with the given visitor_id
     bool userFound = false;
+    std::vector<std::string> removed;
     JsonArray users = document.as<JsonArray>();
     for (int i = 0; i < users.size(); i++) {
         JsonObject user = users[i].as<JsonObject>();
@@ -778,6 +766,10 @@ bool SDCardModule::deleteNFCsUserFromSDCard(const char *visitorId){
         }
 
         if (strcmp(userVisitorId, visitorId) == 0) {
+            for (JsonObjectConst entry : user["nfcs"].as<JsonArrayConst>()) {
+                const char *keyAccessId = entry["key_access_id"];
+                if (keyAccessId != nullptr) removed.push_back(keyAccessId);
+            }
             users.remove(i);
             userFound = true;
             ESP_LOGI(SD_CARD_LOG_TAG, "User with Visitor ID %s deleted in memory", visitorId);
@@ -795,6 +787,16 @@ bool SDCardModule::deleteNFCsUserFromSDCard(const char *visitorId){
                 return false;
             }
             file.close();
+            rebuildIndex(LockType::RFID, document.as<JsonArrayConst>());
+
+            JsonDocument change;
+            change["op"] = "delete_user";
+            change["type"] = "RFID";
+            change["visitor_id"] = visitorId;
+            appendChange(change);
+            notifyRemoved(LockType::RFID, removed);
+            if (removedKeyAccessIds != nullptr) *removedKeyAccessIds = removed;
+
             ESP_LOGI(SD_CARD_LOG_TAG, "NFC data change is successfully stored to SD Card");
             return true;
         } else {
@@ -818,54 +820,25 @@ bool SDCardModule::deleteNFCsUserFromSDCard(const char *visitorId){
 std::string* SDCardModule::getKeyAccessIdByNFCUid(char *id) {
     ESP_LOGI(SD_CARD_LOG_TAG, "Get Key Access ID by NFC ID %s in SD Card", id);
 
-    // Open the file and then close it and create new Static in heap
-    File file = SD.open(RFID_FILE_PATH, FILE_READ);
-    JsonDocument document;
-
-    if (file) {
-        DeserializationError error = deserializeJson(document, file);
-        if (error) {
-            ESP_LOGE(SD_CARD_LOG_TAG, "Failed to deserialize JSON: %s", error.c_str());
-            file.close();
-            return nullptr;
-        }
-        file.close();
-    } else {
-        ESP_LOGE(SD_CARD_LOG_TAG, "Error opening the File!, File %s", RFID_FILE_PATH);
-        return nullptr;
-    }
-
-    // Loop through each user in the JSON array
-    for (JsonObject user : document.as<JsonArray>()) {
-        JsonArray nfcCards = user["nfcs"].as<JsonArray>();
-        if (!nfcCards.isNull()) {
-            for (JsonObject nfcCard : nfcCards) {
-                const char* storedId = nfcCard["nfc_uid"];
-                const char* keyAccessId = nfcCard["key_access_id"];
-
-                // Check first if there is named key_access_id or nfc_uid field, to prevent nullptr comparison
-                if (storedId == nullptr) {
-                    ESP_LOGW(SD_CARD_LOG_TAG, "NFC entry seems missing nfc_uid. Skipping.");
-                    continue;
-                }
-
-                if (keyAccessId == nullptr) {
-                    ESP_LOGW(SD_CARD_LOG_TAG, "NFC entry seems missing key_access_id. Skipping.");
-                    continue;
-                }
-
-                // Check if the current NFC ID matches the one we're looking for
-                if (strcmp(storedId, id) == 0) {
-                    ESP_LOGI(SD_CARD_LOG_TAG, "Found keyAccessId %s for NFC Unique ID %s", keyAccessId, storedId);
-                    return new std::string(keyAccessId);
+    std::string *keyAccessId = nullptr;
+    if (xSemaphoreTake(_indexMutex, portMAX_DELAY) == pdTRUE) {
+        StringHandle uidHandle = _stringPool.find(id);
+        if (uidHandle != INVALID_STRING_HANDLE) {
+            for (const NFCIndexEntry &nfc : _nfcIndex) {
+                const char *storedKeyAccessId = _stringPool.get(nfc.keyAccessId);
+                if (nfc.uidCard == uidHandle && storedKeyAccessId != nullptr) {
+                    keyAccessId = new std::string(storedKeyAccessId);
+                    break;
                 }
             }
         }
+        xSemaphoreGive(_indexMutex);
     }
 
     // If no matching NFC ID is found, log and return nullptr
-    ESP_LOGW(SD_CARD_LOG_TAG, "NFC ID %s not found in any user", id);
-    return nullptr;
+    if (keyAccessId != nullptr) ESP_LOGI(SD_CARD_LOG_TAG, "Found keyAccessId %s for NFC Unique ID %s", keyAccessId->c_str(), id);
+    else ESP_LOGW(SD_CARD_LOG_TAG, "NFC ID %s not found in any user", id);
+    return keyAccessId;
 }
 
 /**
@@ -881,6 +854,7 @@ std::string* SDCardModule::getKeyAccessIdByNFCUid(char *id) {
  * @note Logs errors for invalid LockType or failed deletions.
  */
 bool SDCardModule::deleteAccessJsonFile(LockType type) {
+    StorageLock lock(this);
     ESP_LOGI(SD_CARD_LOG_TAG, "Delete the JSON Key Access File, Type %d", type);
 
     // Switch the file path based on LockType
@@ -899,6 +873,10 @@ bool SDCardModule::deleteAccessJsonFile(LockType type) {
         // Attempt to delete the file
         if (SD.remove(filePath)) {
             ESP_LOGI(SD_CARD_LOG_TAG, "%s file deleted successfully.", filePath);
+            std::vector<std::string> removed = getIndexedKeyAccessIds(type);
+            rebuildIndex(type, JsonArrayConst());
+            restartChangeLog();
+            notifyRemoved(type, removed);
             return true;
         } else {
             ESP_LOGE(SD_CARD_LOG_TAG, "Failed to delete %s file.", filePath);
@@ -916,6 +894,7 @@ bool SDCardModule::deleteAccessJsonFile(LockType type) {
  * @param filePath The path to the JSON file to create.
  */
 void SDCardModule::createEmptyJsonFileIfNotExists(const char *filePath){
+    StorageLock lock(this);
     ESP_LOGI(SD_CARD_LOG_TAG, "Start creating Empty JSON File");
 
     // Check if the file exists, if not, create it
@@ -947,6 +926,7 @@ void SDCardModule::createEmptyJsonFileIfNotExists(const char *filePath){
  * @return JsonObject The synchronized data from the RFID and Fingerprint files.
  */
 JsonDocument SDCardModule::syncData(){
+    StorageLock lock(this);
     ESP_LOGI(SD_CARD_LOG_TAG, "Start sync data from ESP32 SD Card to Titan");
 
     JsonDocument document;
@@ -986,3 +966,924 @@ JsonDocument SDCardModule::syncData(){
 
     return document;
 }
+
+/**
+ * @brief Get the revision of the key access files, it changes every time one of the files is changed
+ *
+ * @return The current revision
+ */
+uint32_t SDCardModule::getRevision(){
+    return _revision.load();
+}
+
+/**
+ * @brief Get the number of key access in the RAM index
+ *
+ * @param nfcCount Set to the number of NFC Cards
+ * @param fingerprintCount Set to the number of Fingerprints
+ */
+void SDCardModule::getKeyAccessCount(size_t &nfcCount, size_t &fingerprintCount){
+    nfcCount = 0;
+    fingerprintCount = 0;
+    if (xSemaphoreTake(_indexMutex, portMAX_DELAY) != pdTRUE) return;
+
+    nfcCount = _nfcIndex.size();
+    fingerprintCount = _fingerprintIndex.size();
+    xSemaphoreGive(_indexMutex);
+}
+
+/**
+ * @brief Stream a key access file from the SD Card in small parts, it is never loaded as a whole.
+ *
+ * @param type The type of the key access file (RFID or Fingerprint)
+ * @param writer Called with every part of the file, in order
+ * @return `true` if the whole file was streamed, `false` otherwise.
+ */
+bool SDCardModule::streamKeyAccessFile(LockType type, const SDStreamWriter &writer){
+    return streamFile(type == LockType::RFID ? RFID_FILE_PATH : FINGERPRINT_FILE_PATH, 0, SIZE_MAX, writer);
+}
+
+/**
+ * @brief Start a new change log, the changes before it can only be backed up with a full backup.
+ *
+ * Called after every bulk change of the key access files, a bulk change is not logged change by change.
+ *
+ * @return The id of the new change log, 0 if it could not be written
+ */
+uint32_t SDCardModule::restartChangeLog(){
+    StorageLock lock(this);
+    // The id tells a backup apart the log it was taken from, so it must never be reused by another log
+    uint32_t logId;
+    do {
+        logId = esp_random();
+    } while (logId == 0 || logId == _changeLogId);
+
+    File file = SD.open(CHANGE_LOG_FILE_PATH, FILE_WRITE);
+    if (!file) {
+        ESP_LOGE(SD_CARD_LOG_TAG, "Error opening the file: %s", CHANGE_LOG_FILE_PATH);
+        _changeLogId = 0;
+        return 0;
+    }
+    file.printf("{\"log\":%lu}\n", (unsigned long)logId);
+    file.close();
+
+    _changeLogId = logId;
+    ESP_LOGI(SD_CARD_LOG_TAG, "Change log restarted, Log ID %lu", (unsigned long)logId);
+    return logId;
+}
+
+/**
+ * @brief Get the id and the size of the change log
+ *
+ * @param logId Set to the id of the change log
+ * @param size Set to the size of the change log in bytes, including its header line
+ * @return `true` if there is a change log, `false` otherwise.
+ */
+bool SDCardModule::getChangeLogInfo(uint32_t &logId, size_t &size){
+    StorageLock lock(this);
+    logId = _changeLogId;
+    size = 0;
+    if (logId == 0) return false;
+
+    File file = SD.open(CHANGE_LOG_FILE_PATH, FILE_READ);
+    if (!file) return false;
+    size = file.size();
+    file.close();
+    return true;
+}
+
+/**
+ * @brief Stream a part of the change log, one json line per change.
+ *
+ * @param logId The id of the change log the part was planned from, the stream fails if it was restarted since
+ * @param offset The offset of the first byte to stream
+ * @param length The number of bytes to stream
+ * @param writer Called with every part of the log, in order
+ * @return `true` if the whole part was streamed, `false` otherwise.
+ */
+bool SDCardModule::streamChangeLog(uint32_t logId, size_t offset, size_t length, const SDStreamWriter &writer){
+    if (logId == 0 || logId != _changeLogId) return false;
+    if (!streamFile(CHANGE_LOG_FILE_PATH, offset, length, writer)) return false;
+    return logId == _changeLogId;
+}
+
+/**
+ * @brief Apply a change of the change log, from a restored backup.
+ *
+ * A change that is already applied, like a key access that is already stored, counts as applied so a
+ * backup can be restored over the key access that are left.
+ *
+ * @param change A change line of the change log
+ * @return `true` if the key access files have the change, `false` otherwise.
+ */
+bool SDCardModule::applyChange(JsonObjectConst change){
+    StorageLock lock(this);
+    const char *op = change["op"];
+    const char *typeName = change["type"];
+    const char *keyAccessId = change["key_access_id"];
+    const char *visitorId = change["visitor_id"];
+    if (op == nullptr || typeName == nullptr) return false;
+
+    LockType type;
+    if (strcmp(typeName, "RFID") == 0) type = LockType::RFID;
+    else if (strcmp(typeName, "FINGERPRINT") == 0) type = LockType::FINGERPRINT;
+    else return false;
+
+    if (strcmp(op, "add") == 0) {
+        const char *name = change["name"];
+        if (keyAccessId == nullptr || visitorId == nullptr || name == nullptr) return false;
+
+        if (type == LockType::RFID) {
+            const char *uidCard = change["nfc_uid"];
+            if (uidCard == nullptr) return false;
+            if (isNFCIdRegistered(uidCard)) return true;
+            return saveNFCToSDCard(name, uidCard, visitorId, keyAccessId);
+        }
+
+        if (!change["fingerprint_id"].is<int>()) return false;
+        int fingerprintId = change["fingerprint_id"];
+        if (isFingerprintIdRegistered(fingerprintId)) return true;
+        return saveFingerprintToSDCard(name, fingerprintId, visitorId, keyAccessId);
+    }
+
+    if (strcmp(op, "delete") == 0) {
+        if (keyAccessId == nullptr) return false;
+        if (!hasKeyAccess(type, keyAccessId, nullptr)) return true;
+        return type == LockType::RFID ? deleteNFCFromSDCard(keyAccessId) : deleteFingerprintFromSDCard(keyAccessId);
+    }
+
+    if (strcmp(op, "delete_user") == 0) {
+        if (visitorId == nullptr) return false;
+        if (!hasKeyAccess(type, nullptr, visitorId)) return true;
+        return type == LockType::RFID ? deleteNFCsUserFromSDCard(visitorId) : deleteFingerprintsUserFromSDCard(visitorId);
+    }
+
+    ESP_LOGW(SD_CARD_LOG_TAG, "Unknown change %s", op);
+    return false;
+}
+
+/**
+ * @brief Stream a part of a file from the SD Card in small parts, it is never loaded as a whole.
+ *
+ * The storage mutex is held for the whole stream, so a key access change cannot tear the file midway.
+ *
+ * @param filePath The path of the file on the SD Card
+ * @param offset The offset of the first byte to stream
+ * @param length The number of bytes to stream, `SIZE_MAX` for the rest of the file
+ * @param writer Called with every part of the file, in order
+ * @return `true` if the whole part was streamed, `false` otherwise.
+ */
+bool SDCardModule::streamFile(const char *filePath, size_t offset, size_t length, const SDStreamWriter &writer){
+    StorageLock lock(this);
+    File file = SD.open(filePath, FILE_READ);
+    if (!file) {
+        ESP_LOGE(SD_CARD_LOG_TAG, "Error opening the file: %s", filePath);
+        return false;
+    }
+    if (offset > 0 && !file.seek(offset)) {
+        ESP_LOGE(SD_CARD_LOG_TAG, "Failed to seek %s to %d", filePath, offset);
+        file.close();
+        return false;
+    }
+
+    uint8_t buffer[SD_STREAM_CHUNK_SIZE];
+    size_t remaining = length;
+    bool complete = true;
+    while (remaining > 0 && file.available() > 0) {
+        size_t read = file.read(buffer, remaining < sizeof(buffer) ? remaining : sizeof(buffer));
+        if (read == 0 || !writer(buffer, read)) {
+            complete = false;
+            break;
+        }
+        remaining -= read;
+    }
+    file.close();
+
+    // A part that ends past the end of the file is not complete
+    return complete && (length == SIZE_MAX || remaining == 0);
+}
+
+/**
+ * @brief Replace the key access files with an uploaded import.
+ *
+ * The import is a json object with the `rfids` and `fingerprints` arrays in the same format as the key
+ * access files, a missing array keeps its file as it is. The import is read one user at a time, each
+ * checked and written to a temporary file, so it is never held in RAM whole. The key access files are
+ * only replaced once the whole import is valid, and the import file is removed afterwards.
+ *
+ * @param filePath The path of the uploaded import on the SD Card
+ * @param nfcUsers Set to the number of users imported with NFC Cards
+ * @param fingerprintUsers Set to the number of users imported with Fingerprints
+ * @return `true` if the import was applied, `false` if it is invalid or could not be written.
+ */
+bool SDCardModule::importKeyAccess(const char *filePath, int &nfcUsers, int &fingerprintUsers){
+    StorageLock lock(this);
+    nfcUsers = 0;
+    fingerprintUsers = 0;
+
+    File file = SD.open(filePath, FILE_READ);
+    if (!file) {
+        ESP_LOGE(SD_CARD_LOG_TAG, "Error opening the file: %s", filePath);
+        return false;
+    }
+
+    KeyAccessIndex index;
+    bool importedNFCs = false;
+    bool importedFingerprints = false;
+
+    bool valid = JsonStream::readObject(file, [&](const char *name) {
+        bool isRFIDs = strcmp(name, "rfids") == 0;
+        bool isFingerprints = strcmp(name, "fingerprints") == 0;
+
+        // Any other member, or a null array, is skipped without keeping it
+        if ((!isRFIDs && !isFingerprints) || JsonStream::skipWhitespace(file) == 'n') return JsonStream::skipValue(file);
+
+        // Each array only once, the second one would have been checked against the first
+        if ((isRFIDs && importedNFCs) || (isFingerprints && importedFingerprints)) return false;
+        if (isRFIDs) {
+            importedNFCs = true;
+            return importUsers(file, LockType::RFID, index, nfcUsers);
+        }
+        importedFingerprints = true;
+        return importUsers(file, LockType::FINGERPRINT, index, fingerprintUsers);
+    });
+    file.close();
+    SD.remove(filePath);
+
+    if (!valid) {
+        ESP_LOGE(SD_CARD_LOG_TAG, "Invalid import, the key access files are not changed");
+        SD.remove(IMPORT_RFID_TEMP_PATH);
+        SD.remove(IMPORT_FINGERPRINT_TEMP_PATH);
+        nfcUsers = 0;
+        fingerprintUsers = 0;
+        return false;
+    }
+
+    // The watcher is told about the key access the import leaves out, whichever way the index ends up
+    std::vector<std::string> nfcsBefore = getIndexedKeyAccessIds(LockType::RFID);
+    std::vector<std::string> fingerprintsBefore = getIndexedKeyAccessIds(LockType::FINGERPRINT);
+
+    // A deleted key access file has nothing to remove before the rename
+    auto replaceFile = [](const char *tempPath, const char *filePath) {
+        return (!SD.exists(filePath) || SD.remove(filePath)) && SD.rename(tempPath, filePath);
+    };
+    if ((importedNFCs && !replaceFile(IMPORT_RFID_TEMP_PATH, RFID_FILE_PATH))
+        || (importedFingerprints && !replaceFile(IMPORT_FINGERPRINT_TEMP_PATH, FINGERPRINT_FILE_PATH))) {
+        ESP_LOGE(SD_CARD_LOG_TAG, "Failed to replace the key access files with the import");
+        createEmptyJsonFileIfNotExists(RFID_FILE_PATH);
+        createEmptyJsonFileIfNotExists(FINGERPRINT_FILE_PATH);
+        loadIndex();
+        restartChangeLog();
+        notifyRemovedSince(LockType::RFID, nfcsBefore);
+        notifyRemovedSince(LockType::FINGERPRINT, fingerprintsBefore);
+        return false;
+    }
+
+    if (importedNFCs || importedFingerprints) {
+        swapIndex(index, !importedNFCs, !importedFingerprints);
+        restartChangeLog();
+        notifyRemovedSince(LockType::RFID, nfcsBefore);
+        notifyRemovedSince(LockType::FINGERPRINT, fingerprintsBefore);
+    }
+
+    ESP_LOGI(SD_CARD_LOG_TAG, "Key access imported, %d NFC users, %d Fingerprint users", nfcUsers, fingerprintUsers);
+    return true;
+}
+
+/**
+ * @brief Read the users array of an import one user at a time, check them and write them to the temporary file of their type.
+ *
+ * Every user needs its ids, and every NFC Card UID may only be used once, which is checked against
+ * the index being built. An imported key access counts as not acknowledged by the server, so the next
+ * pull does not remove it.
+ *
+ * @param input The import, at the start of the array
+ * @param type The type of the key access of the array (RFID or Fingerprint)
+ * @param index The index of the import, the users are added to it
+ * @param users Set to the number of users of the array
+ * @return `true` if the whole array is valid and written, `false` otherwise.
+ */
+bool SDCardModule::importUsers(File &input, LockType type, KeyAccessIndex &index, int &users){
+    users = 0;
+    if (!JsonStream::consume(input, '[')) {
+        ESP_LOGE(SD_CARD_LOG_TAG, "Invalid import, rfids and fingerprints must be arrays");
+        return false;
+    }
+
+    const char *tempPath = type == LockType::RFID ? IMPORT_RFID_TEMP_PATH : IMPORT_FINGERPRINT_TEMP_PATH;
+    File output = SD.open(tempPath, FILE_WRITE);
+    if (!output) {
+        ESP_LOGE(SD_CARD_LOG_TAG, "Error opening the file: %s", tempPath);
+        return false;
+    }
+
+    bool valid = output.print('[') == 1;
+    bool first = true;
+    while (valid && !JsonStream::consume(input, ']')) {
+        if (!first && !JsonStream::consume(input, ',')) {
+            valid = false;
+            break;
+        }
+
+        JsonDocument user;
+        if (JsonStream::skipWhitespace(input) != '{' || deserializeJson(user, input)) {
+            ESP_LOGE(SD_CARD_LOG_TAG, "Invalid import, a user is not a json object");
+            valid = false;
+            break;
+        }
+
+        const char *entries = type == LockType::RFID ? "nfcs" : "fingerprints";
+        if (user["name"].isNull() || user["visitor_id"].isNull() || !user[entries].is<JsonArray>()) {
+            ESP_LOGE(SD_CARD_LOG_TAG, "Invalid import, user without name, visitor_id or %s", entries);
+            valid = false;
+            break;
+        }
+
+        JsonArray userEntries = user[entries].as<JsonArray>();
+        for (size_t i = 0; valid && i < userEntries.size(); i++) {
+            JsonObject entry = userEntries[i];
+            entry.remove("synced");
+            if (type != LockType::RFID) continue;
+
+            const char *uidCard = entry["nfc_uid"];
+            if (uidCard == nullptr || entry["key_access_id"].isNull()) {
+                ESP_LOGE(SD_CARD_LOG_TAG, "Invalid import, NFC Card without nfc_uid or key_access_id");
+                valid = false;
+                break;
+            }
+
+            // Against the users imported before, from the index being built, and the NFC Cards of the same user
+            StringHandle handle = index.stringPool.find(uidCard);
+            bool used = handle != INVALID_STRING_HANDLE && std::any_of(index.nfcs.begin(), index.nfcs.end(),
+                [handle](const NFCIndexEntry &nfc) { return nfc.uidCard == handle; });
+            for (size_t j = 0; j < i && !used; j++) used = userEntries[j]["nfc_uid"] == uidCard;
+            if (used) {
+                ESP_LOGE(SD_CARD_LOG_TAG, "Invalid import, NFC ID %s is used more than once", uidCard);
+                valid = false;
+            }
+        }
+        if (!valid) break;
+
+        indexUser(index, type, user.as<JsonObjectConst>());
+
+        if ((!first && output.print(',') != 1) || serializeJson(user, output) == 0) {
+            ESP_LOGE(SD_CARD_LOG_TAG, "Failed to write the import to %s", tempPath);
+            valid = false;
+            break;
+        }
+        first = false;
+        users++;
+    }
+
+    valid = valid && output.print(']') == 1;
+    output.close();
+    return valid;
+}
+
+/**
+ * @brief Replace a key access file and rebuild its RAM index.
+ *
+ * @param type The type of the key access file (RFID or Fingerprint)
+ * @param users The users array of the key access file
+ * @return `true` if the file was written, `false` otherwise.
+ */
+bool SDCardModule::writeKeyAccessFile(LockType type, JsonArrayConst users){
+    StorageLock lock(this);
+    const char *filePath = type == LockType::RFID ? RFID_FILE_PATH : FINGERPRINT_FILE_PATH;
+
+    File file = SD.open(filePath, FILE_WRITE);
+    if (!file) {
+        ESP_LOGE(SD_CARD_LOG_TAG, "Error opening the file: %s", filePath);
+        return false;
+    }
+    if (serializeJson(users, file) == 0) {
+        ESP_LOGE(SD_CARD_LOG_TAG, "Failed to serialize JSON to file");
+        file.close();
+        return false;
+    }
+    file.close();
+
+    rebuildIndex(type, users);
+    restartChangeLog();
+    return true;
+}
+
+/**
+ * @brief Make the key access files match the key access list of the vehicle from the server.
+ *
+ * Key access that the server listed before and not anymore are removed, and NFC Cards that are in
+ * the list but not on the SD Card are added. A key access the server never listed, like one enrolled
+ * offline, replicated from another door or imported, is kept until the server lists it, and a key
+ * access with a delete still waiting in the outbox is not added back. Fingerprints can only be removed,
+ * their template has to be enrolled on the sensor first.
+ *
+ * The list is read one key access at a time without the storage mutex, only the listed key access
+ * that are stored on the device are kept in RAM and the NFC Cards to add are kept in a temporary file.
+ * The files are then only changed if nothing was changed since `expectedRevision`, the check and the
+ * writes are done under the storage mutex so no other change can come in between.
+ *
+ * @param list The `{"data": [...]}` key access list of the vehicle, each with `key_access_id`, `type`,
+ * `visitor_id`, `visitor_name` and `nfc_uid` for RFID
+ * @param pendingDeletes The Key Access IDs of the deletes in the outbox that the server has not got yet
+ * @param expectedRevision The revision of the files when the list was requested, see `getRevision`
+ * @param added The number of key access added
+ * @param removed The number of key access removed
+ * @return `true` if both files match the list, `false` if the list is invalid, or a file could not be changed or was changed meanwhile
+ */
+bool SDCardModule::applyKeyAccessList(Stream &list, const std::vector<std::string> &pendingDeletes, uint32_t expectedRevision, int &added, int &removed){
+    added = 0;
+    removed = 0;
+
+    std::vector<std::string> listedNFCs;
+    std::vector<std::string> listedFingerprints;
+    int count = 0;
+    if (!readKeyAccessList(list, pendingDeletes, listedNFCs, listedFingerprints, count)) {
+        ESP_LOGE(SD_CARD_LOG_TAG, "Invalid key access list from the server");
+        SD.remove(KEY_ACCESS_LIST_TEMP_PATH);
+        return false;
+    }
+
+    StorageLock lock(this);
+    ESP_LOGI(SD_CARD_LOG_TAG, "Applying the key access list from the server, %d key access", count);
+
+    bool applied = applyKeyAccessFile(LockType::RFID, listedNFCs, expectedRevision, added, removed)
+        && applyKeyAccessFile(LockType::FINGERPRINT, listedFingerprints, expectedRevision, added, removed);
+    SD.remove(KEY_ACCESS_LIST_TEMP_PATH);
+    return applied;
+}
+
+/**
+ * @brief Read the key access list from the server one key access at a time.
+ *
+ * The Key Access IDs of the list are only kept if the device stores a key access with them, the
+ * others can not be removed anyway. The NFC Cards that are not stored and have no delete in the
+ * outbox are written to `KEY_ACCESS_LIST_TEMP_PATH`, one json line each.
+ *
+ * @param list The key access list, at the start of the object
+ * @param pendingDeletes The Key Access IDs of the deletes in the outbox, they are not added back
+ * @param listedNFCs Set to the sorted Key Access IDs of the NFC Cards in the list that are stored on the device
+ * @param listedFingerprints Set to the sorted Key Access IDs of the Fingerprints in the list that are stored on the device
+ * @param count Set to the number of key access in the list
+ * @return `true` if the whole list was read, `false` otherwise.
+ */
+bool SDCardModule::readKeyAccessList(Stream &list, const std::vector<std::string> &pendingDeletes, std::vector<std::string> &listedNFCs, std::vector<std::string> &listedFingerprints, int &count){
+    File additions = SD.open(KEY_ACCESS_LIST_TEMP_PATH, FILE_WRITE);
+    if (!additions) {
+        ESP_LOGE(SD_CARD_LOG_TAG, "Error opening the file: %s", KEY_ACCESS_LIST_TEMP_PATH);
+        return false;
+    }
+
+    // Only keep the fields that are stored on the SD Card
+    JsonDocument filter;
+    filter["key_access_id"] = true;
+    filter["type"] = true;
+    filter["visitor_id"] = true;
+    filter["visitor_name"] = true;
+    filter["nfc_uid"] = true;
+
+    bool hasData = false;
+    bool valid = JsonStream::readObject(list, [&](const char *name) {
+        if (strcmp(name, "data") != 0 || hasData) return JsonStream::skipValue(list);
+        hasData = true;
+
+        return JsonStream::readArray(list, [&]() {
+            JsonDocument keyAccess;
+            if (JsonStream::skipWhitespace(list) != '{' || deserializeJson(keyAccess, list, DeserializationOption::Filter(filter))) return false;
+            count++;
+
+            const char *keyAccessId = keyAccess["key_access_id"];
+            bool isRFID = keyAccess["type"] == "RFID";
+            if (keyAccessId == nullptr || (!isRFID && keyAccess["type"] != "Fingerprint")) return true;
+
+            // A Key Access ID that is not interned is not stored on the device
+            if (findIndexedString(keyAccessId) != INVALID_STRING_HANDLE) (isRFID ? listedNFCs : listedFingerprints).push_back(keyAccessId);
+
+            const char *uidCard = keyAccess["nfc_uid"];
+            if (!isRFID || uidCard == nullptr || keyAccess["visitor_id"].isNull() || isNFCIdRegistered(uidCard)) return true;
+
+            // Deleted here, the server only forgets it once the outbox is delivered
+            if (std::find(pendingDeletes.begin(), pendingDeletes.end(), keyAccessId) != pendingDeletes.end()) return true;
+
+            if (serializeJson(keyAccess, additions) == 0 || additions.print('\n') != 1) {
+                ESP_LOGE(SD_CARD_LOG_TAG, "Failed to write the file: %s", KEY_ACCESS_LIST_TEMP_PATH);
+                return false;
+            }
+            return true;
+        });
+    });
+    additions.close();
+
+    std::sort(listedNFCs.begin(), listedNFCs.end());
+    std::sort(listedFingerprints.begin(), listedFingerprints.end());
+    return valid && hasData;
+}
+
+/**
+ * @brief Find a string in the `StringPool` of the RAM index
+ *
+ * @return The handle of the string, `INVALID_STRING_HANDLE` if no key access uses it
+ */
+StringHandle SDCardModule::findIndexedString(const char *str){
+    if (xSemaphoreTake(_indexMutex, portMAX_DELAY) != pdTRUE) return INVALID_STRING_HANDLE;
+    StringHandle handle = _stringPool.find(str);
+    xSemaphoreGive(_indexMutex);
+    return handle;
+}
+
+/**
+ * @brief Make one key access file match the key access of its type in the list from the server.
+ *
+ * A key access is marked `synced` once it was in a list, only those are removed when the server leaves them out.
+ *
+ * @param type The type of the key access file (RFID or Fingerprint)
+ * @param listed The sorted Key Access IDs of the type in the list that are also stored on the device
+ * @param expectedRevision The revision the file must still have, updated when the file is changed
+ * @param added The number of key access added, incremented
+ * @param removed The number of key access removed, incremented
+ * @return `true` if the file matches the list, `false` otherwise
+ */
+bool SDCardModule::applyKeyAccessFile(LockType type, const std::vector<std::string> &listed, uint32_t &expectedRevision, int &added, int &removed){
+    const char *filePath = type == LockType::RFID ? RFID_FILE_PATH : FINGERPRINT_FILE_PATH;
+    const char *listKey = type == LockType::RFID ? "nfcs" : "fingerprints";
+
+    if (_revision.load() != expectedRevision) {
+        ESP_LOGW(SD_CARD_LOG_TAG, "Key access changed while the list was downloaded, skipping the list");
+        return false;
+    }
+
+    File file = SD.open(filePath, FILE_READ);
+    if (!file) {
+        ESP_LOGE(SD_CARD_LOG_TAG, "Error opening the file: %s", filePath);
+        return false;
+    }
+
+    JsonDocument document;
+    DeserializationError error = deserializeJson(document, file);
+    file.close();
+    if (error) {
+        ESP_LOGE(SD_CARD_LOG_TAG, "Failed to deserialize JSON: %s", error.c_str());
+        return false;
+    }
+
+    bool changed = false;
+    std::vector<std::string> removedKeyAccessIds;
+    JsonArray users = document.as<JsonArray>();
+
+    // Remove the key access the server does not list anymore, and the users left without key access
+    for (int i = users.size() - 1; i >= 0; i--) {
+        JsonArray entries = users[i][listKey].as<JsonArray>();
+        for (int j = entries.size() - 1; j >= 0; j--) {
+            JsonObject entry = entries[j];
+            const char *keyAccessId = entry["key_access_id"];
+            if (keyAccessId == nullptr) continue;
+
+            bool found = std::binary_search(listed.begin(), listed.end(), std::string(keyAccessId));
+
+            // The server has it now, from here on it is removed once the server leaves it out
+            if (found) {
+                if (!entry["synced"].as<bool>()) {
+                    entry["synced"] = true;
+                    changed = true;
+                }
+                continue;
+            }
+
+            // Not acknowledged by the server yet, e.g. enrolled while offline
+            if (!entry["synced"].as<bool>()) continue;
+
+            ESP_LOGI(SD_CARD_LOG_TAG, "Key Access ID %s was revoked on the server, removing it", keyAccessId);
+            removedKeyAccessIds.push_back(keyAccessId);
+            entries.remove(j);
+            removed++;
+            changed = true;
+        }
+        if (entries.size() == 0) users.remove(i);
+    }
+
+    // Add the NFC Cards that were added on the server, kept aside while the list was read
+    if (type == LockType::RFID) {
+        File additions = SD.open(KEY_ACCESS_LIST_TEMP_PATH, FILE_READ);
+        if (!additions) {
+            ESP_LOGE(SD_CARD_LOG_TAG, "Error opening the file: %s", KEY_ACCESS_LIST_TEMP_PATH);
+            return false;
+        }
+
+        JsonDocument keyAccess;
+        while (JsonStream::skipWhitespace(additions) == '{' && !deserializeJson(keyAccess, additions)) {
+            const char *uidCard = keyAccess["nfc_uid"];
+            const char *visitorId = keyAccess["visitor_id"];
+
+            bool found = false;
+            JsonArray nfcs;
+            for (JsonObject user : users) {
+                if (user["visitor_id"] == visitorId) nfcs = user["nfcs"].as<JsonArray>();
+                for (JsonObjectConst nfc : user["nfcs"].as<JsonArrayConst>()) {
+                    if (nfc["nfc_uid"] == uidCard) found = true;
+                }
+            }
+            if (found) continue;
+
+            if (nfcs.isNull()) {
+                JsonObject user = users.add<JsonObject>();
+                user["name"] = keyAccess["visitor_name"];
+                user["visitor_id"] = visitorId;
+                nfcs = user["nfcs"].to<JsonArray>();
+            }
+
+            JsonObject nfc = nfcs.add<JsonObject>();
+            nfc["nfc_uid"] = uidCard;
+            nfc["key_access_id"] = keyAccess["key_access_id"];
+            nfc["synced"] = true;
+            added++;
+            changed = true;
+            ESP_LOGI(SD_CARD_LOG_TAG, "NFC ID %s was added on the server, storing it", uidCard);
+        }
+        additions.close();
+    }
+
+    if (!changed) return true;
+
+    if (!writeKeyAccessFile(type, document.as<JsonArrayConst>())) return false;
+    notifyRemoved(type, removedKeyAccessIds);
+    expectedRevision++;
+    return true;
+}
+
+/**
+ * @brief Append a change of a single key access to the change log, for the incremental backups.
+ *
+ * A log that would grow past `CHANGE_LOG_MAX_SIZE` is restarted instead, the change is then in the
+ * next full backup.
+ *
+ * @param change The change, with `op`, `type` and the fields of the key access
+ */
+void SDCardModule::appendChange(JsonDocument &change){
+    StorageLock lock(this);
+    if (_changeLogId == 0 && restartChangeLog() == 0) return;
+
+    File file = SD.open(CHANGE_LOG_FILE_PATH, FILE_APPEND);
+    if (!file) {
+        ESP_LOGE(SD_CARD_LOG_TAG, "Error opening the file: %s", CHANGE_LOG_FILE_PATH);
+        restartChangeLog();
+        return;
+    }
+
+    if (file.size() + measureJson(change) + 1 > CHANGE_LOG_MAX_SIZE) {
+        file.close();
+        restartChangeLog();
+        return;
+    }
+
+    serializeJson(change, file);
+    file.print('\n');
+    file.close();
+}
+
+/**
+ * @brief Read the id of the change log on the SD Card, a missing or invalid log is restarted.
+ *
+ */
+void SDCardModule::loadChangeLog(){
+    File file = SD.open(CHANGE_LOG_FILE_PATH, FILE_READ);
+    if (file) {
+        JsonDocument header;
+        DeserializationError error = deserializeJson(header, file, DeserializationOption::NestingLimit(1));
+        file.close();
+        if (!error) _changeLogId = header["log"] | (uint32_t)0;
+    }
+
+    if (_changeLogId == 0) restartChangeLog();
+    else ESP_LOGI(SD_CARD_LOG_TAG, "Change log loaded, Log ID %lu", (unsigned long)_changeLogId);
+}
+
+/**
+ * @brief Check in the RAM index if a key access or a user is stored.
+ *
+ * @param type The type of the key access (RFID or Fingerprint)
+ * @param keyAccessId The Key Access ID to search for, `nullptr` to match any
+ * @param visitorId The Visitor ID to search for, `nullptr` to match any
+ * @return `true` if a key access matches both, `false` otherwise.
+ */
+bool SDCardModule::hasKeyAccess(LockType type, const char *keyAccessId, const char *visitorId){
+    if (xSemaphoreTake(_indexMutex, portMAX_DELAY) != pdTRUE) return false;
+
+    StringHandle keyAccessHandle = keyAccessId != nullptr ? _stringPool.find(keyAccessId) : INVALID_STRING_HANDLE;
+    StringHandle visitorHandle = visitorId != nullptr ? _stringPool.find(visitorId) : INVALID_STRING_HANDLE;
+    bool found = false;
+    if ((keyAccessId == nullptr || keyAccessHandle != INVALID_STRING_HANDLE) && (visitorId == nullptr || visitorHandle != INVALID_STRING_HANDLE)) {
+        if (type == LockType::RFID) {
+            for (const NFCIndexEntry &nfc : _nfcIndex) {
+                if ((keyAccessId == nullptr || nfc.keyAccessId == keyAccessHandle) && (visitorId == nullptr || nfc.visitorId == visitorHandle)) {
+                    found = true;
+                    break;
+                }
+            }
+        } else {
+            for (const FingerprintIndexEntry &fingerprint : _fingerprintIndex) {
+                if ((keyAccessId == nullptr || fingerprint.keyAccessId == keyAccessHandle) && (visitorId == nullptr || fingerprint.visitorId == visitorHandle)) {
+                    found = true;
+                    break;
+                }
+            }
+        }
+    }
+    xSemaphoreGive(_indexMutex);
+    return found;
+}
+
+/**
+ * @brief Keep the key access removed from a key access file, the watcher is told once the storage mutex is released.
+ *
+ * @param type The type of the removed key access (RFID or Fingerprint)
+ * @param keyAccessIds The Key Access IDs that were removed
+ */
+void SDCardModule::notifyRemoved(LockType type, const std::vector<std::string> &keyAccessIds) {
+    for (const std::string &keyAccessId : keyAccessIds) _removed.push_back({type, keyAccessId});
+}
+
+/**
+ * @brief List the Key Access IDs of one type in the RAM index, to find the ones a bulk change removes.
+ *
+ * @param type The type of the key access (RFID or Fingerprint)
+ * @return The Key Access IDs, once each
+ */
+std::vector<std::string> SDCardModule::getIndexedKeyAccessIds(LockType type) {
+    std::vector<std::string> keyAccessIds;
+    if (xSemaphoreTake(_indexMutex, portMAX_DELAY) != pdTRUE) return keyAccessIds;
+
+    std::vector<bool> listed(_stringPool.size(), false);
+    auto add = [&](StringHandle keyAccessId) {
+        if (keyAccessId == INVALID_STRING_HANDLE || listed[keyAccessId]) return;
+        listed[keyAccessId] = true;
+        keyAccessIds.push_back(_stringPool.get(keyAccessId));
+    };
+    if (type == LockType::RFID) {
+        for (const NFCIndexEntry &nfc : _nfcIndex) add(nfc.keyAccessId);
+    } else {
+        for (const FingerprintIndexEntry &fingerprint : _fingerprintIndex) add(fingerprint.keyAccessId);
+    }
+
+    xSemaphoreGive(_indexMutex);
+    return keyAccessIds;
+}
+
+/**
+ * @brief Keep the key access of a listing taken before a bulk change that are not in the RAM index anymore.
+ *
+ * @param type The type of the key access (RFID or Fingerprint)
+ * @param keyAccessIds The Key Access IDs listed by `getIndexedKeyAccessIds` before the change
+ */
+void SDCardModule::notifyRemovedSince(LockType type, const std::vector<std::string> &keyAccessIds) {
+    if (keyAccessIds.empty() || xSemaphoreTake(_indexMutex, portMAX_DELAY) != pdTRUE) return;
+
+    std::vector<bool> indexed(_stringPool.size(), false);
+    if (type == LockType::RFID) {
+        for (const NFCIndexEntry &nfc : _nfcIndex) if (nfc.keyAccessId != INVALID_STRING_HANDLE) indexed[nfc.keyAccessId] = true;
+    } else {
+        for (const FingerprintIndexEntry &fingerprint : _fingerprintIndex) if (fingerprint.keyAccessId != INVALID_STRING_HANDLE) indexed[fingerprint.keyAccessId] = true;
+    }
+
+    std::vector<std::string> removed;
+    for (const std::string &keyAccessId : keyAccessIds) {
+        StringHandle handle = _stringPool.find(keyAccessId.c_str());
+        if (handle == INVALID_STRING_HANDLE || !indexed[handle]) removed.push_back(keyAccessId);
+    }
+    xSemaphoreGive(_indexMutex);
+
+    notifyRemoved(type, removed);
+}
+
+/**
+ * @brief Take the storage mutex, it can be taken again by its holder.
+ *
+ */
+void SDCardModule::lockStorage() {
+    xSemaphoreTakeRecursive(_storageMutex, portMAX_DELAY);
+    _storageDepth++;
+}
+
+/**
+ * @brief Give the storage mutex, and tell the watcher about the removed key access once it is released.
+ *
+ * The watcher is called without the mutex, as it may take locks that are held while the key access
+ * files are changed, like the one of the replication.
+ */
+void SDCardModule::unlockStorage() {
+    std::vector<std::pair<LockType, std::string>> removed;
+    if (--_storageDepth == 0) removed.swap(_removed);
+    xSemaphoreGiveRecursive(_storageMutex);
+
+    if (!_removedWatcher) return;
+    for (const auto &keyAccess : removed) _removedWatcher(keyAccess.first, keyAccess.second.c_str());
+}
+
+/**
+ * @brief Load both key access files from the SD Card into the RAM index.
+ *
+ */
+void SDCardModule::loadIndex() {
+    const char *filePaths[] = {RFID_FILE_PATH, FINGERPRINT_FILE_PATH};
+    const LockType types[] = {LockType::RFID, LockType::FINGERPRINT};
+
+    for (int i = 0; i < 2; i++) {
+        File file = SD.open(filePaths[i], FILE_READ);
+        if (!file) {
+            ESP_LOGE(SD_CARD_LOG_TAG, "Error opening the file: %s", filePaths[i]);
+            continue;
+        }
+
+        JsonDocument document;
+        DeserializationError error = deserializeJson(document, file);
+        file.close();
+
+        if (error) {
+            ESP_LOGE(SD_CARD_LOG_TAG, "Failed to deserialize JSON: %s", error.c_str());
+            continue;
+        }
+        rebuildIndex(types[i], document.as<JsonArrayConst>());
+    }
+}
+
+/**
+ * @brief Rebuild the RAM index of one type of key access from its JSON document.
+ *
+ * @param type The type of the key access to rebuild (RFID or Fingerprint)
+ * @param users The users array of the key access file
+ */
+void SDCardModule::rebuildIndex(LockType type, JsonArrayConst users) {
+    KeyAccessIndex index;
+    for (JsonObjectConst user : users) indexUser(index, type, user);
+    swapIndex(index, type != LockType::RFID, type != LockType::FINGERPRINT);
+}
+
+/**
+ * @brief Add the key access of one user of a key access file to an index being built
+ *
+ * @param index The index being built
+ * @param type The type of the key access file the user is from (RFID or Fingerprint)
+ * @param user The user, with its `nfcs` or `fingerprints`
+ */
+void SDCardModule::indexUser(KeyAccessIndex &index, LockType type, JsonObjectConst user) {
+    StringHandle name = index.stringPool.intern(user["name"].as<const char*>());
+    StringHandle visitorId = index.stringPool.intern(user["visitor_id"].as<const char*>());
+
+    if (type == LockType::RFID) {
+        for (JsonObjectConst nfc : user["nfcs"].as<JsonArrayConst>()) {
+            const char *uidCard = nfc["nfc_uid"];
+            if (uidCard == nullptr) continue;
+            index.nfcs.push_back({index.stringPool.intern(uidCard), index.stringPool.intern(nfc["key_access_id"].as<const char*>()), visitorId, name});
+        }
+    } else {
+        for (JsonObjectConst fingerprint : user["fingerprints"].as<JsonArrayConst>()) {
+            index.fingerprints.push_back({fingerprint["fingerprint_id"].as<uint8_t>(), index.stringPool.intern(fingerprint["key_access_id"].as<const char*>()), visitorId, name});
+        }
+    }
+}
+
+/**
+ * @brief Replace the RAM index with one built aside.
+ *
+ * The strings are interned into the fresh `StringPool` of the new index, so the strings of removed
+ * key access are released. The types that are kept have their entries and strings moved over from
+ * the current index.
+ *
+ * @param index The new index, its contents are moved out
+ * @param keepNFCs Keep the NFC Cards of the current index instead of the ones of the new index
+ * @param keepFingerprints Keep the Fingerprints of the current index instead of the ones of the new index
+ */
+void SDCardModule::swapIndex(KeyAccessIndex &index, bool keepNFCs, bool keepFingerprints) {
+    if (xSemaphoreTake(_indexMutex, portMAX_DELAY) != pdTRUE) return;
+
+    if (keepFingerprints) {
+        index.fingerprints.clear();
+        for (const FingerprintIndexEntry &fingerprint : _fingerprintIndex) {
+            index.fingerprints.push_back({
+                fingerprint.fingerprintId,
+                index.stringPool.intern(_stringPool.get(fingerprint.keyAccessId)),
+                index.stringPool.intern(_stringPool.get(fingerprint.visitorId)),
+                index.stringPool.intern(_stringPool.get(fingerprint.name))
+            });
+        }
+    }
+    if (keepNFCs) {
+        index.nfcs.clear();
+        for (const NFCIndexEntry &nfc : _nfcIndex) {
+            index.nfcs.push_back({
+                index.stringPool.intern(_stringPool.get(nfc.uidCard)),
+                index.stringPool.intern(_stringPool.get(nfc.keyAccessId)),
+                index.stringPool.intern(_stringPool.get(nfc.visitorId)),
+                index.stringPool.intern(_stringPool.get(nfc.name))
+            });
+        }
+    }
+
+    _stringPool = std::move(index.stringPool);
+    _fingerprintIndex = std::move(index.fingerprints);
+    _nfcIndex = std::move(index.nfcs);
+    _revision++;
+
+    ESP_LOGI(SD_CARD_LOG_TAG, "Key Access index rebuilt, %d Fingerprints, %d NFC Cards, %d unique strings using %d bytes",
+        _fingerprintIndex.size(), _nfcIndex.size(), _stringPool.size(), _stringPool.memoryUsage());
+
+    xSemaphoreGive(_indexMutex);
+}
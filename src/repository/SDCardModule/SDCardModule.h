@@ -7,7 +7,13 @@
 #include <Arduino.h>
 
 #include <vector>
+#include <string>
+#include <atomic>
+#include <functional>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include "enum/LockType.h"
+#include "StringPool.h"
 
 #define CS_PIN 5    // Chip Select pin
 #define SCK_PIN 18  // Clock pin
@@ -16,17 +22,55 @@
 
 #define FINGERPRINT_FILE_PATH "/fingerprints.json" // File path for storing Fingerprints Access to Data
 #define RFID_FILE_PATH "/rfids.json"               // File path for storing NFC Tag to Data
+#define IMPORT_FILE_PATH "/import.json"            // File path of an uploaded import, applied once it is complete
+#define IMPORT_RFID_TEMP_PATH "/rfids.tmp"         // Imported NFC users are written here first, then renamed over the key access file
+#define IMPORT_FINGERPRINT_TEMP_PATH "/fingerprints.tmp" // Same for the imported Fingerprint users
+#define SD_STREAM_CHUNK_SIZE 512                   // Bytes read from the SD Card at once when a file is streamed
+#define KEY_ACCESS_LIST_TEMP_PATH "/key_access_list.tmp" // NFC Cards of a pulled key access list to add, one json line each
+#define CHANGE_LOG_FILE_PATH "/key_access_changes.log" // Json lines of the key access changes since the last bulk change
+#define CHANGE_LOG_MAX_SIZE 16384                  // Size the change log is restarted at, the next backup is then a full one
+
+/// @brief Writes a part of a streamed file, returns `false` to stop the stream
+typedef std::function<bool(const uint8_t *data, size_t length)> SDStreamWriter;
+
+/// @brief Called for every key access removed from the key access files, once the storage mutex is released
+typedef std::function<void(LockType type, const char *keyAccessId)> KeyAccessWatcher;
+
+/// @brief RAM index entry of a Fingerprint key access, the strings are handles to the `StringPool`
+struct FingerprintIndexEntry {
+    uint8_t fingerprintId;
+    StringHandle keyAccessId;
+    StringHandle visitorId;
+    StringHandle name;
+};
+
+/// @brief RAM index entry of an NFC key access, the strings are handles to the `StringPool`
+struct NFCIndexEntry {
+    StringHandle uidCard;
+    StringHandle keyAccessId;
+    StringHandle visitorId;
+    StringHandle name;
+};
+
+/// @brief RAM index of both types of key access, built aside and then swapped in as a whole
+struct KeyAccessIndex {
+    StringPool stringPool;
+    std::vector<FingerprintIndexEntry> fingerprints;
+    std::vector<NFCIndexEntry> nfcs;
+};
 
 /// @brief SD Card class wrapper
 class SDCardModule {
 public:
     SDCardModule();
     bool setup();
+    bool selfTest();
+    void watchRemoved(KeyAccessWatcher watcher);
 
     bool isFingerprintIdRegistered(int fingerprintId);
     bool saveFingerprintToSDCard(const char *username, int fingerprintId, const char *visitorId, const char *keyAccessId);
     bool deleteFingerprintFromSDCard(const char *keyAccessId);
-    bool deleteFingerprintsUserFromSDCard(const char *visitorId);
+    bool deleteFingerprintsUserFromSDCard(const char *visitorId, std::vector<std::string> *removedKeyAccessIds = nullptr);
     int getFingerprintIdByKeyAccessId(const char *keyAccessId);
     std::vector<int> getFingerprintIdsByVisitorId(const char *visitorId);
     std::string* getKeyAccessIdByFingerprintId(int fingerprintId);
@@ -34,12 +78,59 @@ public:
     bool isNFCIdRegistered(const char *uidCard);
     bool saveNFCToSDCard(const char *username, const char *uidCard, const char *visitorId, const char *keyAccessId);
     bool deleteNFCFromSDCard(const char *keyAccessId);
-    bool deleteNFCsUserFromSDCard(const char *visitorId);
+    bool deleteNFCsUserFromSDCard(const char *visitorId, std::vector<std::string> *removedKeyAccessIds = nullptr);
     std::string* getKeyAccessIdByNFCUid(char *uidCard);
 
     bool deleteAccessJsonFile(LockType type);
     void createEmptyJsonFileIfNotExists(const char *filepath);
     JsonDocument syncData();
+
+    uint32_t getRevision();
+    void getKeyAccessCount(size_t &nfcCount, size_t &fingerprintCount);
+    bool streamKeyAccessFile(LockType type, const SDStreamWriter &writer);
+    bool importKeyAccess(const char *filePath, int &nfcUsers, int &fingerprintUsers);
+    bool applyKeyAccessList(Stream &list, const std::vector<std::string> &pendingDeletes, uint32_t expectedRevision, int &added, int &removed);
+
+    uint32_t restartChangeLog();
+    bool getChangeLogInfo(uint32_t &logId, size_t &size);
+    bool streamChangeLog(uint32_t logId, size_t offset, size_t length, const SDStreamWriter &writer);
+    bool applyChange(JsonObjectConst change);
+
+private:
+    // RAM index of the key access files, the files on SD Card stay the source of truth
+    // and the index is rebuilt every time a file is changed. The NFC, Fingerprint, WiFi, MQTT,
+    // admin and replication tasks all change the files, one at a time under the storage mutex
+    StringPool _stringPool;
+    std::vector<FingerprintIndexEntry> _fingerprintIndex;
+    std::vector<NFCIndexEntry> _nfcIndex;
+    SemaphoreHandle_t _indexMutex;
+    SemaphoreHandle_t _storageMutex;    // Held for every read-modify-write of the key access files and the change log
+    UBaseType_t _storageDepth;          // How many times the holder has taken the storage mutex
+    std::vector<std::pair<LockType, std::string>> _removed; // Removed key access not told to the watcher yet
+    std::atomic<uint32_t> _revision;    // Incremented every time a key access file is changed
+    std::atomic<uint32_t> _changeLogId; // Random id of the change log, a new one every time it is restarted
+    KeyAccessWatcher _removedWatcher;
+
+    friend class StorageLock;
+    void lockStorage();
+    void unlockStorage();
+
+    bool writeKeyAccessFile(LockType type, JsonArrayConst users);
+    bool importUsers(File &input, LockType type, KeyAccessIndex &index, int &users);
+    bool readKeyAccessList(Stream &list, const std::vector<std::string> &pendingDeletes, std::vector<std::string> &listedNFCs, std::vector<std::string> &listedFingerprints, int &count);
+    bool applyKeyAccessFile(LockType type, const std::vector<std::string> &listed, uint32_t &expectedRevision, int &added, int &removed);
+    StringHandle findIndexedString(const char *str);
+    bool streamFile(const char *filePath, size_t offset, size_t length, const SDStreamWriter &writer);
+    void appendChange(JsonDocument &change);
+    void loadChangeLog();
+    bool hasKeyAccess(LockType type, const char *keyAccessId, const char *visitorId);
+    void loadIndex();
+    void rebuildIndex(LockType type, JsonArrayConst users);
+    void indexUser(KeyAccessIndex &index, LockType type, JsonObjectConst user);
+    void swapIndex(KeyAccessIndex &index, bool keepNFCs, bool keepFingerprints);
+    void notifyRemoved(LockType type, const std::vector<std::string> &keyAccessIds);
+    std::vector<std::string> getIndexedKeyAccessIds(LockType type);
+    void notifyRemovedSince(LockType type, const std::vector<std::string> &keyAccessIds);
 };
 
 #endif
\ No newline at end of file
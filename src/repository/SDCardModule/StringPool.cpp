@@ -0,0 +1,139 @@
+#include "StringPool.h"
+#include <cstring>
+
+StringPool::StringPool() : _currentBlock(nullptr), _blockUsed(0), _arenaBytes(0) {}
+
+/**
+ * @brief Intern a string into the pool.
+ *
+ * @param str The string to intern
+ * @return The handle of the string, the same handle is returned for the same string content.
+ *         `INVALID_STRING_HANDLE` if `str` is nullptr or the pool is full.
+ */
+StringHandle StringPool::intern(const char *str) {
+    if (str == nullptr) return INVALID_STRING_HANDLE;
+
+    // Keep the load factor under 3/4 so the probing stays short
+    if ((_strings.size() + 1) * 4 > _slots.size() * 3) growSlots();
+
+    uint32_t strHash = hash(str);
+    size_t slot = findSlot(str, strHash);
+    if (_slots[slot] != INVALID_STRING_HANDLE) return _slots[slot];
+
+    // All handles are used, one handle value is reserved for invalid
+    if (_strings.size() >= INVALID_STRING_HANDLE) return INVALID_STRING_HANDLE;
+
+    StringHandle handle = (StringHandle)_strings.size();
+    _strings.push_back(store(str, strlen(str)));
+    _slots[slot] = handle;
+    return handle;
+}
+
+/**
+ * @brief Find the handle of a string without interning it.
+ *
+ * @param str The string to search
+ * @return The handle of the string, or `INVALID_STRING_HANDLE` if it was never interned
+ */
+StringHandle StringPool::find(const char *str) const {
+    if (str == nullptr || _slots.empty()) return INVALID_STRING_HANDLE;
+    return _slots[findSlot(str, hash(str))];
+}
+
+/**
+ * @brief Get the string of a handle.
+ *
+ * @param handle The handle from `intern` or `find`
+ * @return The interned string, or nullptr if the handle is invalid
+ */
+const char *StringPool::get(StringHandle handle) const {
+    if (handle >= _strings.size()) return nullptr;
+    return _strings[handle];
+}
+
+/// @brief Number of distinct strings in the pool
+size_t StringPool::size() const {
+    return _strings.size();
+}
+
+/// @brief Heap used by the pool, the arena plus the handle tables
+size_t StringPool::memoryUsage() const {
+    return _arenaBytes + _strings.capacity() * sizeof(const char*) + _slots.capacity() * sizeof(StringHandle);
+}
+
+/// @brief Remove all the strings and release the arena
+void StringPool::clear() {
+    _blocks.clear();
+    _strings.clear();
+    _slots.clear();
+    _currentBlock = nullptr;
+    _blockUsed = 0;
+    _arenaBytes = 0;
+}
+
+/**
+ * @brief Copy the string into the arena.
+ *
+ * @param str The string to copy
+ * @param length Length of the string without the null terminator
+ * @return Pointer to the copy inside the arena
+ */
+const char *StringPool::store(const char *str, size_t length) {
+    size_t needed = length + 1;
+
+    // Long strings get their own block so they don't waste the rest of the current block
+    if (needed > STRING_POOL_BLOCK_SIZE / 4) {
+        _blocks.push_back(std::unique_ptr<char[]>(new char[needed]));
+        memcpy(_blocks.back().get(), str, needed);
+        _arenaBytes += needed;
+        return _blocks.back().get();
+    }
+
+    if (_currentBlock == nullptr || _blockUsed + needed > STRING_POOL_BLOCK_SIZE) {
+        _blocks.push_back(std::unique_ptr<char[]>(new char[STRING_POOL_BLOCK_SIZE]));
+        _currentBlock = _blocks.back().get();
+        _blockUsed = 0;
+        _arenaBytes += STRING_POOL_BLOCK_SIZE;
+    }
+
+    char *copy = _currentBlock + _blockUsed;
+    memcpy(copy, str, needed);
+    _blockUsed += needed;
+    return copy;
+}
+
+/**
+ * @brief Find the slot holding the string, or the empty slot where it should be inserted.
+ *
+ * @param str The string to search
+ * @param strHash The hash of the string
+ * @return Index of the slot
+ */
+size_t StringPool::findSlot(const char *str, uint32_t strHash) const {
+    size_t mask = _slots.size() - 1;
+    size_t slot = strHash & mask;
+    while (_slots[slot] != INVALID_STRING_HANDLE && strcmp(_strings[_slots[slot]], str) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/// @brief Double the hash set and re-insert all the handles
+void StringPool::growSlots() {
+    size_t newSize = _slots.empty() ? 64 : _slots.size() * 2;
+    _slots.assign(newSize, INVALID_STRING_HANDLE);
+
+    for (size_t handle = 0; handle < _strings.size(); handle++) {
+        _slots[findSlot(_strings[handle], hash(_strings[handle]))] = (StringHandle)handle;
+    }
+}
+
+/// @brief FNV-1a hash of a string
+uint32_t StringPool::hash(const char *str) {
+    uint32_t value = 2166136261u;
+    while (*str) {
+        value ^= (uint8_t)*str++;
+        value *= 16777619u;
+    }
+    return value;
+}
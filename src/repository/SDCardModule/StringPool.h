@@ -0,0 +1,46 @@
+#ifndef STRING_POOL_H
+#define STRING_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#define STRING_POOL_BLOCK_SIZE      1024        // Size of each arena block, longer strings get their own block
+#define INVALID_STRING_HANDLE       0xFFFF      // Handle returned when the string is not interned
+
+/// @brief Compact 16-bit handle of an interned string, only valid for the `StringPool` that gave it
+typedef uint16_t StringHandle;
+
+/// @brief Interned string pool, an append-only arena plus an open addressing hash set of handles
+///
+/// Each distinct string is stored once in the arena and identified by a 16-bit handle, so the
+/// same visitor name or ID that appear in several key access only cost two bytes per reference.
+/// Strings are never removed one by one, the owner rebuild a new pool when the data changes.
+class StringPool {
+public:
+    StringPool();
+
+    StringHandle intern(const char *str);
+    StringHandle find(const char *str) const;
+    const char *get(StringHandle handle) const;
+
+    size_t size() const;
+    size_t memoryUsage() const;
+    void clear();
+
+private:
+    std::vector<std::unique_ptr<char[]>> _blocks;   // Arena blocks, never moved so the string pointers stay valid
+    char *_currentBlock;                            // Arena block that new short strings are appended to
+    size_t _blockUsed;                              // Bytes used in the current arena block
+    size_t _arenaBytes;                             // Total bytes allocated for the arena
+    std::vector<const char*> _strings;              // Handle to string
+    std::vector<StringHandle> _slots;               // Hash set of handles, size is always power of two
+
+    const char *store(const char *str, size_t length);
+    size_t findSlot(const char *str, uint32_t hash) const;
+    void growSlots();
+    static uint32_t hash(const char *str);
+};
+
+#endif
@@ -0,0 +1,215 @@
+#define USAGE_STATS_LOG_TAG "USAGE_STATS"
+
+#include "esp_log.h"
+#include "UsageStatsModule.h"
+
+UsageStatsModule::UsageStatsModule() : _flushTaskHandle(nullptr), _dirtyCount(0) {
+    _statsMutex = xSemaphoreCreateMutex();
+    if (_statsMutex == NULL) ESP_LOGE(USAGE_STATS_LOG_TAG, "Failed to create Usage Stats mutex.");
+    load();
+}
+
+/**
+ * @brief Create the background task that flush the usage statistic to the SD Card.
+ *
+ * The task wakes up every `USAGE_STATS_FLUSH_INTERVAL_MS` or earlier when `recordAccess` has crossed
+ * the `USAGE_STATS_DIRTY_THRESHOLD`, so the SD Card is never written from the tap-to-unlock path.
+ */
+void UsageStatsModule::startFlushTask() {
+    xTaskCreate(
+        flushTask,                      // Function to run in the task
+        "Usage Stats Flush",            // Name of the task
+        USAGE_STATS_TASK_STACK_SIZE,    // Stack size (adjustable)
+        this,                           // Pass the `this` pointer to the task
+        2,                              // Task priority, lower than the sensor tasks
+        &_flushTaskHandle               // Store the task handle for later control
+    );
+    ESP_LOGI(USAGE_STATS_LOG_TAG, "Usage Stats flush task created successfully");
+}
+
+/**
+ * @brief Record a granted access of a Key Access in the RAM table.
+ *
+ * Only update the RAM table, the SD Card is written later in batch by the flush task.
+ *
+ * @param keyAccessId The Key Access ID that was granted the access
+ * @param type The type of the Key Access (RFID or Fingerprint)
+ */
+void UsageStatsModule::recordAccess(const char *keyAccessId, LockType type) {
+    if (keyAccessId == nullptr) return;
+
+    bool shouldFlush = false;
+    if (xSemaphoreTake(_statsMutex, portMAX_DELAY) == pdTRUE) {
+        UsageStats &stats = _stats[keyAccessId];
+        stats.type = type;
+        stats.useCount++;
+        stats.lastUsed = time(nullptr);
+
+        _dirtyCount++;
+        shouldFlush = _dirtyCount >= USAGE_STATS_DIRTY_THRESHOLD;
+        xSemaphoreGive(_statsMutex);
+    }
+
+    // Wake the flush task earlier if there is too much statistic that has not been stored yet
+    if (shouldFlush && _flushTaskHandle != nullptr) {
+        xTaskNotifyGive(_flushTaskHandle);
+    }
+}
+
+/**
+ * @brief Remove the usage statistic of a deleted Key Access.
+ *
+ * @param keyAccessId The Key Access ID to remove
+ */
+void UsageStatsModule::removeKeyAccess(const char *keyAccessId) {
+    if (keyAccessId == nullptr) return;
+
+    if (xSemaphoreTake(_statsMutex, portMAX_DELAY) == pdTRUE) {
+        if (_stats.erase(keyAccessId) > 0) _dirtyCount++;
+        xSemaphoreGive(_statsMutex);
+    }
+}
+
+/**
+ * @brief Remove the usage statistic of all the Key Access of a type, used when the key access file is deleted.
+ *
+ * @param type The type of the Key Access (RFID or Fingerprint)
+ */
+void UsageStatsModule::clear(LockType type) {
+    if (xSemaphoreTake(_statsMutex, portMAX_DELAY) == pdTRUE) {
+        for (auto it = _stats.begin(); it != _stats.end();) {
+            if (it->second.type == type) {
+                it = _stats.erase(it);
+                _dirtyCount++;
+            } else {
+                ++it;
+            }
+        }
+        xSemaphoreGive(_statsMutex);
+    }
+}
+
+/**
+ * @brief Write the whole RAM table to the SD Card in a single batch.
+ *
+ * The table is written into a temporary file first and then renamed, so a power loss in the middle
+ * of the flush will not corrupt the previous statistic.
+ *
+ * @return `true` if the statistic is stored to the SD Card, `false` otherwise.
+ */
+bool UsageStatsModule::flush() {
+    JsonDocument document;
+    uint16_t flushedCount = 0;
+
+    // Only take the snapshot while holding the lock, the SD Card is written after that
+    if (xSemaphoreTake(_statsMutex, portMAX_DELAY) == pdTRUE) {
+        JsonObject data = document.to<JsonObject>();
+        for (const auto &entry : _stats) {
+            JsonObject stats = data[entry.first].to<JsonObject>();
+            stats["type"] = entry.second.type;
+            stats["use_count"] = entry.second.useCount;
+            stats["last_used"] = entry.second.lastUsed;
+        }
+        flushedCount = _dirtyCount;
+        _dirtyCount = 0;
+        xSemaphoreGive(_statsMutex);
+    }
+
+    ESP_LOGI(USAGE_STATS_LOG_TAG, "Flushing usage statistic to SD Card, %d pending changes", flushedCount);
+
+    File file = SD.open(USAGE_STATS_TEMP_FILE_PATH, FILE_WRITE);
+    bool stored = false;
+    if (file) {
+        stored = serializeJson(document, file) > 0;
+        file.close();
+    }
+
+    if (stored) {
+        SD.remove(USAGE_STATS_FILE_PATH);
+        stored = SD.rename(USAGE_STATS_TEMP_FILE_PATH, USAGE_STATS_FILE_PATH);
+    }
+
+    if (!stored) {
+        ESP_LOGE(USAGE_STATS_LOG_TAG, "Failed to store usage statistic to SD Card, will retry on next flush");
+        if (xSemaphoreTake(_statsMutex, portMAX_DELAY) == pdTRUE) {
+            _dirtyCount += flushedCount;
+            xSemaphoreGive(_statsMutex);
+        }
+        return false;
+    }
+
+    ESP_LOGI(USAGE_STATS_LOG_TAG, "Usage statistic successfully stored to SD Card");
+    return true;
+}
+
+/**
+ * @brief Export the usage statistic from the RAM table into a JsonObject for the sync payload.
+ *
+ * @param object The JsonObject to fill, keyed by the Key Access ID
+ */
+void UsageStatsModule::exportStats(JsonObject object) {
+    if (xSemaphoreTake(_statsMutex, portMAX_DELAY) == pdTRUE) {
+        for (const auto &entry : _stats) {
+            JsonObject stats = object[entry.first].to<JsonObject>();
+            stats["type"] = entry.second.type == LockType::RFID ? "RFID" : "Fingerprint";
+            stats["use_count"] = entry.second.useCount;
+            stats["last_used"] = entry.second.lastUsed;
+        }
+        xSemaphoreGive(_statsMutex);
+    }
+}
+
+/**
+ * @brief Load the last flushed usage statistic from the SD Card into the RAM table.
+ *
+ * @return `true` if the statistic was loaded, `false` if there is none or it cannot be read.
+ */
+bool UsageStatsModule::load() {
+    File file = SD.open(USAGE_STATS_FILE_PATH, FILE_READ);
+    if (!file) {
+        ESP_LOGI(USAGE_STATS_LOG_TAG, "No usage statistic stored yet in %s", USAGE_STATS_FILE_PATH);
+        return false;
+    }
+
+    JsonDocument document;
+    DeserializationError error = deserializeJson(document, file);
+    file.close();
+
+    if (error) {
+        ESP_LOGE(USAGE_STATS_LOG_TAG, "Failed to deserialize JSON: %s", error.c_str());
+        return false;
+    }
+
+    for (JsonPair entry : document.as<JsonObject>()) {
+        UsageStats stats;
+        stats.type = entry.value()["type"].as<int>() == LockType::RFID ? LockType::RFID : LockType::FINGERPRINT;
+        stats.useCount = entry.value()["use_count"].as<uint32_t>();
+        stats.lastUsed = entry.value()["last_used"].as<time_t>();
+        _stats[entry.key().c_str()] = stats;
+    }
+
+    ESP_LOGI(USAGE_STATS_LOG_TAG, "Loaded usage statistic of %d Key Access", _stats.size());
+    return true;
+}
+
+/**
+ * @brief Function to be run by the Usage Stats flush task.
+ *
+ * @param params Pointer to the task parameters (in this case, the UsageStatsModule instance).
+ */
+void UsageStatsModule::flushTask(void *params) {
+    UsageStatsModule* module = (UsageStatsModule*)params;
+
+    while (1) {
+        // Wait until the dirty threshold is reached or the flush interval has elapsed
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(USAGE_STATS_FLUSH_INTERVAL_MS));
+
+        // The count is changed by the tasks that record an access, so it is only read under the lock
+        bool dirty = false;
+        if (xSemaphoreTake(module->_statsMutex, portMAX_DELAY) == pdTRUE) {
+            dirty = module->_dirtyCount > 0;
+            xSemaphoreGive(module->_statsMutex);
+        }
+        if (dirty) module->flush();
+    }
+}
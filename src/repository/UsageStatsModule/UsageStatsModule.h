@@ -0,0 +1,51 @@
+#ifndef USAGE_STATS_MODULE_H
+#define USAGE_STATS_MODULE_H
+
+#include <SD.h>
+#include <ArduinoJson.h>
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include <string>
+#include <unordered_map>
+#include "enum/LockType.h"
+
+#define USAGE_STATS_FILE_PATH       "/usage_stats.json"     // File path for storing the Key Access usage statistic
+#define USAGE_STATS_TEMP_FILE_PATH  "/usage_stats.tmp"      // Temporary file path used while flushing the statistic
+
+#define USAGE_STATS_FLUSH_INTERVAL_MS   (5 * 60 * 1000)     // Flush the statistic to SD Card at least every 5 minutes
+#define USAGE_STATS_DIRTY_THRESHOLD     16                  // Or earlier when this many access has not been flushed yet
+#define USAGE_STATS_TASK_STACK_SIZE     4096
+
+/// @brief Usage statistic of a single Key Access
+struct UsageStats {
+    LockType type;          /* The type of the Key Access (RFID or Fingerprint)     */
+    uint32_t useCount;      /* How many times the Key Access has granted access     */
+    time_t lastUsed;        /* Epoch time of the last granted access                */
+};
+
+/// @brief Write-behind RAM table for the Key Access usage statistic that is flushed in batches to the SD Card
+class UsageStatsModule {
+public:
+    UsageStatsModule();
+    void startFlushTask();
+
+    void recordAccess(const char *keyAccessId, LockType type);
+    void removeKeyAccess(const char *keyAccessId);
+    void clear(LockType type);
+    bool flush();
+    void exportStats(JsonObject object);
+
+private:
+    std::unordered_map<std::string, UsageStats> _stats;
+    SemaphoreHandle_t _statsMutex;
+    TaskHandle_t _flushTaskHandle;
+    uint16_t _dirtyCount;
+
+    bool load();
+    static void flushTask(void *parameter);
+};
+
+#endif
@@ -0,0 +1,319 @@
+#define ADMIN_SERVICE_LOG_TAG "ADMIN_SERVICE"
+#include "AdminService.h"
+#include "versionInfo.h"
+#include <WiFi.h>
+#include <esp_netif.h>
+#include <esp_timer.h>
+#include <nvs.h>
+
+AdminService::AdminService(SDCardModule *sdCardModule, OutboxModule *outboxModule)
+    : _sdCardModule(sdCardModule), _outboxModule(outboxModule), _server(nullptr) {
+    _token[0] = '\0';
+}
+
+/**
+ * @brief Start the HTTP admin server, it answers once the device is on a WiFi network
+ *
+ * The server is only started when a token is configured, there is no default one.
+ *
+ * @return `true` if the server is started, `false` otherwise.
+ */
+bool AdminService::start(){
+    if (_server != nullptr) return true;
+
+    if (!loadToken()) {
+        ESP_LOGW(ADMIN_SERVICE_LOG_TAG, "No admin token of at least %d characters is configured, the admin server is not started", ADMIN_TOKEN_MIN_LENGTH);
+        return false;
+    }
+
+    // The server socket needs the TCP/IP stack, which is otherwise only started with the WiFi
+    esp_netif_init();
+
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.server_port = ADMIN_SERVER_PORT;
+    config.stack_size = ADMIN_SERVER_STACK_SIZE;
+    config.lru_purge_enable = true;
+
+    esp_err_t err = httpd_start(&_server, &config);
+    if (err != ESP_OK) {
+        ESP_LOGE(ADMIN_SERVICE_LOG_TAG, "Failed to start the admin server: %s", esp_err_to_name(err));
+        _server = nullptr;
+        return false;
+    }
+
+    const httpd_uri_t handlers[] = {
+        {"/api/key-access/export", HTTP_GET, handleExport, this},
+        {"/api/key-access/import", HTTP_POST, handleImport, this},
+        {"/api/key-access", HTTP_GET, handleList, this},
+        {"/api/key-access", HTTP_DELETE, handleDelete, this},
+        {"/api/diagnostics", HTTP_GET, handleDiagnostics, this},
+    };
+    for (const httpd_uri_t &handler : handlers) httpd_register_uri_handler(_server, &handler);
+
+    ESP_LOGI(ADMIN_SERVICE_LOG_TAG, "Admin server started on port %d", ADMIN_SERVER_PORT);
+    return true;
+}
+
+/**
+ * @brief Load the token from the build, or from NVS when the build has none
+ *
+ * @return `true` if a token of at least `ADMIN_TOKEN_MIN_LENGTH` characters is configured, `false` otherwise.
+ */
+bool AdminService::loadToken(){
+#ifdef ADMIN_API_TOKEN
+    snprintf(_token, sizeof(_token), "%s", ADMIN_API_TOKEN);
+#else
+    _token[0] = '\0';
+    nvs_handle_t handle;
+    if (nvs_open(ADMIN_TOKEN_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+        size_t length = sizeof(_token);
+        if (nvs_get_str(handle, ADMIN_TOKEN_NVS_KEY, _token, &length) != ESP_OK) _token[0] = '\0';
+        nvs_close(handle);
+    }
+#endif
+    return strlen(_token) >= ADMIN_TOKEN_MIN_LENGTH;
+}
+
+/**
+ * @brief Check the bearer token of the request, and answer with 401 if it is wrong
+ *
+ * @param request The request
+ * @return `true` if the request may continue, `false` if it was already answered
+ */
+bool AdminService::authorize(httpd_req_t *request){
+    AdminService *service = (AdminService*)request->user_ctx;
+    static const char scheme[] = "Bearer ";
+    char header[sizeof(scheme) + ADMIN_TOKEN_MAX_LENGTH + 1] = {0};
+
+    size_t tokenLength = strlen(service->_token);
+    bool authorized = httpd_req_get_hdr_value_str(request, "Authorization", header, sizeof(header)) == ESP_OK
+        && strlen(header) == sizeof(scheme) - 1 + tokenLength
+        && strncmp(header, scheme, sizeof(scheme) - 1) == 0;
+
+    // Compare every byte, so the time taken does not tell how much of the token is right
+    uint8_t difference = 0;
+    const char *token = header + sizeof(scheme) - 1;
+    for (size_t i = 0; authorized && i < tokenLength; i++) difference |= token[i] ^ service->_token[i];
+    if (authorized && difference == 0) return true;
+
+    ESP_LOGW(ADMIN_SERVICE_LOG_TAG, "Unauthorized admin request to %s", request->uri);
+    httpd_resp_set_status(request, "401 Unauthorized");
+    httpd_resp_set_hdr(request, "WWW-Authenticate", "Bearer");
+    httpd_resp_sendstr(request, "{\"message\":\"Unauthorized\"}");
+    return false;
+}
+
+/**
+ * @brief Get a value of the query string of the request
+ *
+ * @param request The request
+ * @param key The key of the value
+ * @param value The buffer for the value
+ * @param size The size of the buffer
+ * @return `true` if the query has the key, `false` otherwise.
+ */
+bool AdminService::getQueryValue(httpd_req_t *request, const char *key, char *value, size_t size){
+    char query[HTTPD_MAX_URI_LEN];
+    if (httpd_req_get_url_query_str(request, query, sizeof(query)) != ESP_OK) return false;
+    return httpd_query_key_value(query, key, value, size) == ESP_OK;
+}
+
+/**
+ * @brief Get the key access type from the `type` query value, and answer with 400 if it is not valid
+ *
+ * @param request The request
+ * @param type Set to the type of the key access
+ * @return `true` if the type is valid, `false` if the request was already answered
+ */
+bool AdminService::parseType(httpd_req_t *request, LockType &type){
+    char value[ADMIN_QUERY_VALUE_SIZE];
+    if (getQueryValue(request, "type", value, sizeof(value))) {
+        if (strcmp(value, "rfid") == 0) {
+            type = LockType::RFID;
+            return true;
+        }
+        if (strcmp(value, "fingerprint") == 0) {
+            type = LockType::FINGERPRINT;
+            return true;
+        }
+    }
+
+    httpd_resp_send_err(request, HTTPD_400_BAD_REQUEST, "type must be rfid or fingerprint");
+    return false;
+}
+
+esp_err_t AdminService::sendJson(httpd_req_t *request, const char *status, JsonDocument &document){
+    char body[512];
+    serializeJson(document, body, sizeof(body));
+
+    httpd_resp_set_status(request, status);
+    httpd_resp_set_type(request, "application/json");
+    return httpd_resp_sendstr(request, body);
+}
+
+/**
+ * @brief GET /api/key-access, send the key access file of a type chunked straight from the SD Card
+ *
+ */
+esp_err_t AdminService::handleList(httpd_req_t *request){
+    AdminService *service = (AdminService*)request->user_ctx;
+    if (!authorize(request)) return ESP_OK;
+
+    LockType type;
+    if (!parseType(request, type)) return ESP_OK;
+
+    httpd_resp_set_type(request, "application/json");
+    bool complete = service->_sdCardModule->streamKeyAccessFile(type, [request](const uint8_t *data, size_t length) {
+        return httpd_resp_send_chunk(request, (const char*)data, length) == ESP_OK;
+    });
+
+    // Closing the connection without the last chunk tells the client the list is incomplete
+    if (!complete) return ESP_FAIL;
+    return httpd_resp_send_chunk(request, nullptr, 0);
+}
+
+/**
+ * @brief GET /api/key-access/export, send both key access files chunked, in the format of the import
+ *
+ */
+esp_err_t AdminService::handleExport(httpd_req_t *request){
+    AdminService *service = (AdminService*)request->user_ctx;
+    if (!authorize(request)) return ESP_OK;
+
+    SDStreamWriter writer = [request](const uint8_t *data, size_t length) {
+        return httpd_resp_send_chunk(request, (const char*)data, length) == ESP_OK;
+    };
+
+    httpd_resp_set_type(request, "application/json");
+    httpd_resp_set_hdr(request, "Content-Disposition", "attachment; filename=\"key-access.json\"");
+
+    bool complete = httpd_resp_sendstr_chunk(request, "{\"rfids\":") == ESP_OK
+        && service->_sdCardModule->streamKeyAccessFile(LockType::RFID, writer)
+        && httpd_resp_sendstr_chunk(request, ",\"fingerprints\":") == ESP_OK
+        && service->_sdCardModule->streamKeyAccessFile(LockType::FINGERPRINT, writer)
+        && httpd_resp_sendstr_chunk(request, "}") == ESP_OK;
+
+    if (!complete) return ESP_FAIL;
+    return httpd_resp_send_chunk(request, nullptr, 0);
+}
+
+/**
+ * @brief POST /api/key-access/import, write the body to the SD Card as it is received, then apply it
+ *
+ */
+esp_err_t AdminService::handleImport(httpd_req_t *request){
+    AdminService *service = (AdminService*)request->user_ctx;
+    if (!authorize(request)) return ESP_OK;
+
+    JsonDocument response;
+    if (request->content_len == 0 || request->content_len > ADMIN_UPLOAD_MAX_SIZE) {
+        response["message"] = "The import must be between 1 byte and 512 KB";
+        return sendJson(request, HTTPD_400, response);
+    }
+
+    File file = SD.open(IMPORT_FILE_PATH, FILE_WRITE);
+    if (!file) {
+        response["message"] = "Failed to open the import file";
+        return sendJson(request, HTTPD_500, response);
+    }
+
+    char buffer[ADMIN_UPLOAD_CHUNK_SIZE];
+    size_t remaining = request->content_len;
+    int timeouts = 0;
+    int64_t started = esp_timer_get_time();
+    while (remaining > 0) {
+        int received = httpd_req_recv(request, buffer, remaining < sizeof(buffer) ? remaining : sizeof(buffer));
+        // A client that stalls would keep the server task and the import file forever
+        if (received == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts < ADMIN_UPLOAD_MAX_TIMEOUTS) continue;
+        if (received <= 0 || file.write((const uint8_t*)buffer, received) != (size_t)received) {
+            ESP_LOGE(ADMIN_SERVICE_LOG_TAG, "Import upload failed with %d bytes left", remaining);
+            file.close();
+            SD.remove(IMPORT_FILE_PATH);
+            if (received == HTTPD_SOCK_ERR_TIMEOUT) httpd_resp_send_err(request, HTTPD_408_REQ_TIMEOUT, nullptr);
+            return ESP_FAIL;
+        }
+        timeouts = 0;
+        remaining -= received;
+    }
+    file.close();
+
+    int nfcUsers = 0;
+    int fingerprintUsers = 0;
+    if (!service->_sdCardModule->importKeyAccess(IMPORT_FILE_PATH, nfcUsers, fingerprintUsers)) {
+        response["message"] = "Invalid import, the key access are not changed";
+        return sendJson(request, HTTPD_400, response);
+    }
+
+    ESP_LOGI(ADMIN_SERVICE_LOG_TAG, "Imported %d bytes in %lu ms", request->content_len, (unsigned long)((esp_timer_get_time() - started) / 1000));
+    response["message"] = "Key access imported";
+    response["rfid_users"] = nfcUsers;
+    response["fingerprint_users"] = fingerprintUsers;
+    return sendJson(request, HTTPD_200, response);
+}
+
+/**
+ * @brief DELETE /api/key-access, delete a key access by `key_access_id`, or every key access of a type of a user by `visitor_id`
+ *
+ * A deleted Fingerprint stops working right away, but its template stays on the sensor. Every deleted
+ * key access is also put in the outbox, so the server deletes it too and the next pull does not bring it back.
+ */
+esp_err_t AdminService::handleDelete(httpd_req_t *request){
+    AdminService *service = (AdminService*)request->user_ctx;
+    if (!authorize(request)) return ESP_OK;
+
+    LockType type;
+    if (!parseType(request, type)) return ESP_OK;
+
+    char keyAccessId[ADMIN_QUERY_VALUE_SIZE];
+    char visitorId[ADMIN_QUERY_VALUE_SIZE];
+    std::vector<std::string> removedKeyAccessIds;
+    bool deleted;
+    if (getQueryValue(request, "key_access_id", keyAccessId, sizeof(keyAccessId))) {
+        deleted = type == LockType::RFID ? service->_sdCardModule->deleteNFCFromSDCard(keyAccessId)
+                                         : service->_sdCardModule->deleteFingerprintFromSDCard(keyAccessId);
+        if (deleted) removedKeyAccessIds.push_back(keyAccessId);
+    } else if (getQueryValue(request, "visitor_id", visitorId, sizeof(visitorId))) {
+        deleted = type == LockType::RFID ? service->_sdCardModule->deleteNFCsUserFromSDCard(visitorId, &removedKeyAccessIds)
+                                         : service->_sdCardModule->deleteFingerprintsUserFromSDCard(visitorId, &removedKeyAccessIds);
+    } else {
+        httpd_resp_send_err(request, HTTPD_400_BAD_REQUEST, "key_access_id or visitor_id is required");
+        return ESP_OK;
+    }
+
+    for (const std::string &removedKeyAccessId : removedKeyAccessIds) {
+        if (!service->_outboxModule->pushDelete(type, removedKeyAccessId.c_str())) {
+            ESP_LOGE(ADMIN_SERVICE_LOG_TAG, "Failed to queue the server delete of Key Access ID %s", removedKeyAccessId.c_str());
+        }
+    }
+
+    JsonDocument response;
+    response["message"] = deleted ? "Key access deleted" : "Key access not found";
+    return sendJson(request, deleted ? HTTPD_200 : HTTPD_404, response);
+}
+
+/**
+ * @brief GET /api/diagnostics, the state of the firmware, memory, WiFi and key access
+ *
+ */
+esp_err_t AdminService::handleDiagnostics(httpd_req_t *request){
+    AdminService *service = (AdminService*)request->user_ctx;
+    if (!authorize(request)) return ESP_OK;
+
+    size_t nfcCount, fingerprintCount;
+    service->_sdCardModule->getKeyAccessCount(nfcCount, fingerprintCount);
+
+    JsonDocument response;
+    response["firmware"] = CURRENT_FIRMWARE_VERSION;
+    response["uptime_s"] = esp_timer_get_time() / 1000000;
+    response["heap"]["free"] = ESP.getFreeHeap();
+    response["heap"]["min_free"] = ESP.getMinFreeHeap();
+    response["heap"]["max_alloc"] = ESP.getMaxAllocHeap();
+    response["wifi"]["ssid"] = WiFi.SSID();
+    response["wifi"]["rssi"] = WiFi.RSSI();
+    response["wifi"]["ip"] = WiFi.localIP().toString();
+    response["key_access"]["rfid"] = nfcCount;
+    response["key_access"]["fingerprint"] = fingerprintCount;
+    response["key_access"]["revision"] = service->_sdCardModule->getRevision();
+    response["outbox_pending"] = service->_outboxModule->size();
+    return sendJson(request, HTTPD_200, response);
+}
@@ -0,0 +1,60 @@
+#ifndef ADMIN_SERVICE_H
+#define ADMIN_SERVICE_H
+
+#include <esp_http_server.h>
+#include <esp_log.h>
+
+#include "repository/SDCardModule/SDCardModule.h"
+#include "repository/OutboxModule/OutboxModule.h"
+#include "config/Config.h"
+
+#define ADMIN_SERVER_PORT               8080
+#define ADMIN_SERVER_STACK_SIZE         8192        // An import is parsed and written to the SD Card on the server task
+#define ADMIN_UPLOAD_CHUNK_SIZE         1024        // Bytes of an upload received and written to the SD Card at once
+#define ADMIN_UPLOAD_MAX_SIZE           (512 * 1024)
+#define ADMIN_UPLOAD_MAX_TIMEOUTS       3           // Receive timeouts in a row before a stalled upload is aborted
+#define ADMIN_QUERY_VALUE_SIZE          48
+#define ADMIN_TOKEN_NVS_NAMESPACE       "admin"     // NVS namespace of the token, when it is not given at build time
+#define ADMIN_TOKEN_NVS_KEY             "token"
+#define ADMIN_TOKEN_MIN_LENGTH          16
+#define ADMIN_TOKEN_MAX_LENGTH          64
+
+/**
+ * @brief HTTP admin api on the local network, for bulk key access management at the depot
+ *
+ * Every request needs the `Authorization: Bearer <token>` header. The token is `ADMIN_API_TOKEN` of the
+ * build, or the `token` of the `admin` NVS namespace, and the server is not started without one.
+ *   GET    /api/key-access?type=rfid|fingerprint                  The key access file of the type
+ *   GET    /api/key-access/export                                 Both key access files, in the import format
+ *   POST   /api/key-access/import                                 Replace the key access files with an export
+ *   DELETE /api/key-access?type=rfid|fingerprint&key_access_id=   Delete a key access, or all of a user with `visitor_id=`
+ *   GET    /api/diagnostics                                       Firmware, memory, WiFi and key access state
+ *
+ * The responses are sent chunked straight from the SD Card, and an import is written to the SD Card
+ * as it is received, so neither is ever held in memory as a whole.
+ */
+class AdminService {
+    public:
+        AdminService(SDCardModule *sdCardModule, OutboxModule *outboxModule);
+        bool start();
+
+    private:
+        SDCardModule* _sdCardModule;
+        OutboxModule* _outboxModule;
+        httpd_handle_t _server;
+        char _token[ADMIN_TOKEN_MAX_LENGTH + 1];
+
+        bool loadToken();
+        static bool authorize(httpd_req_t *request);
+        static bool getQueryValue(httpd_req_t *request, const char *key, char *value, size_t size);
+        static bool parseType(httpd_req_t *request, LockType &type);
+        static esp_err_t sendJson(httpd_req_t *request, const char *status, JsonDocument &document);
+
+        static esp_err_t handleList(httpd_req_t *request);
+        static esp_err_t handleExport(httpd_req_t *request);
+        static esp_err_t handleImport(httpd_req_t *request);
+        static esp_err_t handleDelete(httpd_req_t *request);
+        static esp_err_t handleDiagnostics(httpd_req_t *request);
+};
+
+#endif
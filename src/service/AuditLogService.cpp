@@ -0,0 +1,79 @@
+#define AUDIT_LOG_SERVICE_LOG_TAG "AUDIT_LOG_SERVICE"
+#include "AuditLogService.h"
+
+AuditLogService::AuditLogService(AuditLogModule *auditLogModule, BLEModule *bleModule)
+    : _auditLogModule(auditLogModule), _bleModule(bleModule){}
+
+/**
+ * @brief Send the access events between two timestamps as BLE notifications.
+ *
+ * The events are sent in pages with `STATUS_ACCESS_LOG_EVENTS`, each page holds as many events as fit in the
+ * negotiated ATT MTU of the connected clients. Each event is an array of
+ * `[timestamp, type, granted, key_access_id, nfc_uid or fingerprint_id]`. The query ends with
+ * `SUCCESS_QUERY_ACCESS_LOG` holding the number of events, and `next_from` when the query was cut by
+ * `AUDIT_LOG_QUERY_MAX_EVENTS` so the client can request the rest.
+ *
+ * @param from The start of the range (inclusive) in epoch time
+ * @param to The end of the range (inclusive) in epoch time
+ * @return The number of events sent
+ */
+size_t AuditLogService::sendAccessLog(uint32_t from, uint32_t to){
+    ESP_LOGI(AUDIT_LOG_SERVICE_LOG_TAG, "Start sending access log from %lu to %lu", (unsigned long)from, (unsigned long)to);
+
+    JsonDocument page;
+    JsonArray events = page.to<JsonArray>();
+    size_t sent = 0;
+    uint32_t nextFrom = 0;
+
+    // The page is measured as JSON, the MessagePack of the same report is never larger
+    JsonDocument envelope;
+    envelope["status"] = STATUS_ACCESS_LOG_EVENTS;
+    envelope["data"].to<JsonArray>();
+    size_t envelopeSize = measureJson(envelope) - measureJson(envelope["data"]);
+    size_t notificationSize = _bleModule->getNotificationSize();
+
+    _auditLogModule->query(from, to, [&](const AccessLogRecord &record) {
+        if (sent >= AUDIT_LOG_QUERY_MAX_EVENTS) {
+            nextFrom = record.timestamp;
+            return false;
+        }
+
+        addEvent(events, record);
+        sent++;
+
+        // Send the page without the event that overflows it, an event alone is sent even if it is too large
+        if (events.size() > 1 && envelopeSize + measureJson(page) > notificationSize) {
+            events.remove(events.size() - 1);
+            _bleModule->sendReport(STATUS_ACCESS_LOG_EVENTS, page.as<JsonVariantConst>());
+            events = page.to<JsonArray>();
+            addEvent(events, record);
+        }
+        return true;
+    });
+
+    if (events.size() > 0) {
+        _bleModule->sendReport(STATUS_ACCESS_LOG_EVENTS, page.as<JsonVariantConst>());
+    }
+
+    JsonDocument summary;
+    summary["count"] = sent;
+    if (nextFrom != 0) summary["next_from"] = nextFrom;
+    _bleModule->sendReport(SUCCESS_QUERY_ACCESS_LOG, summary.as<JsonVariantConst>());
+
+    ESP_LOGI(AUDIT_LOG_SERVICE_LOG_TAG, "Finished sending %d access log events", sent);
+    return sent;
+}
+
+/**
+ * @brief Append a record to a page as `[timestamp, type, granted, key_access_id, nfc_uid or fingerprint_id]`
+ *
+ */
+void AuditLogService::addEvent(JsonArray events, const AccessLogRecord &record){
+    JsonArray event = events.add<JsonArray>();
+    event.add(record.timestamp);
+    event.add(record.type);
+    event.add(record.granted);
+    event.add(record.keyAccessId);
+    if (record.type == LockType::RFID) event.add(record.uidCard);
+    else event.add(record.fingerprintId);
+}
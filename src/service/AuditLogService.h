@@ -0,0 +1,24 @@
+#ifndef AUDIT_LOG_SERVICE_H
+#define AUDIT_LOG_SERVICE_H
+
+#include "repository/AuditLogModule/AuditLogModule.h"
+#include "communication/ble/core/BLEModule.h"
+#include "StatusCodes.h"
+#include <esp_log.h>
+
+#define AUDIT_LOG_QUERY_MAX_EVENTS          256     // Maximum events sent for a single query, the client continue from `next_from`
+
+/// @brief Class that serve the local access log queries over BLE
+class AuditLogService {
+    public:
+        AuditLogService(AuditLogModule *auditLogModule, BLEModule *bleModule);
+        size_t sendAccessLog(uint32_t from, uint32_t to);
+
+    private:
+        AuditLogModule* _auditLogModule;
+        BLEModule* _bleModule;
+
+        static void addEvent(JsonArray events, const AccessLogRecord &record);
+};
+
+#endif
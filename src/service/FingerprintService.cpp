@@ -2,8 +2,8 @@
 #include "FingerprintService.h"
 #include <esp_log.h>
 
-FingerprintService::FingerprintService(FingerprintSensor *fingerprintSensor, SDCardModule *sdCardModule, DoorRelay *doorRelay, BLEModule *bleModule, QueueHandle_t fingerprintQueueRequest, QueueHandle_t fingerprintQueueResponse) 
-    : _fingerprintSensor(fingerprintSensor), _sdCardModule(sdCardModule), _doorRelay(doorRelay), _bleModule(bleModule), _fingerprintQueueRequest(fingerprintQueueRequest), _fingerprintQueueResponse(fingerprintQueueResponse){
+FingerprintService::FingerprintService(FingerprintSensor *fingerprintSensor, SDCardModule *sdCardModule, UsageStatsModule *usageStatsModule, AuditLogModule *auditLogModule, LeaseModule *leaseModule, ReplicationService *replicationService, DoorRelay *doorRelay, BLEModule *bleModule, AccessEventRing *accessEvents, SemaphoreHandle_t accessEventSignal, QueueHandle_t fingerprintQueueRequest) 
+    : _fingerprintSensor(fingerprintSensor), _sdCardModule(sdCardModule), _usageStatsModule(usageStatsModule), _auditLogModule(auditLogModule), _leaseModule(leaseModule), _replicationService(replicationService), _doorRelay(doorRelay), _bleModule(bleModule), _accessEvents(accessEvents), _accessEventSignal(accessEventSignal), _fingerprintQueueRequest(fingerprintQueueRequest){
     setup();
 }
 
@@ -47,6 +47,7 @@ bool FingerprintService::addFingerprint(const char *username, const char *visito
     }
 
     ESP_LOGI(FINGERPRINT_SERVICE_LOG_TAG, "Fingerprint saved to SD card successfully for User: %s, FingerprintID: %d, VisitorID: %s, KeyAccessID : %s", username, fingerprintId, visitorId, keyAccessId);
+    _leaseModule->grant(keyAccessId);
     sendbleNotification(SUCCESS_REGISTERING_FINGERPRINT_ACCESS);
     return true;
 }
@@ -170,6 +171,7 @@ bool FingerprintService::deleteFingerprintAccessFile(){
 
     if(_sdCardModule->deleteAccessJsonFile(LockType::FINGERPRINT)){
         ESP_LOGI(FINGERPRINT_SERVICE_LOG_TAG, "Successfully deleted the fingerprint key access file");
+        _usageStatsModule->clear(LockType::FINGERPRINT);
         sendbleNotification(SUCCESS_DELETING_FINGERPRINT_ACCESS_FILE);
         return true;
     }
@@ -194,27 +196,43 @@ bool FingerprintService::authenticateAccessFingerprint(){
     if(isRegsiteredModel > 0){
         if(_sdCardModule->isFingerprintIdRegistered(isRegsiteredModel)){
             ESP_LOGI(FINGERPRINT_SERVICE_LOG_TAG, "Fingerprint Match with ID %d", isRegsiteredModel);
-            _doorRelay->toggleRelay();
 
             // Get the key access Id of that Fingerprint ID
             std::string *keyAccessId = _sdCardModule->getKeyAccessIdByFingerprintId(isRegsiteredModel);
 
             if(keyAccessId != nullptr){
-                // Send the access history without waiting the response
-                FingerprintQueueRequest msg;
-                msg.state = AUTHENTICATE_FP;
-                msg.fingerprintId = isRegsiteredModel;
-                snprintf(msg.keyAccessId, sizeof(msg.keyAccessId), "%s", keyAccessId->c_str());
-
-                if (xQueueSend(_fingerprintQueueRequest, &msg, portMAX_DELAY) != pdPASS) {
-                    ESP_LOGE(FINGERPRINT_SERVICE_LOG_TAG, "Failed to send Fingerprint message to WiFi queue!");
+                // Only the RAM lease table is checked, an expired lease is revalidated in the background
+                if (!_leaseModule->authorize(*keyAccessId)) {
+                    ESP_LOGI(FINGERPRINT_SERVICE_LOG_TAG, "Fingerprint ID %d has no valid lease, access denied", isRegsiteredModel);
+                    _auditLogModule->append(LockType::FINGERPRINT, false, keyAccessId->c_str(), nullptr, isRegsiteredModel);
+                    delete keyAccessId;
+                    return false;
+                }
+                _doorRelay->toggleRelay();
+
+                // Only touch the RAM table, the statistic will be flushed later to SD Card
+                _usageStatsModule->recordAccess(keyAccessId->c_str(), LockType::FINGERPRINT);
+                _auditLogModule->append(LockType::FINGERPRINT, true, keyAccessId->c_str(), nullptr, isRegsiteredModel);
+
+                // Send the access history without waiting, the event is written straight into the ring
+                AccessEvent *event = _accessEvents->claim();
+                if (event != nullptr) {
+                    event->fingerprintId = isRegsiteredModel;
+                    snprintf(event->keyAccessId, sizeof(event->keyAccessId), "%s", keyAccessId->c_str());
+                    event->uidCard[0] = '\0';
+                    _accessEvents->publish();
+                    xSemaphoreGive(_accessEventSignal);
+                } else {
+                    ESP_LOGE(FINGERPRINT_SERVICE_LOG_TAG, "Access event ring is full, the access is only kept in the audit log!");
                 }
 
+                delete keyAccessId;
                 return true;
             }
         }
 
         ESP_LOGI(FINGERPRINT_SERVICE_LOG_TAG, "Fingerprint Model ID %d is Registered on Sensor, but not appear in stored data. Cannot open the Door Lock!", isRegsiteredModel);
+        _auditLogModule->append(LockType::FINGERPRINT, false, nullptr, nullptr, isRegsiteredModel);
         return false;
     }
     else{
@@ -295,7 +313,7 @@ void FingerprintService::sendbleNotification(int statusCode){
  * @param username Name of the user associated with the operation.
  * @param keyAccessId Key Access ID to be used for cleanup (can be nullptr if not applicable).
  * @param message Error message to log and send in the notification.
- * @param cleanup If true and visitorId is provided, will send a REMOVE_FP request to the server.
+ * @param cleanup If true and visitorId is provided, queues a REMOVE_FP request to the server without waiting for its answer.
  * @return Always returns false
  */
 bool FingerprintService::handleError(int statusCode, const char* username, const char* keyAccessId, const char* message, bool cleanup) {
@@ -303,22 +321,27 @@ bool FingerprintService::handleError(int statusCode, const char* username, const
     sendbleNotification(statusCode);
 
     if (cleanup && keyAccessId) {
-        FingerprintQueueRequest msg;
-        msg.state = DELETE_FP;
-        snprintf(msg.keyAccessId, sizeof(msg.keyAccessId), "%s", keyAccessId);
-        snprintf(msg.username, sizeof(msg.username), "%s", username);
-        snprintf(msg.vehicleInformationNumber, sizeof(msg.vehicleInformationNumber), "%s", VIN);
-
-        if (xQueueSend(_fingerprintQueueRequest, &msg, portMAX_DELAY) != pdPASS) {
-            ESP_LOGE(FINGERPRINT_SERVICE_LOG_TAG, "Failed to send cleanup request for Key Access ID: %s", keyAccessId);
+        // Only the pointer of the request is queued, the WiFi Task releases the block once it is handled
+        QueueRequest *msg = queueRequestPool().acquire();
+        if (msg == nullptr) {
+            ESP_LOGE(FINGERPRINT_SERVICE_LOG_TAG, "No free request block for the cleanup of Key Access ID: %s", keyAccessId);
+            return false;
         }
-
-        FingerprintQueueResponse resp;
-        if (xQueueReceive(_fingerprintQueueResponse, &resp, pdMS_TO_TICKS(5000)) != pdPASS) {
-            ESP_LOGE(FINGERPRINT_SERVICE_LOG_TAG, "No response received for cleanup request.");
-        } else {
-            ESP_LOGI(FINGERPRINT_SERVICE_LOG_TAG, "Cleanup response: %s", resp.response);
+        int requestId = nextQueueRequestId();
+        msg->request_id = requestId;
+        msg->state = DELETE_FP;
+        snprintf(msg->keyAccessId, sizeof(msg->keyAccessId), "%s", keyAccessId);
+        snprintf(msg->username, sizeof(msg->username), "%s", username);
+        snprintf(msg->vehicleInformationNumber, sizeof(msg->vehicleInformationNumber), "%s", VIN);
+
+        // The sensor task does not wait for the server, the WiFi Task falls back to the outbox if it cannot reach it
+        // or the server does not take the delete
+        if (xQueueSend(_fingerprintQueueRequest, &msg, 0) != pdPASS) {
+            ESP_LOGE(FINGERPRINT_SERVICE_LOG_TAG, "Request queue full, cleanup of Key Access ID %s not sent", keyAccessId);
+            queueRequestPool().release(msg);
+            return false;
         }
+        ESP_LOGI(FINGERPRINT_SERVICE_LOG_TAG, "Cleanup request %d queued for Key Access ID: %s", requestId, keyAccessId);
     }
     return false;
 }
@@ -4,16 +4,21 @@
 #include "FingerprintSensor.h"
 #include "DoorRelay.h"
 #include "repository/SDCardModule/SDCardModule.h"
+#include "repository/UsageStatsModule/UsageStatsModule.h"
+#include "repository/AuditLogModule/AuditLogModule.h"
+#include "repository/LeaseModule/LeaseModule.h"
+#include "service/ReplicationService.h"
 #include "config/Config.h"
 #include "enum/LockType.h"
 #include "entity/QueueMessage.h"
+#include <freertos/semphr.h>
 #include "communication/ble/core/BLEModule.h"
 
 /// @brief Class that manages the Fingerprint Access Control system by wrapping the functionalitites of Fingerprint sensor, SD Card module, and the Door Relay
 class FingerprintService
 {
 public:
-    FingerprintService(FingerprintSensor *fingerprintSensor, SDCardModule *sdCardModule, DoorRelay *DoorRelay, BLEModule* bleModule, QueueHandle_t fingerprintQueueRequest, QueueHandle_t fingerprintQueueResponse);
+    FingerprintService(FingerprintSensor *fingerprintSensor, SDCardModule *sdCardModule, UsageStatsModule *usageStatsModule, AuditLogModule *auditLogModule, LeaseModule *leaseModule, ReplicationService *replicationService, DoorRelay *DoorRelay, BLEModule* bleModule, AccessEventRing *accessEvents, SemaphoreHandle_t accessEventSignal, QueueHandle_t fingerprintQueueRequest);
     bool setup();
     bool addFingerprint(const char *username, const char *visitorId, const char *keyAccessId);
     bool deleteFingerprint(const char *keyAccessId);
@@ -33,10 +38,15 @@ public:
 private:
     FingerprintSensor* _fingerprintSensor;
     SDCardModule* _sdCardModule;
+    UsageStatsModule* _usageStatsModule;
+    AuditLogModule* _auditLogModule;
+    LeaseModule* _leaseModule;
+    ReplicationService* _replicationService;
     DoorRelay* _doorRelay;
     BLEModule* _bleModule;
+    AccessEventRing* _accessEvents;
+    SemaphoreHandle_t _accessEventSignal;
     QueueHandle_t _fingerprintQueueRequest;
-    QueueHandle_t _fingerprintQueueResponse;
 };
 
 #endif
\ No newline at end of file
@@ -2,8 +2,8 @@
 #include "NFCService.h"
 #include <esp_log.h>
 
-NFCService::NFCService(AdafruitNFCSensor *nfcSensor, SDCardModule *sdCardModule, DoorRelay *doorRelay, BLEModule* bleModule, QueueHandle_t nfcQueueRequest, QueueHandle_t nfcQueueResponse) 
-    : _nfcSensor(nfcSensor), _sdCardModule(sdCardModule), _doorRelay(doorRelay), _bleModule(bleModule), _nfcQueueRequest(nfcQueueRequest), _nfcQueueResponse(nfcQueueResponse){
+NFCService::NFCService(AdafruitNFCSensor *nfcSensor, SDCardModule *sdCardModule, UsageStatsModule *usageStatsModule, AuditLogModule *auditLogModule, LeaseModule *leaseModule, ReplicationService *replicationService, DoorRelay *doorRelay, BLEModule* bleModule, AccessEventRing *accessEvents, SemaphoreHandle_t accessEventSignal, QueueHandle_t nfcQueueRequest) 
+    : _nfcSensor(nfcSensor), _sdCardModule(sdCardModule), _usageStatsModule(usageStatsModule), _auditLogModule(auditLogModule), _leaseModule(leaseModule), _replicationService(replicationService), _doorRelay(doorRelay), _bleModule(bleModule), _accessEvents(accessEvents), _accessEventSignal(accessEventSignal), _nfcQueueRequest(nfcQueueRequest){
     setup();
 }
 
@@ -52,6 +52,8 @@ bool NFCService::addNFC(const char *username, const char *visitorId, const char
     }
 
     ESP_LOGI(NFC_SERVICE_LOG_TAG, "NFC UID %s successfully saved to SD card for User: %s", uidCard, username);
+    _leaseModule->grant(keyAccessId);
+    _replicationService->recordAdd(LockType::RFID, keyAccessId, uidCard, visitorId, username);
     sendbleNotification(SUCCESS_REGISTERING_NFC_ACCESS);
     return true;
 }
@@ -119,6 +121,7 @@ bool NFCService::deleteNFCAccessFile(){
 
     if(_sdCardModule->deleteAccessJsonFile(LockType::RFID)){
         ESP_LOGI(NFC_SERVICE_LOG_TAG, "Successfully deleted the NFC key access file");
+        _usageStatsModule->clear(LockType::RFID);
         sendbleNotification(SUCCESS_DELETING_NFC_ACCESS_FILE);
         return true;
     }
@@ -141,25 +144,47 @@ bool NFCService::authenticateAccessNFC(){
     else {
         if(_sdCardModule->isNFCIdRegistered(uidCard)){
             ESP_LOGI(NFC_SERVICE_LOG_TAG, "NFC Card Match with ID %s", uidCard);
-            _doorRelay->toggleRelay();
 
             // Get the key access Id of that UID Card
             std::string *keyAccessId = _sdCardModule->getKeyAccessIdByNFCUid(uidCard);
+            if (keyAccessId == nullptr) {
+                // The index is out of step with the key files, deny like an unknown Fingerprint ID
+                ESP_LOGW(NFC_SERVICE_LOG_TAG, "Key Access ID of NFC Card ID %s is not found, access denied", uidCard);
+                _auditLogModule->append(LockType::RFID, false, nullptr, uidCard, 0);
+                return false;
+            }
+
+            // Only the RAM lease table is checked, an expired lease is revalidated in the background
+            if (!_leaseModule->authorize(*keyAccessId)) {
+                ESP_LOGI(NFC_SERVICE_LOG_TAG, "NFC Card ID %s has no valid lease, access denied", uidCard);
+                _auditLogModule->append(LockType::RFID, false, keyAccessId->c_str(), uidCard, 0);
+                delete keyAccessId;
+                return false;
+            }
+            _doorRelay->toggleRelay();
 
-            // Send the access history without waiting the response
-            NFCQueueRequest msg;
-            msg.state = AUTHENTICATE_RFID;
-            snprintf(msg.keyAccessId, sizeof(msg.keyAccessId), "%s", keyAccessId->c_str());
-            snprintf(msg.uidCard, sizeof(msg.uidCard), "%s", uidCard);
+            // Only touch the RAM table, the statistic will be flushed later to SD Card
+            _usageStatsModule->recordAccess(keyAccessId->c_str(), LockType::RFID);
+            _auditLogModule->append(LockType::RFID, true, keyAccessId->c_str(), uidCard, 0);
 
-            if (xQueueSend(_nfcQueueRequest, &msg, portMAX_DELAY) != pdPASS) {
-                ESP_LOGE(NFC_SERVICE_LOG_TAG, "Failed to send NFC message to WiFi queue!");
+            // Send the access history without waiting, the event is written straight into the ring
+            AccessEvent *event = _accessEvents->claim();
+            if (event != nullptr) {
+                event->fingerprintId = 0;
+                snprintf(event->keyAccessId, sizeof(event->keyAccessId), "%s", keyAccessId->c_str());
+                snprintf(event->uidCard, sizeof(event->uidCard), "%s", uidCard);
+                _accessEvents->publish();
+                xSemaphoreGive(_accessEventSignal);
+            } else {
+                ESP_LOGE(NFC_SERVICE_LOG_TAG, "Access event ring is full, the access is only kept in the audit log!");
             }
-            
+
+            delete keyAccessId;
             return true;
         }
 
         ESP_LOGI(NFC_SERVICE_LOG_TAG, "NFC Card ID %s is detected but not stored in our data system!", uidCard);
+        _auditLogModule->append(LockType::RFID, false, nullptr, uidCard, 0);
         return false;
     }
 }
@@ -209,7 +234,7 @@ void NFCService::sendbleNotification(int statusCode){
  * @param username Name of the user associated with the operation.
  * @param keyAccessId Key Access ID to be used for cleanup (can be nullptr if not applicable).
  * @param message Error message to log and send in the notification.
- * @param cleanup If true and visitorId is provided, will send a REMOVE_FP request to the server.
+ * @param cleanup If true and visitorId is provided, queues a REMOVE_FP request to the server without waiting for its answer.
  * @return Always returns false
  */
 bool NFCService::handleError(int statusCode, const char* username, const char* keyAccessId, const char* message, bool cleanup) {
@@ -217,22 +242,27 @@ bool NFCService::handleError(int statusCode, const char* username, const char* k
     sendbleNotification(statusCode);
 
     if (cleanup && keyAccessId) {
-        NFCQueueRequest msg;
-        msg.state = DELETE_RFID;
-        snprintf(msg.keyAccessId, sizeof(msg.keyAccessId), "%s", keyAccessId);
-        snprintf(msg.username, sizeof(msg.username), "%s", username);
-        snprintf(msg.vehicleInformationNumber, sizeof(msg.vehicleInformationNumber), "%s", VIN);
-
-        if (xQueueSend(_nfcQueueRequest, &msg, portMAX_DELAY) != pdPASS) {
-            ESP_LOGE(NFC_SERVICE_LOG_TAG, "Failed to send cleanup request for visitor ID: %s", keyAccessId);
+        // Only the pointer of the request is queued, the WiFi Task releases the block once it is handled
+        QueueRequest *msg = queueRequestPool().acquire();
+        if (msg == nullptr) {
+            ESP_LOGE(NFC_SERVICE_LOG_TAG, "No free request block for the cleanup of visitor ID: %s", keyAccessId);
+            return false;
         }
+        int requestId = nextQueueRequestId();
+        msg->request_id = requestId;
+        msg->state = DELETE_RFID;
+        snprintf(msg->keyAccessId, sizeof(msg->keyAccessId), "%s", keyAccessId);
+        snprintf(msg->username, sizeof(msg->username), "%s", username);
+        snprintf(msg->vehicleInformationNumber, sizeof(msg->vehicleInformationNumber), "%s", VIN);
 
-        NFCQueueResponse resp;
-        if (xQueueReceive(_nfcQueueResponse, &resp, pdMS_TO_TICKS(5000)) != pdPASS) {
-            ESP_LOGE(NFC_SERVICE_LOG_TAG, "No response received for cleanup request.");
-        } else {
-            ESP_LOGI(NFC_SERVICE_LOG_TAG, "Cleanup response: %s", resp.response);
+        // The sensor task does not wait for the server, the WiFi Task falls back to the outbox if it cannot reach it
+        // or the server does not take the delete
+        if (xQueueSend(_nfcQueueRequest, &msg, 0) != pdPASS) {
+            ESP_LOGE(NFC_SERVICE_LOG_TAG, "Request queue full, cleanup of visitor ID %s not sent", keyAccessId);
+            queueRequestPool().release(msg);
+            return false;
         }
+        ESP_LOGI(NFC_SERVICE_LOG_TAG, "Cleanup request %d queued for visitor ID: %s", requestId, keyAccessId);
     }
 
     return false;
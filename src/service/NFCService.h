@@ -5,8 +5,13 @@
 #include "DoorRelay.h"
 #include "StatusCodes.h"
 #include "repository/SDCardModule/SDCardModule.h"
+#include "repository/UsageStatsModule/UsageStatsModule.h"
+#include "repository/AuditLogModule/AuditLogModule.h"
+#include "repository/LeaseModule/LeaseModule.h"
+#include "service/ReplicationService.h"
 #include "communication/ble/core/BLEModule.h"
 #include "entity/QueueMessage.h"
+#include <freertos/semphr.h>
 #include "enum/LockType.h"
 #include "enum/SystemState.h"
 #include "config/Config.h"
@@ -14,7 +19,7 @@
 /// @brief Class that manages the NFC Access Control system by wrapping the functionalitites of NFC sensor, SD Card module, and the Door Relay
 class NFCService {
     public:
-        NFCService(AdafruitNFCSensor *nfcSensor, SDCardModule *sdCardModule, DoorRelay *doorRelay, BLEModule *bleModule, QueueHandle_t nfcQueueRequest, QueueHandle_t nfcQueueResponse);
+        NFCService(AdafruitNFCSensor *nfcSensor, SDCardModule *sdCardModule, UsageStatsModule *usageStatsModule, AuditLogModule *auditLogModule, LeaseModule *leaseModule, ReplicationService *replicationService, DoorRelay *doorRelay, BLEModule *bleModule, AccessEventRing *accessEvents, SemaphoreHandle_t accessEventSignal, QueueHandle_t nfcQueueRequest);
         bool setup();
         bool addNFC(const char *username, const char *visitorId, const char *keyAccessId);
         bool deleteNFC(const char *keyAccessId);
@@ -32,10 +37,15 @@ class NFCService {
     private:
         AdafruitNFCSensor* _nfcSensor;
         SDCardModule* _sdCardModule;
+        UsageStatsModule* _usageStatsModule;
+        AuditLogModule* _auditLogModule;
+        LeaseModule* _leaseModule;
+        ReplicationService* _replicationService;
         DoorRelay* _doorRelay;
         BLEModule* _bleModule;
+        AccessEventRing* _accessEvents;
+        SemaphoreHandle_t _accessEventSignal;
         QueueHandle_t _nfcQueueRequest;
-        QueueHandle_t _nfcQueueResponse;
 };
 
 #endif
\ No newline at end of file
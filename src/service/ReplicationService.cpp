@@ -0,0 +1,252 @@
+#define REPLICATION_SERVICE_LOG_TAG "REPLICATION_SERVICE"
+#include "ReplicationService.h"
+#include <Arduino.h>
+#include <esp_netif.h>
+#include <mbedtls/md.h>
+#include <netinet/in.h>
+
+/**
+ * @brief FNV-1a hash of the replication group, only the controllers of the same group replicate to each other
+ *
+ */
+static uint32_t groupId(const char *group){
+    uint32_t hash = 2166136261u;
+    for (const char *c = group; *c != '\0'; c++) hash = (hash ^ (uint8_t)*c) * 16777619u;
+    return hash;
+}
+
+static void replicationMac(const uint8_t *data, size_t length, uint8_t *mac){
+#ifdef REPLICATION_KEY
+    static const char key[] = REPLICATION_KEY;
+    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const unsigned char*)key, sizeof(key) - 1, data, length, mac);
+#else
+    // Never used, `src/config/Config.h` stops a build with the replication enabled and no key
+    memset(mac, 0, 32);
+#endif
+}
+
+ReplicationService::ReplicationService(SDCardModule *sdCardModule, LeaseModule *leaseModule)
+    : _sdCardModule(sdCardModule), _leaseModule(leaseModule), _node(nullptr), _journalSize(0), _taskHandle(nullptr) {
+    _nodeMutex = xSemaphoreCreateMutex();
+    if (_nodeMutex == NULL) ESP_LOGE(REPLICATION_SERVICE_LOG_TAG, "Failed to create replication mutex.");
+    _journalMutex = xSemaphoreCreateMutex();
+    if (_journalMutex == NULL) ESP_LOGE(REPLICATION_SERVICE_LOG_TAG, "Failed to create replication journal mutex.");
+}
+
+/**
+ * @brief Start the replication when it is enabled with `REPLICATION_ENABLED`
+ *
+ * The node id is folded from the MAC address, and the change log of before the restart is loaded
+ * from the SD Card, so the node resumes its own sequence.
+ *
+ * @return `true` if the replication is started, `false` otherwise.
+ */
+bool ReplicationService::start(){
+    if (!REPLICATION_ENABLED || _node != nullptr) return false;
+
+    uint64_t mac = ESP.getEfuseMac();
+    uint32_t nodeId = (uint32_t)mac ^ (uint32_t)(mac >> 32);
+
+    _node = new ReplicationNode(nodeId, groupId(REPLICATION_GROUP),
+        [this](const ReplicationPeer *peer, const uint8_t *data, size_t length) { _socket.send(peer, data, length); },
+        [this](const ReplicationEntry &entry) { return applyEntry(entry); },
+        replicationMac);
+    loadState();
+
+    // The socket needs the TCP/IP stack, the datagrams are dropped until the WiFi is connected
+    esp_netif_init();
+    if (!_socket.open(INADDR_ANY, REPLICATION_PORT, true)) {
+        ESP_LOGE(REPLICATION_SERVICE_LOG_TAG, "Failed to open the replication socket on port %d", REPLICATION_PORT);
+        return false;
+    }
+    _socket.addTarget(INADDR_BROADCAST, REPLICATION_PORT);
+
+    xTaskCreate(
+        loop,                           // Function to run in the task
+        "Replication",                  // Name of the task
+        REPLICATION_TASK_STACK_SIZE,    // Stack size (adjustable)
+        this,                           // Pass the `this` pointer to the task
+        4,                              // Task priority, lower than the WiFi Task
+        &_taskHandle                    // Store the task handle for later control
+    );
+    ESP_LOGI(REPLICATION_SERVICE_LOG_TAG, "Replication started, node %08lx, %d key access in the change log", (unsigned long)nodeId, _node->getEntryCount());
+    return true;
+}
+
+/**
+ * @brief Replicate a key access that was just added to this controller
+ *
+ * @param type The type of the key access, only NFC Cards are replicated
+ * @param keyAccessId The Key Access ID
+ * @param uidCard The NFC Card UID
+ * @param visitorId The Visitor ID
+ * @param name The visitor name
+ */
+void ReplicationService::recordAdd(LockType type, const char *keyAccessId, const char *uidCard, const char *visitorId, const char *name){
+    if (_node == nullptr || type != LockType::RFID) return;
+
+    if (xSemaphoreTake(_nodeMutex, portMAX_DELAY) != pdTRUE) return;
+    bool recorded = _node->record(REPLICATION_ADD, type, keyAccessId, uidCard, visitorId, name);
+    xSemaphoreGive(_nodeMutex);
+
+    if (recorded) saveChanges();
+    else ESP_LOGW(REPLICATION_SERVICE_LOG_TAG, "Change log is full, Key Access ID %s is not replicated", keyAccessId);
+}
+
+/**
+ * @brief Replicate a key access that was just revoked on this controller
+ *
+ * Called for every key access removed from the SD Card. A revoke applied from another controller is
+ * already in the change log, and is applied on the replication task with the node mutex held.
+ *
+ * @param type The type of the key access
+ * @param keyAccessId The Key Access ID
+ */
+void ReplicationService::recordRevoke(LockType type, const char *keyAccessId){
+    if (_node == nullptr || xTaskGetCurrentTaskHandle() == _taskHandle) return;
+
+    if (xSemaphoreTake(_nodeMutex, portMAX_DELAY) != pdTRUE) return;
+    bool recorded = _node->record(REPLICATION_REVOKE, type, keyAccessId, nullptr, nullptr, nullptr);
+    xSemaphoreGive(_nodeMutex);
+
+    if (recorded) saveChanges();
+    else ESP_LOGW(REPLICATION_SERVICE_LOG_TAG, "Change log is full, Key Access ID %s is not replicated", keyAccessId);
+}
+
+/**
+ * @brief Apply a change of another controller to the SD Card
+ *
+ * A revoked Fingerprint stops working right away, but its template stays on the sensor. The usage
+ * statistic and the lease of a revoked key access go with it through the watcher of the SD Card
+ * module, the lease is also revoked here for a key access that is not on the SD Card.
+ *
+ * @return `true` if the change is applied, `false` if it has to be pushed again.
+ */
+bool ReplicationService::applyEntry(const ReplicationEntry &entry){
+    ESP_LOGI(REPLICATION_SERVICE_LOG_TAG, "Replicated %s of Key Access ID %s from node %08lx",
+        entry.action == REPLICATION_ADD ? "add" : "revoke", entry.keyAccessId, (unsigned long)entry.origin);
+
+    if (entry.action == REPLICATION_REVOKE) {
+        _leaseModule->revoke(entry.keyAccessId);
+        // A key access that is not on the SD Card is already revoked
+        if (entry.type == LockType::RFID) _sdCardModule->deleteNFCFromSDCard(entry.keyAccessId);
+        else _sdCardModule->deleteFingerprintFromSDCard(entry.keyAccessId);
+        return true;
+    }
+
+    if (entry.type != LockType::RFID || _sdCardModule->isNFCIdRegistered(entry.uidCard)) return true;
+    if (!_sdCardModule->saveNFCToSDCard(entry.name, entry.uidCard, entry.visitorId, entry.keyAccessId)) return false;
+    _leaseModule->grant(entry.keyAccessId);
+    return true;
+}
+
+/**
+ * @brief Load the snapshot of the change log and the sequence vector stored before the restart, and
+ * replay the journal of the changes since on top of it
+ *
+ */
+void ReplicationService::loadState(){
+    File file = SD.open(REPLICATION_STATE_FILE_PATH, FILE_READ);
+    if (file) {
+        std::vector<uint8_t> data(file.size());
+        bool loaded = file.read(data.data(), data.size()) == data.size() && _node->load(data.data(), data.size());
+        file.close();
+        if (!loaded) ESP_LOGE(REPLICATION_SERVICE_LOG_TAG, "Invalid replication state, the peers push the change log again");
+    } else {
+        ESP_LOGI(REPLICATION_SERVICE_LOG_TAG, "No replication state stored yet in %s", REPLICATION_STATE_FILE_PATH);
+    }
+
+    file = SD.open(REPLICATION_JOURNAL_FILE_PATH, FILE_READ);
+    if (!file) return;
+
+    std::vector<uint8_t> journal(file.size());
+    bool read = file.read(journal.data(), journal.size()) == journal.size();
+    file.close();
+    _journalSize = journal.size();
+
+    // A torn last record is from a power loss while it was written, the peers push it again
+    if (!read || !_node->replay(journal.data(), journal.size())) {
+        ESP_LOGW(REPLICATION_SERVICE_LOG_TAG, "Replication journal ends early, the peers push the rest again");
+    }
+}
+
+/**
+ * @brief Store the changes of the node since the last call, called without the node mutex held
+ *
+ * The changes are appended to the journal. Once the journal is full, a snapshot of the whole state
+ * is stored instead, through a temporary file so a power loss in the middle keeps the previous
+ * snapshot and journal, and the journal restarts. The node mutex is only held while the changes or
+ * the snapshot are taken from the node, never while the SD Card is written.
+ */
+void ReplicationService::saveChanges(){
+    if (xSemaphoreTake(_journalMutex, portMAX_DELAY) != pdTRUE) return;
+
+    std::vector<uint8_t> changes;
+    std::vector<uint8_t> snapshot;
+    bool compact = false;
+    if (xSemaphoreTake(_nodeMutex, portMAX_DELAY) == pdTRUE) {
+        _node->takeJournal(changes);
+        compact = !changes.empty() && _journalSize + changes.size() > REPLICATION_JOURNAL_MAX_SIZE && _node->save(snapshot);
+        xSemaphoreGive(_nodeMutex);
+    }
+
+    if (compact) {
+        File file = SD.open(REPLICATION_STATE_TEMP_FILE_PATH, FILE_WRITE);
+        bool stored = false;
+        if (file) {
+            stored = file.write(snapshot.data(), snapshot.size()) == snapshot.size();
+            file.close();
+        }
+        if (stored) {
+            SD.remove(REPLICATION_STATE_FILE_PATH);
+            stored = SD.rename(REPLICATION_STATE_TEMP_FILE_PATH, REPLICATION_STATE_FILE_PATH);
+        }
+
+        // Replaying the old journal on the new snapshot changes nothing, so it is removed last
+        if (stored) {
+            SD.remove(REPLICATION_JOURNAL_FILE_PATH);
+            _journalSize = 0;
+            changes.clear();
+        } else {
+            ESP_LOGE(REPLICATION_SERVICE_LOG_TAG, "Failed to store the replication snapshot to SD Card, appending to the journal");
+        }
+    }
+
+    if (!changes.empty()) {
+        File file = SD.open(REPLICATION_JOURNAL_FILE_PATH, FILE_APPEND);
+        bool stored = false;
+        if (file) {
+            stored = file.write(changes.data(), changes.size()) == changes.size();
+            file.close();
+        }
+        if (stored) _journalSize += changes.size();
+        else ESP_LOGE(REPLICATION_SERVICE_LOG_TAG, "Failed to append the replication changes to SD Card");
+    }
+
+    xSemaphoreGive(_journalMutex);
+}
+
+/**
+ * @brief FreeRTOS loop of the replication, handles the datagrams of the peers and broadcasts the digest
+ *
+ * @param parameter Pointer to the ReplicationService instance (cast from void*).
+ */
+void ReplicationService::loop(void *parameter){
+    ReplicationService *service = (ReplicationService*)parameter;
+    uint8_t buffer[REPLICATION_MAX_DATAGRAM];
+    uint32_t waitMs = 0;
+
+    while (1){
+        ReplicationPeer from;
+        int length = service->_socket.receive(buffer, sizeof(buffer), from, waitMs);
+        if (length < 0) vTaskDelay(pdMS_TO_TICKS(1000));
+
+        bool changed = false;
+        if (xSemaphoreTake(service->_nodeMutex, portMAX_DELAY) == pdTRUE) {
+            changed = length > 0 && service->_node->receive(buffer, length, from);
+            waitMs = service->_node->poll(millis());
+            xSemaphoreGive(service->_nodeMutex);
+        }
+        if (changed) service->saveChanges();
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef REPLICATION_SERVICE_H
+#define REPLICATION_SERVICE_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+
+#include "communication/replication/ReplicationNode.h"
+#include "communication/replication/ReplicationSocket.h"
+#include "repository/SDCardModule/SDCardModule.h"
+#include "repository/LeaseModule/LeaseModule.h"
+#include "enum/LockType.h"
+#include "config/Config.h"
+
+#define REPLICATION_PORT                    47800
+#define REPLICATION_STATE_FILE_PATH         "/replication.bin"  // Snapshot of the change log and sequence vector, so a restart resumes them
+#define REPLICATION_STATE_TEMP_FILE_PATH    "/replication.tmp"  // Temporary file path used while storing the snapshot
+#define REPLICATION_JOURNAL_FILE_PATH       "/replication.log"  // Journal of the changes since the snapshot, replayed on top of it
+#define REPLICATION_JOURNAL_MAX_SIZE        16384               // Journal size a new snapshot is stored at, and the journal restarted
+#define REPLICATION_TASK_STACK_SIZE         8192                // Holds a datagram, and the changes are written here
+
+/**
+ * @brief Replicates the key access enrolled or revoked on this controller to the other controllers
+ * of the network over UDP, see `ReplicationNode` for the protocol
+ *
+ * Provisioning several doors costs one enroll on any of them, the others apply it from the gossip.
+ * Added NFC Cards and revoked key access of both types are replicated. An added Fingerprint cannot
+ * be, its template only exists on the sensor it was enrolled on.
+ *
+ * Every change is appended to a journal on the SD Card, and a snapshot of the whole state is only
+ * stored once the journal reaches `REPLICATION_JOURNAL_MAX_SIZE`. Both are written without the node
+ * mutex, so an enroll never waits for the SD Card while the replication task writes.
+ */
+class ReplicationService {
+    public:
+        ReplicationService(SDCardModule *sdCardModule, LeaseModule *leaseModule);
+        bool start();
+
+        void recordAdd(LockType type, const char *keyAccessId, const char *uidCard, const char *visitorId, const char *name);
+        void recordRevoke(LockType type, const char *keyAccessId);
+
+    private:
+        SDCardModule* _sdCardModule;
+        LeaseModule* _leaseModule;
+        ReplicationNode* _node;
+        ReplicationSocket _socket;
+        SemaphoreHandle_t _nodeMutex;
+        SemaphoreHandle_t _journalMutex;    // Held while the changes are taken from the node and written, so they stay in order
+        size_t _journalSize;                // Bytes in the journal file since the last snapshot
+        TaskHandle_t _taskHandle;
+
+        bool applyEntry(const ReplicationEntry &entry);
+        void loadState();
+        void saveChanges();
+
+        static void loop(void *parameter);
+};
+
+#endif
@@ -2,15 +2,17 @@
 #define SYNC_SERVICE_H
 
 #include "repository/SDCardModule/SDCardModule.h"
+#include "repository/UsageStatsModule/UsageStatsModule.h"
 #include "communication/ble/core/BLEModule.h"
 #include <esp_log.h>
 
 class SyncService {
     public:
-        SyncService(SDCardModule *sdCardModule, BLEModule *bleModule);
+        SyncService(SDCardModule *sdCardModule, UsageStatsModule *usageStatsModule, BLEModule *bleModule);
         void sync();
     private:
         SDCardModule* _sdCardModule;
+        UsageStatsModule* _usageStatsModule;
         BLEModule* _bleModule;
 };
 
@@ -2,16 +2,88 @@
 #include "WifiService.h"
 #include <esp_log.h>
 
-WifiService::WifiService(BLEModule* bleModule, OTA *otaModule, SDCardModule *sdCardModule)
-    :_bleModule(bleModule), _otaModule(otaModule), _sdCardModule(sdCardModule) {
+#define KEY_ACCESS_SYNC_FILE_PATH       "/key_access_sync.json" // Validators of the last key access list, kept with the key access files
+#define KEY_ACCESS_BACKUP_TIMEOUT_MS    (60 * 1000) // Time given to a whole backup upload or restore download
+
+/**
+ * @brief Load the validators of the key access list that was applied last from the SD Card
+ *
+ * The validators are stored with the id of the change log, and only used while the store still has it.
+ * Any bulk change of the store, a swapped SD Card or an emptied key access file starts a new log, so
+ * the next pull then gets the whole list instead of a 304.
+ *
+ * @param validators Filled with the stored validators, empty if there are none or the store changed
+ * @param logId The id of the change log of the key access files, see `SDCardModule::getChangeLogInfo`
+ */
+static void loadKeyAccessValidators(HttpCacheValidators &validators, uint32_t logId){
+    validators = HttpCacheValidators();
+
+    File file = SD.open(KEY_ACCESS_SYNC_FILE_PATH, FILE_READ);
+    if (!file) return;
+
+    JsonDocument document;
+    DeserializationError error = deserializeJson(document, file);
+    file.close();
+    if (error || logId == 0 || document["log"] != logId) return;
+
+    snprintf(validators.etag, sizeof(validators.etag), "%s", document["etag"] | "");
+    snprintf(validators.lastModified, sizeof(validators.lastModified), "%s", document["modified"] | "");
+}
+
+/**
+ * @brief Store the validators of the key access list that was just applied on the SD Card
+ *
+ * @param validators The validators of the response
+ * @param logId The id of the change log once the list is applied
+ */
+static void saveKeyAccessValidators(const HttpCacheValidators &validators, uint32_t logId){
+    JsonDocument document;
+    document["log"] = logId;
+    document["etag"] = validators.etag;
+    document["modified"] = validators.lastModified;
+
+    File file = SD.open(KEY_ACCESS_SYNC_FILE_PATH, FILE_WRITE);
+    bool stored = false;
+    if (file) {
+        stored = serializeJson(document, file) > 0;
+        file.close();
+    }
+
+    if (!stored) ESP_LOGW(WIFI_SERVICE_LOG_TAG, "Failed to store the key access list validators");
+}
+
+WifiService::WifiService(BLEModule* bleModule, OTA *otaModule, SDCardModule *sdCardModule, OutboxModule *outboxModule, LeaseModule *leaseModule, BackupModule *backupModule)
+    :_bleModule(bleModule), _otaModule(otaModule), _sdCardModule(sdCardModule), _outboxModule(outboxModule), _leaseModule(leaseModule), _backupModule(backupModule) {
     // Create new object of Wifi for the Wifi Tasks
     _wifi = new Wifi();
+    _httpEngine = new HttpRequestEngine(_wifi);
+    _mqtt = new MqttClient();
+    _chunkedOTA = new ChunkedOTA();
+
+    // Shared with the BLE OTA Service, every kind of update writes the same inactive partition
+    _firmwareMutex = firmwareUpdateMutex();
+    if (_firmwareMutex == NULL) ESP_LOGE(WIFI_SERVICE_LOG_TAG, "Failed to create firmware update mutex.");
+
+    _keyAccessMessages = xQueueCreate(KEY_ACCESS_MESSAGE_QUEUE_SIZE, sizeof(KeyAccessMessage));
+    if (_keyAccessMessages == NULL) ESP_LOGE(WIFI_SERVICE_LOG_TAG, "Failed to create key access message queue.");
 }
 
 bool WifiService::setup() {
     ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Start initializing the WiFi!");
     // Start the Wifi manager from the Wifi Service instead
     _wifi->init();
+
+    // The server requests are sent from the HTTP engine task, so the Wifi Task never wait on the server
+    _httpEngine->startTask();
+
+    // Key access changes are pushed by the server as they happen, instead of waiting for the next pull
+#if defined(MQTT_BROKER_URL) && defined(MQTT_USERNAME) && defined(MQTT_PASSWORD)
+    _mqtt->start(MQTT_BROKER_URL, MQTT_USERNAME, MQTT_PASSWORD, "door-" VIN, MQTT_KEY_ACCESS_TOPIC, [this](const char *topic, const char *data, size_t length) {
+        handleKeyAccessMessage(data, length);
+    });
+#else
+    ESP_LOGW(WIFI_SERVICE_LOG_TAG, "No MQTT broker and login configured, the key access only change with the pull");
+#endif
     return true;
 }
 
@@ -26,200 +98,463 @@ bool WifiService::isConnected() {
     return _wifi->isConnected();
 }
 
-bool WifiService::reconnect(){
-    ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Attempting to reconnect to WiFi...");
-    return _wifi->reconnect();
+/**
+ * @brief Set the function that wakes up the job keeping the WiFi connected, it is called on every WiFi event
+ *
+ * @param watcher Wakes up the job running `maintainConnection`
+ */
+void WifiService::watchConnection(std::function<void()> watcher){
+    _wifi->watchConnection(watcher);
 }
 
 /**
- * @brief Sends request for adding new NFC access data to the backend server via HTTP POST.
- *   
- * @param nfcrequest The NFC request data, including VIN and username.
- * @return NFCQueueResponse The NFC response
+ * @brief Run one step of the background WiFi reconnect, see `Wifi::maintainConnection`
+ *
+ * The requests queued before the link was lost are cancelled, they would only run into their deadline.
+ *
+ * @return The time in ms until the next step, 0 if there is nothing to do until the next WiFi event
  */
-NFCQueueResponse WifiService::addNFCToServer(NFCQueueRequest nfcrequest){
-    ESP_LOGI(WIFI_SERVICE_LOG_TAG, 
-        "Sending request for Adding new NFC data to the server. Username : %s VIN %s", nfcrequest.username, nfcrequest.vehicleInformationNumber);
-    
-    // For now url will be stored here first
-    std::string url = "http://203.100.57.59:3000/api/v1/user-vehicle/visitor";
+uint32_t WifiService::maintainConnection(){
+    bool linkLost = false;
+    uint32_t delayMs = _wifi->maintainConnection(linkLost);
 
-    // Prepare the document payload
-    JsonDocument document;
-    document["visitor_name"] = nfcrequest.username;
-    document["vin"] = nfcrequest.vehicleInformationNumber;
-    document["type"] = "RFID";
+    if (linkLost) _httpEngine->cancelAll();
+    return delayMs;
+}
 
-    // Serialize the json into c-string
-    std::string payload;
-    serializeJson(document, payload);
-    
-    // Send the request to the server
-    std::string response = _wifi->sendPostRequest(url, payload);
+/**
+ * @brief Open the WiFiManager config portal to change the WiFi, on an explicit request only
+ *
+ */
+void WifiService::openConfigPortal(){
+    ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Opening the WiFi config portal.");
+    _wifi->requestConfigPortal();
+}
 
-    // Prepare the return statement
-    NFCQueueResponse nfcResponse;
-    nfcResponse.request_id = nfcrequest.request_id;
-    snprintf(nfcResponse.response, sizeof(nfcResponse.response), "%s", response.c_str());
+/**
+ * @brief Set the function that wakes up the job closing the idle connections, it is called when a connection is kept open
+ *
+ * @param watcher Wakes up the job running `closeIdleConnections`
+ */
+void WifiService::watchIdleConnections(std::function<void()> watcher){
+    _wifi->watchIdleConnections(watcher);
+}
 
-    return nfcResponse;
+/**
+ * @brief Close the keep-alive connections to the server that have been idle for too long
+ *
+ * @return The time in ms until the next kept connection is idle for too long, 0 if none is kept open
+ */
+uint32_t WifiService::closeIdleConnections(){
+    return _wifi->closeIdleConnections();
 }
 
 /**
  * @brief Sends request for delete  NFC access data to the backend server via HTTP DELETE.
  *  
  * @param nfcrequest The NFC request data, including VIN and username.
- * @return NFCQueueResponse The NFC response
+ * @param callback Called from the HTTP engine task with the response, matched by `request_id`
+ * @return `true` if the request is queued to the HTTP engine, `false` otherwise.
  */
-NFCQueueResponse WifiService::deleteNFCFromServer(NFCQueueRequest nfcrequest){
+bool WifiService::deleteNFCFromServer(const QueueRequest &nfcrequest, HttpCallback callback){
     ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Sending request for deleting NFC data to the server. Key Access ID : %s", nfcrequest.keyAccessId);
     
-    // For now url will be stored here first
-    std::string url = "http://203.100.57.59:3000/api/v1/user-vehicle/visitor/" + std::string(nfcrequest.keyAccessId);
-    
-    // Send the request to the server
-    std::string response = _wifi->sendDeleteRequest(url);
-    
-    // Prepare the return statement
-    NFCQueueResponse nfcResponse;
-    nfcResponse.request_id = nfcrequest.request_id;
-    snprintf(nfcResponse.response, sizeof(nfcResponse.response), "%s", response.c_str());
+    std::string url = std::string(BACKEND_URL) + "/user-vehicle/visitor/" + std::string(nfcrequest.keyAccessId);
     
-    return nfcResponse;
+    // Queue the request to the server, the response is passed to the callback
+    return _httpEngine->submit(nfcrequest.request_id, "DELETE", url, JsonDocument(), QUEUE_RESPONSE_TIMEOUT_MS, callback);
 }
 
 /**
- * @brief Sends request for updating/adding new NFC access history the backend server via HTTP POST.
+ * @brief Sends request for delete Fingerprint access data to the backend server via HTTP DELETE.
  *  
- * @param nfcrequest The NFC request data, including VIN and username.
- * @return NFCQueueResponse The NFC response
+ * @param fingerprintRequest The Fingerprint request data, including VIN and username.
+ * @param callback Called from the HTTP engine task with the response, matched by `request_id`
+ * @return `true` if the request is queued to the HTTP engine, `false` otherwise.
  */
-NFCQueueResponse WifiService::authenticateAccessNFCToServer(NFCQueueRequest nfcrequest){
-    ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Sending request for addding history NFC data access to the server. Visitor ID %s", nfcrequest.keyAccessId);
+bool WifiService::deleteFingerprintFromServer(const QueueRequest &fingerprintRequest, HttpCallback callback){
+    ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Sending request for deleting Fingerprint data to the server");
 
-    // For now url will be stored here first
-    std::string url = "http://203.100.57.59:3000/api/v1/user-vehicle/visitor/activity";
+    std::string url = std::string(BACKEND_URL) + "/user-vehicle/visitor/" + std::string(fingerprintRequest.keyAccessId);
 
-    // Prepare the document payload
-    JsonDocument document;
-    document["key_access_id"] = nfcrequest.keyAccessId;
+    // Queue the request to the server, the response is passed to the callback
+    return _httpEngine->submit(fingerprintRequest.request_id, "DELETE", url, JsonDocument(), QUEUE_RESPONSE_TIMEOUT_MS, callback);
+}
+
+/**
+ * @brief Pull the key access list of the vehicle from the backend server and apply it to the SD Card.
+ *
+ * The request is a conditional GET with the ETag and Last-Modified of the list that was applied last,
+ * so an unchanged list costs only an empty 304 response. A changed list is read straight from the
+ * socket one key access at a time and applied in one batch, its validators are only stored once it is
+ * applied. The validators are kept on the SD Card with the id of the change log, so a swapped or
+ * emptied store pulls the whole list.
+ *
+ * @return `true` if the list is unchanged or was applied, `false` otherwise.
+ */
+bool WifiService::pullKeyAccessList(){
+    if (!_wifi->isConnected()) {
+        ESP_LOGW(WIFI_SERVICE_LOG_TAG, "Device is not connected to WiFi/Internet, cannot pull the key access list");
+        return false;
+    }
+
+    // The restore replaces the key access files, the list is pulled on top of it
+    if (_backupModule->isRestorePending()) {
+        ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Key access are not restored yet, skipping the pull");
+        return false;
+    }
+
+    std::string url = std::string(BACKEND_URL) + "/user-vehicle/vehicle/" + VIN + "/key-access";
+
+    uint32_t logId;
+    size_t logSize;
+    _sdCardModule->getChangeLogInfo(logId, logSize);
+
+    HttpCacheValidators validators;
+    loadKeyAccessValidators(validators, logId);
+
+    // Key access enrolled while the list is downloaded are not in the list yet
+    uint32_t revision = _sdCardModule->getRevision();
 
-    // Serialize the json into c-string
-    std::string payload;
-    serializeJson(document, payload);
+    // The key access deleted on the device stay deleted until the server got their delete
+    std::vector<std::string> pendingDeletes;
+    _outboxModule->getPendingDeletes(pendingDeletes);
 
-    // Send the requesrt to the server
-    std::string response = _wifi->sendPostRequest(url, payload);
+    // The list is applied while it is read from the socket, one key access at a time
+    bool applied = false;
+    int added = 0;
+    int removed = 0;
+    int statusCode = _wifi->sendConditionalGet(url.c_str(), validators, [&](Stream &body) {
+        applied = _sdCardModule->applyKeyAccessList(body, pendingDeletes, revision, added, removed);
+    });
 
-    // Prepare the return statement
-    NFCQueueResponse nfcResponse;
-    nfcResponse.request_id = nfcrequest.request_id;
-    snprintf(nfcResponse.response, sizeof(nfcResponse.response), "%s", response.c_str());
+    if (statusCode == HTTP_CODE_NOT_MODIFIED) {
+        ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Key access list is unchanged");
+        return true;
+    }
+    if (statusCode != HTTP_CODE_OK) {
+        ESP_LOGE(WIFI_SERVICE_LOG_TAG, "Failed to pull the key access list, status %d", statusCode);
+        return false;
+    }
+    if (!applied) {
+        ESP_LOGW(WIFI_SERVICE_LOG_TAG, "Key access list is not applied, it is pulled again on the next sync");
+        return false;
+    }
 
-    return nfcResponse;
+    _sdCardModule->getChangeLogInfo(logId, logSize);
+    saveKeyAccessValidators(validators, logId);
+    ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Key access list applied, %d added, %d removed", added, removed);
+
+    // The added key access have no lease yet
+    if (added > 0) _leaseModule->requestRefresh();
+    return true;
 }
 
 /**
- * @brief Sends request for adding new Fingerprint access data to the backend server via HTTP POST.
- *  
- * @param nfcrequest The Fingerprint request data, including VIN and username.
- * @return FingerprintQueueResponse The Fingerprint response
+ * @brief Set the function that wakes up the job renewing the key access leases, it is called when a lease has to be revalidated
+ *
+ * @param revalidator Wakes up the job running `refreshLeases`
  */
-FingerprintQueueResponse WifiService::addFingerprintToServer(FingerprintQueueRequest fingerprintRequest){
-    ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Sending request for adding new Fingerprint data to the server");
-    
-    // For now url will be stored here first
-    std::string url = "http://203.100.57.59:3000/api/v1/user-vehicle/visitor";
+void WifiService::watchLeases(std::function<void()> revalidator){
+    _leaseModule->setRevalidationJob(revalidator);
+}
 
-    // Prepare the document payload
-    JsonDocument document;
-    document["vin"] = fingerprintRequest.vehicleInformationNumber;
-    document["visitor_name"] = fingerprintRequest.username;
-    document["type"] = "Fingerprint";
+/**
+ * @brief Renew the leases of every key access of the vehicle in a single request to the backend server.
+ *
+ * The response is `{"data": [{"key_access_id", "expires_in"}]}` with the seconds until each lease
+ * expires, a key access that is not in it is revoked. While the server cannot be reached the leases
+ * keep their expiry, and the offline grace period of `LeaseModule` starts once they expire.
+ *
+ * @return The time in ms until the next refresh is due
+ */
+uint32_t WifiService::refreshLeases(){
+    if (!_wifi->isConnected()) {
+        ESP_LOGW(WIFI_SERVICE_LOG_TAG, "Device is not connected to WiFi/Internet, cannot refresh the key access leases");
+        _leaseModule->refreshFailed();
+        return _leaseModule->nextRefreshDelayMs();
+    }
 
-    // Serialize the json into c-string
-    std::string payload;
-    serializeJson(document, payload);
-    
-    // Send the request to the server
-    std::string response = _wifi->sendPostRequest(url, payload);
+    std::string url = std::string(BACKEND_URL) + "/user-vehicle/vehicle/" + VIN + "/key-access/leases";
 
-    // Prepare the return statement
-    FingerprintQueueResponse fingerprintResponse;
-    fingerprintResponse.request_id = fingerprintRequest.request_id;
-    snprintf(fingerprintResponse.response, sizeof(fingerprintResponse.response), "%s", response.c_str());
+    // The grants and revokes made while the request is in flight are merged into its answer
+    _leaseModule->beginRefresh();
 
-    return fingerprintResponse;
+    // The leases change on every refresh, so the request carries no validators
+    HttpCacheValidators validators;
+    bool renewed = false;
+    int statusCode = _wifi->sendConditionalGet(url.c_str(), validators, [&](Stream &body) {
+        renewed = _leaseModule->renew(body);
+    });
+
+    if (statusCode != HTTP_CODE_OK || !renewed) {
+        ESP_LOGE(WIFI_SERVICE_LOG_TAG, "Failed to refresh the key access leases, status %d", statusCode);
+        _leaseModule->refreshFailed();
+    }
+    return _leaseModule->nextRefreshDelayMs();
 }
 
 /**
- * @brief Sends request for delete Fingerprint access data to the backend server via HTTP DELETE.
- *  
- * @param fingerprintRequest The Fingerprint request data, including VIN and username.
- * @return FingerprintQueueRequest The Fingerprint response
+ * @brief Send the next backup of the key access store to the backend server.
+ *
+ * The backup is compressed from the SD Card straight into a chunked request, see `BackupModule`. The
+ * server answers 409 when it does not have the backup an incremental backup builds on, the next
+ * backup is then a full one.
+ *
+ * @return `true` if the backup was accepted or there was nothing to back up, `false` to retry it.
  */
-FingerprintQueueResponse WifiService::deleteFingerprintFromServer(FingerprintQueueRequest fingerprintRequest){
-    ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Sending request for deleting Fingerprint data to the server");
+bool WifiService::backupKeyAccess(){
+    if (!_wifi->isConnected()) {
+        ESP_LOGW(WIFI_SERVICE_LOG_TAG, "Device is not connected to WiFi/Internet, cannot back up the key access");
+        return false;
+    }
 
-    // For now url will be stored here first
-    std::string url = "http://203.100.57.59:3000/api/v1/user-vehicle/visitor/" + std::string(fingerprintRequest.keyAccessId);
+    // An empty store would replace the backup it should be restored from
+    if (_backupModule->isRestorePending()) {
+        ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Key access are not restored yet, skipping the backup");
+        return false;
+    }
 
-    // Send the request to the server
-    std::string response = _wifi->sendDeleteRequest(url);
+    BackupPlan plan;
+    if (!_backupModule->plan(plan)) {
+        ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Key access are unchanged since the last backup");
+        return true;
+    }
 
-    // Prepare the return statement
-    FingerprintQueueResponse fingerprintResponse;
-    fingerprintResponse.request_id = fingerprintRequest.request_id;
-    snprintf(fingerprintResponse.response, sizeof(fingerprintResponse.response), "%s", response.c_str());
+    std::string url = std::string(BACKEND_URL) + "/user-vehicle/vehicle/" + VIN + "/key-access/backup?mode="
+        + (plan.mode == BACKUP_FULL ? "full" : "incremental") + "&sequence=" + std::to_string(plan.sequence) + "&base=" + std::to_string(plan.base);
 
-    return fingerprintResponse;
+    char responseData[128];
+    HttpResponseBuffer response = { responseData, sizeof(responseData), 0, 0, false };
+    int statusCode = _wifi->sendStreamedRequest("POST", url.c_str(), "application/x-ndjson", "deflate",
+        [this, &plan](const HttpChunkWriter &write) { return _backupModule->writeSnapshot(plan, write); },
+        response, KEY_ACCESS_BACKUP_TIMEOUT_MS);
+
+    if (statusCode == HTTP_CODE_CONFLICT) {
+        ESP_LOGW(WIFI_SERVICE_LOG_TAG, "Server does not have backup %lu, sending a full backup next", (unsigned long)plan.base);
+        _backupModule->requireFull();
+        return false;
+    }
+    if (statusCode < 200 || statusCode >= 300) {
+        ESP_LOGE(WIFI_SERVICE_LOG_TAG, "Failed to back up the key access, status %d", statusCode);
+        return false;
+    }
+
+    _backupModule->commit(plan);
+    return true;
 }
 
 /**
- * @brief Sends request for updating/adding new Fingerprint access history the backend server via HTTP POST.  
+ * @brief Restore the key access store from the last backup on the backend server, only while it needs one.
  *
- * @param fingerprintRequest The Fingerprint request data, including VIN and username.
- * @return FingerprintQueueRequest The Fingerprint response
+ * The backup is downloaded to the SD Card first and only applied once it is complete and checked, the
+ * connection is released before it is applied. A server without a backup for the vehicle answers 404.
+ *
+ * @return `true` if the store is restored or does not need a restore, `false` to retry it.
+ */
+bool WifiService::restoreKeyAccess(){
+    if (!_backupModule->isRestorePending()) return true;
+
+    if (!_wifi->isConnected()) {
+        ESP_LOGW(WIFI_SERVICE_LOG_TAG, "Device is not connected to WiFi/Internet, cannot restore the key access");
+        return false;
+    }
+
+    std::string url = std::string(BACKEND_URL) + "/user-vehicle/vehicle/" + VIN + "/key-access/backup";
+
+    // The backup changes with every upload, so the request carries no validators
+    HttpCacheValidators validators = {};
+    bool received = false;
+    int statusCode = _wifi->sendConditionalGet(url.c_str(), validators, [&](Stream &body) {
+        received = _backupModule->receiveRestore(body);
+    }, KEY_ACCESS_BACKUP_TIMEOUT_MS);
+
+    if (statusCode == HTTP_CODE_NOT_FOUND) {
+        ESP_LOGI(WIFI_SERVICE_LOG_TAG, "There is no backup of the key access to restore");
+        _backupModule->requireFull();
+        return true;
+    }
+    if (statusCode != HTTP_CODE_OK || !received) {
+        ESP_LOGE(WIFI_SERVICE_LOG_TAG, "Failed to download the key access backup, status %d", statusCode);
+        return false;
+    }
+
+    return _backupModule->applyRestore();
+}
+
+/**
+ * @brief Set the function that wakes up the job applying the key access messages, called for every queued message
+ *
+ * @param watcher Wakes up the job running `applyKeyAccessMessages`, called from the MQTT task
  */
-FingerprintQueueResponse WifiService::authenticateAccessFingerprintToServer(FingerprintQueueRequest fingerprintRequest){
-    ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Sending request for addding history Fingerprint data access to the server");
+void WifiService::watchKeyAccessMessages(std::function<void()> watcher){
+    _keyAccessMessageWatcher = watcher;
+}
+
+/**
+ * @brief Check a key access change pushed by the server on the MQTT connection, and queue it for the SD Card.
+ *
+ * The message is a json object with `action` (`add` or `revoke`), `type` (`RFID` or `Fingerprint`),
+ * `key_access_id`, and for an added NFC Card `nfc_uid`, `visitor_id` and `visitor_name`. Runs on the MQTT
+ * task, which never writes the SD Card itself, the change is applied by `applyKeyAccessMessages`.
+ * Fingerprints can only be revoked, their template has to be enrolled on the sensor.
+ *
+ * @param data The message
+ * @param length The length of the message
+ */
+void WifiService::handleKeyAccessMessage(const char *data, size_t length){
+    JsonDocument document;
+    DeserializationError error = deserializeJson(document, data, length);
+    if (error) {
+        ESP_LOGE(WIFI_SERVICE_LOG_TAG, "Failed to deserialize the key access message: %s", error.c_str());
+        return;
+    }
+
+    const char *action = document["action"];
+    const char *type = document["type"];
+    const char *keyAccessId = document["key_access_id"];
+    if (action == nullptr || type == nullptr || keyAccessId == nullptr || strlen(keyAccessId) >= sizeof(KeyAccessMessage::keyAccessId)) {
+        ESP_LOGE(WIFI_SERVICE_LOG_TAG, "Invalid key access message");
+        return;
+    }
+    ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Key access message, action %s, type %s, Key Access ID %s", action, type, keyAccessId);
+
+    KeyAccessMessage message = {};
+    message.revoke = strcmp(action, "revoke") == 0;
+    message.type = strcmp(type, "RFID") == 0 ? LockType::RFID : LockType::FINGERPRINT;
+    strcpy(message.keyAccessId, keyAccessId);
+
+    if (!message.revoke) {
+        const char *uidCard = document["nfc_uid"];
+        const char *visitorId = document["visitor_id"];
+        const char *name = document["visitor_name"];
+        if (strcmp(action, "add") != 0 || message.type != LockType::RFID) {
+            ESP_LOGW(WIFI_SERVICE_LOG_TAG, "Key access message is not supported, action %s, type %s", action, type);
+            return;
+        }
+        if (uidCard == nullptr || visitorId == nullptr || name == nullptr || strlen(uidCard) >= sizeof(message.uidCard)
+            || strlen(visitorId) >= sizeof(message.visitorId) || strlen(name) >= sizeof(message.name)) {
+            ESP_LOGE(WIFI_SERVICE_LOG_TAG, "Invalid key access message, the NFC Card is incomplete");
+            return;
+        }
+        strcpy(message.uidCard, uidCard);
+        strcpy(message.visitorId, visitorId);
+        strcpy(message.name, name);
+    }
 
-    // For now url will be stored here first
-    std::string url = "http://203.100.57.59:3000/api/v1/user-vehicle/visitor/activity";
+    // A change that does not fit is not lost for good, the next pull of the key access list applies it
+    if (xQueueSend(_keyAccessMessages, &message, 0) != pdTRUE) {
+        ESP_LOGW(WIFI_SERVICE_LOG_TAG, "Key access message queue is full, Key Access ID %s is left to the next pull", keyAccessId);
+        return;
+    }
+    if (_keyAccessMessageWatcher) _keyAccessMessageWatcher();
+}
+
+/**
+ * @brief Apply the queued key access changes from MQTT to the SD Card, on the same worker as the pull.
+ *
+ * A revoked key access is removed from the SD Card right away, so it stops working before the next pull.
+ */
+void WifiService::applyKeyAccessMessages(){
+    KeyAccessMessage message;
+    while (xQueueReceive(_keyAccessMessages, &message, 0) == pdTRUE) {
+        if (message.revoke) {
+            _leaseModule->revoke(message.keyAccessId);
+            if (message.type == LockType::RFID) _sdCardModule->deleteNFCFromSDCard(message.keyAccessId);
+            else _sdCardModule->deleteFingerprintFromSDCard(message.keyAccessId);
+        } else if (_sdCardModule->saveNFCToSDCard(message.name, message.uidCard, message.visitorId, message.keyAccessId)) {
+            _leaseModule->grant(message.keyAccessId);
+        }
+    }
+}
+
+/**
+ * @brief Sends a batch of outbox events to the backend server in a single message.
+ *
+ * Access events are stored in the access history and delete events remove the Key Access from
+ * the backend. Every event carries its outbox sequence, so a batch that is sent again after a
+ * lost response can be deduplicated by the backend. The batch is published on the MQTT connection
+ * while it is up, with an HTTP POST otherwise.
+ *
+ * @param requestId The id to match the response with the upload
+ * @param events The outbox events to send, in sequence order
+ * @param count The number of events
+ * @param deadlineMs The time from now the upload has to be done in
+ * @param callback Called from the HTTP engine or MQTT task with the response, status 200 once the broker got the batch
+ * @return `true` if the batch is sent or queued to the HTTP engine, `false` otherwise.
+ */
+bool WifiService::uploadOutboxEvents(int requestId, const OutboxEvent *events, size_t count, uint32_t deadlineMs, HttpCallback callback){
+    ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Sending batch of %d outbox events to the server, sequence %lu to %lu",
+        count, (unsigned long)events[0].sequence, (unsigned long)events[count - 1].sequence);
+
+    std::string url = std::string(BACKEND_URL) + "/user-vehicle/visitor/activity/batch";
 
     // Prepare the document payload
     JsonDocument document;
-    document["key_access_id"] = fingerprintRequest.keyAccessId;
+    document["vin"] = VIN;
+    JsonArray data = document["events"].to<JsonArray>();
+    for (size_t i = 0; i < count; i++) {
+        JsonObject event = data.add<JsonObject>();
+        event["sequence"] = events[i].sequence;
+        event["action"] = events[i].action == OUTBOX_DELETE ? "delete" : "access";
+        event["type"] = events[i].type == LockType::RFID ? "RFID" : "Fingerprint";
+        event["key_access_id"] = events[i].keyAccessId;
+        event["timestamp"] = events[i].timestamp;
+        if (events[i].uidCard[0] != '\0') event["nfc_uid"] = events[i].uidCard;
+        if (events[i].fingerprintId > 0) event["fingerprint_id"] = events[i].fingerprintId;
+    }
 
-    // Serialize the json into c-string
-    std::string payload;
-    serializeJson(document, payload);
-    
-    // Send the requesrt to the server
-    std::string response = _wifi->sendPostRequest(url, payload);
+    if (_mqtt->isConnected()) {
+        std::string message;
+        serializeJson(document, message);
+
+        int messageId = _mqtt->publishTracked(MQTT_EVENTS_TOPIC, message.c_str(), message.length(), [requestId, callback](int messageId) {
+            HttpResult result = {requestId, HTTP_CODE_OK, "", 0, 0, false};
+            callback(result);
+        });
+        if (messageId >= 0) return true;
+        ESP_LOGW(WIFI_SERVICE_LOG_TAG, "Failed to publish the outbox events, sending them with HTTP");
+    }
 
-    // Prepare the return statement
-    FingerprintQueueResponse fingerprintResponse;
-    fingerprintResponse.request_id = fingerprintRequest.request_id;
-    snprintf(fingerprintResponse.response, sizeof(fingerprintResponse.response), "%s", response.c_str());
+    // Queue the request to the server, the document is only serialized when the request is sent
+    return _httpEngine->submit(requestId, "POST", url, std::move(document), deadlineMs, callback);
+}
 
-    return fingerprintResponse;
+/**
+ * @brief Cancel a request queued to the HTTP engine, its callback will not be called anymore
+ *
+ * @param requestId The id of the request
+ * @return `true` if the request was still in flight, `false` otherwise.
+ */
+bool WifiService::cancelRequest(int requestId){
+    return _httpEngine->cancel(requestId);
+}
+
+/**
+ * @brief Cancel every request queued to the HTTP engine, e.g. after the WiFi connection was lost
+ *
+ */
+void WifiService::cancelAllRequests(){
+    _httpEngine->cancelAll();
 }
 
 /**
  * @brief Start the configuration of the OTA Service such as the callback for each OTA progress
  * and starts the ArduinoOTA service
- *   
+ *
+ * Does not wait for the WiFi, the caller tries again on the next connection.
+ *
+ * @return `true` if the OTA Service has begun, `false` if the device is not connected yet.
  */
-void WifiService::beginOTA(){
-    ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Start initializing the OTA Service!");
-
-    // Ensure first that devices is already connected to some WiFi
-    // that came from the WiFi Manager settings
-    while (WiFi.status() != WL_CONNECTED){
-        vTaskDelay(500 / portTICK_PERIOD_MS);
+bool WifiService::beginOTA(){
+    if (!_wifi->isConnected()) {
+        ESP_LOGD(WIFI_SERVICE_LOG_TAG, "Not connected yet, the OTA Service begins on the next connection");
+        return false;
     }
+
+    ESP_LOGI(WIFI_SERVICE_LOG_TAG, "Start initializing the OTA Service!");
     _otaModule->init();
+    return true;
 }
 
 /**
@@ -234,4 +569,68 @@ void WifiService::handleOTA(){
     _otaModule->handleOTA();
 }
 
+/**
+ * @brief Pull the latest firmware from the server and write it into the inactive OTA partition
+ *
+ * An interrupted chunked download is resumed first. Otherwise the signed manifest of the latest firmware
+ * is fetched and the server is asked for the delta patch from `CURRENT_FIRMWARE_VERSION` to it, the patch
+ * has to build the image of the manifest. If there is no usable patch the full image is downloaded in
+ * verified chunks.
+ *
+ * @return `OTA_UPDATED` if the device should be restarted to run the new firmware, see `OTAResult`
+ */
+OTAResult WifiService::updateFirmware(){
+#if !OTA_SIGNED_UPDATES_ENABLED
+    ESP_LOGW(WIFI_SERVICE_LOG_TAG, "Built without OTA_MANIFEST_PUBLIC_KEY, the firmware updates from the server are disabled");
+    return OTA_FAILED;
+#endif
+    if (!_wifi->isConnected()) {
+        ESP_LOGW(WIFI_SERVICE_LOG_TAG, "Device is not connected to WiFi/Internet, cannot check for firmware update");
+        return OTA_FAILED;
+    }
 
+    // Every kind of update writes the same inactive partition
+    if (xSemaphoreTake(_firmwareMutex, 0) != pdTRUE) {
+        ESP_LOGW(WIFI_SERVICE_LOG_TAG, "A firmware update is already running");
+        return OTA_FAILED;
+    }
+
+    std::string manifestUrl = std::string(OTA_SERVER_URL) + "/manifest?vin=" + VIN;
+    std::string imageUrl = std::string(OTA_SERVER_URL) + "/image?vin=" + VIN;
+
+    OTAResult result = OTA_FAILED;
+    if (_chunkedOTA->hasPendingUpdate()) {
+        result = _chunkedOTA->update(manifestUrl.c_str(), imageUrl.c_str(), CURRENT_FIRMWARE_VERSION);
+    } else {
+        // The delta patch is not signed itself, it has to build the image of the signed manifest
+        OTAManifest manifest;
+        manifest.chunkSha256 = nullptr;
+        if (_chunkedOTA->fetchManifest(manifestUrl.c_str(), manifest)) {
+            if (strcmp(manifest.version, CURRENT_FIRMWARE_VERSION) == 0) {
+                result = OTA_UP_TO_DATE;
+            } else {
+                // No patch from the running firmware means the full image is downloaded
+                std::string deltaUrl = std::string(OTA_SERVER_URL) + "/delta?vin=" + VIN + "&from=" + CURRENT_FIRMWARE_VERSION;
+                if (_otaModule->pullDeltaUpdate(deltaUrl.c_str(), manifest.size, manifest.imageSha256) == OTA_UPDATED) result = OTA_UPDATED;
+            }
+        }
+        free(manifest.chunkSha256);
+
+        if (result == OTA_FAILED) {
+            ESP_LOGW(WIFI_SERVICE_LOG_TAG, "No usable delta update, downloading the full firmware in chunks");
+            result = _chunkedOTA->update(manifestUrl.c_str(), imageUrl.c_str(), CURRENT_FIRMWARE_VERSION);
+        }
+    }
+
+    xSemaphoreGive(_firmwareMutex);
+    return result;
+}
+
+/**
+ * @brief Check if a chunked firmware download was interrupted and should be resumed
+ *
+ * @return `true` if there is saved progress of a download, `false` otherwise.
+ */
+bool WifiService::hasPendingFirmwareUpdate(){
+    return OTA_SIGNED_UPDATES_ENABLED && _chunkedOTA->hasPendingUpdate();
+}
@@ -2,39 +2,85 @@
 #define WIFI_SERVICE_H
 
 #include "communication/wifi/Wifi.h"
+#include "communication/wifi/HttpRequestEngine.h"
+#include "communication/wifi/MqttClient.h"
 #include "communication/ble/core/BLEModule.h"
 
 #include "ota/ota.h"
+#include "ota/ChunkedOTA.h"
 
 #include "entity/QueueMessage.h"
 #include "enum/LockType.h"
 
 #include "repository/SDCardModule/SDCardModule.h"
+#include "repository/OutboxModule/OutboxModule.h"
+#include "repository/LeaseModule/LeaseModule.h"
+#include "repository/BackupModule/BackupModule.h"
+#include "config/Config.h"
+#include "versionInfo.h"
+
+#define KEY_ACCESS_MESSAGE_QUEUE_SIZE   8   // Key access messages received on MQTT and not applied to the SD Card yet
+
+/// @brief A key access change received on MQTT, applied to the SD Card by the WiFi jobs worker
+struct KeyAccessMessage {
+    bool revoke;                /* Revoke the key access, otherwise add the NFC Card    */
+    LockType type;              /* The type of the Key Access (RFID or Fingerprint)     */
+    char keyAccessId[40];       /* The Key Access ID                                    */
+    char uidCard[24];           /* The NFC Card UID of an added NFC Card                */
+    char visitorId[40];         /* The Visitor ID of an added NFC Card                  */
+    char name[64];              /* The visitor name of an added NFC Card                */
+};
 
 /// @brief Class that manages WiFi Service to send api requests
 class WifiService {
     public:
-        WifiService(BLEModule *bleModule, OTA *otaModule, SDCardModule *sdCardModule);
+        WifiService(BLEModule *bleModule, OTA *otaModule, SDCardModule *sdCardModule, OutboxModule *outboxModule, LeaseModule *leaseModule, BackupModule *backupModule);
         bool setup();
         bool isConnected();
-        bool reconnect();
+        void watchConnection(std::function<void()> watcher);
+        uint32_t maintainConnection();
+        void openConfigPortal();
+        void watchIdleConnections(std::function<void()> watcher);
+        uint32_t closeIdleConnections();
+
+        bool deleteNFCFromServer(const QueueRequest &nfcRequest, HttpCallback callback);
 
-        NFCQueueResponse addNFCToServer(NFCQueueRequest nfcRequest);
-        NFCQueueResponse deleteNFCFromServer(NFCQueueRequest nfcRequest);
-        NFCQueueResponse authenticateAccessNFCToServer(NFCQueueRequest nfcRequest);
+        bool deleteFingerprintFromServer(const QueueRequest &fingerprintRequest, HttpCallback callback);
 
-        FingerprintQueueResponse addFingerprintToServer(FingerprintQueueRequest fingerprintRequest);
-        FingerprintQueueResponse deleteFingerprintFromServer(FingerprintQueueRequest fingerprintRequest);
-        FingerprintQueueResponse authenticateAccessFingerprintToServer(FingerprintQueueRequest fingerprintRequest);
+        bool pullKeyAccessList();
+        void watchKeyAccessMessages(std::function<void()> watcher);
+        void applyKeyAccessMessages();
+        void watchLeases(std::function<void()> revalidator);
+        uint32_t refreshLeases();
 
-        void beginOTA();
+        bool backupKeyAccess();
+        bool restoreKeyAccess();
+
+        bool uploadOutboxEvents(int requestId, const OutboxEvent *events, size_t count, uint32_t deadlineMs, HttpCallback callback);
+        bool cancelRequest(int requestId);
+        void cancelAllRequests();
+
+        bool beginOTA();
         void handleOTA();
+        OTAResult updateFirmware();
+        bool hasPendingFirmwareUpdate();
 
     private:
         BLEModule* _bleModule;
         OTA* _otaModule;
         SDCardModule* _sdCardModule;
+        OutboxModule* _outboxModule;
+        LeaseModule* _leaseModule;
+        BackupModule* _backupModule;
         Wifi* _wifi;
+        HttpRequestEngine* _httpEngine;
+        MqttClient* _mqtt;
+        ChunkedOTA* _chunkedOTA;
+        SemaphoreHandle_t _firmwareMutex;
+        QueueHandle_t _keyAccessMessages;
+        std::function<void()> _keyAccessMessageWatcher;
+
+        void handleKeyAccessMessage(const char *data, size_t length);
 };
 
 #endif
\ No newline at end of file
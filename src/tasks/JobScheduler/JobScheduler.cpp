@@ -0,0 +1,226 @@
+#include "JobScheduler.h"
+#include <esp_random.h>
+#define JOB_SCHEDULER_LOG_TAG "JOB_SCHEDULER"
+
+JobScheduler::JobScheduler(const char *name, uint32_t stackSize, UBaseType_t priority)
+    : _name(name), _stackSize(stackSize), _priority(priority), _taskHandle(nullptr), _timer(nullptr) {
+    _jobMutex = xSemaphoreCreateMutex();
+    if (_jobMutex == NULL) ESP_LOGE(JOB_SCHEDULER_LOG_TAG, "Failed to create job scheduler mutex.");
+
+    for (Job &job : _jobs) job.active = false;
+}
+
+/**
+ * @brief Create the wake up timer and the worker task, the jobs added before are due from now on
+ *
+ * @return `true` if the worker is started, `false` otherwise.
+ */
+bool JobScheduler::start() {
+    if (_taskHandle != nullptr) return true;
+
+    esp_timer_create_args_t timerArgs = {};
+    timerArgs.callback = onTimer;
+    timerArgs.arg = this;
+    timerArgs.dispatch_method = ESP_TIMER_TASK;
+    timerArgs.name = _name;
+    if (esp_timer_create(&timerArgs, &_timer) != ESP_OK) {
+        ESP_LOGE(JOB_SCHEDULER_LOG_TAG, "Failed to create the wake up timer of %s", _name);
+        return false;
+    }
+
+    xTaskCreate(
+        loop,                       // Function to run in the task
+        _name,                      // Name of the task
+        _stackSize,                 // Stack size (adjustable), shared by every job
+        this,                       // Pass the `this` pointer to the task
+        _priority,                  // Task priority
+        &_taskHandle                // Store the task handle for later control
+    );
+    ESP_LOGI(JOB_SCHEDULER_LOG_TAG, "Job scheduler created successfully: Task Name = %s, Priority = %d", _name, _priority);
+    return _taskHandle != nullptr;
+}
+
+/**
+ * @brief Add a job that decides itself when it runs again
+ *
+ * @param name Name of the job, for the logs
+ * @param priority Order of the jobs that are due at the same time
+ * @param delayMs Delay in ms before the first run, or `JOB_WAIT_FOR_TRIGGER`
+ * @param jitterMs Random delay of up to this many ms added to every run, so many devices do not run it at once
+ * @param function Runs the job and returns the delay in ms until its next run
+ * @return The id of the job to trigger it, -1 if the job table is full.
+ */
+int JobScheduler::addJob(const char *name, JobPriority priority, uint32_t delayMs, uint32_t jitterMs, JobFunction function) {
+    if (xSemaphoreTake(_jobMutex, portMAX_DELAY) != pdTRUE) return -1;
+
+    int jobId = -1;
+    for (int i = 0; i < JOB_SCHEDULER_MAX_JOBS; i++) {
+        if (!_jobs[i].active) {
+            jobId = i;
+            break;
+        }
+    }
+
+    if (jobId >= 0) {
+        Job &job = _jobs[jobId];
+        job.name = name;
+        job.function = function;
+        job.priority = priority;
+        job.jitterMs = jitterMs;
+        job.dueUs = INT64_MAX;
+        job.triggered = false;
+        job.active = true;
+    }
+    xSemaphoreGive(_jobMutex);
+
+    if (jobId < 0) {
+        ESP_LOGE(JOB_SCHEDULER_LOG_TAG, "Job table is full, cannot add job %s", name);
+        return -1;
+    }
+
+    reschedule(jobId, delayMs);
+    wakeWorker();
+    ESP_LOGI(JOB_SCHEDULER_LOG_TAG, "Job %s added with id %d", name, jobId);
+    return jobId;
+}
+
+/**
+ * @brief Add a job that runs every `periodMs`, the first run is right away
+ *
+ */
+int JobScheduler::addPeriodic(const char *name, JobPriority priority, uint32_t periodMs, uint32_t jitterMs, std::function<void()> function) {
+    return addJob(name, priority, 0, jitterMs, [function, periodMs]() {
+        function();
+        return periodMs;
+    });
+}
+
+/**
+ * @brief Add a job that runs once after `delayMs`
+ *
+ */
+int JobScheduler::addOneShot(const char *name, JobPriority priority, uint32_t delayMs, std::function<void()> function) {
+    return addJob(name, priority, delayMs, 0, [function]() {
+        function();
+        return (uint32_t)JOB_STOP;
+    });
+}
+
+/**
+ * @brief Run a job as soon as the worker is free, safe to call from any task but not from an ISR.
+ *
+ * A job triggered while it runs runs once more right after.
+ *
+ * @param jobId The id returned when the job was added
+ */
+void JobScheduler::trigger(int jobId) {
+    if (jobId < 0 || jobId >= JOB_SCHEDULER_MAX_JOBS) return;
+    if (xSemaphoreTake(_jobMutex, portMAX_DELAY) != pdTRUE) return;
+    if (_jobs[jobId].active) _jobs[jobId].triggered = true;
+    xSemaphoreGive(_jobMutex);
+    wakeWorker();
+}
+
+/**
+ * @brief Pick the due job with the highest priority, and the earliest one among the same priority
+ *
+ * @param nextDueUs Set to the time the next job is due when no job is due now
+ * @return The id of the job to run, -1 if no job is due.
+ */
+int JobScheduler::takeDueJob(int64_t &nextDueUs) {
+    nextDueUs = INT64_MAX;
+    if (xSemaphoreTake(_jobMutex, portMAX_DELAY) != pdTRUE) return -1;
+
+    int64_t now = esp_timer_get_time();
+    int jobId = -1;
+    for (int i = 0; i < JOB_SCHEDULER_MAX_JOBS; i++) {
+        Job &job = _jobs[i];
+        if (!job.active) continue;
+
+        if (!job.triggered && job.dueUs > now) {
+            if (job.dueUs < nextDueUs) nextDueUs = job.dueUs;
+            continue;
+        }
+
+        int64_t dueUs = job.triggered ? now : job.dueUs;
+        if (jobId < 0 || job.priority < _jobs[jobId].priority
+            || (job.priority == _jobs[jobId].priority && dueUs < (_jobs[jobId].triggered ? now : _jobs[jobId].dueUs))) {
+            jobId = i;
+        }
+    }
+
+    if (jobId >= 0) {
+        // Until it is rescheduled the job only runs again from a trigger that comes while it runs
+        _jobs[jobId].triggered = false;
+        _jobs[jobId].dueUs = INT64_MAX;
+    }
+    xSemaphoreGive(_jobMutex);
+    return jobId;
+}
+
+/**
+ * @brief Set the next run of a job from the delay it returned
+ *
+ */
+void JobScheduler::reschedule(int jobId, uint32_t delayMs) {
+    if (xSemaphoreTake(_jobMutex, portMAX_DELAY) != pdTRUE) return;
+
+    Job &job = _jobs[jobId];
+    if (delayMs == JOB_STOP) {
+        job.active = false;
+        job.function = nullptr;
+    } else if (job.triggered) {
+        job.dueUs = esp_timer_get_time();
+    } else if (delayMs == JOB_WAIT_FOR_TRIGGER) {
+        job.dueUs = INT64_MAX;
+    } else {
+        uint32_t jitterMs = job.jitterMs > 0 ? esp_random() % (job.jitterMs + 1) : 0;
+        job.dueUs = esp_timer_get_time() + ((int64_t)delayMs + jitterMs) * 1000;
+    }
+    xSemaphoreGive(_jobMutex);
+}
+
+/**
+ * @brief Arm the wake up timer for the next due job, only called from the worker
+ *
+ */
+void JobScheduler::armTimer(int64_t dueUs) {
+    esp_timer_stop(_timer);
+    if (dueUs == INT64_MAX) return;
+
+    int64_t delayUs = dueUs - esp_timer_get_time();
+    esp_timer_start_once(_timer, delayUs > 0 ? delayUs : 1);
+}
+
+void JobScheduler::wakeWorker() {
+    if (_taskHandle != nullptr) xTaskNotifyGive(_taskHandle);
+}
+
+void JobScheduler::onTimer(void *parameter) {
+    ((JobScheduler*)parameter)->wakeWorker();
+}
+
+/**
+ * @brief FreeRTOS loop of the worker, runs the due jobs one at a time and sleeps until the next one.
+ *
+ * @param parameter Pointer to the JobScheduler instance (cast from void*).
+ */
+void JobScheduler::loop(void *parameter) {
+    JobScheduler *scheduler = (JobScheduler*)parameter;
+
+    while (1) {
+        int64_t nextDueUs;
+        int jobId = scheduler->takeDueJob(nextDueUs);
+
+        if (jobId < 0) {
+            // A trigger or a new job between the pick and the wait leaves the notification pending
+            scheduler->armTimer(nextDueUs);
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        ESP_LOGD(JOB_SCHEDULER_LOG_TAG, "Running job %s", scheduler->_jobs[jobId].name);
+        uint32_t delayMs = scheduler->_jobs[jobId].function();
+        scheduler->reschedule(jobId, delayMs);
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef JOB_SCHEDULER_H
+#define JOB_SCHEDULER_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+#include <esp_log.h>
+
+#include <functional>
+
+#define JOB_SCHEDULER_MAX_JOBS  12                  // Jobs kept in the fixed job table
+#define JOB_WAIT_FOR_TRIGGER    UINT32_MAX          // Returned by a job that only runs again once it is triggered
+#define JOB_STOP                (UINT32_MAX - 1)    // Returned by a job that never runs again
+
+/// @brief Priority of a job, the due job with the highest priority runs first
+enum JobPriority : uint8_t {
+    JOB_PRIORITY_HIGH,      /* Latency sensitive jobs, like answering the OTA requests      */
+    JOB_PRIORITY_NORMAL,    /* Connection and sync jobs                                     */
+    JOB_PRIORITY_LOW,       /* Jobs that can wait for the others, like resuming a download  */
+};
+
+/// @brief Runs a job and returns the delay in ms until it runs again, or `JOB_WAIT_FOR_TRIGGER`/`JOB_STOP`
+typedef std::function<uint32_t()> JobFunction;
+
+/// @brief A job of the scheduler table
+struct Job {
+    const char *name;       /* Name of the job, for the logs                                            */
+    JobFunction function;   /* Function run by the worker                                               */
+    JobPriority priority;   /* Order of the jobs that are due at the same time                          */
+    uint32_t jitterMs;      /* Random delay of up to this many ms added to every reschedule             */
+    int64_t dueUs;          /* `esp_timer` time the job is due, `INT64_MAX` while waiting for a trigger */
+    bool triggered;         /* Triggered since it started its last run, it runs again right away        */
+    bool active;            /* The slot holds a job                                                     */
+};
+
+/**
+ * @brief Runs the periodic and one-shot background jobs on a single worker task.
+ *
+ * The worker sleeps until a one-shot `esp_timer` fires for the earliest due job, or until a job is
+ * triggered, so the jobs cost one stack and no polling. The jobs run one at a time, a job that blocks
+ * delays the others, so a long job should rather be split or given a low priority.
+ */
+class JobScheduler {
+    public:
+        JobScheduler(const char *name, uint32_t stackSize, UBaseType_t priority);
+        bool start();
+
+        int addJob(const char *name, JobPriority priority, uint32_t delayMs, uint32_t jitterMs, JobFunction function);
+        int addPeriodic(const char *name, JobPriority priority, uint32_t periodMs, uint32_t jitterMs, std::function<void()> function);
+        int addOneShot(const char *name, JobPriority priority, uint32_t delayMs, std::function<void()> function);
+        void trigger(int jobId);
+
+    private:
+        const char *_name;
+        uint32_t _stackSize;
+        UBaseType_t _priority;
+        TaskHandle_t _taskHandle;
+        SemaphoreHandle_t _jobMutex;
+        esp_timer_handle_t _timer;
+        Job _jobs[JOB_SCHEDULER_MAX_JOBS];
+
+        int takeDueJob(int64_t &nextDueUs);
+        void reschedule(int jobId, uint32_t delayMs);
+        void armTimer(int64_t dueUs);
+        void wakeWorker();
+
+        static void loop(void *parameter);
+        static void onTimer(void *parameter);
+};
+
+#endif
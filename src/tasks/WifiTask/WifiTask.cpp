@@ -1,14 +1,25 @@
 #include "WifiTask.h"
 #define WIFI_TASK_LOG_TAG "WIFI_TASK"
 
-WifiTask::WifiTask(const char* taskName, UBaseType_t priority, WifiService* wifiService, QueueHandle_t nfcQueueRequest, QueueHandle_t nfcQueueResponse, QueueHandle_t fingerprintQueueRequest, QueueHandle_t fingerprintQueueResponse)
-    : _taskName(taskName), _priority(priority), _wifiService(wifiService) {
+WifiTask::WifiTask(const char* taskName, UBaseType_t priority, WifiService* wifiService, OutboxModule *outboxModule, AccessEventRing *nfcAccessEvents, AccessEventRing *fingerprintAccessEvents, SemaphoreHandle_t accessEventSignal, QueueHandle_t nfcQueueRequest, QueueHandle_t fingerprintQueueRequest)
+    : _taskName(taskName), _priority(priority), _jobScheduler("wifiJobs", MIDSIZE_STACK_SIZE, JOB_SCHEDULER_PRIORITY), _outboxJob(-1),
+      _wifiService(wifiService), _outboxModule(outboxModule), _outboxRetryMs(0), _nextOutboxUpload(0), _nextLeaseRefresh(0),
+      _outboxRequestId(0), _outboxStatusCode(0), _outboxDone(false), _outboxLastSequence(0), _outboxDeadline(0) {
         
         // Referencing the queues message
+        _nfcAccessEvents = nfcAccessEvents;
+        _fingerprintAccessEvents = fingerprintAccessEvents;
+        _accessEventSignal = accessEventSignal;
         _nfcQueueRequest = nfcQueueRequest;
-        _nfcQueueResponse = nfcQueueResponse;
         _fingerprintQueueRequest = fingerprintQueueRequest;
-        _fingerprintQueueResponse = fingerprintQueueResponse;
+
+        // A queue can only join a set while it is empty, so the set is made before the services start sending
+        // The access event rings have no queue, their producers give the signal semaphore after every event
+        _requestSet = xQueueCreateSet(uxQueueSpacesAvailable(nfcQueueRequest) + uxQueueSpacesAvailable(fingerprintQueueRequest) + 1);
+        if (_requestSet == NULL || xQueueAddToSet(nfcQueueRequest, _requestSet) != pdPASS || xQueueAddToSet(fingerprintQueueRequest, _requestSet) != pdPASS
+            || xQueueAddToSet(accessEventSignal, _requestSet) != pdPASS) {
+            ESP_LOGE(WIFI_TASK_LOG_TAG, "Failed to create the request queue set.");
+        }
 
         _xWifiSemaphore = xSemaphoreCreateBinary();
         xSemaphoreGive(_xWifiSemaphore);
@@ -72,178 +83,186 @@ bool WifiTask::resumeTask(){
 /**
  * @brief Main FreeRTOS loop for the WifiTask.
  *
- * Initializes the WiFi service and continuously listens for NFC and fingerprint
- * requests from their respective queues.
+ * Initializes the WiFi service, then sleeps until an NFC or fingerprint request arrives on either
+ * queue, or an unlock on either access event ring, and handles it right away. The outbox and the other background work run as scheduler jobs.
  *
  * @param params Pointer to the WifiTask instance (cast from void*).
  */
 void WifiTask::loop(void *params){
     WifiTask* task = (WifiTask*)params;
     
+    // The background jobs of the WiFi share one worker, the WiFi events wake up the reconnect job
+    // Registered before the setup, as the setup already starts the first connection attempt
+    int reconnectJob = task->_jobScheduler.addJob("reconnect", JOB_PRIORITY_NORMAL, 0, 0, [task]() { return task->reconnect(); });
+
+    // Delivers the outbox events, woken up by new events, finished uploads and a new connection
+    task->_outboxJob = task->_jobScheduler.addJob("drainOutbox", JOB_PRIORITY_NORMAL, 0, 0, [task]() { return task->drainOutbox(); });
+
+    // Begins the OTA Service on the first connection, then adds the OTA jobs
+    int otaJob = task->_jobScheduler.addJob("beginOTA", JOB_PRIORITY_HIGH, 0, 0, [task]() { return task->beginOTA(); });
+    task->_wifiService->watchConnection([task, reconnectJob, otaJob]() {
+        task->_jobScheduler.trigger(reconnectJob);
+        task->_jobScheduler.trigger(task->_outboxJob);
+        task->_jobScheduler.trigger(otaJob);
+    });
+
+    // Closes the kept connections once they are idle, woken up when a request keeps one open
+    int idleJob = task->_jobScheduler.addJob("closeIdleConnections", JOB_PRIORITY_LOW, JOB_WAIT_FOR_TRIGGER, 0, [task]() { return task->closeIdleConnections(); });
+    task->_wifiService->watchIdleConnections([task, idleJob]() { task->_jobScheduler.trigger(idleJob); });
+
+#if KEY_ACCESS_LEASE_MODE
+    // Renews the key access leases, woken up early by the expired leases
+    int leaseJob = task->_jobScheduler.addJob("refreshLeases", JOB_PRIORITY_NORMAL, 0, 0, [task]() { return task->refreshLeases(); });
+    task->_wifiService->watchLeases([task, leaseJob]() { task->_jobScheduler.trigger(leaseJob); });
+#endif
+
+    // Applies the key access changes received on MQTT, the MQTT task only queues them
+    int keyAccessMessageJob = task->_jobScheduler.addJob("applyKeyAccessMessages", JOB_PRIORITY_HIGH, JOB_WAIT_FOR_TRIGGER, 0,
+        [task]() { task->_wifiService->applyKeyAccessMessages(); return (uint32_t)JOB_WAIT_FOR_TRIGGER; });
+    task->_wifiService->watchKeyAccessMessages([task, keyAccessMessageJob]() { task->_jobScheduler.trigger(keyAccessMessageJob); });
+
     // Initialize the Wifi operation inside the task
     vTaskDelay(1000 / portTICK_PERIOD_MS); // Give time for system to catch up
     task -> _wifiService -> setup();
 
-    // Spawning job schedule to periodically check wether WiFi is connected or not
-    // If yes, then that means there something wrong with the source
-    // Lets just create new connection
-    xTaskCreate(
-        reconnect,                  // Function to run in the task
-        "reconnect",                // Name of the task
-        MINIMUM_STACK_SIZE,         // Stack size (adjustable), I'll set this to maximum personal config just in case
-        task,                       // Pass the `this` pointer to the task
-        5,                          // Task priority
-        NULL                        // Store the task handle for later control
-    );
-    ESP_LOGI(WIFI_TASK_LOG_TAG, "Wifi Task Job Schedule for checking WiFi Connectivity created successfully: Task Name = %s, Priority = %d", "reconnect", 5);
+    // Keeps the key access on the SD Card in sync with the server
+    int pullJob = task->_jobScheduler.addPeriodic("pullKeyAccess", JOB_PRIORITY_NORMAL, KEY_ACCESS_PULL_INTERVAL_MS, KEY_ACCESS_PULL_JITTER_MS,
+        [task]() { task->_wifiService->pullKeyAccessList(); });
 
-    // Spawning job schedule to periodically check/listen for any OTA updates request from external
-    xTaskCreate(
-        listenOTA,                  // Function to run in the task
-        "listenOTA",                // Name of the task
-        MINIMUM_STACK_SIZE,         // Stack size (adjustable), I'll set this to maximum personal config just in case
-        task,                       // Pass the `this` pointer to the task
-        5,                          // Task priority
-        NULL                        // Store the task handle for later control
-    );
-    ESP_LOGI(WIFI_TASK_LOG_TAG, "Wifi Task Job Schedule for listening OTA updates created successfully: Task Name = %s, Priority = %d", "listenOTA", 5);
+#if KEY_ACCESS_BACKUP_ENABLED
+    // A device with an empty store is restored first, the pull and the backups wait for it, then the
+    // list is pulled on top of the restore and the store is backed up in the background
+    task->_jobScheduler.addJob("restoreKeyAccess", JOB_PRIORITY_NORMAL, 0, 0, [task, pullJob]() {
+        if (!task->_wifiService->restoreKeyAccess()) return (uint32_t)KEY_ACCESS_BACKUP_RETRY_MS;
+        task->_jobScheduler.trigger(pullJob);
+        return (uint32_t)JOB_STOP;
+    });
+    task->_jobScheduler.addJob("backupKeyAccess", JOB_PRIORITY_LOW, KEY_ACCESS_BACKUP_RETRY_MS, KEY_ACCESS_BACKUP_JITTER_MS,
+        [task]() { return task->_wifiService->backupKeyAccess() ? (uint32_t)KEY_ACCESS_BACKUP_INTERVAL_MS : (uint32_t)KEY_ACCESS_BACKUP_RETRY_MS; });
+#endif
+
+    task->_jobScheduler.start();
 
-    // Hold the queues message
-    NFCQueueRequest nfcMessage;
-    FingerprintQueueRequest fingerprintMessage;
+    // Hold the pointer of the queues message, the block goes back to the pool once handled
+    QueueRequest *message;
 
     while(1){
-        ESP_LOGD(WIFI_TASK_LOG_TAG, "Running Routine Wifi Thread | Reading queue for incoming data");
-        
-        // Check wether there's new queue message in every 100ms
-        if (xQueueReceive( task-> _nfcQueueRequest, &nfcMessage, 100) == pdTRUE) {
-            ESP_LOGD(WIFI_TASK_LOG_TAG, "Running Routine Wifi Thread | Reading queue for incoming data");
-            task->handleNFCTask(nfcMessage);
-        }
-        
-        // Check wether there's new queue message in every 100ms
-        if (xQueueReceive( task-> _fingerprintQueueRequest, &fingerprintMessage, 100) == pdTRUE) {
-            ESP_LOGD(WIFI_TASK_LOG_TAG, "Running Routine Wifi Thread | Reading queue for incoming data");
-            task->handleFingerprintTask(fingerprintMessage);
+        // Sleep until either queue has a request or an unlock was signaled, the set tells which one
+        QueueSetMemberHandle_t ready = xQueueSelectFromSet(task->_requestSet, portMAX_DELAY);
+
+        if (ready == task->_accessEventSignal && xSemaphoreTake(task->_accessEventSignal, 0) == pdTRUE) {
+            // One signal may stand for several events of both sensors, so both rings are emptied
+            task->handleAccessEvents(task->_nfcAccessEvents, LockType::RFID);
+            task->handleAccessEvents(task->_fingerprintAccessEvents, LockType::FINGERPRINT);
+        } else if (ready == task->_nfcQueueRequest && xQueueReceive(task->_nfcQueueRequest, &message, 0) == pdTRUE) {
+            ESP_LOGD(WIFI_TASK_LOG_TAG, "Running Routine Wifi Thread | Handling NFC request");
+            task->handleNFCTask(*message);
+            queueRequestPool().release(message);
+        } else if (ready == task->_fingerprintQueueRequest && xQueueReceive(task->_fingerprintQueueRequest, &message, 0) == pdTRUE) {
+            ESP_LOGD(WIFI_TASK_LOG_TAG, "Running Routine Wifi Thread | Handling Fingerprint request");
+            task->handleFingerprintTask(*message);
+            queueRequestPool().release(message);
         }
-        vTaskDelay(100 / portTICK_PERIOD_MS);
     }
 }
 
 /**
- * @brief Scheduler Job FreeRTOS loop for the WifiTask.
+ * @brief Scheduler Job of the WifiTask, keeps the WiFi connected with the saved credentials.
  *
- * Check the WiFi does the WiFi is connected to any, if not then spawn new Config portal to change the
- * connection to others WiFi
+ * Runs again when a WiFi event triggers it or the next reconnect attempt is due, and also opens
+ * the config portal when it was requested.
  *
- * @param params Pointer to the WifiTask instance (cast from void*).
+ * @return The time in ms until the next run, `JOB_WAIT_FOR_TRIGGER` to wait for the next WiFi event
  */
-void WifiTask::reconnect(void *params){
-    WifiTask* task = (WifiTask*)params;
-
-    while (1){
-        // Start reconnecting thread job
-        ESP_LOGI(WIFI_TASK_LOG_TAG, "Start Reconnect Job Schedule!!");
-        bool reconnected = task-> _wifiService->reconnect();
-
-        if(reconnected) ESP_LOGI(WIFI_TASK_LOG_TAG, "Success reconnected!");
-        else ESP_LOGE(WIFI_TASK_LOG_TAG, "Failed to reconnect. Possibly not needed or a timeout");
-        
-        // Will start this job in every 3 minutes to check, it's because the timeout set to 3 minutes for the portal
-        // So adjusting that
-        vTaskDelay(3 * 60 * 1000 / portTICK_PERIOD_MS);
-    }
+uint32_t WifiTask::reconnect(){
+    uint32_t delayMs = _wifiService->maintainConnection();
+    return delayMs == 0 ? JOB_WAIT_FOR_TRIGGER : delayMs;
 }
 
 /**
- * @brief Scheduler Job FreeRTOS loop for the WifiTask OTA Service.
- * Run in loop for listening for any OTA request from external
- *  
- * @param params Pointer to the WifiTask instance (cast from void*).
+ * @brief Scheduler Job of the WifiTask, begins the OTA Service and adds the jobs that listen to the OTA requests.
+ *
+ * Triggered by the WiFi events, it never waits for the connection so the other jobs of the worker keep running.
+ *
+ * @return `JOB_STOP` once the OTA Service has begun, `JOB_WAIT_FOR_TRIGGER` until the device is connected
  */
-void WifiTask::listenOTA(void *params){
-    WifiTask* task = (WifiTask*)params;
-    ESP_LOGI(WIFI_TASK_LOG_TAG, "Start OTA Job Schedule!!");
-
+uint32_t WifiTask::beginOTA(){
     // Start beginning the OTA Service
     ESP_LOGI(WIFI_TASK_LOG_TAG, "Start OTA Service");
-    task->_wifiService->beginOTA();
+    if (!_wifiService->beginOTA()) return JOB_WAIT_FOR_TRIGGER;
 
-    // Checking the heap size after task creation
+    // Checking the heap size after the OTA Service begin
     ESP_LOGI(WIFI_TASK_LOG_TAG, "Heap Size Information After OTA Service Begin!");
     ESP_LOGI(WIFI_TASK_LOG_TAG, "Heap size: %u bytes", ESP.getHeapSize());
     ESP_LOGI(WIFI_TASK_LOG_TAG, "Free heap: %u bytes", ESP.getFreeHeap());
     ESP_LOGI(WIFI_TASK_LOG_TAG, "Minimum free heap ever: %u bytes", ESP.getMinFreeHeap());
 
-    vTaskDelay(50 / portTICK_PERIOD_MS); // Just caution to give enough time for the watchdog to process this OTA beginning
+    _jobScheduler.addPeriodic("listenOTA", JOB_PRIORITY_HIGH, OTA_LISTEN_INTERVAL_MS, 0, [this]() { listenOTA(); });
+    _jobScheduler.addPeriodic("resumeOTA", JOB_PRIORITY_LOW, OTA_RESUME_INTERVAL_MS, 0, [this]() { resumeOTA(); });
+    return JOB_STOP;
+}
 
-    while (1){
-        ESP_LOGD(WIFI_TASK_LOG_TAG, "Start OTA Listening Service");
-        task->_wifiService->handleOTA();
+/**
+ * @brief Scheduler Job of the WifiTask, listens for any OTA request from external
+ *
+ */
+void WifiTask::listenOTA(){
+    ESP_LOGD(WIFI_TASK_LOG_TAG, "Start OTA Listening Service");
+    _wifiService->handleOTA();
+}
+
+/**
+ * @brief Scheduler Job of the WifiTask, continues an interrupted firmware download from its first unverified chunk
+ *
+ */
+void WifiTask::resumeOTA(){
+    if (_wifiService->hasPendingFirmwareUpdate() && _wifiService->updateFirmware() == OTA_UPDATED) {
+        ESP_LOGI(WIFI_TASK_LOG_TAG, "Firmware download resumed and finished, restarting!");
         vTaskDelay(100 / portTICK_PERIOD_MS);
+        esp_restart();
     }
 }
 
+/**
+ * @brief Scheduler Job of the WifiTask, renews the key access leases in bulk when they are due,
+ * or sooner when an unlock found an expired lease and triggered it
+ *
+ * @return The time in ms until the next refresh
+ */
+uint32_t WifiTask::refreshLeases(){
+    // Every tap on an expired lease triggers this job, do not flood the server with them
+    TickType_t now = xTaskGetTickCount();
+    if ((int32_t)(now - _nextLeaseRefresh) < 0) return (_nextLeaseRefresh - now) * portTICK_PERIOD_MS;
+
+    _nextLeaseRefresh = now + pdMS_TO_TICKS(LEASE_REVALIDATE_MIN_MS);
+    return _wifiService->refreshLeases();
+}
+
 /**
  * @brief The handler function when receviving queue from `_nfcQueueRequest` to be send from WiFi Service into back NFC Service
  * 
- * Processes NFC operations based on the request state, such as adding,
- * removing, or authenticating NFC (RFID) tags by communicating with the server.
+ * Processes NFC operations based on the request state, such as removing NFC (RFID) tags
+ * by communicating with the server.
+ * The server request is only queued to the HTTP engine, its response is handled by
+ * `handleDeleteResponse` once it arrives.
  * 
- * @param message NFCQueueRequest message format from the queue
+ * @param message The request the queued pointer refers to, only valid during the call
  */
-void WifiTask::handleNFCTask(NFCQueueRequest message) {
-    ESP_LOGI(WIFI_TASK_LOG_TAG, "Handling NFC task, state: %d", message.state);
-
-    if (message.state == ENROLL_RFID) {
-        ESP_LOGI(WIFI_TASK_LOG_TAG, "Adding NFC (RFID) data to server.");
+void WifiTask::handleNFCTask(const QueueRequest &message) {
+    ESP_LOGI(WIFI_TASK_LOG_TAG, "Handling NFC task, state: %d, request id: %d", message.state, message.request_id);
 
-        if(_wifiService->isConnected()){
-            // Send the data to the server
-            NFCQueueResponse response = _wifiService->addNFCToServer(message);
-            ESP_LOGI(WIFI_TASK_LOG_TAG, "ADD_RFID response received.");
-    
-            // Send the result back to NFCService
-            if (xQueueSend(_nfcQueueResponse, &response, portMAX_DELAY)) {
-                ESP_LOGI(WIFI_TASK_LOG_TAG, "Sent ADD_RFID response back to NFCService.");
-            } else {
-                ESP_LOGE(WIFI_TASK_LOG_TAG, "Failed to send ADD_RFID response back to NFCService.");
-            }
-        }else{
-            ESP_LOGW(WIFI_TASK_LOG_TAG, "Device is not connected to WiFi/Internet, so cannot proceed to do operation");
-        }
-        
-    }
-    
     if (message.state == DELETE_RFID) {
         ESP_LOGI(WIFI_TASK_LOG_TAG, "Removing NFC (RFID) data from server.");
         
-        if(_wifiService->isConnected()){
-            // Send the data to the server
-            NFCQueueResponse response = _wifiService->deleteNFCFromServer(message);
-            
-            ESP_LOGI(WIFI_TASK_LOG_TAG, "REMOVE_RFID response received.");
-            
-            // Send the result back to NFCService
-            if (xQueueSend(_nfcQueueResponse, &response, portMAX_DELAY)) {
-                ESP_LOGI(WIFI_TASK_LOG_TAG, "Sent REMOVE_RFID response back to NFCService.");
-            } else {
-                ESP_LOGE(WIFI_TASK_LOG_TAG, "Failed to send REMOVE_RFID response back to NFCService.");
-            }
-        } else{
-            ESP_LOGW(WIFI_TASK_LOG_TAG, "Device is not connected to WiFi/Internet, so cannot proceed to do operation");
-        }
-    }
-    
-    if (message.state == AUTHENTICATE_RFID) {
-        ESP_LOGI(WIFI_TASK_LOG_TAG, "Authenticating NFC (RFID) access.");
-        
-        if(_wifiService->isConnected()){
-            // Authenticate NFC access
-            _wifiService->authenticateAccessNFCToServer(message);
-            ESP_LOGI(WIFI_TASK_LOG_TAG, "NFC (RFID) access authentication request sent.");    
-        }else{
-            ESP_LOGW(WIFI_TASK_LOG_TAG, "Device is not connected to WiFi/Internet, will hold the data in temporary local history data access");
+        // Keep the cleanup behind the pending events, so the server sees them in order
+        std::string keyAccessId = message.keyAccessId;
+        bool queued = _wifiService->isConnected() && _outboxModule->size() == 0
+            && _wifiService->deleteNFCFromServer(message, [this, keyAccessId](const HttpResult &result) { handleDeleteResponse(LockType::RFID, keyAccessId, result); });
+
+        if (!queued) {
+            ESP_LOGW(WIFI_TASK_LOG_TAG, "Cannot send the REMOVE_RFID request now, storing it in the outbox");
+            if (_outboxModule->pushDelete(LockType::RFID, message.keyAccessId)) _jobScheduler.trigger(_outboxJob);
+            else ESP_LOGE(WIFI_TASK_LOG_TAG, "Failed to store the REMOVE_RFID request %d in the outbox.", message.request_id);
         }
     }
 }
@@ -251,64 +270,161 @@ void WifiTask::handleNFCTask(NFCQueueRequest message) {
 /**
  * @brief The handler function when receviving queue from `_fingerprintQueueRequest` to be send from WiFi Service into back Fingerprint Service
  * 
- * Processes Fingerprint operations based on the request state, such as adding,
- * removing, or authenticating Fingerprint by communicating with the server.
+ * Processes Fingerprint operations based on the request state, such as removing Fingerprint
+ * by communicating with the server.
+ * The server request is only queued to the HTTP engine, its response is handled by
+ * `handleDeleteResponse` once it arrives.
  * 
- * @param message FingerprintQueueRequest message format from the queue
+ * @param message The request the queued pointer refers to, only valid during the call
  */
-void WifiTask::handleFingerprintTask(FingerprintQueueRequest message) {
-    ESP_LOGI(WIFI_TASK_LOG_TAG, "Handling Fingerprint task, state: %d", message.state);
-    
-    if (message.state == ENROLL_FP) {
-        ESP_LOGI(WIFI_TASK_LOG_TAG, "Adding Fingerprint data to server.");
-        
-        
-        if(_wifiService->isConnected()){
-            // Send the data to the server
-            FingerprintQueueResponse response = _wifiService->addFingerprintToServer(message);
-            ESP_LOGI(WIFI_TASK_LOG_TAG, "ADD_FP response received.");
-            
-            // Send the result back to FingerprintService
-            if (xQueueSend(_fingerprintQueueResponse, &response, portMAX_DELAY)) {
-                ESP_LOGI(WIFI_TASK_LOG_TAG, "Sent ADD_FP response back to FingerprintService.");
-            } else {
-                ESP_LOGE(WIFI_TASK_LOG_TAG, "Failed to send ADD_FP response back to FingerprintService.");
-            }
-        }else{
-            ESP_LOGW(WIFI_TASK_LOG_TAG, "Device is not connected to WiFi/Internet, so cannot proceed to do operation");
-        }
-    }
+void WifiTask::handleFingerprintTask(const QueueRequest &message) {
+    ESP_LOGI(WIFI_TASK_LOG_TAG, "Handling Fingerprint task, state: %d, request id: %d", message.state, message.request_id);
     
     if (message.state == DELETE_FP) { 
         ESP_LOGI(WIFI_TASK_LOG_TAG, "Removing Fingerprint data from server.");
         
-        if(_wifiService->isConnected()){
-            // Send the data to the server
-            FingerprintQueueResponse response = _wifiService->deleteFingerprintFromServer(message);
-            
-            ESP_LOGI(WIFI_TASK_LOG_TAG, "REMOVE_FP response received.");
-            
-            // Send the result back to FingerprintService
-            if (xQueueSend(_fingerprintQueueResponse, &response, portMAX_DELAY)) {
-                ESP_LOGI(WIFI_TASK_LOG_TAG, "Sent REMOVE_FP response back to FingerprintService.");
-            } else {
-                ESP_LOGE(WIFI_TASK_LOG_TAG, "Failed to send REMOVE_FP response back to FingerprintService.");
-            }
-        }else{
-            ESP_LOGW(WIFI_TASK_LOG_TAG, "Device is not connected to WiFi/Internet, so cannot proceed to do operation");
+        // Keep the cleanup behind the pending events, so the server sees them in order
+        std::string keyAccessId = message.keyAccessId;
+        bool queued = _wifiService->isConnected() && _outboxModule->size() == 0
+            && _wifiService->deleteFingerprintFromServer(message, [this, keyAccessId](const HttpResult &result) { handleDeleteResponse(LockType::FINGERPRINT, keyAccessId, result); });
+
+        if (!queued) {
+            ESP_LOGW(WIFI_TASK_LOG_TAG, "Cannot send the REMOVE_FP request now, storing it in the outbox");
+            if (_outboxModule->pushDelete(LockType::FINGERPRINT, message.keyAccessId)) _jobScheduler.trigger(_outboxJob);
+            else ESP_LOGE(WIFI_TASK_LOG_TAG, "Failed to store the REMOVE_FP request %d in the outbox.", message.request_id);
         }
     }
-    
-    if (message.state == AUTHENTICATE_FP) {
-        ESP_LOGI(WIFI_TASK_LOG_TAG, "Authenticating Fingerprint access.");
-        
-        if(_wifiService->isConnected()){
-            // Authenticate Fingerprint access
-            _wifiService->authenticateAccessFingerprintToServer(message);
-            ESP_LOGI(WIFI_TASK_LOG_TAG, "Fingerprint access authentication request sent.");
-        }else{
-            ESP_LOGW(WIFI_TASK_LOG_TAG, "Device is not connected to WiFi/Internet, will hold the data in temporary local history data access");
+}
+
+/**
+ * @brief Handle the response of the server to a delete request, called from the HTTP engine task with the `request_id` of the request
+ *
+ * A delete the server did not take is stored in the outbox, so it is sent again behind the pending
+ * events. A key access the server does not know anymore counts as deleted.
+ *
+ * @param type The lock type of the deleted key access
+ * @param keyAccessId The Key Access ID of the deleted key access
+ * @param result The response of the server
+ */
+void WifiTask::handleDeleteResponse(LockType type, const std::string &keyAccessId, const HttpResult &result) {
+    if ((result.statusCode >= 200 && result.statusCode < 300) || result.statusCode == 404) {
+        ESP_LOGI(WIFI_TASK_LOG_TAG, "Request %d deleted Key Access ID %s from the server, status %d.", result.requestId, keyAccessId.c_str(), result.statusCode);
+        return;
+    }
+
+    ESP_LOGW(WIFI_TASK_LOG_TAG, "Request %d failed to delete Key Access ID %s from the server, status %d, storing it in the outbox.", result.requestId, keyAccessId.c_str(), result.statusCode);
+    if (_outboxModule->pushDelete(type, keyAccessId.c_str())) _jobScheduler.trigger(_outboxJob);
+    else ESP_LOGE(WIFI_TASK_LOG_TAG, "Failed to store the delete of Key Access ID %s in the outbox.", keyAccessId.c_str());
+}
+
+/**
+ * @brief Store the unlocks waiting in the access event ring of a sensor in the outbox
+ *
+ * The events are read in place from the ring, and always go through the outbox, it is sent in batch
+ * when the device is connected. The outbox job is woken up once for all of them.
+ *
+ * @param events The access event ring of the sensor, this task is its only consumer
+ * @param type The lock type of the sensor
+ */
+void WifiTask::handleAccessEvents(AccessEventRing *events, LockType type) {
+    int stored = 0;
+    AccessEvent *event;
+    while ((event = events->front()) != nullptr) {
+        if (_outboxModule->pushAccess(type, event->keyAccessId, event->uidCard[0] != '\0' ? event->uidCard : nullptr, event->fingerprintId)) {
+            stored++;
+        } else {
+            ESP_LOGE(WIFI_TASK_LOG_TAG, "Failed to store %s access in the outbox.", type == LockType::RFID ? "NFC (RFID)" : "Fingerprint");
+        }
+        events->pop();
+    }
+
+    if (stored > 0) {
+        ESP_LOGI(WIFI_TASK_LOG_TAG, "%d %s access stored in the outbox.", stored, type == LockType::RFID ? "NFC (RFID)" : "Fingerprint");
+        _jobScheduler.trigger(_outboxJob);
+    }
+}
+
+/**
+ * @brief Scheduler Job of the WifiTask, sends the oldest batch of pending outbox events to the server.
+ *
+ * The upload runs on the HTTP engine, this only starts a batch or collects the result of the
+ * batch in flight, the upload callback triggers the job again. A failed upload doubles the retry
+ * delay from `OUTBOX_RETRY_MIN_MS` up to `OUTBOX_RETRY_MAX_MS`, and a successful one resets it. A
+ * batch rejected by the server as malformed (400, 413 or 422) is dropped, so it can never block the
+ * outbox. Every other error, e.g. a 401 of a bad token or a 404 of an older backend, keeps the events.
+ *
+ * @return The time in ms until the next run, `JOB_WAIT_FOR_TRIGGER` while there is nothing to send
+ */
+uint32_t WifiTask::drainOutbox() {
+    TickType_t now = xTaskGetTickCount();
+
+    if (_outboxRequestId != 0) {
+        if (!_outboxDone) {
+            // The callback will never come if the request was cancelled, give up after the deadline
+            if ((int32_t)(now - _outboxDeadline) < 0) return (_outboxDeadline - now) * portTICK_PERIOD_MS;
+            _wifiService->cancelRequest(_outboxRequestId);
+            _outboxStatusCode = HTTP_ENGINE_ERROR_DEADLINE_EXCEEDED;
+        }
+        _outboxRequestId = 0;
+
+        int statusCode = _outboxStatusCode;
+        bool delivered = statusCode >= 200 && statusCode < 300;
+        // Only a malformed or oversized payload is dropped, an auth or routing error is retried so no history is lost
+        bool rejected = statusCode == 400 || statusCode == 413 || statusCode == 422;
+
+        if (delivered || rejected) {
+            _outboxModule->pop(_outboxLastSequence);
+            _outboxRetryMs = 0;
+
+            if (rejected) ESP_LOGE(WIFI_TASK_LOG_TAG, "Server rejected the outbox events with status %d, dropping them", statusCode);
+            else ESP_LOGI(WIFI_TASK_LOG_TAG, "Delivered outbox events, %lu still pending", (unsigned long)_outboxModule->size());
+            return 0;
         }
+
+        _outboxRetryMs = _outboxRetryMs == 0 ? OUTBOX_RETRY_MIN_MS : _outboxRetryMs * 2;
+        if (_outboxRetryMs > OUTBOX_RETRY_MAX_MS) _outboxRetryMs = OUTBOX_RETRY_MAX_MS;
+        _nextOutboxUpload = now + pdMS_TO_TICKS(_outboxRetryMs);
+
+        ESP_LOGW(WIFI_TASK_LOG_TAG, "Failed to deliver outbox events (status %d), retrying in %lu ms", statusCode, (unsigned long)_outboxRetryMs);
+        return _outboxRetryMs;
     }
+
+    if (_outboxModule->size() == 0) return JOB_WAIT_FOR_TRIGGER;
+    if (_outboxRetryMs > 0 && (int32_t)(now - _nextOutboxUpload) < 0) return (_nextOutboxUpload - now) * portTICK_PERIOD_MS;
+    if (!_wifiService->isConnected()) return JOB_WAIT_FOR_TRIGGER;
+
+    OutboxEvent events[OUTBOX_BATCH_SIZE];
+    size_t count = _outboxModule->peek(events, OUTBOX_BATCH_SIZE);
+    if (count == 0) return JOB_WAIT_FOR_TRIGGER;
+
+    int requestId = nextQueueRequestId();
+    _outboxDone = false;
+    _outboxRequestId = requestId;
+    _outboxLastSequence = events[count - 1].sequence;
+    // Give the engine some slack over the request deadline before giving up on the callback
+    _outboxDeadline = now + pdMS_TO_TICKS(2 * OUTBOX_UPLOAD_DEADLINE_MS);
+
+    bool queued = _wifiService->uploadOutboxEvents(requestId, events, count, OUTBOX_UPLOAD_DEADLINE_MS, [this, requestId](const HttpResult &result) {
+        if (_outboxRequestId != requestId) return;
+        _outboxStatusCode = result.statusCode;
+        _outboxDone = true;
+        _jobScheduler.trigger(_outboxJob);
+    });
+
+    // The HTTP engine is busy, try again a bit later
+    if (!queued) {
+        _outboxRequestId = 0;
+        return OUTBOX_RETRY_MIN_MS;
+    }
+    return 2 * OUTBOX_UPLOAD_DEADLINE_MS;
 }
 
+/**
+ * @brief Scheduler Job of the WifiTask, closes the keep-alive connections that have been idle for too long
+ *
+ * @return The time in ms until the next kept connection is idle, `JOB_WAIT_FOR_TRIGGER` while none is kept open
+ */
+uint32_t WifiTask::closeIdleConnections() {
+    uint32_t delayMs = _wifiService->closeIdleConnections();
+    return delayMs == 0 ? JOB_WAIT_FOR_TRIGGER : delayMs;
+}
@@ -4,44 +4,87 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
 #include <freertos/task.h>
+#include <freertos/queue.h>
 #include <esp_log.h>
 
+#include <atomic>
+
 #include "service/WifiService.h"
+#include "repository/OutboxModule/OutboxModule.h"
 
 #include "tasks/BaseTask.h"
+#include "tasks/JobScheduler/JobScheduler.h"
 #include "communication/wifi/Wifi.h"
 
 #include "enum/SystemState.h"
+#include "enum/LockType.h"
 #include "entity/QueueMessage.h"
 
+#define OUTBOX_BATCH_SIZE           16                  // Maximum outbox events sent in a single request
+#define OUTBOX_RETRY_MIN_MS         2000                // First retry delay after a failed outbox upload
+#define OUTBOX_RETRY_MAX_MS         (5 * 60 * 1000)     // The retry delay doubles on every failure up to this
+#define OUTBOX_UPLOAD_DEADLINE_MS   10000               // Deadline of a single batch upload
+#define OTA_LISTEN_INTERVAL_MS      100                 // Delay between two polls of the OTA requests from the local network
+#define OTA_RESUME_INTERVAL_MS      (60 * 1000)         // Delay between attempts to resume an interrupted firmware download
+#define KEY_ACCESS_PULL_INTERVAL_MS (5 * 60 * 1000)     // Delay between two pulls of the key access list from the server
+#define KEY_ACCESS_PULL_JITTER_MS   (30 * 1000)         // Random delay added to every pull, so the devices of a fleet do not pull at once
+#define LEASE_REVALIDATE_MIN_MS     (5 * 1000)          // Shortest delay between two lease refreshes woken up by expired leases
+#define KEY_ACCESS_BACKUP_INTERVAL_MS (60 * 60 * 1000)  // Delay between two backups of the key access store to the server
+#define KEY_ACCESS_BACKUP_JITTER_MS (5 * 60 * 1000)     // Random delay added to every backup, so the devices of a fleet do not back up at once
+#define KEY_ACCESS_BACKUP_RETRY_MS  (60 * 1000)         // Delay before the next attempt after a failed backup or restore
+#define JOB_SCHEDULER_PRIORITY      5                   // Priority of the worker running the background jobs of the WiFi
+
 /// @brief Class for managing the WiFi Task Action
 class WifiTask : BaseTask {
     public:
-        WifiTask(const char* taskName, UBaseType_t priority, WifiService *wifiService, 
-                 QueueHandle_t nfcQueueRequest, QueueHandle_t nfcQueueResponse, 
-                 QueueHandle_t fingerprintQueueRequest, QueueHandle_t fingerprintQueueResponse);
+        WifiTask(const char* taskName, UBaseType_t priority, WifiService *wifiService, OutboxModule *outboxModule,
+                 AccessEventRing *nfcAccessEvents, AccessEventRing *fingerprintAccessEvents, SemaphoreHandle_t accessEventSignal,
+                 QueueHandle_t nfcQueueRequest, QueueHandle_t fingerprintQueueRequest);
         ~WifiTask();
         void startTask() override;
         bool suspendTask() override;
         bool resumeTask() override;
-        void handleNFCTask(NFCQueueRequest message);
-        void handleFingerprintTask(FingerprintQueueRequest message);
+        void handleNFCTask(const QueueRequest &message);
+        void handleFingerprintTask(const QueueRequest &message);
+        void handleAccessEvents(AccessEventRing *events, LockType type);
+        void handleDeleteResponse(LockType type, const std::string &keyAccessId, const HttpResult &result);
         
     private:
         const char* _taskName;
         UBaseType_t _priority;
         TaskHandle_t _taskHandle;
         SemaphoreHandle_t _xWifiSemaphore;
+        JobScheduler _jobScheduler;
+        QueueSetHandle_t _requestSet;
+        int _outboxJob;
         WifiService* _wifiService;
+        OutboxModule* _outboxModule;
+
+        uint32_t _outboxRetryMs;
+        TickType_t _nextOutboxUpload;
+        TickType_t _nextLeaseRefresh;
+
+        // State of the outbox batch in flight, the result is written from the HTTP engine task
+        std::atomic<int> _outboxRequestId;
+        std::atomic<int> _outboxStatusCode;
+        std::atomic<bool> _outboxDone;
+        uint32_t _outboxLastSequence;
+        TickType_t _outboxDeadline;
 
+        AccessEventRing* _nfcAccessEvents;
+        AccessEventRing* _fingerprintAccessEvents;
+        SemaphoreHandle_t _accessEventSignal;
         QueueHandle_t _nfcQueueRequest;
-        QueueHandle_t _nfcQueueResponse;
         QueueHandle_t _fingerprintQueueRequest;
-        QueueHandle_t _fingerprintQueueResponse;
 
         static void loop(void *parameter);
-        static void reconnect(void *parameter);
-        static void listenOTA(void *parameter);
+        uint32_t reconnect();
+        uint32_t drainOutbox();
+        uint32_t closeIdleConnections();
+        uint32_t beginOTA();
+        void listenOTA();
+        void resumeOTA();
+        uint32_t refreshLeases();
 };
 
 #endif